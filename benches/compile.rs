@@ -0,0 +1,56 @@
+#![feature(test)]
+extern crate test;
+extern crate lilium;
+
+use test::Bencher;
+use lilium::*;
+
+/// Build a lookup function consisting of a chain of nested conditionals,
+/// resembling machine-generated code.
+fn nested_conditionals(depth: usize) -> String {
+    let mut program = String::from("(def lookup (x)");
+    for i in 0..depth {
+        program.push_str(&format!(" (if (== x {}) ({}) (", i, i * 2));
+    }
+    program.push_str("0");
+    for _ in 0..depth {
+        program.push_str("))");
+    }
+    program.push_str(")(write (lookup 42))");
+    program
+}
+
+/// Build a single arithmetic expression nested as deep as the register
+/// window allows.
+fn nested_arithmetic(depth: usize) -> String {
+    let mut program = String::new();
+    for i in 0..depth {
+        program.push_str(&format!("(+ {} ", i));
+    }
+    program.push_str("0");
+    for _ in 0..depth {
+        program.push_str(")");
+    }
+    program
+}
+
+#[bench]
+fn compile_conditionals_shallow(b: &mut Bencher) {
+    let program = nested_conditionals(100);
+    b.bytes = program.len() as u64;
+    b.iter(|| compile(&program));
+}
+
+#[bench]
+fn compile_conditionals_deep(b: &mut Bencher) {
+    let program = nested_conditionals(5000);
+    b.bytes = program.len() as u64;
+    b.iter(|| compile(&program));
+}
+
+#[bench]
+fn compile_arithmetic(b: &mut Bencher) {
+    let program = nested_arithmetic(120);
+    b.bytes = program.len() as u64;
+    b.iter(|| compile(&program));
+}
@@ -0,0 +1,65 @@
+#![feature(test)]
+extern crate test;
+extern crate lilium;
+
+use test::Bencher;
+use lilium::*;
+
+/// Number of distinct keys being looked up
+const KEYS: i64 = 32;
+
+/// Loop looking up `n mod KEYS` for all n down to 1, summing up the values
+fn lookup_loop(lookup: &str) -> String {
+    format!(concat!(
+        "(def lookups (m n acc)",
+        "  (if (> n 0)",
+        "    ((lookups m (- n 1) (+ acc {})))",
+        "    (acc)))"
+    ), lookup.replace("KEY", &format!("(- n (* (/ n {0}) {0}))", KEYS)))
+}
+
+fn bench_program(b: &mut Bencher, program: &str) {
+    let Module {
+        functions: f,
+        constants: c,
+        data: d,
+        entry_point: e,
+        code: i,
+        ..
+    } = compile(program);
+
+    let mut registers = vec![0; 4096];
+    let mut thread = Thread {
+        functions: &f,
+        constants: &c,
+        data: &d,
+        code: &i,
+        registers: &mut registers,
+        base: 0,
+        pc: 0,
+        heap: Heap::new()
+    };
+
+    b.iter(|| { run(&mut thread, e as usize) });
+}
+
+#[bench]
+fn lookup_map(b: &mut Bencher) {
+    let mut program = String::from("(def fill (m n) (if (< n 0) (m) ((fill (put m n (* n 3)) (- n 1)))))");
+    program.push_str(&lookup_loop("(get m KEY)"));
+    program.push_str(&format!("(lookups (fill (make-map) {}) 1000 0)", KEYS - 1));
+    bench_program(b, &program);
+}
+
+#[bench]
+fn lookup_if_chain(b: &mut Bencher) {
+    // (if (== k 0) (0) ((if (== k 1) (3) (...))))
+    let mut chain = String::from("(0)");
+    for key in (0..KEYS).rev() {
+        chain = format!("((if (== k {}) ({}) {}))", key, key * 3, chain);
+    }
+    let mut program = format!("(def find (k) {})", &chain[1..chain.len() - 1]);
+    program.push_str(&lookup_loop("(find KEY)"));
+    program.push_str("(lookups 0 1000 0)");
+    bench_program(b, &program);
+}
@@ -10,8 +10,10 @@ fn sum(b: &mut Bencher) {
     let Module {
         functions: f,
         constants: c,
+        data: d,
         entry_point: e,
-        code: i
+        code: i,
+        ..
     } = compile(concat!(
         "(def sum (a b)",
         "  (if ",
@@ -25,9 +27,12 @@ fn sum(b: &mut Bencher) {
     let mut thread = Thread {
         functions: &f,
         constants: &c,
+        data: &d,
         code: &i,
         registers: &mut registers,
-        base: 0
+        base: 0,
+        pc: 0,
+        heap: Heap::new()
     };
 
     b.iter(|| { run(&mut thread, e as usize) });
@@ -38,8 +43,10 @@ fn sum_tail(b: &mut Bencher) {
     let Module {
         functions: f,
         constants: c,
+        data: d,
         entry_point: e,
-        code: i
+        code: i,
+        ..
     } = compile(concat!(
         "(def sum (a b)",
         "  (if ",
@@ -53,9 +60,12 @@ fn sum_tail(b: &mut Bencher) {
     let mut thread = Thread {
         functions: &f,
         constants: &c,
+        data: &d,
         code: &i,
         registers: &mut registers,
-        base: 0
+        base: 0,
+        pc: 0,
+        heap: Heap::new()
     };
 
     b.iter(|| { run(&mut thread, e as usize) });
@@ -0,0 +1,122 @@
+extern crate lalrpop;
+
+use std::env;
+use std::fs::File;
+use std::io::{BufRead, BufReader, Write};
+use std::path::Path;
+
+/// Opcode of the first superinstruction, all lower opcodes are base instructions
+const FIRST_SUPERINSTRUCTION: usize = 128;
+
+/// Instructions which may change the PC, these may only end a superinstruction.
+/// `ops::is_control_flow` is generated from this list.
+const CONTROL_FLOW: &[&str] = &[
+    "HLT", "CAL", "TLC", "CLI", "TLI", "RET", "JMF", "JMB", "JTF", "JFF", "RSM", "YLD"
+];
+
+/// Instructions which may suspend the thread or wait and execute again. They
+/// do not return the next instruction then, so they may only end a
+/// superinstruction as well. `ops::ends_sequence` is generated from both lists.
+const SUSPENDING: &[&str] = &["WRI", "RDI", "RDN", "RDR", "WRR", "WRB", "RDL", "FRD", "FWR", "CLS"];
+
+/// Write a function checking whether an opcode is one of the listed ones.
+fn write_predicate(out: &mut File, doc: &str, name: &str, list: &[&str]) {
+    let ops: Vec<String> = list.iter().map(|op| format!("ops::{}", op)).collect();
+    writeln!(out, "/// {}", doc).unwrap();
+    writeln!(out, "pub fn {}(opcode: Opcode) -> bool {{", name).unwrap();
+    writeln!(out, "    match opcode {{").unwrap();
+    writeln!(out, "        {} => true,", ops.join(" | ")).unwrap();
+    writeln!(out, "        _ => false").unwrap();
+    writeln!(out, "    }}").unwrap();
+    writeln!(out, "}}").unwrap();
+}
+
+/// Read the list of superinstructions, each line contains the mnemonics of
+/// the fused instructions separated by whitespace. Text after `#` is ignored.
+fn read_superinstructions(path: &str) -> Vec<Vec<String>> {
+    let file = File::open(path).expect("Could not open superinstruction list");
+    let mut sequences = Vec::new();
+
+    for line in BufReader::new(file).lines() {
+        let line = line.expect("Could not read superinstruction list");
+        let line = line.split('#').next().unwrap_or("");
+        let sequence: Vec<String> = line.split_whitespace()
+            .map(|s| s.to_uppercase())
+            .collect();
+        if sequence.is_empty() {
+            continue;
+        }
+
+        if sequence.len() < 2 {
+            panic!("Superinstruction {} needs at least two instructions", line);
+        }
+        for op in &sequence[..sequence.len() - 1] {
+            if CONTROL_FLOW.contains(&op.as_str()) || SUSPENDING.contains(&op.as_str()) {
+                panic!("Superinstruction {}: {} may only be the last instruction", line, op);
+            }
+        }
+        if sequence.last().map(|op| op == "HLT").unwrap_or(false) {
+            panic!("Superinstruction {}: HLT can not be fused", line);
+        }
+        sequences.push(sequence);
+    }
+
+    if FIRST_SUPERINSTRUCTION + sequences.len() > 256 {
+        panic!("Too many superinstructions");
+    }
+    sequences
+}
+
+/// Generate the opcode table used by the compiler and the disassembler, as
+/// well as the handler macros used by the dispatch loop.
+fn generate_superinstructions(sequences: &[Vec<String>], out_dir: &Path) {
+    let mut table = File::create(out_dir.join("superinstructions.rs"))
+        .expect("Could not create superinstruction table");
+    writeln!(table, "pub const SUPERINSTRUCTIONS: &[(Opcode, &[Opcode])] = &[").unwrap();
+    for (i, sequence) in sequences.iter().enumerate() {
+        let ops: Vec<String> = sequence.iter().map(|op| format!("ops::{}", op)).collect();
+        writeln!(table, "    ({}, &[{}]),", FIRST_SUPERINSTRUCTION + i, ops.join(", ")).unwrap();
+    }
+    writeln!(table, "];").unwrap();
+    write_predicate(&mut table, "Check whether an instruction may change the PC to anything but the next instruction",
+                    "is_control_flow", CONTROL_FLOW);
+    let ends: Vec<&str> = CONTROL_FLOW.iter().chain(SUSPENDING).cloned().collect();
+    write_predicate(&mut table, "Check whether an instruction may only be the last one of a superinstruction",
+                    "ends_sequence", &ends);
+
+    let mut handlers = File::create(out_dir.join("superhandlers.rs"))
+        .expect("Could not create superinstruction handlers");
+    writeln!(handlers, "macro_rules! superinstruction_addresses {{").unwrap();
+    writeln!(handlers, "    ($ops:ident) => {{").unwrap();
+    for i in 0..sequences.len() {
+        let opcode = FIRST_SUPERINSTRUCTION + i;
+        writeln!(handlers, "        $ops[{}] = label_addr!(\"op_s{}\");", opcode, opcode).unwrap();
+    }
+    writeln!(handlers, "    }}").unwrap();
+    writeln!(handlers, "}}").unwrap();
+
+    writeln!(handlers, "macro_rules! superinstruction_handlers {{").unwrap();
+    writeln!(handlers, "    ($state:ident, $pc:ident) => {{").unwrap();
+    for (i, sequence) in sequences.iter().enumerate() {
+        let opcode = FIRST_SUPERINSTRUCTION + i;
+        writeln!(handlers, "        do_and_dispatch!($state, \"op_s{}\", $pc, {{", opcode).unwrap();
+        for op in sequence {
+            writeln!(handlers, "            $pc = op_{}(&mut $state, $pc);", op.to_lowercase()).unwrap();
+        }
+        writeln!(handlers, "        }});").unwrap();
+    }
+    writeln!(handlers, "    }}").unwrap();
+    writeln!(handlers, "}}").unwrap();
+}
+
+fn main() {
+    lalrpop::process_root().unwrap();
+
+    let list = "src/vm/superinstructions.txt";
+    println!("cargo:rerun-if-changed=build.rs");
+    println!("cargo:rerun-if-changed=src/compiler/parser/parser.lalrpop");
+    println!("cargo:rerun-if-changed={}", list);
+    let out_dir = env::var("OUT_DIR").unwrap();
+    let sequences = read_superinstructions(list);
+    generate_superinstructions(&sequences, Path::new(&out_dir));
+}
@@ -2,29 +2,51 @@ extern crate bincode;
 extern crate lilium;
 
 use std::env;
-use std::io::{Read, Error, ErrorKind, Result};
+use std::io::{Read, Write, BufWriter, Error, ErrorKind, Result};
 use bincode::deserialize;
-use lilium::{Module, disassemble};
+use lilium::{Module, Statistics, disassemble};
 
-fn disassemble_file(file_name: &str) -> Result<()> {
+/// Output produced by lasm
+enum Mode {
+    Disassembly,
+    Statistics,
+    Json
+}
+
+fn disassemble_file(file_name: &str, mode: Mode) -> Result<()> {
     let mut file = std::fs::File::open(&file_name)?;
     let mut contents: Vec<u8> = Vec::new();
     file.read_to_end(&mut contents)?;
 
     let m: Module = deserialize(&contents)
         .map_err(|err| Error::new(ErrorKind::Other, err))?;
-    disassemble(&m.constants, &m.functions, &m.code);
 
-    Ok(())
+    let stdout = std::io::stdout();
+    let mut out = BufWriter::new(stdout.lock());
+    match mode {
+        Mode::Disassembly => disassemble(&mut out, &m.constants, &m.functions, &m.code)?,
+        Mode::Statistics => Statistics::new(&m).write_text(&mut out)?,
+        Mode::Json => Statistics::new(&m).write_json(&mut out)?
+    }
+    out.flush()
 }
 
 fn main() {
-    let mut args = env::args();
-    if let Some(file_name) = args.nth(1) {
-        if let Err(e) = disassemble_file(&file_name) {
+    let mut mode = Mode::Disassembly;
+    let mut file_name: Option<String> = None;
+    for arg in env::args().skip(1) {
+        match arg.as_str() {
+            "--stats" => mode = Mode::Statistics,
+            "--json" => mode = Mode::Json,
+            _ => file_name = Some(arg)
+        }
+    }
+
+    if let Some(file_name) = file_name {
+        if let Err(e) = disassemble_file(&file_name, mode) {
             println!("Error during disassembly: {}", e);
         }
     } else {
-        println!("Usage: lasm lilium_bytecode.bc");
+        println!("Usage: lasm [--stats | --json] lilium_bytecode.bc");
     }
-}
\ No newline at end of file
+}
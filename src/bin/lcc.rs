@@ -3,15 +3,37 @@ extern crate lilium;
 
 use std::env;
 use std::io::{Read, Write, Error, ErrorKind, Result};
-use bincode::{serialize, Infinite};
-use lilium::compile;
+use bincode::{serialize, deserialize, Infinite};
+use lilium::{Profile, code_hash, compile, compile_with_profile};
 
-fn compile_file(file_name: &str) -> Result<()> {
+fn read_profile(profile_name: &str) -> Result<Profile> {
+    let mut file = std::fs::File::open(profile_name)?;
+    let mut contents: Vec<u8> = Vec::new();
+    file.read_to_end(&mut contents)?;
+
+    deserialize(&contents)
+        .map_err(|err| Error::new(ErrorKind::Other, err))
+}
+
+fn compile_file(file_name: &str, profile_name: Option<&str>) -> Result<()> {
     let mut file = std::fs::File::open(&file_name)?;
     let mut contents = String::new();
     file.read_to_string(&mut contents)?;
 
-    let m = compile(&contents);
+    let m = match profile_name {
+        Some(profile_name) => {
+            // The profile has to be recorded on the code compiled without one
+            let profile = read_profile(profile_name)?;
+            let plain = compile(&contents);
+            if code_hash(&plain.functions, &plain.constants, &plain.code) != profile.code {
+                return Err(Error::new(ErrorKind::InvalidData,
+                                      format!("{} was not recorded on {} compiled without a profile",
+                                              profile_name, file_name)));
+            }
+            compile_with_profile(&contents, &profile)
+        }
+        None => compile(&contents)
+    };
     let mut bc_name = file_name.to_string();
     bc_name.push_str(".bc");
     let bc = std::fs::File::create(bc_name)?;
@@ -24,12 +46,22 @@ fn compile_file(file_name: &str) -> Result<()> {
 }
 
 fn main() {
-    let mut args = env::args();
-    if let Some(file_name) = args.nth(1) {
-        if let Err(e) = compile_file(&file_name) {
+    let mut args = env::args().skip(1);
+    let mut profile_name: Option<String> = None;
+    let mut file_name: Option<String> = None;
+    while let Some(arg) = args.next() {
+        match arg.as_str() {
+            "--use-profile" => profile_name = args.next(),
+            _ => file_name = Some(arg)
+        }
+    }
+
+    if let Some(file_name) = file_name {
+        let profile_name = profile_name.as_ref().map(|s| s.as_str());
+        if let Err(e) = compile_file(&file_name, profile_name) {
             println!("Error during compilation: {}", e);
         }
     } else {
-        println!("Usage: lcc lilium_file.l");
+        println!("Usage: lcc [--use-profile profile_file] lilium_file.l");
     }
-}
\ No newline at end of file
+}
@@ -1,12 +1,85 @@
 extern crate bincode;
+extern crate libc;
 extern crate lilium;
 
 use std::env;
-use std::io::{Read, Error, ErrorKind, Result};
-use bincode::deserialize;
-use lilium::{Module, Thread, run};
+use std::collections::HashMap;
+use std::io::{Read, Write, Error, ErrorKind, Result};
+use std::time::Duration;
+use bincode::{serialize, deserialize, Infinite};
+use lilium::{CountersFile, Framing, Heap, Module, Profile, Thread, Trace, instrumentation, locate,
+             run, run_instrumented, run_profiled, run_sampled, run_traced, set_framing,
+             set_instrumentation};
 
-fn execute_file(file_name: &str) -> Result<()> {
+/// Interval of CPU time between two samples
+const SAMPLE_INTERVAL_US: u64 = 1000;
+
+enum Mode {
+    Run,
+    Profile(String),
+    Sample,
+    Count,
+    Trace(usize)
+}
+
+/// Toggle the instrumentation of a counted run
+extern "C" fn on_toggle(_signal: libc::c_int) {
+    set_instrumentation(!instrumentation());
+}
+
+/// Get the name of the function containing a PC, named like in `lasm --stats`.
+fn function_name(m: &Module, pc: u64) -> String {
+    let mut owner: Option<(u64, String)> = if pc >= m.entry_point {
+        Some((m.entry_point, "main".to_string()))
+    } else {
+        None
+    };
+    for (index, &address) in m.functions.iter().enumerate() {
+        if address <= pc && owner.as_ref().map_or(true, |&(start, _)| address > start) {
+            owner = Some((address, format!("f{}", index)));
+        }
+    }
+    owner.map_or("?".to_string(), |(_, name)| name)
+}
+
+/// Print the hottest source lines of a sampled or counted run. Without a line
+/// table, counts are reported per PC.
+fn report(m: &Module, title: &str, samples: &[u64]) {
+    let total: u64 = samples.iter().sum();
+    let runs = m.lines.as_ref().map(|lines| lines.runs()).unwrap_or_default();
+
+    let mut hot: HashMap<(String, String), u64> = HashMap::new();
+    for (pc, &count) in samples.iter().enumerate().filter(|&(_, &count)| count > 0) {
+        let position = match locate(&runs, pc as u64) {
+            Some(location) => format!("{}:{}", location.line, location.column),
+            None => format!("0x{:05x}", pc)
+        };
+        *hot.entry((position, function_name(m, pc as u64))).or_insert(0) += count;
+    }
+    let mut hot: Vec<((String, String), u64)> = hot.into_iter().collect();
+    hot.sort_by(|a, b| b.1.cmp(&a.1).then(a.0.cmp(&b.0)));
+
+    eprintln!("{}: {}", title, total);
+    eprintln!("{:>12} {:>7}  {:<10} {}", "count", "%", "location", "function");
+    for ((position, function), count) in hot {
+        eprintln!("{:>12} {:>6.1}%  {:<10} {}",
+                  count, 100.0 * count as f64 / total.max(1) as f64, position, function);
+    }
+}
+
+/// Print the statistics of the garbage collector.
+fn report_gc(heap: &Heap) {
+    let stats = heap.stats();
+    let pause = |d: std::time::Duration| d.as_secs() as f64 * 1e3 + d.subsec_nanos() as f64 * 1e-6;
+    eprintln!("Allocated words:   {}", stats.allocated);
+    eprintln!("Promoted words:    {}", stats.promoted);
+    eprintln!("Live words:        {}", stats.live);
+    eprintln!("Collections:       {} minor, {} major", stats.minor_collections, stats.major_collections);
+    eprintln!("Pause time:        {:.3} ms total, {:.3} ms max",
+              pause(stats.total_pause), pause(stats.max_pause));
+}
+
+fn execute_file(file_name: &str, mode: &Mode, stats_name: Option<&str>, gc_stats: bool) -> Result<()> {
     let mut file = std::fs::File::open(file_name)?;
     let mut contents: Vec<u8> = Vec::new();
     file.read_to_end(&mut contents)?;
@@ -18,23 +91,104 @@ fn execute_file(file_name: &str) -> Result<()> {
     let mut thread = Thread {
         functions: &m.functions,
         constants: &m.constants,
+        data: &m.data,
         code: &m.code,
         registers: &mut registers,
-        base: 0
+        base: 0,
+        pc: 0,
+        heap: Heap::new()
     };
 
-    run(&mut thread, m.entry_point as usize);
+    // The counters file has to stay mapped until the thread halts
+    let _stats = match stats_name {
+        Some(stats_name) => {
+            let mut stats = CountersFile::create(stats_name)?;
+            stats.publish();
+            Some(stats)
+        }
+        None => None
+    };
+
+    match *mode {
+        Mode::Run => {
+            run(&mut thread, m.entry_point as usize);
+        }
+        Mode::Profile(ref profile_name) => {
+            let mut profile = Profile::default();
+            run_profiled(&mut thread, m.entry_point as usize, &mut profile);
+
+            let file = std::fs::File::create(profile_name)?;
+            let mut writer = std::io::BufWriter::new(file);
+            let encoded: Vec<u8> = serialize(&profile, Infinite)
+                .map_err(|err| Error::new(ErrorKind::Other, err))?;
+            writer.write_all(&encoded)?;
+        }
+        Mode::Sample => {
+            let interval = Duration::new(0, SAMPLE_INTERVAL_US as u32 * 1000);
+            let samples = run_sampled(&mut thread, m.entry_point as usize, interval);
+            report(&m, &format!("Samples ({} us interval)", SAMPLE_INTERVAL_US), &samples);
+        }
+        Mode::Count => {
+            // SIGUSR1 switches counting off and on again while running
+            unsafe {
+                libc::signal(libc::SIGUSR1, on_toggle as libc::sighandler_t);
+            }
+            set_instrumentation(true);
+            let mut counts = vec![0; m.code.len()];
+            run_instrumented(&mut thread, m.entry_point as usize, &mut counts);
+            report(&m, "Executed instructions", &counts);
+        }
+        Mode::Trace(entries) => {
+            // The trace is only written if the program panics
+            let mut trace = Trace::new(entries);
+            run_traced(&mut thread, m.entry_point as usize, &mut trace);
+        }
+    }
+
+    if gc_stats {
+        report_gc(&thread.heap);
+    }
 
     Ok(())
 }
 
 fn main() {
-    let mut args = env::args();
-    if let Some(file_name) = args.nth(1) {
-        if let Err(e) = execute_file(&file_name) {
+    let mut args = env::args().skip(1);
+    let mut mode = Mode::Run;
+    let mut file_name: Option<String> = None;
+    let mut stats_name: Option<String> = None;
+    let mut gc_stats = false;
+    let (mut input, mut output) = (Framing::Text, Framing::Text);
+    while let Some(arg) = args.next() {
+        match arg.as_str() {
+            "--emit-profile" => {
+                if let Some(profile_name) = args.next() {
+                    mode = Mode::Profile(profile_name);
+                }
+            }
+            "--sample" => mode = Mode::Sample,
+            "--count" => mode = Mode::Count,
+            "--trace" => {
+                if let Some(entries) = args.next().and_then(|n| n.parse().ok()) {
+                    mode = Mode::Trace(entries);
+                }
+            }
+            "--stats-file" => stats_name = args.next(),
+            "--gc-stats" => gc_stats = true,
+            "--binary-input" => input = Framing::Binary,
+            "--binary-output" => output = Framing::Binary,
+            _ => file_name = Some(arg)
+        }
+    }
+
+    if let Some(file_name) = file_name {
+        set_framing(input, output);
+        if let Err(e) = execute_file(&file_name, &mode, stats_name.as_ref().map(|s| s.as_str()), gc_stats) {
             println!("Error during execution: {}", e);
         }
     } else {
-        println!("Usage: lexec lilium_bytecode.bc");
+        println!("Usage: lexec [--emit-profile profile_file | --sample | --count | --trace entries] \
+                  [--stats-file stats_file] [--gc-stats] [--binary-input] [--binary-output] \
+                  lilium_bytecode.bc");
     }
-}
\ No newline at end of file
+}
@@ -0,0 +1,71 @@
+extern crate lilium;
+
+use std::env;
+use std::io::Result;
+use std::time::{Duration, Instant};
+use lilium::{CountersFile, Snapshot};
+
+/// Get the rate of a counter per second.
+fn rate(current: usize, previous: usize, elapsed: Duration) -> f64 {
+    let seconds = elapsed.as_secs() as f64 + elapsed.subsec_nanos() as f64 * 1e-9;
+    current.wrapping_sub(previous) as f64 / seconds.max(1e-9)
+}
+
+/// Print the counters of a running VM periodically, like vmstat.
+fn watch(stats_name: &str, interval: Duration, count: Option<usize>) -> Result<()> {
+    let file = CountersFile::open(stats_name)?;
+
+    println!("{:>14} {:>12} {:>12} {:>12} {:>10} {:>10} {:>8} {:>8} {:>10}",
+             "instr/s", "calls/s", "returns/s", "tailcalls/s", "reads/s", "writes/s",
+             "depth", "maxdepth", "maxregs");
+    let mut previous: Snapshot = file.counters().snapshot();
+    let mut last = Instant::now();
+    let mut printed = 0;
+    while count.map_or(true, |count| printed < count) {
+        std::thread::sleep(interval);
+        let current = file.counters().snapshot();
+        let elapsed = last.elapsed();
+        last = Instant::now();
+
+        println!("{:>14.0} {:>12.0} {:>12.0} {:>12.0} {:>10.0} {:>10.0} {:>8} {:>8} {:>10}",
+                 rate(current.instructions, previous.instructions, elapsed),
+                 rate(current.calls, previous.calls, elapsed),
+                 rate(current.returns, previous.returns, elapsed),
+                 rate(current.tail_calls, previous.tail_calls, elapsed),
+                 rate(current.reads, previous.reads, elapsed),
+                 rate(current.writes, previous.writes, elapsed),
+                 current.depth,
+                 current.max_depth,
+                 current.max_registers);
+        previous = current;
+        printed += 1;
+    }
+
+    Ok(())
+}
+
+fn main() {
+    let mut args = env::args().skip(1);
+    let mut interval: u64 = 1;
+    let mut count: Option<usize> = None;
+    let mut stats_name: Option<String> = None;
+    while let Some(arg) = args.next() {
+        match arg.as_str() {
+            "-i" => {
+                interval = args.next()
+                    .and_then(|i| i.parse().ok())
+                    .unwrap_or(interval);
+            }
+            "-n" => count = args.next().and_then(|n| n.parse().ok()),
+            _ => stats_name = Some(arg)
+        }
+    }
+
+    if let Some(stats_name) = stats_name {
+        if let Err(e) = watch(&stats_name, Duration::from_secs(interval.max(1)), count) {
+            println!("Error reading statistics: {}", e);
+        }
+    } else {
+        println!("Usage: lstat [-i seconds] [-n count] stats_file");
+    }
+}
@@ -0,0 +1,70 @@
+extern crate bincode;
+extern crate lilium;
+
+use std::env;
+use std::collections::HashMap;
+use std::io::{Read, Error, ErrorKind, Result};
+use bincode::deserialize;
+use lilium::{Opcode, Profile, ops};
+
+fn read_profile(profile_name: &str) -> Result<Profile> {
+    let mut file = std::fs::File::open(profile_name)?;
+    let mut contents: Vec<u8> = Vec::new();
+    file.read_to_end(&mut contents)?;
+
+    deserialize(&contents)
+        .map_err(|err| Error::new(ErrorKind::Other, err))
+}
+
+/// Merge the sequence counts of all profiles and print the sequences saving
+/// the most dispatches, in the format of src/vm/superinstructions.txt
+fn mine_sequences(profile_names: &[String], count: usize) -> Result<()> {
+    let mut sequences: HashMap<Vec<Opcode>, u64> = HashMap::new();
+    for profile_name in profile_names {
+        let profile = read_profile(profile_name)?;
+        for (sequence, n) in profile.sequences {
+            *sequences.entry(sequence).or_insert(0) += n;
+        }
+    }
+
+    // A superinstruction of length n saves n - 1 dispatches per execution
+    let mut ranked: Vec<(u64, Vec<Opcode>)> = sequences.into_iter()
+        .filter(|&(ref sequence, _)| sequence.last() != Some(&ops::HLT))
+        .filter(|&(ref sequence, _)| !sequence[..sequence.len() - 1].iter().any(|&op| ops::ends_sequence(op)))
+        .map(|(sequence, n)| (n * (sequence.len() as u64 - 1), sequence))
+        .collect();
+    ranked.sort_by(|a, b| b.0.cmp(&a.0).then_with(|| a.1.cmp(&b.1)));
+
+    println!("# Generated by lsuper from {} profile(s)", profile_names.len());
+    println!("# Each line is followed by the number of dispatches it saved");
+    for &(saved, ref sequence) in ranked.iter().take(count) {
+        let names: Vec<&str> = sequence.iter()
+            .map(|&op| ops::NAMES[op as usize])
+            .collect();
+        println!("{:<24}# {}", names.join(" "), saved);
+    }
+
+    Ok(())
+}
+
+fn main() {
+    let mut args = env::args().skip(1);
+    let mut count: usize = 16;
+    let mut profile_names: Vec<String> = Vec::new();
+    while let Some(arg) = args.next() {
+        match arg.as_str() {
+            "-k" => {
+                count = args.next()
+                    .and_then(|k| k.parse().ok())
+                    .unwrap_or(count);
+            }
+            _ => profile_names.push(arg)
+        }
+    }
+
+    if profile_names.is_empty() {
+        println!("Usage: lsuper [-k count] profile_file...");
+    } else if let Err(e) = mine_sequences(&profile_names, count) {
+        println!("Error during mining: {}", e);
+    }
+}
@@ -0,0 +1,106 @@
+/// Mapping of bytecode PCs to source locations
+use std::cmp::Ordering;
+
+/// A position in the source code, both line and column start at 1
+#[derive(Serialize, Deserialize, Clone, Copy, PartialEq, Eq, Hash, PartialOrd, Ord, Debug, Default)]
+pub struct Location {
+    pub line: u32,
+    pub column: u32
+}
+
+/// Compact table mapping each PC to the source location it was generated
+/// from.
+///
+/// The table is a sequence of runs, each starting at a PC and covering all
+/// instructions up to the start of the next run. A run is stored as the PC
+/// delta and the line delta to the previous run, followed by the column, all
+/// as variable length integers, so most runs take 3 bytes.
+#[derive(Serialize, Deserialize, Clone, Default)]
+pub struct LineTable {
+    data: Vec<u8>
+}
+
+impl LineTable {
+    /// Encode a list of runs.
+    ///
+    /// # Arguments
+    ///
+    /// * `runs` - Start PC and location of each run, ordered by PC
+    pub fn new(runs: &[(u64, Location)]) -> LineTable {
+        let mut data = Vec::with_capacity(runs.len() * 3);
+        let mut pc = 0;
+        let mut line = 0;
+        for &(start, location) in runs {
+            write_unsigned(&mut data, start - pc);
+            write_signed(&mut data, location.line as i64 - line as i64);
+            write_unsigned(&mut data, location.column as u64);
+            pc = start;
+            line = location.line;
+        }
+        LineTable { data }
+    }
+
+    /// Decode all runs of the table, ordered by PC.
+    pub fn runs(&self) -> Vec<(u64, Location)> {
+        let mut runs = Vec::new();
+        let mut pos = 0;
+        let mut pc = 0;
+        let mut line = 0;
+        while pos < self.data.len() {
+            pc += read_unsigned(&self.data, &mut pos);
+            line = (line as i64 + read_signed(&self.data, &mut pos)) as u32;
+            let column = read_unsigned(&self.data, &mut pos) as u32;
+            runs.push((pc, Location { line, column }));
+        }
+        runs
+    }
+
+    /// Size of the encoded table in bytes
+    pub fn size(&self) -> usize {
+        self.data.len()
+    }
+}
+
+/// Find the location of a PC in decoded runs.
+///
+/// # Arguments
+///
+/// * `runs` - Runs as returned by `LineTable::runs`
+/// * `pc` - PC to be looked up
+pub fn locate(runs: &[(u64, Location)], pc: u64) -> Option<Location> {
+    let index = runs.binary_search_by(|&(start, _)| {
+        if start <= pc { Ordering::Less } else { Ordering::Greater }
+    }).unwrap_err();
+    if index == 0 { None } else { Some(runs[index - 1].1) }
+}
+
+fn write_unsigned(data: &mut Vec<u8>, mut value: u64) {
+    while value >= 0x80 {
+        data.push(value as u8 | 0x80);
+        value >>= 7;
+    }
+    data.push(value as u8);
+}
+
+fn write_signed(data: &mut Vec<u8>, value: i64) {
+    write_unsigned(data, ((value << 1) ^ (value >> 63)) as u64);
+}
+
+fn read_unsigned(data: &[u8], pos: &mut usize) -> u64 {
+    let mut value = 0;
+    let mut shift = 0;
+    loop {
+        let byte = data[*pos];
+        *pos += 1;
+        value |= ((byte & 0x7F) as u64) << shift;
+        if byte & 0x80 == 0 {
+            return value;
+        }
+        shift += 7;
+    }
+}
+
+fn read_signed(data: &[u8], pos: &mut usize) -> i64 {
+    let value = read_unsigned(data, pos);
+    (value >> 1) as i64 ^ -((value & 1) as i64)
+}
@@ -1,4 +1,11 @@
 /// Type definitions and serializations of types used in the VM and in other modules
+use std::collections::HashMap;
+use vm::Heap;
+
+mod lines;
+mod natives;
+pub use self::lines::{LineTable, Location, locate};
+pub use self::natives::{Native, native_function, native_index, register_native};
 
 #[derive(Serialize, Deserialize, Clone)]
 pub struct Instruction {
@@ -12,16 +19,63 @@ pub struct Instruction {
 pub struct Module {
     pub functions: Vec<u64>,
     pub constants: Vec<i64>,
+    /// Bytes of all string literals, referred to by constants
+    pub data: Vec<u8>,
     pub entry_point: u64,
-    pub code: Vec<Instruction>
+    pub code: Vec<Instruction>,
+    /// Source location of each instruction, if known
+    pub lines: Option<LineTable>
+}
+
+/// Execution counts gathered by the profiling interpreter, all keyed by the
+/// PC of the instruction in the profiled module
+#[derive(Serialize, Deserialize, Default)]
+pub struct Profile {
+    /// Hash of the profiled code (see `code_hash`), 0 for an empty profile
+    pub code: u64,
+    /// Conditional jumps with the number of times the jump was (taken, not taken)
+    pub branches: HashMap<u64, (u64, u64)>,
+    /// Number of times each call site (CAL, TLC, JMB) was executed
+    pub calls: HashMap<u64, u64>,
+    /// Number of times each function was entered, keyed by its address
+    pub entries: HashMap<u64, u64>,
+    /// Number of times each sequence of 2 to 4 base opcodes was executed
+    /// without an intermediate instruction ending a sequence (see
+    /// `ops::ends_sequence`)
+    pub sequences: HashMap<Vec<Opcode>, u64>
+}
+
+/// Hash the code of a module, which identifies the PCs a profile is keyed by.
+///
+/// # Remarks
+///
+/// Superinstructions are hashed as their first instruction, so fusing does
+/// not change the hash. The layout does: a module compiled with a profile
+/// hashes differently from the module the profile was recorded on, unless
+/// the profile did not move any code.
+pub fn code_hash(functions: &[u64], constants: &[i64], code: &[Instruction]) -> u64 {
+    let instructions = code.iter().map(|i| {
+        (superops::base(i.opcode) as u64) << 24 | (i.target as u64) << 16 | (i.left as u64) << 8 | i.right as u64
+    });
+    let words = functions.iter().cloned()
+        .chain(constants.iter().map(|&c| c as u64))
+        .chain(instructions);
+
+    // FNV-1a over whole words
+    words.fold(0xcbf2_9ce4_8422_2325, |hash, word| (hash ^ word).wrapping_mul(0x0000_0100_0000_01b3))
 }
 
 pub struct Thread<'a> {
     pub functions: &'a [u64],
     pub constants: &'a [i64],
+    pub data: &'a [u8],
     pub code: &'a [Instruction],
     pub registers: &'a mut [i64],
-    pub base: usize
+    pub base: usize,
+    /// PC a suspended thread continues at (see `vm::resume`)
+    pub pc: usize,
+    /// Objects referenced by the registers, kept across runs of the thread
+    pub heap: Heap
 }
 
 /// Definition of the register type and a list of special registers
@@ -63,6 +117,121 @@ pub mod ops {
     pub const JTF: Opcode = 24;
     pub const WRI: Opcode = 25;
     pub const RDI: Opcode = 26;
+    pub const JFF: Opcode = 27;
+    pub const CONS: Opcode = 28;
+    pub const CAR: Opcode = 29;
+    pub const CDR: Opcode = 30;
+    pub const NIL: Opcode = 31;
+    pub const MAP: Opcode = 32;
+    pub const GET: Opcode = 33;
+    pub const PUT: Opcode = 34;
+    pub const HAS: Opcode = 35;
+    pub const SIZE: Opcode = 36;
+    pub const LDS: Opcode = 37;
+    pub const BUF: Opcode = 38;
+    pub const APP: Opcode = 39;
+    pub const STR: Opcode = 40;
+    pub const SLC: Opcode = 41;
+    pub const BYT: Opcode = 42;
+    pub const CMP: Opcode = 43;
+    pub const HSH: Opcode = 44;
+    pub const WRB: Opcode = 45;
+    pub const RDL: Opcode = 46;
+    pub const REC: Opcode = 47;
+    pub const FLD: Opcode = 48;
+    pub const WTH: Opcode = 49;
+    pub const VEC: Opcode = 50;
+    pub const VGT: Opcode = 51;
+    pub const VPS: Opcode = 52;
+    pub const VAS: Opcode = 53;
+    pub const VLN: Opcode = 54;
+    pub const RDN: Opcode = 55;
+    pub const GEN: Opcode = 56;
+    pub const RSM: Opcode = 57;
+    pub const FIN: Opcode = 58;
+    pub const YLD: Opcode = 59;
+    pub const OPN: Opcode = 60;
+    pub const FRD: Opcode = 61;
+    pub const FWR: Opcode = 62;
+    pub const CLS: Opcode = 63;
+    pub const IMP: Opcode = 64;
+    pub const IPR: Opcode = 65;
+    pub const IGT: Opcode = 66;
+    pub const IAD: Opcode = 67;
+    pub const IGU: Opcode = 68;
+    pub const RDR: Opcode = 69;
+    pub const WRR: Opcode = 70;
+    pub const CALLN: Opcode = 71;
+    pub const MOD: Opcode = 72;
+    pub const POW: Opcode = 73;
+    pub const GCD: Opcode = 74;
+    pub const MIN: Opcode = 75;
+    pub const MAX: Opcode = 76;
+    pub const ABS: Opcode = 77;
+    pub const SQRT: Opcode = 78;
+    pub const PCNT: Opcode = 79;
+    pub const CLZ: Opcode = 80;
+    pub const CTZ: Opcode = 81;
+    pub const CLO: Opcode = 82;
+    pub const CLI: Opcode = 83;
+    pub const TLI: Opcode = 84;
+
+    /// Mnemonics of the base instructions, indexed by opcode
+    pub const NAMES: &[&str] = &[
+        "HLT", "LD", "LDB", "LDR", "ADD", "SUB", "MUL", "DIV", "AND", "OR",
+        "NOT", "EQ", "LT", "LE", "GT", "GE", "NEQ", "CAL", "TLC", "RET",
+        "MOV", "MVO", "JMF", "JMB", "JTF", "WRI", "RDI", "JFF", "CONS", "CAR",
+        "CDR", "NIL", "MAP", "GET", "PUT", "HAS", "SIZE", "LDS", "BUF", "APP",
+        "STR", "SLC", "BYT", "CMP", "HSH", "WRB", "RDL", "REC", "FLD", "WTH",
+        "VEC", "VGT", "VPS", "VAS", "VLN", "RDN", "GEN", "RSM", "FIN", "YLD",
+        "OPN", "FRD", "FWR", "CLS", "IMP", "IPR", "IGT", "IAD", "IGU",
+        "RDR", "WRR", "CALLN", "MOD", "POW", "GCD", "MIN", "MAX", "ABS", "SQRT", "PCNT",
+        "CLZ", "CTZ", "CLO", "CLI", "TLI"
+    ];
+
+    /// Check whether an instruction may change the PC to anything but the
+    /// next instruction. Generated by the build script from the same list
+    /// that limits superinstructions.
+    pub fn is_control_flow(opcode: Opcode) -> bool {
+        superops::is_control_flow(opcode)
+    }
+
+    /// Check whether an instruction may only be the last one of a
+    /// superinstruction, as it changes the PC or may suspend the thread or
+    /// execute again.
+    pub fn ends_sequence(opcode: Opcode) -> bool {
+        superops::ends_sequence(opcode)
+    }
+}
+
+/// Superinstructions execute a sequence of instructions with a single
+/// dispatch. The fused opcode only replaces the opcode of the first
+/// instruction, the operands of all instructions stay in place, so jumps into
+/// the middle of a sequence remain valid.
+///
+/// The table is generated by the build script from src/vm/superinstructions.txt
+pub mod superops {
+    use super::*;
+
+    pub const FIRST: Opcode = 128;
+
+    include!(concat!(env!("OUT_DIR"), "/superinstructions.rs"));
+
+    /// Get the instructions fused by a superinstruction
+    pub fn components(opcode: Opcode) -> Option<&'static [Opcode]> {
+        if opcode < FIRST {
+            return None;
+        }
+        SUPERINSTRUCTIONS.get((opcode - FIRST) as usize).map(|&(_, sequence)| sequence)
+    }
+
+    /// Get the opcode of the instruction a (super)instruction starts with
+    pub fn base(opcode: Opcode) -> Opcode {
+        match components(opcode) {
+            Some(sequence) => sequence[0],
+            None => opcode
+        }
+    }
 }
 
 /// A listing of possible types
@@ -70,7 +239,43 @@ pub type Type = u8;
 pub mod types {
     use super::*;
     pub const INT: Type = 0;
+    /// A record whose fields are kept in consecutive registers
+    pub const RECORD: Type = 1;
+    /// A function which is only called, its captured values are kept in
+    /// consecutive registers
+    pub const FUNCTION: Type = 2;
     //pub const FLOAT: Type = 0;
     //pub const INTLIST: Type = 0;
     //pub const FLOATLIST: Type = 0;
-}
\ No newline at end of file
+}
+/// Encoding of values in registers. Registers hold plain integers, references
+/// to heap objects are integers with a reserved tag in the upper 16 bits.
+/// Integers in the tagged range can therefore not be used.
+pub mod values {
+    /// Tag of all references
+    pub const REF: i64 = 0x7ff1 << 48;
+    pub const TAG: i64 = 0xffff << 48;
+    /// Set in references to the old generation, clear for the nursery
+    pub const OLD: i64 = 1 << 47;
+    /// The empty list
+    pub const NIL: i64 = REF;
+
+    /// Check whether a value is a reference, including `NIL`.
+    #[inline(always)]
+    pub fn is_ref(value: i64) -> bool {
+        value & TAG == REF
+    }
+
+    /// Build the constant of a string literal from its offset and length in
+    /// the data section of the module
+    #[inline(always)]
+    pub fn literal(offset: usize, len: usize) -> i64 {
+        (offset as i64) << 32 | len as i64
+    }
+
+    /// Word offset of a referenced object in its space
+    #[inline(always)]
+    pub fn offset(value: i64) -> usize {
+        (value & (OLD - 1)) as usize
+    }
+}
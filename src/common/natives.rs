@@ -0,0 +1,83 @@
+/// Registry of native functions, host functions callable from Lilium
+use std::sync::{Once, ONCE_INIT, RwLock};
+
+/// A native function. It gets its arguments as a slice of the register
+/// window of the caller and returns the value of the call.
+///
+/// # Remarks
+///
+/// Arguments are passed as they are stored in the registers: integers as
+/// they are, references as opaque values. The result has to be an integer,
+/// `nil` or one of the arguments, as the function can not allocate on the
+/// heap of the thread.
+pub type Native = fn(&[i64]) -> i64;
+
+/// Natives can be numbered by a single operand
+const MAX_NATIVES: usize = 256;
+
+struct Entry {
+    name: String,
+    arity: u8,
+    function: Native
+}
+
+static INIT: Once = ONCE_INIT;
+static mut REGISTRY: *const RwLock<Vec<Entry>> = 0 as *const RwLock<Vec<Entry>>;
+
+fn registry() -> &'static RwLock<Vec<Entry>> {
+    unsafe {
+        INIT.call_once(|| REGISTRY = Box::into_raw(Box::new(RwLock::new(Vec::new()))));
+        &*REGISTRY
+    }
+}
+
+/// Register a native function for all threads of the process. Calls of
+/// functions with this name, which are not defined by the program, are
+/// compiled to calls of the native function. Returns its index.
+///
+/// # Arguments
+///
+/// * `name` - Name the function is called by
+/// * `arity` - Number of arguments of the function
+/// * `function` - The function
+///
+/// # Remarks
+///
+/// Registering a name again replaces the function for code compiled and
+/// decoded afterwards, the arity has to stay the same. Compiled modules
+/// refer to natives by their index, so a module has to be run in a process
+/// which registered the same natives in the same order.
+pub fn register_native(name: &str, arity: u8, function: Native) -> u8 {
+    let mut natives = registry().write().unwrap();
+    if let Some(index) = natives.iter().position(|entry| entry.name == name) {
+        if natives[index].arity != arity {
+            panic!("Native function {} already takes {} arguments", name, natives[index].arity);
+        }
+        natives[index].function = function;
+        return index as u8;
+    }
+    if natives.len() == MAX_NATIVES {
+        panic!("Too many native functions");
+    }
+    natives.push(Entry {
+        name: name.to_string(),
+        arity,
+        function
+    });
+    (natives.len() - 1) as u8
+}
+
+/// Look up a native function by name, returns its index and arity.
+pub fn native_index(name: &str) -> Option<(u8, u8)> {
+    let natives = registry().read().unwrap();
+    natives.iter()
+        .position(|entry| entry.name == name)
+        .map(|index| (index as u8, natives[index].arity))
+}
+
+/// Get a native function with its arity by index.
+pub fn native_function(index: u8) -> Option<(Native, u8)> {
+    let natives = registry().read().unwrap();
+    natives.get(index as usize).map(|entry| (entry.function, entry.arity))
+}
+
@@ -2,15 +2,99 @@
 /// the AST provided by the parser. The instructions are being stored in
 /// an appropriate data structure, this module is not concerned with
 /// packing code into modules.
+use std;
 use std::collections::HashMap;
 use std::convert::TryFrom;
 use common::*;
 use compiler::parser::{Expression, Expression::*};
 
-/// Structure for performing optimizations
-struct OptimizationInfo<'a> {
-    func_name: &'a str,
-    tail: bool,
+/// A pending unit of work of the code generator.
+///
+/// Instead of recursing on the native stack for every level of the AST, the
+/// generator keeps an explicit stack of tasks. An expression is expanded into
+/// the tasks needed to evaluate it, pushed in reverse order so that they are
+/// popped in evaluation order. Native stack usage therefore does not depend on
+/// how deeply expressions are nested.
+enum Task<'a> {
+    /// Generate an expression, storing the result in the given register.
+    /// The flag marks expressions in tail position of a function body.
+    Generate(&'a Expression, Register, bool),
+    /// Append an instruction which is fully known at expansion time
+    Emit(Instruction),
+    /// Make a variable visible to all following tasks
+    Bind(&'a String, Register),
+    /// Make a variable visible whose record is kept in consecutive registers,
+    /// starting at the given one
+    BindRecord(&'a String, &'a str, Register),
+    /// Make a variable visible which is bound to a lambda that is only called,
+    /// with the function of the lambda and the number of its captured values.
+    /// These are kept in consecutive registers, starting at the given one.
+    BindFunction(&'a String, u32, u8, Register),
+    /// Remove the innermost binding of a variable
+    Unbind(&'a String),
+    /// Copy the value of a variable into a register
+    Load(&'a String, Register),
+    /// Call the function with the given index, the flag marks tail calls
+    Call(u32, Register, bool),
+    /// Emit a conditional forward jump of the given conditional, the offset is
+    /// patched later
+    Branch(Register, Opcode, u32),
+    /// Emit an unconditional forward jump, the offset is patched later
+    Jump,
+    /// Patch the most recent conditional jump to the current position
+    PatchBranch,
+    /// Patch the most recent unconditional jump to the current position
+    PatchJump,
+    /// Restore the source location of an expression, after one of its
+    /// subexpressions has been generated
+    Locate(Location),
+    /// Remember the current position as the target of a backward jump
+    Mark,
+    /// Emit a backward jump to the most recent mark, removing it
+    JumpBack,
+    /// Start collecting the exits of a loop
+    OpenLoop,
+    /// Emit a conditional forward jump out of the innermost loop
+    Exit(Register, Opcode),
+    /// Patch all exits of the innermost loop to the current position
+    CloseLoop
+}
+
+/// Address of a function whose code has not been generated yet
+const PENDING: u64 = std::u64::MAX;
+
+/// Step between the tags of values, subtracting it from an integer literal
+/// overlapping the tag of references leaves a plain integer
+const TAG_STEP: i64 = 1 << 48;
+
+/// State of the code generator while processing the AST.
+struct Generator<'a> {
+    func: HashMap<&'a str, u32>,
+    /// Number of parameters of each function, without captured values
+    arities: Vec<u8>,
+    /// Lambdas whose bodies are generated once the current function is
+    /// complete, with their function, parameters, body and captured variables
+    lambdas: Vec<(u32, &'a [String], &'a [Expression], Vec<&'a String>)>,
+    /// Records with their type number and field names
+    records: HashMap<&'a str, (i64, &'a [String])>,
+    vars: HashMap<&'a str, Vec<(Type, Register)>>,
+    /// Record of the variables kept in registers, by their first register
+    shapes: HashMap<Register, &'a str>,
+    /// Function and number of captured values of the lambdas which are only
+    /// called, by the first register of their captured values
+    callees: HashMap<Register, (u32, u8)>,
+    conditionals: HashMap<*const Expression, u32>,
+    likely: &'a [bool],
+    sites: Vec<u64>,
+    jumps: Vec<usize>,
+    /// Targets of backward jumps, and the exits of all open loops
+    marks: Vec<usize>,
+    exits: Vec<Vec<usize>>,
+    tasks: Vec<Task<'a>>,
+    locations: &'a HashMap<*const Expression, Location>,
+    location: Location,
+    lines: Vec<(u64, Location)>,
+    module: Module
 }
 
 /// Generate a module from the abstract syntax tree.
@@ -18,27 +102,60 @@ struct OptimizationInfo<'a> {
 /// # Arguments
 ///
 /// * `expressions` - All top level expressions (AST roots) generated by the parser
+/// * `likely` - For each conditional in source order, whether its condition is
+///              expected to be true. Missing entries are treated as false.
+/// * `locations` - Source location of each expression, as provided by the
+///                 parser. Without locations, no line table is generated.
 ///
 /// # Remarks
 ///
 /// Function definitions are processed first and placed at the beginning of the
 /// module, which allows for easier processing. The entry point of the module
 /// points to the first top level expression being evaluated.
-pub fn generate(expressions: &[Expression]) -> Module {
-    let mut func: HashMap<String, u32> = HashMap::new();
-    let vars: HashMap<String, (Type, Register)> = HashMap::new();
-    let mut module = Module {
-        functions: Vec::new(),
-        constants: Vec::new(),
-        entry_point: 0,
-        code: Vec::new()
+///
+/// Besides the module, the PC of the conditional jump of every conditional is
+/// returned, in source order. This allows mapping a profile of the module back
+/// to the conditionals.
+pub fn generate<'a>(expressions: &'a [Expression],
+                    likely: &'a [bool],
+                    locations: &'a HashMap<*const Expression, Location>) -> (Module, Vec<u64>) {
+    let conditionals = number_conditionals(expressions);
+    let sites = vec![0; conditionals.len()];
+    let mut generator = Generator {
+        func: HashMap::new(),
+        arities: Vec::new(),
+        lambdas: Vec::new(),
+        records: HashMap::new(),
+        vars: HashMap::new(),
+        shapes: HashMap::new(),
+        callees: HashMap::new(),
+        conditionals,
+        likely,
+        sites,
+        jumps: Vec::new(),
+        marks: Vec::new(),
+        exits: Vec::new(),
+        tasks: Vec::new(),
+        locations,
+        location: Location::default(),
+        lines: Vec::new(),
+        module: Module {
+            functions: Vec::new(),
+            constants: Vec::new(),
+            data: Vec::new(),
+            entry_point: 0,
+            code: Vec::new(),
+            lines: None
+        }
     };
 
-    // Initial optimization info structure
-    let oinfo = OptimizationInfo {
-        func_name: "NONE",
-        tail: false
-    };
+    // Record definitions only declare names and do not generate any code
+    for expr in expressions {
+        if let RecordDefinition(ref name, ref fields) = *expr {
+            let id = generator.records.len() as i64;
+            generator.records.insert(name.as_str(), (id, fields.as_slice()));
+        }
+    }
 
     // Process function definitions first
     let filtered = expressions.iter().filter(|&x| match *x {
@@ -46,91 +163,559 @@ pub fn generate(expressions: &[Expression]) -> Module {
         _ => false
     });
     for expr in filtered {
-        generate_expression(expr, reg::VAL, &mut func, &vars, &mut module, &oinfo);
+        generator.generate(expr, reg::VAL);
+        generator.generate_lambdas();
     }
 
     // Process top-level expressions to be evaluated
-    module.entry_point = module.code.len() as u64;
+    generator.module.entry_point = generator.module.code.len() as u64;
     let filtered = expressions.iter().filter(|&x| match *x {
-        FunctionDefinition(_,_,_) => false,
+        FunctionDefinition(_,_,_) | RecordDefinition(_,_) => false,
         _ => true
     });
     for expr in filtered {
-        generate_expression(expr, reg::VAL, &mut func, &vars, &mut module, &oinfo);
+        generator.generate(expr, reg::VAL);
     }
 
-    // Always end with halt instruction
-    module.code.push(Instruction {
+    // Always end with halt instruction, followed by the lambdas of the
+    // top-level expressions
+    generator.module.code.push(Instruction {
         opcode: ops::HLT,
         target: 0,
         left: 0,
         right: 0
     });
+    generator.generate_lambdas();
+    let mut module = generator.module;
+
+    if !locations.is_empty() {
+        module.lines = Some(LineTable::new(&generator.lines));
+    }
 
-    module
+    (module, generator.sites)
 }
 
-/// Generate instructions for an AST with expression as its root node.
+/// Assign a number to every conditional, in the order of appearance in the
+/// source code. Unlike the order of generation, this order does not depend on
+/// the chosen layout.
 ///
 /// # Arguments
 ///
-/// * `expr` - Root expression of the AST
-/// * `base` - Base register of the expression, return value is stored here
-/// * `func` - Lookup table for function table entries
-/// * `vars` - A variable assignment for all child expressions
-/// * `module` - Module to be filled with constant/function/code storage
-/// * `oinfo` - Information used for optimization
-fn generate_expression(expr: &Expression,
-                       base: u8,
-                       func: &mut HashMap<String, u32>,
-                       vars: &HashMap<String, (Type, Register)>,
-                       module: &mut Module,
-                       oinfo: &OptimizationInfo) {
-    match *expr {
-        Integer(i) => {
-            expr_integer(i, base, module);
+/// * `expressions` - All top level expressions (AST roots) generated by the parser
+fn number_conditionals(expressions: &[Expression]) -> HashMap<*const Expression, u32> {
+    let mut conditionals = HashMap::new();
+    let mut stack: Vec<&Expression> = expressions.iter().rev().collect();
+
+    while let Some(expr) = stack.pop() {
+        if let Conditional(_, _, _) = *expr {
+            let index = conditionals.len() as u32;
+            conditionals.insert(expr as *const Expression, index);
         }
-        BinaryOp(ref op, ref left, ref right) => {
-            let optimizations = OptimizationInfo {
-                func_name: oinfo.func_name,
-                tail: false
-            };
-            expr_binary(op, left, right, base, func, vars, module, &optimizations);
+        stack.extend(expr.children().into_iter().rev());
+    }
+
+    conditionals
+}
+
+impl<'a> Generator<'a> {
+    /// Generate instructions for a top level expression.
+    ///
+    /// # Arguments
+    ///
+    /// * `expr` - Root expression of the AST
+    /// * `base` - Base register of the expression, return value is stored here
+    fn generate(&mut self, expr: &'a Expression, base: Register) {
+        self.tasks.push(Task::Generate(expr, base, false));
+        self.run();
+    }
+
+    /// Generate the bodies of all pending lambdas, including the lambdas
+    /// within them. Each body is a function of its own, placed after the
+    /// current code.
+    fn generate_lambdas(&mut self) {
+        while let Some((index, param, body, captured)) = self.lambdas.pop() {
+            self.module.functions[index as usize] = self.module.code.len() as u64;
+            expr_lambda(param, &captured, body, &mut self.tasks);
+            self.run();
         }
-        UnaryOp(ref op, ref left) => {
-            let optimizations = OptimizationInfo {
-                func_name: oinfo.func_name,
-                tail: false
-            };
-            expr_unary(op, left, base, func, vars, module, &optimizations);
+    }
+
+    /// Process tasks until the work stack is empty.
+    fn run(&mut self) {
+        while let Some(task) = self.tasks.pop() {
+            let start = self.module.code.len();
+            match task {
+                Task::Generate(expr, base, tail) => {
+                    if let Some(&location) = self.locations.get(&(expr as *const Expression)) {
+                        self.tasks.push(Task::Locate(self.location));
+                        self.location = location;
+                    }
+                    self.expand(expr, base, tail);
+                }
+                Task::Locate(location) => {
+                    self.location = location;
+                }
+                Task::Emit(instruction) => {
+                    self.module.code.push(instruction);
+                }
+                Task::Bind(name, reg) => {
+                    self.vars.entry(name.as_str()).or_insert_with(Vec::new).push((types::INT, reg));
+                }
+                Task::BindRecord(name, record, reg) => {
+                    self.vars.entry(name.as_str()).or_insert_with(Vec::new).push((types::RECORD, reg));
+                    self.shapes.insert(reg, record);
+                }
+                Task::BindFunction(name, index, count, reg) => {
+                    self.vars.entry(name.as_str()).or_insert_with(Vec::new).push((types::FUNCTION, reg));
+                    self.callees.insert(reg, (index, count));
+                }
+                Task::Unbind(name) => {
+                    if let Some(bindings) = self.vars.get_mut(name.as_str()) {
+                        bindings.pop();
+                    }
+                }
+                Task::Load(name, reg) => {
+                    expr_variable(name, reg, &self.vars, &mut self.module);
+                }
+                Task::Call(index, base, tail) => {
+                    expr_call(index, base, tail, &mut self.module);
+                }
+                Task::Branch(base, opcode, index) => {
+                    self.sites[index as usize] = self.module.code.len() as u64;
+                    self.jumps.push(self.module.code.len());
+                    self.module.code.push(Instruction {
+                        opcode,
+                        target: base,
+                        left: 0,
+                        right: 0
+                    });
+                }
+                Task::Jump => {
+                    self.jumps.push(self.module.code.len());
+                    self.module.code.push(Instruction {
+                        opcode: ops::JMF,
+                        target: 0,
+                        left: 0,
+                        right: 0
+                    });
+                }
+                Task::PatchBranch => {
+                    let jmp_index = self.jumps.pop().expect("Unbalanced branch");
+                    let offset = self.module.code.len() - jmp_index + 1;
+                    let jmp = &mut self.module.code[jmp_index];
+                    jmp.left = offset as u8;
+                    jmp.right = (offset >> 8) as u8;
+                }
+                Task::Mark => {
+                    self.marks.push(self.module.code.len());
+                }
+                Task::JumpBack => {
+                    let mark = self.marks.pop().expect("Unbalanced loop");
+                    let offset = self.module.code.len() - mark;
+                    self.module.code.push(Instruction {
+                        opcode: ops::JMB,
+                        target: offset as u8,
+                        left: (offset >> 8) as u8,
+                        right: (offset >> 16) as u8
+                    });
+                }
+                Task::OpenLoop => {
+                    self.exits.push(Vec::new());
+                }
+                Task::Exit(reg, opcode) => {
+                    let exit = self.module.code.len();
+                    self.exits.last_mut().expect("Exit outside of a loop").push(exit);
+                    self.module.code.push(Instruction {
+                        opcode,
+                        target: reg,
+                        left: 0,
+                        right: 0
+                    });
+                }
+                Task::CloseLoop => {
+                    for exit in self.exits.pop().expect("Unbalanced loop") {
+                        let offset = self.module.code.len() - exit;
+                        let jmp = &mut self.module.code[exit];
+                        jmp.left = offset as u8;
+                        jmp.right = (offset >> 8) as u8;
+                    }
+                }
+                Task::PatchJump => {
+                    let jmp_index = self.jumps.pop().expect("Unbalanced jump");
+                    let offset = self.module.code.len() - jmp_index;
+                    let jmp = &mut self.module.code[jmp_index];
+                    jmp.target = offset as u8;
+                    jmp.left = (offset >> 8) as u8;
+                    jmp.right = (offset >> 16) as u8;
+                }
+            }
+
+            // Start a new line table run if the task emitted code for a
+            // different location than the previous one
+            if self.module.code.len() > start &&
+               self.lines.last().map_or(true, |&(_, location)| location != self.location) {
+                self.lines.push((start as u64, self.location));
+            }
         }
-        NullaryOp(ref op) => {
-            expr_nullary(op, base, module);
+    }
+
+    /// Expand a single AST node, either emitting its instructions directly or
+    /// scheduling the tasks needed to evaluate it.
+    ///
+    /// # Arguments
+    ///
+    /// * `expr` - Expression to be expanded
+    /// * `base` - Base register of the expression, return value is stored here
+    /// * `tail` - Whether the expression is in tail position of a function body
+    fn expand(&mut self, expr: &'a Expression, base: Register, tail: bool) {
+        match *expr {
+            Integer(i) if values::is_ref(i) => {
+                // Literals overlapping the tag of references are computed,
+                // the addition promotes them to bignums
+                expr_integer(i - TAG_STEP, base, &mut self.module);
+                expr_integer(TAG_STEP, base + 1, &mut self.module);
+                self.module.code.push(Instruction { opcode: ops::ADD, target: base, left: base, right: base + 1 });
+            }
+            Integer(i) => {
+                expr_integer(i, base, &mut self.module);
+            }
+            Text(ref text) => {
+                expr_string(text, base, &mut self.module);
+            }
+            BinaryOp(ref op, ref left, ref right) => {
+                expr_binary(op, left, right, base, &mut self.tasks);
+            }
+            UnaryOp(ref op, ref left) => {
+                expr_unary(op, left, base, &mut self.tasks);
+            }
+            TernaryOp(ref op, ref first, ref second, ref third) => {
+                expr_ternary(op, first, second, third, base, &mut self.tasks);
+            }
+            NullaryOp(ref op) => {
+                expr_nullary(op, base, &mut self.module);
+            }
+            Function(ref name, ref param) => {
+                if name == "write-raw" {
+                    return expr_write_raw(param, base, &mut self.tasks);
+                }
+                // Lambdas bound by let shadow the functions of the same name.
+                // Other variables are only called if the name is not a
+                // record, function or native, so those calls stay the same
+                // as before functions were values.
+                match self.vars.get(name.as_str()).and_then(|v| v.last()).cloned() {
+                    Some((types::FUNCTION, reg)) => {
+                        let (index, count) = self.callees[&reg];
+                        let arity = self.arities[index as usize];
+                        if arity as usize != param.len() {
+                            panic!("Function {} takes {} arguments", name, arity);
+                        }
+                        return expr_known_call(index, param, reg, count, base, tail, &mut self.tasks);
+                    }
+                    Some(_) if !self.callable(name) => {
+                        let function = Task::Load(name, base + 1 + param.len() as u8);
+                        return expr_apply(function, param, base, tail, &mut self.tasks);
+                    }
+                    _ => {}
+                }
+                if let Some((id, fields)) = self.records.get(name.as_str()).cloned() {
+                    if fields.len() != param.len() {
+                        panic!("Record {} has {} fields", name, fields.len());
+                    }
+                    return expr_record(id, param, base, &mut self.tasks);
+                }
+                let index = match self.func.get(name.as_str()) {
+                    Some(index) => *index,
+                    _ => match native_index(name) {
+                        Some((index, arity)) => {
+                            if arity as usize != param.len() {
+                                panic!("Native function {} takes {} arguments", name, arity);
+                            }
+                            return expr_native(index, param, base, &mut self.tasks);
+                        }
+                        None => panic!("Function {} is not defined", name)
+                    }
+                };
+                expr_call_params(index, param, base, tail, &mut self.tasks);
+            }
+            Generator(ref name, ref param) => {
+                let index = match self.func.get(name.as_str()) {
+                    Some(index) => *index,
+                    _ => panic!("Function {} is not defined", name)
+                };
+                expr_generator(index, param, base, &mut self.tasks);
+            }
+            RecordDefinition(ref name, _) => {
+                panic!("Record {} is not defined at the top level", name);
+            }
+            FieldAccess(ref record, ref field) => {
+                if let Variable(ref name) = **record {
+                    if let Some(&(types::RECORD, reg)) = self.vars.get(name.as_str()).and_then(|v| v.last()) {
+                        let index = self.field_of(self.shapes[&reg], field);
+                        return expr_variable_field(reg, index, base, &mut self.module);
+                    }
+                }
+                let index = self.field_index(field);
+                expr_field(record, index, base, &mut self.tasks);
+            }
+            FieldUpdate(ref record, ref field, ref value) => {
+                let index = self.field_index(field);
+                expr_field_update(record, index, value, base, &mut self.tasks);
+            }
+            Stream(ref op, ref vars, ref operands) => {
+                if op != "fold" {
+                    panic!("The stream {} is not consumed by fold", op);
+                }
+                expr_fold(&vars[0], &vars[1], &operands[0], &operands[1], &operands[2], base, &mut self.tasks);
+            }
+            FunctionDefinition(ref name, ref param, ref body) => {
+                let index = self.module.functions.len() as u32;
+                self.func.insert(name.as_str(), index);
+                self.arities.push(param.len() as u8);
+                expr_fundef(param, body, base, &mut self.module, &mut self.tasks);
+            }
+            Lambda(ref param, ref body) => {
+                let captured = self.captured(param, body, &[]);
+                let index = self.lambda(param, body, captured.clone());
+                expr_function_value(index, param.len() as u8, &captured, base, &mut self.tasks);
+            }
+            Apply(ref function, ref param) => {
+                let function = Task::Generate(function, base + 1 + param.len() as u8, false);
+                expr_apply(function, param, base, tail, &mut self.tasks);
+            }
+            VariableAssignment(ref assignments, ref body) => {
+                let scalars = self.scalar_records(assignments, body);
+                let functions = self.known_functions(assignments, body);
+                expr_varass(assignments, body, &scalars, &functions, base, &mut self.tasks);
+            }
+            Variable(ref name) => {
+                if self.vars.get(name.as_str()).map_or(true, |v| v.is_empty()) {
+                    if let Some(&index) = self.func.get(name.as_str()) {
+                        let arity = self.arities[index as usize];
+                        return expr_function_value(index, arity, &[], base, &mut self.tasks);
+                    }
+                }
+                expr_variable(name, base, &self.vars, &mut self.module);
+            }
+            Conditional(ref condition, ref yes, ref no) => {
+                let index = self.conditionals[&(expr as *const Expression)];
+                let likely = self.likely.get(index as usize).cloned().unwrap_or(false);
+                expr_conditional(condition, yes, no, base, tail, index, likely, &mut self.tasks);
+            }
         }
-        Function(ref name, ref param) => {
-            expr_call(name, param, base, func, vars, module, oinfo);
+    }
+
+    /// Check whether a name is called as a record, function or native.
+    fn callable(&self, name: &str) -> bool {
+        self.records.contains_key(name) || self.func.contains_key(name) || native_index(name).is_some()
+    }
+
+    /// Get the index of a field in the given record.
+    fn field_of(&self, record: &str, field: &str) -> u8 {
+        let (_, fields) = self.records[record];
+        match fields.iter().position(|f| f == field) {
+            Some(index) => index as u8,
+            None => panic!("Record {} has no field {}", record, field)
         }
-        FunctionDefinition(ref name, ref param, ref body) => {
-            let optimizations = OptimizationInfo {
-                func_name: name,
-                tail: true
-            };
-            expr_fundef(name, param, body, base, func, vars, module, &optimizations);
+    }
+
+    /// Get the index of a field in any record.
+    ///
+    /// # Remarks
+    ///
+    /// Records are not typed statically, so a field has to be at the same
+    /// index in all records declaring it.
+    fn field_index(&self, field: &str) -> u8 {
+        let mut indices = self.records.values()
+            .filter_map(|&(_, fields)| fields.iter().position(|f| f == field));
+        let index = match indices.next() {
+            Some(index) => index,
+            None => panic!("Field {} is not defined", field)
+        };
+        if indices.any(|other| other != index) {
+            panic!("Field {} is at different positions in different records", field);
         }
-        VariableAssignment(ref assignments, ref body) => {
-            let optimizations = OptimizationInfo {
-                func_name: oinfo.func_name,
-                tail: false
+        index as u8
+    }
+
+    /// Find the variables of a **let** expression which can be kept in
+    /// registers instead of the heap (scalar replacement). These are bound
+    /// to a record construction and only used by field accesses, so the
+    /// record never escapes.
+    ///
+    /// # Arguments
+    ///
+    /// * `assignments` - The variables of the expression
+    /// * `body` - The body of the expression
+    ///
+    /// # Remarks
+    ///
+    /// For each variable the record and the field values are returned, or
+    /// `None` if the variable has to be kept in a single register.
+    fn scalar_records(&self,
+                      assignments: &'a [(String, Expression)],
+                      body: &'a [Expression]) -> Vec<Option<(&'a str, &'a [Expression])>> {
+        assignments.iter().enumerate().map(|(i, &(ref var, ref expr))| {
+            let (name, param) = match *expr {
+                Function(ref name, ref param) if !param.is_empty() => (name, param),
+                _ => return None
             };
-            expr_varass(assignments, body, base, func, vars, module, &optimizations);
+            if !self.records.contains_key(name.as_str()) {
+                return None;
+            }
+
+            let later = assignments[i + 1..].iter().map(|&(_, ref e)| e);
+            let mut stack: Vec<&Expression> = later.chain(body.iter()).collect();
+            while let Some(expr) = stack.pop() {
+                match *expr {
+                    FieldAccess(ref record, _) => match **record {
+                        Variable(_) => {}
+                        ref record => stack.push(record)
+                    },
+                    Variable(ref name) if name == var => return None,
+                    // A lambda would capture the record as a value
+                    Lambda(_, _) if mentions(expr, var) => return None,
+                    _ => stack.extend(expr.children())
+                }
+            }
+            Some((name.as_str(), param.as_slice()))
+        }).collect()
+    }
+
+    /// Find the variables of a **let** expression which are bound to a lambda
+    /// that is only called, so it never has to exist as a function value.
+    /// Calls of such a lambda are direct calls, and the values it captures
+    /// are kept in registers.
+    ///
+    /// # Arguments
+    ///
+    /// * `assignments` - The variables of the expression
+    /// * `body` - The body of the expression
+    ///
+    /// # Remarks
+    ///
+    /// A function is reserved for each of these lambdas. For each variable
+    /// the function and the captured variables are returned, or `None` if
+    /// the variable holds a value.
+    fn known_functions(&mut self,
+                       assignments: &'a [(String, Expression)],
+                       body: &'a [Expression]) -> Vec<Option<(u32, Vec<&'a String>)>> {
+        let mut functions = Vec::with_capacity(assignments.len());
+        for (i, &(ref var, ref expr)) in assignments.iter().enumerate() {
+            let (param, lambda) = match *expr {
+                Lambda(ref param, ref lambda) => (param, lambda),
+                _ => {
+                    functions.push(None);
+                    continue;
+                }
+            };
+
+            let later = assignments[i + 1..].iter().map(|&(_, ref e)| e);
+            let mut stack: Vec<&Expression> = later.chain(body.iter()).collect();
+            let mut called = true;
+            while let Some(expr) = stack.pop() {
+                match *expr {
+                    Variable(ref name) if name == var => called = false,
+                    Lambda(_, _) if mentions(expr, var) => called = false,
+                    _ => stack.extend(expr.children())
+                }
+            }
+            if !called {
+                functions.push(None);
+                continue;
+            }
+
+            // The preceding variables are bound by the time the lambda is
+            // reached, so they can be captured as well
+            let earlier: Vec<&'a String> = assignments[..i].iter().map(|&(ref var, _)| var).collect();
+            let captured = self.captured(param, lambda, &earlier);
+            let index = self.lambda(param, lambda, captured.clone());
+            functions.push(Some((index, captured)));
         }
-        Variable(ref name) => {
-            expr_variable(name, base, vars, module);
+        functions
+    }
+
+    /// Get the variables a lambda captures, which are the visible variables
+    /// it uses besides its parameters.
+    ///
+    /// # Arguments
+    ///
+    /// * `param` - The parameters of the lambda
+    /// * `body` - The body of the lambda
+    /// * `bound` - Variables which are not bound yet, but will be once the
+    ///             lambda is reached
+    ///
+    /// # Remarks
+    ///
+    /// Variables bound within the body are captured as well if the name is
+    /// visible outside, which costs a register but is harmless, as the inner
+    /// binding shadows the captured one.
+    fn captured(&self,
+                param: &[String],
+                body: &'a [Expression],
+                bound: &[&'a String]) -> Vec<&'a String> {
+        let mut captured: Vec<&'a String> = Vec::new();
+        let mut stack: Vec<&'a Expression> = body.iter().rev().collect();
+        while let Some(expr) = stack.pop() {
+            match *expr {
+                Variable(ref name) | Function(ref name, _) => {
+                    let visible = self.vars.get(name.as_str()).map_or(false, |v| !v.is_empty()) ||
+                                  bound.contains(&name);
+                    if visible && !param.contains(name) && !captured.contains(&name) {
+                        captured.push(name);
+                    }
+                }
+                _ => {}
+            }
+            stack.extend(expr.children().into_iter().rev());
         }
-        Conditional(ref condition, ref yes, ref no) => {
-            expr_conditional(condition, yes, no, base, func, vars, module, &oinfo);
+        captured
+    }
+
+    /// Reserve a function for a lambda, whose body is generated once the
+    /// current function is complete. Returns the index of the function.
+    fn lambda(&mut self,
+              param: &'a [String],
+              body: &'a [Expression],
+              captured: Vec<&'a String>) -> u32 {
+        let index = self.module.functions.len() as u32;
+        self.module.functions.push(PENDING);
+        self.arities.push(param.len() as u8);
+        self.lambdas.push((index, param, body, captured));
+        index
+    }
+}
+
+/// Check whether an expression uses a variable or calls a function of the
+/// given name.
+fn mentions(expr: &Expression, name: &str) -> bool {
+    let mut stack = vec![expr];
+    while let Some(expr) = stack.pop() {
+        match *expr {
+            Variable(ref var) | Function(ref var, _) if var == name => return true,
+            _ => stack.extend(expr.children())
         }
     }
+    false
+}
+
+/// Schedule a sequence of expressions, all storing their result in the same
+/// register. Only the last expression inherits the tail position.
+///
+/// # Arguments
+///
+/// * `exprs` - The expressions in evaluation order
+/// * `base` - Base register of the expressions, the last value is stored here
+/// * `tail` - Whether the sequence is in tail position of a function body
+/// * `tasks` - Work stack the tasks are pushed on
+#[inline(always)]
+fn push_sequence<'a>(exprs: &'a [Expression],
+                     base: u8,
+                     tail: bool,
+                     tasks: &mut Vec<Task<'a>>) {
+    let last = exprs.len().saturating_sub(1);
+    for (i, expr) in exprs.iter().enumerate().rev() {
+        tasks.push(Task::Generate(expr, base, tail && i == last));
+    }
 }
 
 /// Generate instructions for a constant integer node.
@@ -179,32 +764,346 @@ fn expr_integer(value: i64,
     }
 }
 
-/// Generate instructions for a binary operation.
+/// Generate instructions for a string literal.
 ///
 /// # Arguments
 ///
-/// * `op` - Name of the operation
-/// * `left` - Left operand
-/// * `right` - Right operand
+/// * `text` - Contents of the literal
 /// * `base` - Base register of the expression, return value is stored here
-/// * `func` - Lookup table for function table entries
-/// * `vars` - A variable assignment for all child expressions
 /// * `module` - Module to be filled with constant/function/code storage
-/// * `oinfo` - Information needed for optimizations
+///
+/// # Remarks
+///
+/// The bytes are appended to the data section of the module, the literal is
+/// loaded through a constant holding their offset and length.
 #[inline(always)]
-fn expr_binary(op: &str,
-               left: &Expression,
-               right: &Expression,
+fn expr_string(text: &str,
                base: u8,
-               func: &mut HashMap<String, u32>,
-               vars: &HashMap<String, (Type, Register)>,
-               module: &mut Module,
-               oinfo: &OptimizationInfo) {
-    let reg_left = base + 1;
-    generate_expression(left, reg_left, func, vars, module, oinfo);
-    let reg_right = base + 2;
-    generate_expression(right, reg_right, func, vars, module, oinfo);
+               module: &mut Module) {
+    let len = u16::try_from(module.constants.len())
+        .expect("Reached maximum number of constants.");
+    module.constants.push(values::literal(module.data.len(), text.len()));
+    module.data.extend_from_slice(text.as_bytes());
+    module.code.push(Instruction {
+        opcode: ops::LDS,
+        target: base,
+        left: len as u8,
+        right: (len >> 8) as u8
+    });
+}
 
+/// Schedule instructions for a record construction.
+///
+/// # Arguments
+///
+/// * `id` - Type number of the record
+/// * `param` - Field values in order of declaration
+/// * `base` - Base register of the expression, return value is stored here
+/// * `tasks` - Work stack the tasks are pushed on
+///
+/// # Remarks
+///
+/// The type number and the fields are evaluated into consecutive registers,
+/// which are copied to the heap as one block.
+#[inline(always)]
+fn expr_record<'a>(id: i64,
+                   param: &'a [Expression],
+                   base: u8,
+                   tasks: &mut Vec<Task<'a>>) {
+    tasks.push(Task::Emit(Instruction {
+        opcode: ops::REC,
+        target: base,
+        left: base + 1,
+        right: param.len() as u8 + 1
+    }));
+    for (i, p) in param.iter().enumerate().rev() {
+        tasks.push(Task::Generate(p, base + 2 + i as u8, false));
+    }
+    tasks.push(Task::Emit(Instruction {
+        opcode: ops::LD,
+        target: base + 1,
+        left: id as u8,
+        right: (id >> 8) as u8
+    }));
+}
+
+/// Schedule instructions for writing integers as raw bytes.
+///
+/// # Arguments
+///
+/// * `param` - Expressions evaluating to the integers
+/// * `base` - Base register of the expression, return value is stored here
+/// * `tasks` - Work stack the tasks are pushed on
+///
+/// # Remarks
+///
+/// The integers are evaluated into consecutive registers and written as a
+/// batch by a single instruction.
+#[inline(always)]
+fn expr_write_raw<'a>(param: &'a [Expression],
+                      base: u8,
+                      tasks: &mut Vec<Task<'a>>) {
+    if param.is_empty() {
+        panic!("Nothing to write");
+    }
+    tasks.push(Task::Emit(Instruction {
+        opcode: ops::WRR,
+        target: base,
+        left: base + 1,
+        right: param.len() as u8
+    }));
+    for (i, p) in param.iter().enumerate().rev() {
+        tasks.push(Task::Generate(p, base + 1 + i as u8, false));
+    }
+}
+
+/// Schedule instructions for reading a field of a record on the heap.
+///
+/// # Arguments
+///
+/// * `record` - Expression evaluating to the record
+/// * `index` - Index of the field
+/// * `base` - Base register of the expression, return value is stored here
+/// * `tasks` - Work stack the tasks are pushed on
+#[inline(always)]
+fn expr_field<'a>(record: &'a Expression,
+                  index: u8,
+                  base: u8,
+                  tasks: &mut Vec<Task<'a>>) {
+    tasks.push(Task::Emit(Instruction {
+        opcode: ops::FLD,
+        target: base,
+        left: base + 1,
+        right: index
+    }));
+    tasks.push(Task::Generate(record, base + 1, false));
+}
+
+/// Generate instructions for reading a field of a record kept in registers.
+///
+/// # Arguments
+///
+/// * `reg` - First register of the record
+/// * `index` - Index of the field
+/// * `base` - Base register of the expression, return value is stored here
+/// * `module` - Module to be filled with constant/function/code storage
+#[inline(always)]
+fn expr_variable_field(reg: u8,
+                       index: u8,
+                       base: u8,
+                       module: &mut Module) {
+    module.code.push(Instruction {
+        opcode: ops::MOV,
+        target: base,
+        left: reg + index,
+        right: 0
+    });
+}
+
+/// Schedule instructions for copying a record with one field replaced.
+///
+/// # Arguments
+///
+/// * `record` - Expression evaluating to the record, which is not changed
+/// * `index` - Index of the replaced field
+/// * `value` - New value of the field
+/// * `base` - Base register of the expression, return value is stored here
+/// * `tasks` - Work stack the tasks are pushed on
+#[inline(always)]
+fn expr_field_update<'a>(record: &'a Expression,
+                         index: u8,
+                         value: &'a Expression,
+                         base: u8,
+                         tasks: &mut Vec<Task<'a>>) {
+    tasks.push(Task::Emit(Instruction {
+        opcode: ops::WTH,
+        target: base,
+        left: base + 1,
+        right: index
+    }));
+    tasks.push(Task::Generate(value, base + 1, false));
+    tasks.push(Task::Generate(record, base, false));
+}
+
+/// Schedule a fold over a stream pipeline, which is fused into a single loop
+/// in the current frame.
+///
+/// # Arguments
+///
+/// * `acc` - Name of the accumulator variable
+/// * `var` - Name of the element variable
+/// * `body` - Expression computing the next accumulator
+/// * `init` - Initial value of the accumulator
+/// * `stream` - The pipeline, a nesting of stream stages ending in a source
+/// * `base` - Base register of the expression, return value is stored here
+/// * `tasks` - Work stack the tasks are pushed on
+///
+/// # Remarks
+///
+/// Each stage pulls the next element from the stage it consumes. Sources and
+/// `take` leave the loop when they are exhausted, `filter` jumps back to pull
+/// another element. Bodies of `map` and `filter` are generated inline, so no
+/// stage costs a call or an allocation per element.
+///
+/// The accumulator is followed by the registers of the stages, the constant
+/// 1, the current element and the result of the current body.
+fn expr_fold<'a>(acc: &'a String,
+                 var: &'a String,
+                 body: &'a Expression,
+                 init: &'a Expression,
+                 stream: &'a Expression,
+                 base: u8,
+                 tasks: &mut Vec<Task<'a>>) {
+    // Stages from the one consumed by the fold up to the source
+    let mut stages: Vec<(&'a str, &'a [String], &'a [Expression])> = Vec::new();
+    let mut stage = stream;
+    loop {
+        match *stage {
+            Stream(ref op, ref vars, ref operands) if op != "fold" => {
+                stages.push((op.as_str(), vars.as_slice(), operands.as_slice()));
+                match operands.last() {
+                    Some(source) if op != "range" && op != "ints-each" => stage = source,
+                    _ => break
+                }
+            }
+            _ => panic!("fold needs a stream pipeline")
+        }
+    }
+
+    let acc_reg = base + 1;
+    let mut next = base + 2;
+    let mut state = Vec::with_capacity(stages.len());
+    for &(op, _, _) in &stages {
+        state.push(next);
+        next += match op {
+            "range" => 2,
+            "ints-each" => 4,
+            "take" => 1,
+            _ => 0
+        };
+    }
+    let (one, x, t) = (next, next + 1, next + 2);
+
+    let mut seq = vec![Task::Generate(init, acc_reg, false)];
+    for (i, &(op, _, operands)) in stages.iter().enumerate() {
+        match op {
+            "range" => {
+                seq.push(Task::Generate(&operands[0], state[i], false));
+                seq.push(Task::Generate(&operands[1], state[i] + 1, false));
+            }
+            "ints-each" => {
+                // The array, the address of its integers, the index and the
+                // length
+                let r = state[i];
+                seq.push(Task::Generate(&operands[0], r, false));
+                seq.push(Task::Emit(Instruction { opcode: ops::IAD, target: r + 1, left: r, right: 0 }));
+                seq.push(Task::Emit(Instruction { opcode: ops::LD, target: r + 2, left: 0, right: 0 }));
+                seq.push(Task::Emit(Instruction { opcode: ops::SIZE, target: r + 3, left: r, right: 0 }));
+            }
+            "take" => seq.push(Task::Generate(&operands[0], state[i], false)),
+            _ => {}
+        }
+    }
+    seq.push(Task::Emit(Instruction { opcode: ops::LD, target: one, left: 1, right: 0 }));
+    seq.push(Task::OpenLoop);
+    seq.push(Task::Mark);
+    pull_stage(&stages, &state, 0, one, x, t, &mut seq);
+    seq.push(Task::Bind(acc, acc_reg));
+    seq.push(Task::Bind(var, x));
+    seq.push(Task::Generate(body, t, false));
+    seq.push(Task::Unbind(var));
+    seq.push(Task::Unbind(acc));
+    seq.push(Task::Emit(Instruction { opcode: ops::MOV, target: acc_reg, left: t, right: 0 }));
+    seq.push(Task::JumpBack);
+    seq.push(Task::CloseLoop);
+    seq.push(Task::Emit(Instruction { opcode: ops::MOV, target: base, left: acc_reg, right: 0 }));
+
+    tasks.extend(seq.into_iter().rev());
+}
+
+/// Append the tasks pulling the next element of a stream stage into the
+/// element register.
+///
+/// # Arguments
+///
+/// * `stages` - All stages of the pipeline, with their bound variables and
+///              operands
+/// * `state` - First register of the state of each stage
+/// * `i` - Index of the stage
+/// * `one` - Register holding 1
+/// * `x` - Register receiving the element
+/// * `t` - Register for the result of a body, with free registers above
+/// * `seq` - Tasks in order of execution
+fn pull_stage<'a>(stages: &[(&'a str, &'a [String], &'a [Expression])],
+                  state: &[Register],
+                  i: usize,
+                  one: Register,
+                  x: Register,
+                  t: Register,
+                  seq: &mut Vec<Task<'a>>) {
+    let (op, vars, operands) = stages[i];
+    let r = state[i];
+    match op {
+        "range" => {
+            seq.push(Task::Emit(Instruction { opcode: ops::LT, target: t, left: r, right: r + 1 }));
+            seq.push(Task::Exit(t, ops::JFF));
+            seq.push(Task::Emit(Instruction { opcode: ops::MOV, target: x, left: r, right: 0 }));
+            seq.push(Task::Emit(Instruction { opcode: ops::ADD, target: r, left: r, right: one }));
+        }
+        "ints-each" => {
+            // The index is checked against the length once, so the load
+            // needs no bounds check
+            seq.push(Task::Emit(Instruction { opcode: ops::LT, target: t, left: r + 2, right: r + 3 }));
+            seq.push(Task::Exit(t, ops::JFF));
+            seq.push(Task::Emit(Instruction { opcode: ops::IGU, target: x, left: r + 1, right: r + 2 }));
+            seq.push(Task::Emit(Instruction { opcode: ops::ADD, target: r + 2, left: r + 2, right: one }));
+        }
+        "input" => {
+            seq.push(Task::Emit(Instruction { opcode: ops::RDN, target: x, left: 0, right: 0 }));
+            seq.push(Task::Emit(Instruction { opcode: ops::NIL, target: t, left: x, right: 0 }));
+            seq.push(Task::Exit(t, ops::JTF));
+        }
+        "take" => {
+            seq.push(Task::Exit(r, ops::JFF));
+            pull_stage(stages, state, i + 1, one, x, t, seq);
+            seq.push(Task::Emit(Instruction { opcode: ops::SUB, target: r, left: r, right: one }));
+        }
+        "map" => {
+            pull_stage(stages, state, i + 1, one, x, t, seq);
+            seq.push(Task::Bind(&vars[0], x));
+            seq.push(Task::Generate(&operands[0], t, false));
+            seq.push(Task::Unbind(&vars[0]));
+            seq.push(Task::Emit(Instruction { opcode: ops::MOV, target: x, left: t, right: 0 }));
+        }
+        "filter" => {
+            // Skip the jump back if the element passes
+            seq.push(Task::Mark);
+            pull_stage(stages, state, i + 1, one, x, t, seq);
+            seq.push(Task::Bind(&vars[0], x));
+            seq.push(Task::Generate(&operands[0], t, false));
+            seq.push(Task::Unbind(&vars[0]));
+            seq.push(Task::Emit(Instruction { opcode: ops::JTF, target: t, left: 2, right: 0 }));
+            seq.push(Task::JumpBack);
+        }
+        _ => panic!("Invalid stream {}", op)
+    }
+}
+
+/// Schedule instructions for a binary operation.
+///
+/// # Arguments
+///
+/// * `op` - Name of the operation
+/// * `left` - Left operand
+/// * `right` - Right operand
+/// * `base` - Base register of the expression, return value is stored here
+/// * `tasks` - Work stack the tasks are pushed on
+#[inline(always)]
+fn expr_binary<'a>(op: &str,
+                   left: &'a Expression,
+                   right: &'a Expression,
+                   base: u8,
+                   tasks: &mut Vec<Task<'a>>) {
     let mut instruction = Instruction {
         opcode: ops::HLT,
         target: base,
@@ -225,34 +1124,55 @@ fn expr_binary(op: &str,
         ">" => instruction.opcode = ops::GT,
         ">=" => instruction.opcode = ops::GE,
         "!=" => instruction.opcode = ops::NEQ,
+        "cons" => instruction.opcode = ops::CONS,
+        "get" => instruction.opcode = ops::GET,
+        "has?" => instruction.opcode = ops::HAS,
+        "append" => instruction.opcode = ops::APP,
+        "byte" => instruction.opcode = ops::BYT,
+        "compare" => instruction.opcode = ops::CMP,
+        "vec-get" => instruction.opcode = ops::VGT,
+        "vec-push" => instruction.opcode = ops::VPS,
+        "fd-open" => instruction.opcode = ops::OPN,
+        "fd-read" => instruction.opcode = ops::FRD,
+        "fd-write" => instruction.opcode = ops::FWR,
+        "ints-get" => instruction.opcode = ops::IGT,
+        "%" => instruction.opcode = ops::MOD,
+        "pow" => instruction.opcode = ops::POW,
+        "gcd" => instruction.opcode = ops::GCD,
+        "min" => instruction.opcode = ops::MIN,
+        "max" => instruction.opcode = ops::MAX,
+        "resume" => {
+            // A generator which returns continues at the instruction after
+            // the resume, one which yields skips it
+            tasks.push(Task::Emit(Instruction {
+                opcode: ops::FIN,
+                target: base,
+                left: 0,
+                right: 0
+            }));
+            instruction.opcode = ops::RSM;
+        }
         _ => panic!("Invalid operation")
     }
 
-    module.code.push(instruction);
+    tasks.push(Task::Emit(instruction));
+    tasks.push(Task::Generate(right, base + 2, false));
+    tasks.push(Task::Generate(left, base + 1, false));
 }
 
-/// Generate instructions for an unary operation.
+/// Schedule instructions for an unary operation.
 ///
 /// # Arguments
 ///
 /// * `op` - Name of the unary operation
 /// * `left` - Only operand of the operation
 /// * `base` - Base register of the expression, return value is stored here
-/// * `func` - Lookup table for function table entries
-/// * `vars` - A variable assignment for all child expressions
-/// * `module` - Module to be filled with constant/function/code storage
-/// * `oinfo` - Information needed for optimizations
+/// * `tasks` - Work stack the tasks are pushed on
 #[inline(always)]
-fn expr_unary(op: &str,
-              left: &Expression,
-              base: u8,
-              func: &mut HashMap<String, u32>,
-              vars: &HashMap<String, (Type, Register)>,
-              module: &mut Module,
-              oinfo: &OptimizationInfo) {
-    let reg_left = base + 1;
-    generate_expression(left, reg_left, func, vars, module, oinfo);
-
+fn expr_unary<'a>(op: &str,
+                  left: &'a Expression,
+                  base: u8,
+                  tasks: &mut Vec<Task<'a>>) {
     let mut instruction = Instruction {
         opcode: ops::HLT,
         target: base,
@@ -263,10 +1183,71 @@ fn expr_unary(op: &str,
     match op.as_ref() {
         "~" => instruction.opcode = ops::NOT,
         "write" => instruction.opcode = ops::WRI,
+        "car" => instruction.opcode = ops::CAR,
+        "cdr" => instruction.opcode = ops::CDR,
+        "nil?" => instruction.opcode = ops::NIL,
+        "size" => instruction.opcode = ops::SIZE,
+        "string" => instruction.opcode = ops::STR,
+        "hash" => instruction.opcode = ops::HSH,
+        "write-bytes" => instruction.opcode = ops::WRB,
+        "read-line" => instruction.opcode = ops::RDL,
+        "vec-len" => instruction.opcode = ops::VLN,
+        "yield" => instruction.opcode = ops::YLD,
+        "fd-close" => instruction.opcode = ops::CLS,
+        "load-ints" => instruction.opcode = ops::IMP,
+        "parse-ints" => instruction.opcode = ops::IPR,
+        "abs" => instruction.opcode = ops::ABS,
+        "isqrt" => instruction.opcode = ops::SQRT,
+        "popcount" => instruction.opcode = ops::PCNT,
+        "clz" => instruction.opcode = ops::CLZ,
+        "ctz" => instruction.opcode = ops::CTZ,
         _ => panic!("Invalid operation")
     }
 
-    module.code.push(instruction);
+    tasks.push(Task::Emit(instruction));
+    tasks.push(Task::Generate(left, base + 1, false));
+}
+
+/// Schedule instructions for an operation with three operands.
+///
+/// # Arguments
+///
+/// * `op` - Name of the operation
+/// * `first` - First operand, which is also the result
+/// * `second` - Second operand
+/// * `third` - Third operand
+/// * `base` - Base register of the expression, return value is stored here
+/// * `tasks` - Work stack the tasks are pushed on
+///
+/// # Remarks
+///
+/// Instructions only have three register operands, so the first operand is
+/// evaluated into the target register and updated in place.
+#[inline(always)]
+fn expr_ternary<'a>(op: &str,
+                    first: &'a Expression,
+                    second: &'a Expression,
+                    third: &'a Expression,
+                    base: u8,
+                    tasks: &mut Vec<Task<'a>>) {
+    let mut instruction = Instruction {
+        opcode: ops::HLT,
+        target: base,
+        left: base + 1,
+        right: base + 2
+    };
+
+    match op.as_ref() {
+        "put" => instruction.opcode = ops::PUT,
+        "slice" => instruction.opcode = ops::SLC,
+        "vec-assoc" => instruction.opcode = ops::VAS,
+        _ => panic!("Invalid operation")
+    }
+
+    tasks.push(Task::Emit(instruction));
+    tasks.push(Task::Generate(third, base + 2, false));
+    tasks.push(Task::Generate(second, base + 1, false));
+    tasks.push(Task::Generate(first, base, false));
 }
 
 /// Generate instructions for a nullary operation.
@@ -289,6 +1270,11 @@ fn expr_nullary(op: &str,
 
     match op.as_ref() {
         "read" => instruction.opcode = ops::RDI,
+        "read-raw" => instruction.opcode = ops::RDR,
+        "nil" => return expr_integer(values::NIL, base, module),
+        "make-map" => instruction.opcode = ops::MAP,
+        "buffer" => instruction.opcode = ops::BUF,
+        "vector" => instruction.opcode = ops::VEC,
         _ => panic!("Invalid operation")
     }
 
@@ -296,73 +1282,295 @@ fn expr_nullary(op: &str,
 
 }
 
-/// Generate instructions for a function call.
+/// Schedule the parameter evaluation of a function call.
 ///
 /// # Arguments
 ///
-/// * `name` - Name of the function
+/// * `index` - Function table index of the callee
 /// * `param` - List of parameters, expressions
 /// * `base` - Base register of the expression, return value is stored here
-/// * `func` - Lookup table for function table entries
-/// * `vars` - A variable assignment for all child expressions
-/// * `module` - Module to be filled with constant/function/code storage
-/// * `oinfo` - Information needed for optimization
+/// * `tail` - Whether the call is in tail position of a function body
+/// * `tasks` - Work stack the tasks are pushed on
 #[inline(always)]
-fn expr_call(name: &str,
-             param: &[Expression],
-             base: u8,
-             func: &mut HashMap<String, u32>,
-             vars: &HashMap<String, (Type, Register)>,
-             module: &mut Module,
-             oinfo: &OptimizationInfo) {
-    let index = {
-        match func.get(name) {
-            Some(index) => *index,
-            _ => panic!("Function {} is not defined", name)
-        }
-    };
+fn expr_call_params<'a>(index: u32,
+                        param: &'a [Expression],
+                        base: u8,
+                        tail: bool,
+                        tasks: &mut Vec<Task<'a>>) {
+    tasks.push(Task::Call(index, base, tail));
+    expr_arguments(param, base, tail, tasks);
+}
+
+/// Schedule the call of a native function.
+///
+/// # Arguments
+///
+/// * `index` - Index of the native function
+/// * `param` - List of parameters, expressions
+/// * `base` - Base register of the expression, return value is stored here
+/// * `tasks` - Work stack the tasks are pushed on
+///
+/// # Remarks
+///
+/// The parameters are evaluated into the registers following the base
+/// register, where the native function reads them, so nothing is moved and
+/// no frame is entered.
+#[inline(always)]
+fn expr_native<'a>(index: u8,
+                   param: &'a [Expression],
+                   base: u8,
+                   tasks: &mut Vec<Task<'a>>) {
+    tasks.push(Task::Emit(Instruction {
+        opcode: ops::CALLN,
+        target: base,
+        left: index,
+        right: param.len() as u8
+    }));
+    for (i, p) in param.iter().enumerate().rev() {
+        tasks.push(Task::Generate(p, base + 1 + i as u8, false));
+    }
+}
+
+/// Schedule the creation of a generator, which calls a function once it is
+/// resumed first.
+///
+/// # Arguments
+///
+/// * `index` - Function table index of the generator function
+/// * `param` - List of parameters, expressions
+/// * `base` - Base register of the expression, the generator is stored here
+/// * `tasks` - Work stack the tasks are pushed on
+#[inline(always)]
+fn expr_generator<'a>(index: u32,
+                      param: &'a [Expression],
+                      base: u8,
+                      tasks: &mut Vec<Task<'a>>) {
+    if index > 0xFFFF {
+        panic!("Generator functions have to be among the first 65536 functions");
+    }
+    tasks.push(Task::Emit(Instruction {
+        opcode: ops::GEN,
+        target: base,
+        left: index as u8,
+        right: (index >> 8) as u8
+    }));
+    expr_arguments(param, base, false, tasks);
+}
+
+/// Schedule the evaluation of the parameters of a call and passing them to
+/// the callee.
+///
+/// # Arguments
+///
+/// * `param` - List of parameters, expressions
+/// * `base` - Base register of the expression
+/// * `tail` - Whether the call is in tail position of a function body
+/// * `tasks` - Work stack the tasks are pushed on
+#[inline(always)]
+fn expr_arguments<'a>(param: &'a [Expression],
+                      base: u8,
+                      tail: bool,
+                      tasks: &mut Vec<Task<'a>>) {
+    // Pass results to callee parameter registers, after all parameters have
+    // been evaluated
+    for i in (0..param.len() as u8).rev() {
+        tasks.push(Task::Emit(pass_argument(i, base + 1 + i, tail)));
+    }
 
     // Process each parameter expression before making the actual call
-    let mut tmp_base = base;
-    let mut tmp_param = reg::VAL;
-    let mut tmp_instructions: Vec<Instruction> = Vec::new();
-    let mut mov_instruction = if oinfo.tail {
-        tmp_param -= 1;
+    for (i, p) in param.iter().enumerate().rev() {
+        tasks.push(Task::Generate(p, base + 1 + i as u8, false));
+    }
+}
 
+/// Get the instruction passing a value to a parameter register of the
+/// callee.
+///
+/// # Arguments
+///
+/// * `index` - Index of the parameter
+/// * `reg` - Register holding the value
+/// * `tail` - Whether the call is in tail position of a function body, the
+///            callee then takes over the current frame
+#[inline(always)]
+fn pass_argument(index: u8, reg: u8, tail: bool) -> Instruction {
+    if tail {
         Instruction {
             opcode: ops::MOV,
-            target: tmp_param,
-            left: tmp_base,
+            target: reg::VAL + index,
+            left: reg,
             right: 0
         }
     } else {
         Instruction {
             opcode: ops::MVO,
-            target: tmp_param,
-            left: tmp_base,
+            target: reg::VAL + 1 + index,
+            left: reg,
             right: 0xFF
         }
-    };
-    let param_oinfo = OptimizationInfo {
-        func_name: oinfo.func_name,
-        tail: false
-    };
+    }
+}
 
-    for p in param {
-        tmp_base += 1;
-        tmp_param += 1;
-        generate_expression(p, tmp_base, func, vars, module, &param_oinfo);
+/// Schedule a direct call of a lambda which is only called, passing its
+/// captured values after the arguments.
+///
+/// # Arguments
+///
+/// * `index` - Function table index of the lambda
+/// * `param` - List of parameters, expressions
+/// * `captured` - First of the registers holding the captured values
+/// * `count` - Number of captured values
+/// * `base` - Base register of the expression, return value is stored here
+/// * `tail` - Whether the call is in tail position of a function body
+/// * `tasks` - Work stack the tasks are pushed on
+///
+/// # Remarks
+///
+/// A tail call overwrites the parameter registers of the current frame, so
+/// the captured values are copied next to the arguments first.
+#[inline(always)]
+fn expr_known_call<'a>(index: u32,
+                       param: &'a [Expression],
+                       captured: u8,
+                       count: u8,
+                       base: u8,
+                       tail: bool,
+                       tasks: &mut Vec<Task<'a>>) {
+    let len = param.len() as u8;
+    tasks.push(Task::Call(index, base, tail));
+    for j in (0..count).rev() {
+        let reg = if tail { base + 1 + len + j } else { captured + j };
+        tasks.push(Task::Emit(pass_argument(len + j, reg, tail)));
+    }
+    for i in (0..len).rev() {
+        tasks.push(Task::Emit(pass_argument(i, base + 1 + i, tail)));
+    }
+    if tail {
+        for j in (0..count).rev() {
+            tasks.push(Task::Emit(Instruction {
+                opcode: ops::MOV,
+                target: base + 1 + len + j,
+                left: captured + j,
+                right: 0
+            }));
+        }
+    }
+    for (i, p) in param.iter().enumerate().rev() {
+        tasks.push(Task::Generate(p, base + 1 + i as u8, false));
+    }
+}
+
+/// Schedule the call of a function value.
+///
+/// # Arguments
+///
+/// * `function` - Task evaluating the function value into the register
+///                following the arguments
+/// * `param` - List of parameters, expressions
+/// * `base` - Base register of the expression, return value is stored here
+/// * `tail` - Whether the call is in tail position of a function body
+/// * `tasks` - Work stack the tasks are pushed on
+///
+/// # Remarks
+///
+/// The function value is evaluated after the arguments and before they are
+/// passed, which may overwrite the parameter registers it is computed from.
+#[inline(always)]
+fn expr_apply<'a>(function: Task<'a>,
+                  param: &'a [Expression],
+                  base: u8,
+                  tail: bool,
+                  tasks: &mut Vec<Task<'a>>) {
+    let len = param.len() as u8;
+    if !tail {
+        tasks.push(Task::Emit(Instruction {
+            opcode: ops::LDR,
+            target: base,
+            left: 0,
+            right: 0
+        }));
+    }
+    tasks.push(Task::Emit(Instruction {
+        opcode: if tail { ops::TLI } else { ops::CLI },
+        target: base + 1 + len,
+        left: len,
+        right: 0
+    }));
+    for i in (0..len).rev() {
+        tasks.push(Task::Emit(pass_argument(i, base + 1 + i, tail)));
+    }
+    tasks.push(function);
+    for (i, p) in param.iter().enumerate().rev() {
+        tasks.push(Task::Generate(p, base + 1 + i as u8, false));
+    }
+}
 
-        // Pass results to callee parameter registers
-        mov_instruction.target = tmp_param;
-        mov_instruction.left = tmp_base;
-        tmp_instructions.push(mov_instruction.clone());
+/// Schedule the creation of a function value.
+///
+/// # Arguments
+///
+/// * `index` - Function table index of the function
+/// * `arity` - Number of parameters of the function
+/// * `captured` - Variables whose values are captured
+/// * `base` - Base register of the expression, the function value is stored here
+/// * `tasks` - Work stack the tasks are pushed on
+///
+/// # Remarks
+///
+/// Like a record, the function, its arity and the captured values are put
+/// into consecutive registers, which are copied to the heap as one block.
+#[inline(always)]
+fn expr_function_value<'a>(index: u32,
+                           arity: u8,
+                           captured: &[&'a String],
+                           base: u8,
+                           tasks: &mut Vec<Task<'a>>) {
+    if index > 0x7FFF {
+        panic!("Function values have to refer to the first 32768 functions");
+    }
+    tasks.push(Task::Emit(Instruction {
+        opcode: ops::CLO,
+        target: base,
+        left: base + 1,
+        right: captured.len() as u8 + 2
+    }));
+    for (j, &name) in captured.iter().enumerate().rev() {
+        tasks.push(Task::Load(name, base + 3 + j as u8));
     }
+    tasks.push(Task::Emit(Instruction {
+        opcode: ops::LD,
+        target: base + 2,
+        left: arity,
+        right: 0
+    }));
+    tasks.push(Task::Emit(Instruction {
+        opcode: ops::LD,
+        target: base + 1,
+        left: index as u8,
+        right: (index >> 8) as u8
+    }));
+}
 
-    // Load results of parameter evaluation and make the call
-    module.code.extend(tmp_instructions);
-    if oinfo.tail {
-        let func_off = module.code.len() as u64 - module.functions[index as usize];
+/// Generate instructions for a function call, after the parameters have been
+/// moved to the callee parameter registers.
+///
+/// # Arguments
+///
+/// * `index` - Function table index of the callee
+/// * `base` - Base register of the expression, return value is stored here
+/// * `tail` - Whether the call is in tail position of a function body
+/// * `module` - Module to be filled with constant/function/code storage
+#[inline(always)]
+fn expr_call(index: u32,
+             base: u8,
+             tail: bool,
+             module: &mut Module) {
+    if tail {
+        // Lambdas are generated after their callers, they are out of reach
+        let func_off = match module.functions[index as usize] {
+            PENDING => PENDING,
+            address => module.code.len() as u64 - address
+        };
         if func_off < (2 << 23) {
             module.code.push(Instruction {
                 opcode: ops::JMB,
@@ -394,104 +1602,170 @@ fn expr_call(name: &str,
     }
 }
 
-/// Generate instructions for a function definition.
+/// Schedule instructions for a function definition. The function has to be
+/// registered in the function lookup table by the caller.
 ///
 /// # Arguments
 ///
-/// * `name` - Name of the function
 /// * `param` - List of parameter names
 /// * `body` - Function body, main expression
 /// * `base` - Base register of the expression, return value is stored here
-/// * `func` - Lookup table for function table entries
-/// * `vars` - A variable assignment for all child expressions
 /// * `module` - Module to be filled with constant/function/code storage
-/// * `oinfo` - Information needed for optimization
+/// * `tasks` - Work stack the tasks are pushed on
+///
+/// # Remarks
+///
+/// Only the last body expression is in tail position.
 #[inline(always)]
-fn expr_fundef(name: &str,
-               param: &[String],
-               body: &[Expression],
-               base: u8,
-               func: &mut HashMap<String, u32>,
-               vars: &HashMap<String, (Type, Register)>,
-               module: &mut Module,
-               oinfo: &OptimizationInfo) {
-    let index = func.len() as u32;
+fn expr_fundef<'a>(param: &'a [String],
+                   body: &'a [Expression],
+                   base: u8,
+                   module: &mut Module,
+                   tasks: &mut Vec<Task<'a>>) {
     let address = module.code.len() as u64;
-    func.insert(name.to_string(), index);
     module.functions.push(address);
 
-    let mut base = base;
-    let mut vars = vars.clone();
+    let body_base = base + param.len() as u8;
+    tasks.push(Task::Emit(Instruction {
+        opcode: ops::RET,
+        target: 0,
+        left: 0,
+        right: 0
+    }));
+    tasks.push(Task::Emit(Instruction {
+        opcode: ops::MOV,
+        target: reg::VAL,
+        left: body_base,
+        right: 0
+    }));
     for p in param {
-        vars.insert(p.to_string(), (types::INT, base));
-        base += 1;
+        tasks.push(Task::Unbind(p));
     }
 
-    let base = base;
-    let vars = &vars;
-    for expr in body {
-        generate_expression(expr, base, func, vars, module, oinfo);
+    push_sequence(body, body_base, true, tasks);
+
+    for (i, p) in param.iter().enumerate().rev() {
+        tasks.push(Task::Bind(p, base + i as u8));
     }
+}
 
-    module.code.push(Instruction {
-        opcode: ops::MOV,
-        target: reg::VAL,
-        left: base,
-        right: 0
-    });
-    module.code.push(Instruction {
+/// Schedule instructions for the body of a lambda. It is a function taking
+/// the captured values as parameters, after its own.
+///
+/// # Arguments
+///
+/// * `param` - List of parameter names
+/// * `captured` - The captured variables
+/// * `body` - Body of the lambda
+/// * `tasks` - Work stack the tasks are pushed on
+#[inline(always)]
+fn expr_lambda<'a>(param: &'a [String],
+                   captured: &[&'a String],
+                   body: &'a [Expression],
+                   tasks: &mut Vec<Task<'a>>) {
+    let body_base = reg::VAL + (param.len() + captured.len()) as u8;
+    tasks.push(Task::Emit(Instruction {
         opcode: ops::RET,
         target: 0,
         left: 0,
         right: 0
-    });
+    }));
+    tasks.push(Task::Emit(Instruction {
+        opcode: ops::MOV,
+        target: reg::VAL,
+        left: body_base,
+        right: 0
+    }));
+    for p in param {
+        tasks.push(Task::Unbind(p));
+    }
+    for &name in captured {
+        tasks.push(Task::Unbind(name));
+    }
+
+    push_sequence(body, body_base, true, tasks);
+
+    for (j, &name) in captured.iter().enumerate().rev() {
+        tasks.push(Task::Bind(name, reg::VAL + (param.len() + j) as u8));
+    }
+    for (i, p) in param.iter().enumerate().rev() {
+        tasks.push(Task::Bind(p, reg::VAL + i as u8));
+    }
 }
 
-/// Generate instructions for a variable assignment, corresponding to the
+/// Schedule instructions for a variable assignment, corresponding to the
 /// **let** expression.
 ///
 /// # Arguments
 ///
 /// * `assignment` - A list of tuples, including the variable name and an expression
 /// * `body` - The body of a variable assignment is a list of expressions
+/// * `scalars` - For each variable, the record and its field values if the
+///               record is kept in registers (see `scalar_records`)
+/// * `functions` - For each variable, the function and the captured variables
+///                 if it is bound to a lambda which is only called (see
+///                 `known_functions`)
 /// * `base` - Base register of the expression, return value is stored here
-/// * `func` - Lookup table for function table entries
-/// * `vars` - A variable assignment for all child expressions
-/// * `module` - Module to be filled with constant/function/code storage
-/// * `oinfo` - Information needed for optimization
+/// * `tasks` - Work stack the tasks are pushed on
 ///
 /// # Remarks
 ///
 /// Variables are evaluated in order of definition. Subsequent variables can access
-/// variables previously defined in the same statement.
+/// variables previously defined in the same statement. A record kept in
+/// registers occupies one register per field, a lambda which is only called
+/// one register per captured value.
 #[inline(always)]
-fn expr_varass(assignment: &[(String, Expression)],
-               body: &[Expression],
-               base: u8,
-               func: &mut HashMap<String, u32>,
-               vars: &HashMap<String, (Type, Register)>,
-               module: &mut Module,
-               oinfo: &OptimizationInfo) {
-    let mut tmp_base = base;
-    let mut vars = vars.clone();
-    for &(ref var, ref expr) in assignment {
-        tmp_base += 1;
-        generate_expression(expr, tmp_base, func, &vars, module, oinfo);
-        vars.insert(var.to_string(), (types::INT, tmp_base));
-    }
-
-    let tmp_base = tmp_base;
-    let vars = &vars;
-    for expr in body {
-        generate_expression(expr, tmp_base, func, vars, module, oinfo);
+fn expr_varass<'a>(assignment: &'a [(String, Expression)],
+                   body: &'a [Expression],
+                   scalars: &[Option<(&'a str, &'a [Expression])>],
+                   functions: &[Option<(u32, Vec<&'a String>)>],
+                   base: u8,
+                   tasks: &mut Vec<Task<'a>>) {
+    let mut regs = Vec::with_capacity(assignment.len());
+    let mut next = base + 1;
+    for (scalar, function) in scalars.iter().zip(functions) {
+        regs.push(next);
+        next += match (*scalar, function) {
+            (Some((_, fields)), _) => fields.len() as u8,
+            (_, &Some((_, ref captured))) => std::cmp::max(captured.len(), 1) as u8,
+            _ => 1
+        };
     }
 
-    module.code.push(Instruction {
+    let body_base = next - 1;
+    tasks.push(Task::Emit(Instruction {
         opcode: ops::MOV,
         target: base,
-        left: tmp_base,
+        left: body_base,
         right: 0
-    });
+    }));
+    for &(ref var, _) in assignment {
+        tasks.push(Task::Unbind(var));
+    }
+
+    push_sequence(body, body_base, false, tasks);
+
+    for (i, &(ref var, ref expr)) in assignment.iter().enumerate().rev() {
+        let reg = regs[i];
+        match (scalars[i], &functions[i]) {
+            (Some((record, fields)), _) => {
+                tasks.push(Task::BindRecord(var, record, reg));
+                for (j, field) in fields.iter().enumerate().rev() {
+                    tasks.push(Task::Generate(field, reg + j as u8, false));
+                }
+            }
+            (_, &Some((index, ref captured))) => {
+                tasks.push(Task::BindFunction(var, index, captured.len() as u8, reg));
+                for (j, &name) in captured.iter().enumerate().rev() {
+                    tasks.push(Task::Load(name, reg + j as u8));
+                }
+            }
+            _ => {
+                tasks.push(Task::Bind(var, reg));
+                tasks.push(Task::Generate(expr, reg, false));
+            }
+        }
+    }
 }
 
 /// Generate instructions for a variable use.
@@ -500,14 +1774,14 @@ fn expr_varass(assignment: &[(String, Expression)],
 ///
 /// * `name` - Name of the variable to be loaded
 /// * `base` - Base register of the expression, return value is stored here
-/// * `vars` - A variable assignment for all child expressions
+/// * `vars` - The visible variable bindings, innermost binding last
 /// * `module` - Module to be filled with constant/function/code storage
 #[inline(always)]
 fn expr_variable(name: &str,
                  base: u8,
-                 vars: &HashMap<String, (Type, Register)>,
+                 vars: &HashMap<&str, Vec<(Type, Register)>>,
                  module: &mut Module) {
-    let (_, reg) = match vars.get(name) {
+    let (_, reg) = match vars.get(name).and_then(|v| v.last()) {
         Some(index) => *index,
         _ => panic!("Variable {} is not defined", name)
     };
@@ -520,7 +1794,7 @@ fn expr_variable(name: &str,
     });
 }
 
-/// Generate instructions for a branching operation
+/// Schedule instructions for a branching operation
 ///
 /// # Arguments
 ///
@@ -528,69 +1802,36 @@ fn expr_variable(name: &str,
 /// * `yes` - The expressions being executed when the condition is true
 /// * `no` - The expressions being executed when the condition is false
 /// * `base` - Base register of the expression, return value is stored here
-/// * `func` - Lookup table for function table entries
-/// * `vaprs` - A variable assignment for all child expressions
-/// * `module` - Module to be filled with constant/function/code storage
-/// * `oinfo` - Information needed for optimization
+/// * `tail` - Whether the branch is in tail position of a function body
+/// * `index` - Number of the conditional in source order
+/// * `likely` - Whether the condition is expected to be true
+/// * `tasks` - Work stack the tasks are pushed on
+///
+/// # Remarks
+///
+/// By default the else branch is placed directly after the conditional jump.
+/// If the condition is likely to be true, the arms are swapped and the jump is
+/// inverted, so the likely arm falls through.
 #[inline(always)]
-fn expr_conditional(cond: &Expression,
-                    yes: &[Expression],
-                    no: &[Expression],
-                    base: u8,
-                    func: &mut HashMap<String, u32>,
-                    vars: &HashMap<String, (Type, Register)>,
-                    module: &mut Module,
-                    oinfo: &OptimizationInfo) {
-    let condition_opti = OptimizationInfo {
-        func_name: oinfo.func_name,
-        tail: false
+fn expr_conditional<'a>(cond: &'a Expression,
+                        yes: &'a [Expression],
+                        no: &'a [Expression],
+                        base: u8,
+                        tail: bool,
+                        index: u32,
+                        likely: bool,
+                        tasks: &mut Vec<Task<'a>>) {
+    let (first, second, opcode) = if likely {
+        (yes, no, ops::JFF)
+    } else {
+        (no, yes, ops::JTF)
     };
-    generate_expression(cond, base, func, vars, module, &condition_opti);
-
-    let jmp_index = module.code.len();
-    module.code.push(Instruction {
-        opcode: ops::JTF,
-        target: base,
-        left: 0,
-        right: 0
-    });
-
-    // Generate every expression except tail
-    for expr in &no[..no.len() - 1] {
-        generate_expression(expr, base, func, vars, module, &condition_opti);
-    }
-
-    // Generate tail expression
-    generate_expression(&no[no.len() - 1], base, func, vars, module, oinfo);
 
-    let offset = module.code.len() - jmp_index + 1;
-    {
-        let jmp = &mut module.code[jmp_index];
-        jmp.left = offset as u8;
-        jmp.right = (offset >> 8) as u8;
-    }
-
-    let jmp_index = module.code.len();
-    module.code.push(Instruction {
-        opcode: ops::JMF,
-        target: 0,
-        left: 0,
-        right: 0
-    });
-
-    // Generate every expression except tail
-    for expr in &yes[..yes.len() - 1] {
-        generate_expression(expr, base, func, vars, module, &condition_opti);
-    }
-
-    // Generate tail expression
-    generate_expression(&yes[yes.len() - 1], base, func, vars, module, oinfo);
-
-    let offset = module.code.len() - jmp_index;
-    {
-        let jmp = &mut module.code[jmp_index];
-        jmp.target = offset as u8;
-        jmp.left = (offset >> 8) as u8;
-        jmp.right = (offset >> 16) as u8;
-    }
+    tasks.push(Task::PatchJump);
+    push_sequence(second, base, tail, tasks);
+    tasks.push(Task::Jump);
+    tasks.push(Task::PatchBranch);
+    push_sequence(first, base, tail, tasks);
+    tasks.push(Task::Branch(base, opcode, index));
+    tasks.push(Task::Generate(cond, base, false));
 }
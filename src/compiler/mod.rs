@@ -1,9 +1,50 @@
 mod codegen;
 mod parser;
+mod peephole;
 
-use common::Module;
+use std::collections::HashMap;
+use common::{Module, Profile, code_hash};
 
 pub fn compile(program: &str) -> Module {
-    let expressions = parser::parse_expressions(program).unwrap();
-    codegen::generate(&expressions)
+    let (expressions, locations) = parser::parse_located(program);
+    let mut module = codegen::generate(&expressions, &[], &locations).0;
+    peephole::fuse(&mut module.code);
+    module
+}
+
+/// Compile a program, laying out conditionals according to the branch counts
+/// of a profile.
+///
+/// # Arguments
+///
+/// * `program` - Source code of the program
+/// * `profile` - Profile recorded on the module produced by `compile` for the
+///               same program
+///
+/// # Remarks
+///
+/// The profile is keyed by PC, so the program is compiled without profile
+/// information first to find the jump belonging to each conditional. Arms
+/// which are taken more often than not are placed directly after the jump,
+/// so the likely case falls through.
+///
+/// Panics if the profile was recorded on different code, as its PCs would
+/// refer to other instructions.
+pub fn compile_with_profile(program: &str, profile: &Profile) -> Module {
+    let (expressions, locations) = parser::parse_located(program);
+    let (plain, sites) = codegen::generate(&expressions, &[], &HashMap::new());
+    if code_hash(&plain.functions, &plain.constants, &plain.code) != profile.code {
+        panic!("Profile was recorded on different code");
+    }
+
+    let likely: Vec<bool> = sites.iter().map(|pc| {
+        match profile.branches.get(pc) {
+            Some(&(taken, not_taken)) => taken > not_taken,
+            None => false
+        }
+    }).collect();
+
+    let mut module = codegen::generate(&expressions, &likely, &locations).0;
+    peephole::fuse(&mut module.code);
+    module
 }
@@ -1,15 +1,213 @@
 mod parser;
 
-pub use self::parser::parse_expressions;
+use std::collections::HashMap;
+use std::mem;
+use common::Location;
 
 pub enum Expression {
     Integer(i64),
+    Text(String),
     Variable(String),
     BinaryOp(String, Box<Expression>, Box<Expression>),
     UnaryOp(String, Box<Expression>),
+    TernaryOp(String, Box<Expression>, Box<Expression>, Box<Expression>),
     NullaryOp(String),
     Function(String, Vec<Expression>),
+    /// A generator calling the function with the parameters once resumed
+    Generator(String, Vec<Expression>),
     FunctionDefinition(String, Vec<String>, Vec<Expression>),
+    /// An anonymous function with its parameters and body
+    Lambda(Vec<String>, Vec<Expression>),
+    /// A call of the function value the first expression evaluates to
+    Apply(Box<Expression>, Vec<Expression>),
+    RecordDefinition(String, Vec<String>),
+    FieldAccess(Box<Expression>, String),
+    FieldUpdate(Box<Expression>, String, Box<Expression>),
+    /// A stage of a stream pipeline, with the names of the variables it binds
+    /// and its operands. The stream it consumes is the last operand.
+    Stream(String, Vec<String>, Vec<Expression>),
     VariableAssignment(Vec<(String, Expression)>, Vec<Expression>),
     Conditional(Box<Expression>,Vec<Expression>,Vec<Expression>)
-}
\ No newline at end of file
+}
+
+impl Expression {
+    /// Get all child expressions, in the order they appear in the source.
+    pub fn children(&self) -> Vec<&Expression> {
+        let mut children = Vec::new();
+        match *self {
+            Expression::BinaryOp(_, ref left, ref right) => {
+                children.push(&**left);
+                children.push(&**right);
+            }
+            Expression::UnaryOp(_, ref left) => {
+                children.push(&**left);
+            }
+            Expression::TernaryOp(_, ref first, ref second, ref third) => {
+                children.push(&**first);
+                children.push(&**second);
+                children.push(&**third);
+            }
+            Expression::Function(_, ref param) |
+            Expression::Generator(_, ref param) => {
+                children.extend(param.iter());
+            }
+            Expression::FunctionDefinition(_, _, ref body) |
+            Expression::Lambda(_, ref body) => {
+                children.extend(body.iter());
+            }
+            Expression::Apply(ref function, ref param) => {
+                children.push(&**function);
+                children.extend(param.iter());
+            }
+            Expression::FieldAccess(ref record, _) => {
+                children.push(&**record);
+            }
+            Expression::Stream(_, _, ref operands) => {
+                children.extend(operands.iter());
+            }
+            Expression::FieldUpdate(ref record, _, ref value) => {
+                children.push(&**record);
+                children.push(&**value);
+            }
+            Expression::VariableAssignment(ref assignments, ref body) => {
+                children.extend(assignments.iter().map(|&(_, ref e)| e));
+                children.extend(body.iter());
+            }
+            Expression::Conditional(ref cond, ref yes, ref no) => {
+                children.push(&**cond);
+                children.extend(yes.iter());
+                children.extend(no.iter());
+            }
+            _ => {}
+        }
+        children
+    }
+
+    /// Move all child expressions onto the given stack.
+    fn take_children(&mut self, stack: &mut Vec<Expression>) {
+        match *self {
+            Expression::BinaryOp(_, ref mut left, ref mut right) => {
+                stack.push(mem::replace(&mut **left, Expression::Integer(0)));
+                stack.push(mem::replace(&mut **right, Expression::Integer(0)));
+            }
+            Expression::UnaryOp(_, ref mut left) => {
+                stack.push(mem::replace(&mut **left, Expression::Integer(0)));
+            }
+            Expression::TernaryOp(_, ref mut first, ref mut second, ref mut third) => {
+                stack.push(mem::replace(&mut **first, Expression::Integer(0)));
+                stack.push(mem::replace(&mut **second, Expression::Integer(0)));
+                stack.push(mem::replace(&mut **third, Expression::Integer(0)));
+            }
+            Expression::Function(_, ref mut param) |
+            Expression::Generator(_, ref mut param) => {
+                stack.extend(param.drain(..));
+            }
+            Expression::FunctionDefinition(_, _, ref mut body) |
+            Expression::Lambda(_, ref mut body) => {
+                stack.extend(body.drain(..));
+            }
+            Expression::Apply(ref mut function, ref mut param) => {
+                stack.push(mem::replace(&mut **function, Expression::Integer(0)));
+                stack.extend(param.drain(..));
+            }
+            Expression::FieldAccess(ref mut record, _) => {
+                stack.push(mem::replace(&mut **record, Expression::Integer(0)));
+            }
+            Expression::Stream(_, _, ref mut operands) => {
+                stack.extend(operands.drain(..));
+            }
+            Expression::FieldUpdate(ref mut record, _, ref mut value) => {
+                stack.push(mem::replace(&mut **record, Expression::Integer(0)));
+                stack.push(mem::replace(&mut **value, Expression::Integer(0)));
+            }
+            Expression::VariableAssignment(ref mut assignments, ref mut body) => {
+                stack.extend(assignments.drain(..).map(|(_, e)| e));
+                stack.extend(body.drain(..));
+            }
+            Expression::Conditional(ref mut cond, ref mut yes, ref mut no) => {
+                stack.push(mem::replace(&mut **cond, Expression::Integer(0)));
+                stack.extend(yes.drain(..));
+                stack.extend(no.drain(..));
+            }
+            _ => {}
+        }
+    }
+}
+
+/// Replace the escape sequences of a string literal by the characters they
+/// stand for, unknown sequences stand for the escaped character.
+pub fn unescape(literal: &str) -> String {
+    let mut text = String::with_capacity(literal.len());
+    let mut chars = literal.chars();
+    while let Some(c) = chars.next() {
+        if c != '\\' {
+            text.push(c);
+            continue;
+        }
+        match chars.next() {
+            Some('n') => text.push('\n'),
+            Some('t') => text.push('\t'),
+            Some(c) => text.push(c),
+            None => {}
+        }
+    }
+    text
+}
+
+/// Parse a program, keeping the source location of every expression.
+///
+/// # Arguments
+///
+/// * `program` - Source code of the program
+///
+/// # Remarks
+///
+/// The parser records the offset of each expression as it is reduced, which
+/// happens in post-order. The same traversal of the finished AST assigns the
+/// offsets to the expressions, which are identified by their address.
+pub fn parse_located(program: &str) -> (Vec<Expression>, HashMap<*const Expression, Location>) {
+    let mut offsets = Vec::new();
+    let expressions = parser::parse_expressions(&mut offsets, program).unwrap();
+
+    // Offsets of the line starts, for converting offsets to locations
+    let lines: Vec<usize> = Some(0).into_iter()
+        .chain(program.match_indices('\n').map(|(i, _)| i + 1))
+        .collect();
+
+    let mut locations = HashMap::with_capacity(offsets.len());
+    {
+        let mut offsets = offsets.into_iter();
+        let mut stack: Vec<(&Expression, bool)> = expressions.iter().rev().map(|e| (e, false)).collect();
+        while let Some((expr, visited)) = stack.pop() {
+            if visited {
+                let offset = offsets.next().expect("Missing expression offset");
+                let line = match lines.binary_search(&offset) {
+                    Ok(i) => i,
+                    Err(i) => i - 1
+                };
+                locations.insert(expr as *const Expression, Location {
+                    line: line as u32 + 1,
+                    column: (offset - lines[line]) as u32 + 1
+                });
+                continue;
+            }
+
+            stack.push((expr, true));
+            stack.extend(expr.children().into_iter().rev().map(|e| (e, false)));
+        }
+    }
+
+    (expressions, locations)
+}
+
+/// Deeply nested expressions would overflow the native stack when being
+/// dropped recursively, so the tree is torn down with an explicit stack.
+impl Drop for Expression {
+    fn drop(&mut self) {
+        let mut stack = Vec::new();
+        self.take_children(&mut stack);
+        while let Some(mut expr) = stack.pop() {
+            expr.take_children(&mut stack);
+        }
+    }
+}
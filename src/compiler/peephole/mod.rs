@@ -0,0 +1,38 @@
+/// Code in this module rewrites a generated instruction stream in place,
+/// without changing the number or position of instructions. Jump offsets and
+/// profiles keyed by PC therefore stay valid.
+use common::*;
+
+/// Replace the opcode of every instruction starting a known sequence with the
+/// matching superinstruction.
+///
+/// # Arguments
+///
+/// * `code` - The instruction stream to be rewritten
+///
+/// # Remarks
+///
+/// Only the first opcode of a sequence is replaced, so sequences may overlap
+/// and jumps into the middle of a sequence still execute the remaining
+/// instructions. If several superinstructions match at the same position, the
+/// longest one is used.
+pub fn fuse(code: &mut [Instruction]) {
+    let opcodes: Vec<Opcode> = code.iter().map(|i| i.opcode).collect();
+
+    for pc in 0..code.len() {
+        let mut best: Option<(Opcode, usize)> = None;
+        for &(opcode, sequence) in superops::SUPERINSTRUCTIONS {
+            let end = pc + sequence.len();
+            if end > opcodes.len() || &opcodes[pc..end] != sequence {
+                continue;
+            }
+            if best.map(|(_, len)| sequence.len() > len).unwrap_or(true) {
+                best = Some((opcode, sequence.len()));
+            }
+        }
+
+        if let Some((opcode, _)) = best {
+            code[pc].opcode = opcode;
+        }
+    }
+}
@@ -1,165 +1,531 @@
+mod stats;
+
+use std::io::{Result, Write};
 use common::*;
 
-pub fn disassemble(constants: &[i64],
-                   functions: &[u64],
-                   instructions: &[Instruction]) {
+pub use self::stats::Statistics;
+
+/// Write the disassembly of a module to an output stream, one instruction per
+/// line.
+///
+/// # Arguments
+///
+/// * `out` - Output stream, should be buffered for large modules
+/// * `constants` - Constant table of the module
+/// * `functions` - Function table of the module
+/// * `instructions` - Code of the module
+pub fn disassemble<W: Write>(out: &mut W,
+                             constants: &[i64],
+                             functions: &[u64],
+                             instructions: &[Instruction]) -> Result<()> {
     for (pc, instruction) in instructions.iter().enumerate() {
-        print!("0x{:05x}: ", pc);
+        disassemble_instruction(out, constants, functions, pc, instruction)?;
+    }
 
-        match instruction.opcode {
-            ops::HLT => println!("hlt"),
-            ops::LD => {
-                let rl = instruction.left as u16;
-                let rr = instruction.right as u16;
-                let val = rl | rr << 8;
-                let r = instruction.target;
-                println!("ld {} {}", r, val as i16);
-            }
-            ops::LDB => {
-                let rl = instruction.left as u16;
-                let rr = instruction.right as u16;
-                let val = rl | rr << 8;
-                let r = instruction.target;
-                println!("ld {} {}", r, constants[val as usize]);
-            }
-            ops::LDR => {
-                let r = instruction.target;
-                println!("ldr {}", r);
-            }
-            ops::ADD => {
-                let rl = instruction.left;
-                let rr = instruction.right;
-                let r = instruction.target;
-                println!("add {} {} {}", r, rl, rr);
-            }
-            ops::SUB => {
-                let rl = instruction.left;
-                let rr = instruction.right;
-                let r = instruction.target;
-                println!("sub {} {} {}", r, rl, rr);
-            }
-            ops::MUL => {
-                let rl = instruction.left;
-                let rr = instruction.right;
-                let r = instruction.target;
-                println!("mul {} {} {}", r, rl, rr);
-            }
-            ops::DIV => {
-                let rl = instruction.left;
-                let rr = instruction.right;
-                let r = instruction.target;
-                println!("div {} {} {}", r, rl, rr);
-            }
-            ops::AND => {
-                let rl = instruction.left;
-                let rr = instruction.right;
-                let r = instruction.target;
-                println!("and {} {} {}", r, rl, rr);
-            }
-            ops::OR => {
-                let rl = instruction.left;
-                let rr = instruction.right;
-                let r = instruction.target;
-                println!("or {} {} {}", r, rl, rr);
-            }
-            ops::NOT => {
-                let rl = instruction.left;
-                let r = instruction.target;
-                println!("not {} {}", r, rl);
-            }
-            ops::EQ => {
-                let rl = instruction.left;
-                let rr = instruction.right;
-                let r = instruction.target;
-                println!("eq {} {} {}", r, rl, rr);
-            }
-            ops::LT => {
-                let rl = instruction.left;
-                let rr = instruction.right;
-                let r = instruction.target;
-                println!("lt {} {} {}", r, rl, rr);
-            }
-            ops::LE => {
-                let rl = instruction.left;
-                let rr = instruction.right;
-                let r = instruction.target;
-                println!("le {} {} {}", r, rl, rr);
-            }
-            ops::GT => {
-                let rl = instruction.left;
-                let rr = instruction.right;
-                let r = instruction.target;
-                println!("gt {} {} {}", r, rl, rr);
-            }
-            ops::GE => {
-                let rl = instruction.left;
-                let rr = instruction.right;
-                let r = instruction.target;
-                println!("ge {} {} {}", r, rl, rr);
-            }
-            ops::NEQ => {
-                let rl = instruction.left;
-                let rr = instruction.right;
-                let r = instruction.target;
-                println!("neq {} {} {}", r, rl, rr);
-            }
-            ops::CAL => {
-                let rl = instruction.left as u32;
-                let rr = instruction.right as u32;
-                let r = instruction.target as u32;
-                let addr = functions[(r | rl << 8 | rr << 16) as usize];
-                println!("call 0x{:x}", addr);
-            }
-            ops::TLC => {
-                let rl = instruction.left as u32;
-                let rr = instruction.right as u32;
-                let r = instruction.target as u32;
-                let addr = functions[(r | rl << 8 | rr << 16) as usize];
-                println!("tlc 0x{:x}", addr);
-            }
-            ops::RET => println!("ret"),
-            ops::MOV => {
-                let rl = instruction.left;
-                let r = instruction.target;
-                println!("mov {} {}", r, rl);
-            }
-            ops::MVO => {
-                let rl = instruction.left;
-                let rr = instruction.right;
-                let r = instruction.target;
-                println!("mvo {} {} {}", r, rl, rr);
-            }
-            ops::JMF => {
-                let rl = instruction.left as u32;
-                let rr = instruction.right as u32;
-                let r = instruction.target as u32;
-                let addr = r | rl << 8 | rr << 16;
-                println!("jmf 0x{:x}", addr);
-            }
-            ops::JMB => {
-                let rl = instruction.left as u32;
-                let rr = instruction.right as u32;
-                let r = instruction.target as u32;
-                let addr = r | rl << 8 | rr << 16;
-                println!("jmb 0x{:x}", addr);
-            }
-            ops::JTF => {
-                let rl = instruction.left as u32;
-                let rr = instruction.right as u32;
-                let r = instruction.target;
-                let addr = rl | rr << 8;
-                println!("jtf {} 0x{:x}", r, addr);
-            }
-            ops::WRI => {
-                let rl = instruction.left;
-                let r = instruction.target;
-                println!("write {} {}", r, rl);
-            }
-            ops::RDI => {
-                let r = instruction.target;
-                println!("read {}", r);
+    Ok(())
+}
+
+/// Write the disassembly of a single instruction as one line.
+///
+/// # Arguments
+///
+/// * `out` - Output stream
+/// * `constants` - Constant table of the module
+/// * `functions` - Function table of the module
+/// * `pc` - Address of the instruction
+/// * `instruction` - The instruction to be disassembled
+pub fn disassemble_instruction<W: Write>(out: &mut W,
+                                         constants: &[i64],
+                                         functions: &[u64],
+                                         pc: usize,
+                                         instruction: &Instruction) -> Result<()> {
+    write!(out, "0x{:05x}: ", pc)?;
+
+    // Superinstructions are shown as their first instruction, prefixed
+    // with the fused sequence
+    if let Some(sequence) = superops::components(instruction.opcode) {
+        let names: Vec<String> = sequence.iter()
+            .map(|&op| ops::NAMES[op as usize].to_lowercase())
+            .collect();
+        write!(out, "[{}] ", names.join(";"))?;
+    }
+
+    match superops::base(instruction.opcode) {
+        ops::HLT => writeln!(out, "hlt")?,
+        ops::LD => {
+            let rl = instruction.left as u16;
+            let rr = instruction.right as u16;
+            let val = rl | rr << 8;
+            let r = instruction.target;
+            writeln!(out, "ld {} {}", r, val as i16)?;
+        }
+        ops::LDB => {
+            let rl = instruction.left as u16;
+            let rr = instruction.right as u16;
+            let val = rl | rr << 8;
+            let r = instruction.target;
+            match constants[val as usize] {
+                values::NIL => writeln!(out, "ld {} nil", r)?,
+                constant => writeln!(out, "ld {} {}", r, constant)?
             }
-            _ => println!("Invalid instruction")
         }
+        ops::LDR => {
+            let r = instruction.target;
+            writeln!(out, "ldr {}", r)?;
+        }
+        ops::ADD => {
+            let rl = instruction.left;
+            let rr = instruction.right;
+            let r = instruction.target;
+            writeln!(out, "add {} {} {}", r, rl, rr)?;
+        }
+        ops::SUB => {
+            let rl = instruction.left;
+            let rr = instruction.right;
+            let r = instruction.target;
+            writeln!(out, "sub {} {} {}", r, rl, rr)?;
+        }
+        ops::MUL => {
+            let rl = instruction.left;
+            let rr = instruction.right;
+            let r = instruction.target;
+            writeln!(out, "mul {} {} {}", r, rl, rr)?;
+        }
+        ops::DIV => {
+            let rl = instruction.left;
+            let rr = instruction.right;
+            let r = instruction.target;
+            writeln!(out, "div {} {} {}", r, rl, rr)?;
+        }
+        ops::AND => {
+            let rl = instruction.left;
+            let rr = instruction.right;
+            let r = instruction.target;
+            writeln!(out, "and {} {} {}", r, rl, rr)?;
+        }
+        ops::OR => {
+            let rl = instruction.left;
+            let rr = instruction.right;
+            let r = instruction.target;
+            writeln!(out, "or {} {} {}", r, rl, rr)?;
+        }
+        ops::NOT => {
+            let rl = instruction.left;
+            let r = instruction.target;
+            writeln!(out, "not {} {}", r, rl)?;
+        }
+        ops::EQ => {
+            let rl = instruction.left;
+            let rr = instruction.right;
+            let r = instruction.target;
+            writeln!(out, "eq {} {} {}", r, rl, rr)?;
+        }
+        ops::LT => {
+            let rl = instruction.left;
+            let rr = instruction.right;
+            let r = instruction.target;
+            writeln!(out, "lt {} {} {}", r, rl, rr)?;
+        }
+        ops::LE => {
+            let rl = instruction.left;
+            let rr = instruction.right;
+            let r = instruction.target;
+            writeln!(out, "le {} {} {}", r, rl, rr)?;
+        }
+        ops::GT => {
+            let rl = instruction.left;
+            let rr = instruction.right;
+            let r = instruction.target;
+            writeln!(out, "gt {} {} {}", r, rl, rr)?;
+        }
+        ops::GE => {
+            let rl = instruction.left;
+            let rr = instruction.right;
+            let r = instruction.target;
+            writeln!(out, "ge {} {} {}", r, rl, rr)?;
+        }
+        ops::NEQ => {
+            let rl = instruction.left;
+            let rr = instruction.right;
+            let r = instruction.target;
+            writeln!(out, "neq {} {} {}", r, rl, rr)?;
+        }
+        ops::CAL => {
+            let rl = instruction.left as u32;
+            let rr = instruction.right as u32;
+            let r = instruction.target as u32;
+            let addr = functions[(r | rl << 8 | rr << 16) as usize];
+            writeln!(out, "call 0x{:x}", addr)?;
+        }
+        ops::TLC => {
+            let rl = instruction.left as u32;
+            let rr = instruction.right as u32;
+            let r = instruction.target as u32;
+            let addr = functions[(r | rl << 8 | rr << 16) as usize];
+            writeln!(out, "tlc 0x{:x}", addr)?;
+        }
+        ops::RET => writeln!(out, "ret")?,
+        ops::MOV => {
+            let rl = instruction.left;
+            let r = instruction.target;
+            writeln!(out, "mov {} {}", r, rl)?;
+        }
+        ops::MVO => {
+            let rl = instruction.left;
+            let rr = instruction.right;
+            let r = instruction.target;
+            writeln!(out, "mvo {} {} {}", r, rl, rr)?;
+        }
+        ops::JMF => {
+            let rl = instruction.left as u32;
+            let rr = instruction.right as u32;
+            let r = instruction.target as u32;
+            let addr = r | rl << 8 | rr << 16;
+            writeln!(out, "jmf 0x{:x}", addr)?;
+        }
+        ops::JMB => {
+            let rl = instruction.left as u32;
+            let rr = instruction.right as u32;
+            let r = instruction.target as u32;
+            let addr = r | rl << 8 | rr << 16;
+            writeln!(out, "jmb 0x{:x}", addr)?;
+        }
+        ops::JTF => {
+            let rl = instruction.left as u32;
+            let rr = instruction.right as u32;
+            let r = instruction.target;
+            let addr = rl | rr << 8;
+            writeln!(out, "jtf {} 0x{:x}", r, addr)?;
+        }
+        ops::JFF => {
+            let rl = instruction.left as u32;
+            let rr = instruction.right as u32;
+            let r = instruction.target;
+            let addr = rl | rr << 8;
+            writeln!(out, "jff {} 0x{:x}", r, addr)?;
+        }
+        ops::WRI => {
+            let rl = instruction.left;
+            let r = instruction.target;
+            writeln!(out, "write {} {}", r, rl)?;
+        }
+        ops::RDI => {
+            let r = instruction.target;
+            writeln!(out, "read {}", r)?;
+        }
+        ops::RDN => {
+            let r = instruction.target;
+            writeln!(out, "read-or-nil {}", r)?;
+        }
+        ops::CONS => {
+            let rl = instruction.left;
+            let rr = instruction.right;
+            let r = instruction.target;
+            writeln!(out, "cons {} {} {}", r, rl, rr)?;
+        }
+        ops::CAR => {
+            let rl = instruction.left;
+            let r = instruction.target;
+            writeln!(out, "car {} {}", r, rl)?;
+        }
+        ops::CDR => {
+            let rl = instruction.left;
+            let r = instruction.target;
+            writeln!(out, "cdr {} {}", r, rl)?;
+        }
+        ops::NIL => {
+            let rl = instruction.left;
+            let r = instruction.target;
+            writeln!(out, "nil? {} {}", r, rl)?;
+        }
+        ops::MAP => {
+            let r = instruction.target;
+            writeln!(out, "map {}", r)?;
+        }
+        ops::GET => {
+            let rl = instruction.left;
+            let rr = instruction.right;
+            let r = instruction.target;
+            writeln!(out, "get {} {} {}", r, rl, rr)?;
+        }
+        ops::PUT => {
+            let rl = instruction.left;
+            let rr = instruction.right;
+            let r = instruction.target;
+            writeln!(out, "put {} {} {}", r, rl, rr)?;
+        }
+        ops::HAS => {
+            let rl = instruction.left;
+            let rr = instruction.right;
+            let r = instruction.target;
+            writeln!(out, "has? {} {} {}", r, rl, rr)?;
+        }
+        ops::SIZE => {
+            let rl = instruction.left;
+            let r = instruction.target;
+            writeln!(out, "size {} {}", r, rl)?;
+        }
+        ops::LDS => {
+            let rl = instruction.left as u16;
+            let rr = instruction.right as u16;
+            let literal = constants[(rl | rr << 8) as usize];
+            let r = instruction.target;
+            writeln!(out, "lds {} {}:{}", r, literal >> 32, literal & 0xffff_ffff)?;
+        }
+        ops::BUF => {
+            let r = instruction.target;
+            writeln!(out, "buffer {}", r)?;
+        }
+        ops::APP => {
+            let rl = instruction.left;
+            let rr = instruction.right;
+            let r = instruction.target;
+            writeln!(out, "append {} {} {}", r, rl, rr)?;
+        }
+        ops::STR => {
+            let rl = instruction.left;
+            let r = instruction.target;
+            writeln!(out, "string {} {}", r, rl)?;
+        }
+        ops::SLC => {
+            let rl = instruction.left;
+            let rr = instruction.right;
+            let r = instruction.target;
+            writeln!(out, "slice {} {} {}", r, rl, rr)?;
+        }
+        ops::BYT => {
+            let rl = instruction.left;
+            let rr = instruction.right;
+            let r = instruction.target;
+            writeln!(out, "byte {} {} {}", r, rl, rr)?;
+        }
+        ops::CMP => {
+            let rl = instruction.left;
+            let rr = instruction.right;
+            let r = instruction.target;
+            writeln!(out, "compare {} {} {}", r, rl, rr)?;
+        }
+        ops::HSH => {
+            let rl = instruction.left;
+            let r = instruction.target;
+            writeln!(out, "hash {} {}", r, rl)?;
+        }
+        ops::WRB => {
+            let rl = instruction.left;
+            let r = instruction.target;
+            writeln!(out, "write-bytes {} {}", r, rl)?;
+        }
+        ops::RDL => {
+            let rl = instruction.left;
+            let r = instruction.target;
+            writeln!(out, "read-line {} {}", r, rl)?;
+        }
+        ops::REC => {
+            let rl = instruction.left;
+            let rr = instruction.right;
+            let r = instruction.target;
+            writeln!(out, "record {} {} {}", r, rl, rr)?;
+        }
+        ops::FLD => {
+            let rl = instruction.left;
+            let rr = instruction.right;
+            let r = instruction.target;
+            writeln!(out, "field {} {} {}", r, rl, rr)?;
+        }
+        ops::WTH => {
+            let rl = instruction.left;
+            let rr = instruction.right;
+            let r = instruction.target;
+            writeln!(out, "with {} {} {}", r, rl, rr)?;
+        }
+        ops::VEC => {
+            let r = instruction.target;
+            writeln!(out, "vector {}", r)?;
+        }
+        ops::VGT => {
+            let rl = instruction.left;
+            let rr = instruction.right;
+            let r = instruction.target;
+            writeln!(out, "vec-get {} {} {}", r, rl, rr)?;
+        }
+        ops::VPS => {
+            let rl = instruction.left;
+            let rr = instruction.right;
+            let r = instruction.target;
+            writeln!(out, "vec-push {} {} {}", r, rl, rr)?;
+        }
+        ops::VAS => {
+            let rl = instruction.left;
+            let rr = instruction.right;
+            let r = instruction.target;
+            writeln!(out, "vec-assoc {} {} {}", r, rl, rr)?;
+        }
+        ops::VLN => {
+            let rl = instruction.left;
+            let r = instruction.target;
+            writeln!(out, "vec-len {} {}", r, rl)?;
+        }
+        ops::GEN => {
+            let rl = instruction.left as u32;
+            let rr = instruction.right as u32;
+            let r = instruction.target;
+            let addr = functions[(rl | rr << 8) as usize];
+            writeln!(out, "generator {} 0x{:x}", r, addr)?;
+        }
+        ops::RSM => {
+            let rl = instruction.left;
+            let rr = instruction.right;
+            let r = instruction.target;
+            writeln!(out, "resume {} {} {}", r, rl, rr)?;
+        }
+        ops::FIN => {
+            let r = instruction.target;
+            writeln!(out, "finished {}", r)?;
+        }
+        ops::YLD => {
+            let rl = instruction.left;
+            let r = instruction.target;
+            writeln!(out, "yield {} {}", r, rl)?;
+        }
+        ops::OPN => {
+            let rl = instruction.left;
+            let rr = instruction.right;
+            let r = instruction.target;
+            writeln!(out, "fd-open {} {} {}", r, rl, rr)?;
+        }
+        ops::FRD => {
+            let rl = instruction.left;
+            let rr = instruction.right;
+            let r = instruction.target;
+            writeln!(out, "fd-read {} {} {}", r, rl, rr)?;
+        }
+        ops::FWR => {
+            let rl = instruction.left;
+            let rr = instruction.right;
+            let r = instruction.target;
+            writeln!(out, "fd-write {} {} {}", r, rl, rr)?;
+        }
+        ops::CLS => {
+            let rl = instruction.left;
+            let r = instruction.target;
+            writeln!(out, "fd-close {} {}", r, rl)?;
+        }
+        ops::IMP => {
+            let rl = instruction.left;
+            let r = instruction.target;
+            writeln!(out, "load-ints {} {}", r, rl)?;
+        }
+        ops::IPR => {
+            let rl = instruction.left;
+            let r = instruction.target;
+            writeln!(out, "parse-ints {} {}", r, rl)?;
+        }
+        ops::IGT => {
+            let rl = instruction.left;
+            let rr = instruction.right;
+            let r = instruction.target;
+            writeln!(out, "ints-get {} {} {}", r, rl, rr)?;
+        }
+        ops::IAD => {
+            let rl = instruction.left;
+            let r = instruction.target;
+            writeln!(out, "ints-address {} {}", r, rl)?;
+        }
+        ops::IGU => {
+            let rl = instruction.left;
+            let rr = instruction.right;
+            let r = instruction.target;
+            writeln!(out, "ints-load {} {} {}", r, rl, rr)?;
+        }
+        ops::CALLN => {
+            let rl = instruction.left;
+            let rr = instruction.right;
+            let r = instruction.target;
+            writeln!(out, "native {} {} {}", r, rl, rr)?;
+        }
+        ops::MOD => {
+            let rl = instruction.left;
+            let rr = instruction.right;
+            let r = instruction.target;
+            writeln!(out, "mod {} {} {}", r, rl, rr)?;
+        }
+        ops::POW => {
+            let rl = instruction.left;
+            let rr = instruction.right;
+            let r = instruction.target;
+            writeln!(out, "pow {} {} {}", r, rl, rr)?;
+        }
+        ops::GCD => {
+            let rl = instruction.left;
+            let rr = instruction.right;
+            let r = instruction.target;
+            writeln!(out, "gcd {} {} {}", r, rl, rr)?;
+        }
+        ops::MIN => {
+            let rl = instruction.left;
+            let rr = instruction.right;
+            let r = instruction.target;
+            writeln!(out, "min {} {} {}", r, rl, rr)?;
+        }
+        ops::MAX => {
+            let rl = instruction.left;
+            let rr = instruction.right;
+            let r = instruction.target;
+            writeln!(out, "max {} {} {}", r, rl, rr)?;
+        }
+        ops::ABS => {
+            let rl = instruction.left;
+            let r = instruction.target;
+            writeln!(out, "abs {} {}", r, rl)?;
+        }
+        ops::SQRT => {
+            let rl = instruction.left;
+            let r = instruction.target;
+            writeln!(out, "isqrt {} {}", r, rl)?;
+        }
+        ops::PCNT => {
+            let rl = instruction.left;
+            let r = instruction.target;
+            writeln!(out, "popcount {} {}", r, rl)?;
+        }
+        ops::CLZ => {
+            let rl = instruction.left;
+            let r = instruction.target;
+            writeln!(out, "clz {} {}", r, rl)?;
+        }
+        ops::CTZ => {
+            let rl = instruction.left;
+            let r = instruction.target;
+            writeln!(out, "ctz {} {}", r, rl)?;
+        }
+        ops::CLO => {
+            let rl = instruction.left;
+            let rr = instruction.right;
+            let r = instruction.target;
+            writeln!(out, "closure {} {} {}", r, rl, rr)?;
+        }
+        ops::CLI => {
+            let rl = instruction.left;
+            let r = instruction.target;
+            writeln!(out, "call-value {} {}", r, rl)?;
+        }
+        ops::TLI => {
+            let rl = instruction.left;
+            let r = instruction.target;
+            writeln!(out, "tail-call-value {} {}", r, rl)?;
+        }
+        ops::RDR => {
+            let r = instruction.target;
+            writeln!(out, "read-raw {}", r)?;
+        }
+        ops::WRR => {
+            let rl = instruction.left;
+            let rr = instruction.right;
+            let r = instruction.target;
+            writeln!(out, "write-raw {} {} {}", r, rl, rr)?;
+        }
+        _ => writeln!(out, "Invalid instruction")?
     }
+
+    Ok(())
 }
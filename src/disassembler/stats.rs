@@ -0,0 +1,346 @@
+use std;
+use std::collections::{BTreeSet, HashMap};
+use std::io::{Result, Write};
+use common::*;
+
+/// Static properties of a single function. Top level code is treated as a
+/// function named `main`.
+pub struct FunctionStatistics {
+    pub name: String,
+    pub address: u64,
+    pub size: usize,
+    pub max_register: Option<Register>,
+    pub callers: BTreeSet<usize>,
+    pub callees: BTreeSet<usize>,
+    pub call_sites: usize,
+    pub tail_call_sites: usize,
+    /// Registers needed by this function and all functions it calls, `None`
+    /// if it may recurse without tail calls
+    pub register_requirement: Option<usize>
+}
+
+/// Static instruction mix and frame usage of a module, as reported by
+/// `lasm --stats`
+pub struct Statistics {
+    pub instructions: usize,
+    pub superinstructions: usize,
+    /// Number of instructions per opcode, superinstructions are counted as
+    /// the instruction they start with
+    pub opcodes: Vec<usize>,
+    pub constants: usize,
+    /// Constants stored more than once, with the number of copies
+    pub duplicate_constants: Vec<(i64, usize)>,
+    pub functions: Vec<FunctionStatistics>
+}
+
+/// Get the registers of the current frame an instruction reads or writes.
+fn used_registers(instruction: &Instruction) -> Vec<Register> {
+    match superops::base(instruction.opcode) {
+        ops::LD | ops::LDB | ops::LDR | ops::RDI | ops::JTF | ops::JFF | ops::MAP |
+        ops::LDS | ops::BUF | ops::VEC | ops::RDN | ops::GEN | ops::FIN | ops::RDR |
+        ops::CLI | ops::TLI => {
+            vec![instruction.target]
+        }
+        ops::NOT | ops::MOV | ops::WRI | ops::CAR | ops::CDR | ops::NIL |
+        ops::SIZE | ops::STR | ops::HSH | ops::WRB | ops::RDL | ops::FLD | ops::WTH |
+        ops::VLN | ops::YLD | ops::CLS | ops::IMP | ops::IPR | ops::IAD | ops::ABS | ops::SQRT |
+        ops::PCNT | ops::CLZ | ops::CTZ => {
+            vec![instruction.target, instruction.left]
+        }
+        ops::MVO => {
+            vec![instruction.left]
+        }
+        ops::REC | ops::WRR | ops::CLO => {
+            let fields = instruction.left..instruction.left.saturating_add(instruction.right);
+            Some(instruction.target).into_iter().chain(fields).collect()
+        }
+        ops::CALLN => {
+            let first = instruction.target.saturating_add(1);
+            let arguments = first..first.saturating_add(instruction.right);
+            Some(instruction.target).into_iter().chain(arguments).collect()
+        }
+        ops::ADD | ops::SUB | ops::MUL | ops::DIV | ops::AND | ops::OR |
+        ops::EQ | ops::LT | ops::LE | ops::GT | ops::GE | ops::NEQ | ops::CONS |
+        ops::GET | ops::PUT | ops::HAS | ops::APP | ops::SLC | ops::BYT | ops::CMP |
+        ops::VGT | ops::VPS | ops::VAS | ops::RSM | ops::OPN | ops::FRD | ops::FWR |
+        ops::IGT | ops::IGU | ops::MOD | ops::POW | ops::GCD | ops::MIN | ops::MAX => {
+            vec![instruction.target, instruction.left, instruction.right]
+        }
+        _ => vec![]
+    }
+}
+
+/// Decode the 24 bit operand of calls and unconditional jumps.
+fn wide_operand(instruction: &Instruction) -> usize {
+    instruction.target as usize | (instruction.left as usize) << 8 | (instruction.right as usize) << 16
+}
+
+impl Statistics {
+    /// Gather the statistics of a module.
+    ///
+    /// # Arguments
+    ///
+    /// * `module` - The module to be analyzed
+    ///
+    /// # Remarks
+    ///
+    /// Functions are assumed to extend up to the next function or the entry
+    /// point, which holds for modules generated by the compiler.
+    pub fn new(module: &Module) -> Statistics {
+        let code = &module.code;
+        let entry_point = module.entry_point as usize;
+        let main = module.functions.len();
+
+        // Function boundaries, the top level code being the last function
+        let mut bounds: Vec<(usize, usize)> = module.functions.iter()
+            .enumerate()
+            .map(|(index, &address)| (address as usize, index))
+            .collect();
+        bounds.push((entry_point, main));
+        bounds.sort();
+        let owner = |pc: usize| -> usize {
+            match bounds.binary_search(&(pc, usize::max_value())) {
+                Ok(i) => bounds[i].1,
+                Err(0) => main,
+                Err(i) => bounds[i - 1].1
+            }
+        };
+
+        let mut functions: Vec<FunctionStatistics> = (0..main + 1).map(|index| {
+            FunctionStatistics {
+                name: if index == main { "main".to_string() } else { format!("f{}", index) },
+                address: if index == main { module.entry_point } else { module.functions[index] },
+                size: 0,
+                max_register: None,
+                callers: BTreeSet::new(),
+                callees: BTreeSet::new(),
+                call_sites: 0,
+                tail_call_sites: 0,
+                register_requirement: None
+            }
+        }).collect();
+
+        let mut opcodes = vec![0; ops::NAMES.len()];
+        let mut superinstructions = 0;
+        let mut calls: Vec<BTreeSet<usize>> = vec![BTreeSet::new(); main + 1];
+
+        for (pc, instruction) in code.iter().enumerate() {
+            let function = owner(pc);
+            let opcode = superops::base(instruction.opcode);
+            if (opcode as usize) < opcodes.len() {
+                opcodes[opcode as usize] += 1;
+            }
+            if opcode != instruction.opcode {
+                superinstructions += 1;
+            }
+
+            let f = &mut functions[function];
+            f.size += 1;
+            for r in used_registers(instruction) {
+                f.max_register = Some(f.max_register.map_or(r, |m| m.max(r)));
+            }
+
+            let callee = match opcode {
+                ops::CAL => {
+                    f.call_sites += 1;
+                    let callee = wide_operand(instruction);
+                    calls[function].insert(callee);
+                    Some(callee)
+                }
+                ops::TLC => {
+                    f.tail_call_sites += 1;
+                    Some(wide_operand(instruction))
+                }
+                // Function values can call any function, so the register
+                // requirement is unbounded
+                ops::CLI => {
+                    f.call_sites += 1;
+                    calls[function].insert(std::usize::MAX);
+                    None
+                }
+                ops::TLI => {
+                    f.tail_call_sites += 1;
+                    None
+                }
+                ops::JMB => {
+                    f.tail_call_sites += 1;
+                    Some(owner(pc - wide_operand(instruction)))
+                }
+                // Generators run on frames of their own, so they are callees
+                // without adding to the register requirement
+                ops::GEN => Some(instruction.left as usize | (instruction.right as usize) << 8),
+                _ => None
+            };
+            if let Some(callee) = callee {
+                f.callees.insert(callee);
+            }
+        }
+
+        for caller in 0..functions.len() {
+            let callees: Vec<usize> = functions[caller].callees.iter().cloned().collect();
+            for callee in callees {
+                if callee < functions.len() {
+                    functions[callee].callers.insert(caller);
+                }
+            }
+        }
+
+        // Each non-tail call moves the frame by 256 registers
+        let mut requirements: HashMap<usize, Option<usize>> = HashMap::new();
+        for index in 0..functions.len() {
+            let requirement = register_requirement(index, &functions, &calls, &mut requirements);
+            functions[index].register_requirement = requirement;
+        }
+
+        let mut copies: HashMap<i64, usize> = HashMap::new();
+        for &constant in &module.constants {
+            *copies.entry(constant).or_insert(0) += 1;
+        }
+        let mut duplicate_constants: Vec<(i64, usize)> = copies.into_iter()
+            .filter(|&(_, n)| n > 1)
+            .collect();
+        duplicate_constants.sort();
+
+        Statistics {
+            instructions: code.len(),
+            superinstructions,
+            opcodes,
+            constants: module.constants.len(),
+            duplicate_constants,
+            functions
+        }
+    }
+
+    /// Write the statistics in a human readable form.
+    pub fn write_text<W: Write>(&self, out: &mut W) -> Result<()> {
+        writeln!(out, "Instructions: {} ({} superinstructions)",
+                 self.instructions, self.superinstructions)?;
+        let mut opcodes: Vec<(usize, usize)> = self.opcodes.iter()
+            .cloned()
+            .enumerate()
+            .filter(|&(_, n)| n > 0)
+            .collect();
+        opcodes.sort_by(|a, b| b.1.cmp(&a.1));
+        for (opcode, n) in opcodes {
+            writeln!(out, "  {:<6} {:>8}", ops::NAMES[opcode].to_lowercase(), n)?;
+        }
+
+        writeln!(out, "Constants: {} ({} duplicated)",
+                 self.constants, self.duplicate_constants.len())?;
+        for &(constant, n) in &self.duplicate_constants {
+            writeln!(out, "  {} stored {} times", constant, n)?;
+        }
+
+        writeln!(out, "Functions: {}", self.functions.len() - 1)?;
+        writeln!(out, "  {:<8} {:>8} {:>6} {:>8} {:>7} {:>7} {:>6} {:>10} {:>10}",
+                 "name", "address", "size", "max reg", "fan-in", "fan-out",
+                 "calls", "tail calls", "registers")?;
+        for f in &self.functions {
+            writeln!(out, "  {:<8} {:>8} {:>6} {:>8} {:>7} {:>7} {:>6} {:>10} {:>10}",
+                     f.name,
+                     format!("0x{:05x}", f.address),
+                     f.size,
+                     f.max_register.map_or("-".to_string(), |r| r.to_string()),
+                     f.callers.len(),
+                     f.callees.len(),
+                     f.call_sites,
+                     f.tail_call_sites,
+                     f.register_requirement.map_or("unbounded".to_string(), |r| r.to_string()))?;
+        }
+
+        let call_sites: usize = self.functions.iter().map(|f| f.call_sites).sum();
+        let tail_call_sites: usize = self.functions.iter().map(|f| f.tail_call_sites).sum();
+        writeln!(out, "Call sites: {} ({} tail calls)", call_sites + tail_call_sites, tail_call_sites)?;
+
+        match self.functions.last().and_then(|f| f.register_requirement) {
+            Some(r) => writeln!(out, "Maximum register requirement: {}", r)?,
+            None => writeln!(out, "Maximum register requirement: unbounded (non-tail recursion)")?
+        }
+
+        Ok(())
+    }
+
+    /// Write the statistics as a JSON object.
+    pub fn write_json<W: Write>(&self, out: &mut W) -> Result<()> {
+        writeln!(out, "{{")?;
+        writeln!(out, "  \"instructions\": {},", self.instructions)?;
+        writeln!(out, "  \"superinstructions\": {},", self.superinstructions)?;
+
+        let opcodes: Vec<String> = self.opcodes.iter()
+            .enumerate()
+            .filter(|&(_, &n)| n > 0)
+            .map(|(opcode, n)| format!("\"{}\": {}", ops::NAMES[opcode].to_lowercase(), n))
+            .collect();
+        writeln!(out, "  \"opcodes\": {{{}}},", opcodes.join(", "))?;
+
+        let duplicates: Vec<String> = self.duplicate_constants.iter()
+            .map(|&(constant, n)| format!("{{\"value\": {}, \"copies\": {}}}", constant, n))
+            .collect();
+        writeln!(out, "  \"constants\": {{\"count\": {}, \"duplicates\": [{}]}},",
+                 self.constants, duplicates.join(", "))?;
+
+        writeln!(out, "  \"functions\": [")?;
+        for (i, f) in self.functions.iter().enumerate() {
+            let names = |set: &BTreeSet<usize>| -> String {
+                set.iter()
+                    .filter_map(|&index| self.functions.get(index))
+                    .map(|f| format!("\"{}\"", f.name))
+                    .collect::<Vec<String>>()
+                    .join(", ")
+            };
+            writeln!(out, "    {{\"name\": \"{}\", \"address\": {}, \"size\": {}, \
+                           \"max_register\": {}, \"callers\": [{}], \"callees\": [{}], \
+                           \"call_sites\": {}, \"tail_call_sites\": {}, \"registers\": {}}}{}",
+                     f.name,
+                     f.address,
+                     f.size,
+                     f.max_register.map_or("null".to_string(), |r| r.to_string()),
+                     names(&f.callers),
+                     names(&f.callees),
+                     f.call_sites,
+                     f.tail_call_sites,
+                     f.register_requirement.map_or("null".to_string(), |r| r.to_string()),
+                     if i + 1 < self.functions.len() { "," } else { "" })?;
+        }
+        writeln!(out, "  ]")?;
+        writeln!(out, "}}")?;
+
+        Ok(())
+    }
+}
+
+/// Compute the number of registers needed to run a function, including the
+/// frames of all non-tail calls it makes.
+///
+/// # Arguments
+///
+/// * `index` - The function to be analyzed
+/// * `functions` - Statistics of all functions, providing the frame usage
+/// * `calls` - Non-tail callees of each function
+/// * `requirements` - Memoized results, functions being analyzed map to `None`
+fn register_requirement(index: usize,
+                        functions: &[FunctionStatistics],
+                        calls: &[BTreeSet<usize>],
+                        requirements: &mut HashMap<usize, Option<usize>>) -> Option<usize> {
+    if let Some(&requirement) = requirements.get(&index) {
+        return requirement;
+    }
+    if index >= functions.len() {
+        return None;
+    }
+
+    // Mark as in progress, reaching it again means recursion
+    requirements.insert(index, None);
+
+    let own = functions[index].max_register.map_or(0, |r| r as usize + 1);
+    let mut requirement = Some(own);
+    for &callee in &calls[index] {
+        requirement = match (requirement, register_requirement(callee, functions, calls, requirements)) {
+            (Some(r), Some(c)) => Some(r.max(256 + c)),
+            _ => None
+        };
+    }
+
+    requirements.insert(index, requirement);
+    requirement
+}
@@ -6,13 +6,18 @@
 #[macro_use]
 extern crate serde_derive;
 extern crate lalrpop_util;
+extern crate libc;
 
 mod common;
 mod compiler;
 mod disassembler;
 mod vm;
 
-pub use compiler::compile;
-pub use disassembler::disassemble;
-pub use vm::run;
-pub use common::{Instruction, Module, Thread, reg};
\ No newline at end of file
+pub use compiler::{compile, compile_with_profile};
+pub use disassembler::{Statistics, disassemble, disassemble_instruction};
+pub use vm::{Counters, CountersFile, Framing, GcStats, Heap, Io, Reactor, Snapshot, Status,
+             Suspension, Trace, TraceEntry, counters, framing, instrumentation, resume, run,
+             run_instrumented, run_profiled, run_sampled, run_traced, run_with_io, set_framing,
+             set_instrumentation};
+pub use common::{Instruction, LineTable, Location, Module, Native, Opcode, Profile, Thread, code_hash,
+                 locate, ops, reg, register_native, values};
\ No newline at end of file
@@ -0,0 +1,336 @@
+use std;
+use std::cmp::Ordering;
+use std::fmt;
+
+/// Operands with fewer limbs are multiplied by the schoolbook method
+const KARATSUBA_LIMBS: usize = 32;
+
+/// Arbitrary precision integer in sign and magnitude form, used for the
+/// results of arithmetic which do not fit into a register.
+///
+/// # Remarks
+///
+/// The magnitude is stored in 32 bit limbs, least significant first, so
+/// products of two limbs fit into 64 bits. It has no leading zero limbs, and
+/// zero is never negative.
+#[derive(Clone, PartialEq, Eq, Debug)]
+pub(super) struct Big {
+    pub(super) negative: bool,
+    pub(super) magnitude: Vec<u32>
+}
+
+impl Big {
+    pub(super) fn new(negative: bool, mut magnitude: Vec<u32>) -> Big {
+        trim(&mut magnitude);
+        Big {
+            negative: negative && !magnitude.is_empty(),
+            magnitude
+        }
+    }
+
+    pub(super) fn from_i64(value: i64) -> Big {
+        let magnitude = if value < 0 { (value as u64).wrapping_neg() } else { value as u64 };
+        Big::new(value < 0, vec![magnitude as u32, (magnitude >> 32) as u32])
+    }
+
+    /// Convert to a 64 bit integer, `None` if it is out of range.
+    pub(super) fn to_i64(&self) -> Option<i64> {
+        if self.magnitude.len() > 2 {
+            return None;
+        }
+        let magnitude = self.magnitude.iter().rev().fold(0u64, |acc, &limb| acc << 32 | limb as u64);
+        match (self.negative, magnitude) {
+            (false, magnitude) if magnitude <= std::i64::MAX as u64 => Some(magnitude as i64),
+            (true, magnitude) if magnitude <= 1 << 63 => Some((magnitude as i64).wrapping_neg()),
+            _ => None
+        }
+    }
+
+    pub(super) fn add(&self, other: &Big) -> Big {
+        if self.negative == other.negative {
+            return Big::new(self.negative, add(&self.magnitude, &other.magnitude));
+        }
+        match compare(&self.magnitude, &other.magnitude) {
+            Ordering::Less => Big::new(other.negative, sub(&other.magnitude, &self.magnitude)),
+            _ => Big::new(self.negative, sub(&self.magnitude, &other.magnitude))
+        }
+    }
+
+    pub(super) fn sub(&self, other: &Big) -> Big {
+        self.add(&Big::new(!other.negative, other.magnitude.clone()))
+    }
+
+    pub(super) fn mul(&self, other: &Big) -> Big {
+        Big::new(self.negative != other.negative, mul(&self.magnitude, &other.magnitude))
+    }
+
+    /// Divide, rounding the quotient towards zero. The remainder has the
+    /// sign of the dividend, as for integers in a register.
+    pub(super) fn div_rem(&self, other: &Big) -> (Big, Big) {
+        if other.magnitude.is_empty() {
+            panic!("attempt to divide by zero");
+        }
+        let (quotient, remainder) = div_rem(&self.magnitude, &other.magnitude);
+        (Big::new(self.negative != other.negative, quotient), Big::new(self.negative, remainder))
+    }
+
+    /// Exponentiation by squaring.
+    pub(super) fn pow(&self, mut exponent: u64) -> Big {
+        let mut base = self.clone();
+        let mut result = Big::from_i64(1);
+        while exponent > 0 {
+            if exponent & 1 != 0 {
+                result = result.mul(&base);
+            }
+            exponent >>= 1;
+            if exponent > 0 {
+                base = base.mul(&base);
+            }
+        }
+        result
+    }
+
+    pub(super) fn abs(&self) -> Big {
+        Big::new(false, self.magnitude.clone())
+    }
+
+    /// Square root of the magnitude rounded down, by Newton's method from a
+    /// power of two above the root.
+    pub(super) fn isqrt(&self) -> Big {
+        let top = match self.magnitude.last() {
+            Some(&top) => top,
+            None => return self.clone()
+        };
+        let bits = 32 * self.magnitude.len() - top.leading_zeros() as usize;
+        let shift = (bits + 1) / 2;
+        let mut start = vec![0; shift / 32 + 1];
+        start[shift / 32] = 1 << (shift % 32);
+        let magnitude = self.abs();
+        let two = Big::from_i64(2);
+        let mut root = Big::new(false, start);
+        loop {
+            let next = root.add(&magnitude.div_rem(&root).0).div_rem(&two).0;
+            if next >= root {
+                return root;
+            }
+            root = next;
+        }
+    }
+
+    /// Number of set bits of the magnitude.
+    pub(super) fn count_ones(&self) -> u64 {
+        self.magnitude.iter().map(|limb| limb.count_ones() as u64).sum()
+    }
+
+    /// Number of trailing zero bits, which is the same for the magnitude and
+    /// the two's complement. Zero has none.
+    pub(super) fn trailing_zeros(&self) -> u64 {
+        match self.magnitude.iter().position(|&limb| limb != 0) {
+            Some(index) => 32 * index as u64 + self.magnitude[index].trailing_zeros() as u64,
+            None => 0
+        }
+    }
+}
+
+impl Ord for Big {
+    fn cmp(&self, other: &Big) -> Ordering {
+        match (self.negative, other.negative) {
+            (false, true) => Ordering::Greater,
+            (true, false) => Ordering::Less,
+            (false, false) => compare(&self.magnitude, &other.magnitude),
+            (true, true) => compare(&other.magnitude, &self.magnitude)
+        }
+    }
+}
+
+impl PartialOrd for Big {
+    fn partial_cmp(&self, other: &Big) -> Option<Ordering> {
+        Some(self.cmp(other))
+    }
+}
+
+impl fmt::Display for Big {
+    /// Write the decimal digits, which are split off nine at a time.
+    fn fmt(&self, f: &mut fmt::Formatter) -> fmt::Result {
+        let mut magnitude = self.magnitude.clone();
+        let mut chunks = Vec::new();
+        while !magnitude.is_empty() {
+            let mut remainder = 0u64;
+            for limb in magnitude.iter_mut().rev() {
+                let value = remainder << 32 | *limb as u64;
+                *limb = (value / 1_000_000_000) as u32;
+                remainder = value % 1_000_000_000;
+            }
+            trim(&mut magnitude);
+            chunks.push(remainder);
+        }
+
+        if self.negative {
+            write!(f, "-")?;
+        }
+        match chunks.pop() {
+            Some(first) => write!(f, "{}", first)?,
+            None => return write!(f, "0")
+        }
+        for chunk in chunks.iter().rev() {
+            write!(f, "{:09}", chunk)?;
+        }
+        Ok(())
+    }
+}
+
+/// Remove the leading zero limbs of a magnitude.
+fn trim(magnitude: &mut Vec<u32>) {
+    while magnitude.last() == Some(&0) {
+        magnitude.pop();
+    }
+}
+
+fn compare(a: &[u32], b: &[u32]) -> Ordering {
+    a.len().cmp(&b.len()).then_with(|| a.iter().rev().cmp(b.iter().rev()))
+}
+
+fn add(a: &[u32], b: &[u32]) -> Vec<u32> {
+    let (long, short) = if a.len() >= b.len() { (a, b) } else { (b, a) };
+    let mut sum = Vec::with_capacity(long.len() + 1);
+    let mut carry = 0u64;
+    for (i, &limb) in long.iter().enumerate() {
+        let value = limb as u64 + *short.get(i).unwrap_or(&0) as u64 + carry;
+        sum.push(value as u32);
+        carry = value >> 32;
+    }
+    sum.push(carry as u32);
+    trim(&mut sum);
+    sum
+}
+
+/// Subtract magnitudes, `a` must not be less than `b`.
+fn sub(a: &[u32], b: &[u32]) -> Vec<u32> {
+    let mut difference = Vec::with_capacity(a.len());
+    let mut borrow = 0i64;
+    for (i, &limb) in a.iter().enumerate() {
+        let mut value = limb as i64 - *b.get(i).unwrap_or(&0) as i64 - borrow;
+        borrow = 0;
+        if value < 0 {
+            value += 1 << 32;
+            borrow = 1;
+        }
+        difference.push(value as u32);
+    }
+    trim(&mut difference);
+    difference
+}
+
+/// Divide magnitudes, `b` must not be zero.
+///
+/// # Remarks
+///
+/// A single limb divisor is divided out limb by limb, larger ones bit by bit
+/// by shifting and subtracting.
+fn div_rem(a: &[u32], b: &[u32]) -> (Vec<u32>, Vec<u32>) {
+    if b.len() == 1 {
+        let divisor = b[0] as u64;
+        let mut quotient = vec![0u32; a.len()];
+        let mut remainder = 0u64;
+        for (i, &limb) in a.iter().enumerate().rev() {
+            let value = remainder << 32 | limb as u64;
+            quotient[i] = (value / divisor) as u32;
+            remainder = value % divisor;
+        }
+        trim(&mut quotient);
+        let mut remainder = vec![remainder as u32];
+        trim(&mut remainder);
+        return (quotient, remainder);
+    }
+    if compare(a, b) == Ordering::Less {
+        return (Vec::new(), a.to_vec());
+    }
+
+    let mut quotient = vec![0u32; a.len()];
+    let mut remainder: Vec<u32> = Vec::with_capacity(b.len() + 1);
+    for bit in (0..a.len() * 32).rev() {
+        // Shift the next bit of the dividend into the remainder
+        let mut carry = a[bit / 32] >> (bit % 32) & 1;
+        for limb in remainder.iter_mut() {
+            let next = *limb >> 31;
+            *limb = *limb << 1 | carry;
+            carry = next;
+        }
+        if carry != 0 {
+            remainder.push(carry);
+        }
+        if compare(&remainder, b) != Ordering::Less {
+            remainder = sub(&remainder, b);
+            quotient[bit / 32] |= 1 << (bit % 32);
+        }
+    }
+    trim(&mut quotient);
+    (quotient, remainder)
+}
+
+/// Add `b` shifted by `shift` limbs to `a` in place, `a` has to be large
+/// enough for the sum.
+fn add_at(a: &mut [u32], b: &[u32], shift: usize) {
+    let mut carry = 0u64;
+    let mut i = 0;
+    while i < b.len() || carry != 0 {
+        let value = a[shift + i] as u64 + *b.get(i).unwrap_or(&0) as u64 + carry;
+        a[shift + i] = value as u32;
+        carry = value >> 32;
+        i += 1;
+    }
+}
+
+/// Multiply magnitudes.
+///
+/// # Remarks
+///
+/// Large operands are split into halves and multiplied with three instead
+/// of four half-sized products (Karatsuba), small ones limb by limb.
+fn mul(a: &[u32], b: &[u32]) -> Vec<u32> {
+    if a.is_empty() || b.is_empty() {
+        return Vec::new();
+    }
+    if a.len() < KARATSUBA_LIMBS || b.len() < KARATSUBA_LIMBS {
+        return schoolbook(a, b);
+    }
+
+    let half = std::cmp::max(a.len(), b.len()) / 2;
+    let (a0, a1) = split(a, half);
+    let (b0, b1) = split(b, half);
+    let low = mul(a0, b0);
+    let high = mul(a1, b1);
+    let middle = sub(&sub(&mul(&add(a0, a1), &add(b0, b1)), &low), &high);
+
+    let mut product = vec![0; a.len() + b.len() + 1];
+    add_at(&mut product, &low, 0);
+    add_at(&mut product, &middle, half);
+    add_at(&mut product, &high, 2 * half);
+    trim(&mut product);
+    product
+}
+
+/// Split a magnitude into its lower `at` limbs and the rest, both trimmed.
+fn split(magnitude: &[u32], at: usize) -> (&[u32], &[u32]) {
+    let at = std::cmp::min(at, magnitude.len());
+    let (mut low, high) = magnitude.split_at(at);
+    while low.last() == Some(&0) {
+        low = &low[..low.len() - 1];
+    }
+    (low, high)
+}
+
+fn schoolbook(a: &[u32], b: &[u32]) -> Vec<u32> {
+    let mut product = vec![0u32; a.len() + b.len()];
+    for (i, &x) in a.iter().enumerate() {
+        let mut carry = 0u64;
+        for (j, &y) in b.iter().enumerate() {
+            let value = x as u64 * y as u64 + product[i + j] as u64 + carry;
+            product[i + j] = value as u32;
+            carry = value >> 32;
+        }
+        product[i + b.len()] = carry as u32;
+    }
+    trim(&mut product);
+    product
+}
@@ -0,0 +1,249 @@
+use std;
+use std::fs::OpenOptions;
+use std::io::{Error, ErrorKind, Result};
+use std::os::unix::io::AsRawFd;
+use std::path::Path;
+use std::sync::atomic::{AtomicPtr, AtomicUsize, Ordering};
+use libc;
+
+/// Identifies a counters file, "LILSTAT" followed by the layout version
+const MAGIC: usize = 0x4c494c5354415401;
+
+/// Runtime counters of the VM, updated while threads are running.
+///
+/// The counters are only written by the running VM thread, with relaxed
+/// stores, and can be read at any time. The layout is fixed, so the counters
+/// can be shared with other processes through a `CountersFile`.
+#[repr(C)]
+pub struct Counters {
+    magic: AtomicUsize,
+    /// Instructions dispatched, a superinstruction counting as one. This is
+    /// published at calls, returns, tail calls, I/O and when halting.
+    pub instructions: AtomicUsize,
+    pub calls: AtomicUsize,
+    pub returns: AtomicUsize,
+    pub tail_calls: AtomicUsize,
+    /// Current number of nested non-tail calls
+    pub depth: AtomicUsize,
+    pub max_depth: AtomicUsize,
+    /// Highest number of registers in use on the register stack
+    pub max_registers: AtomicUsize,
+    pub reads: AtomicUsize,
+    pub writes: AtomicUsize
+}
+
+/// Values of all counters at one point in time
+#[derive(Clone, Copy, Default, Debug)]
+pub struct Snapshot {
+    pub instructions: usize,
+    pub calls: usize,
+    pub returns: usize,
+    pub tail_calls: usize,
+    pub depth: usize,
+    pub max_depth: usize,
+    pub max_registers: usize,
+    pub reads: usize,
+    pub writes: usize
+}
+
+impl Counters {
+    /// Read all counters.
+    pub fn snapshot(&self) -> Snapshot {
+        Snapshot {
+            instructions: self.instructions.load(Ordering::Relaxed),
+            calls: self.calls.load(Ordering::Relaxed),
+            returns: self.returns.load(Ordering::Relaxed),
+            tail_calls: self.tail_calls.load(Ordering::Relaxed),
+            depth: self.depth.load(Ordering::Relaxed),
+            max_depth: self.max_depth.load(Ordering::Relaxed),
+            max_registers: self.max_registers.load(Ordering::Relaxed),
+            reads: self.reads.load(Ordering::Relaxed),
+            writes: self.writes.load(Ordering::Relaxed)
+        }
+    }
+}
+
+/// Counters used while no file is published
+static LOCAL: Counters = Counters {
+    magic: AtomicUsize::new(MAGIC),
+    instructions: AtomicUsize::new(0),
+    calls: AtomicUsize::new(0),
+    returns: AtomicUsize::new(0),
+    tail_calls: AtomicUsize::new(0),
+    depth: AtomicUsize::new(0),
+    max_depth: AtomicUsize::new(0),
+    max_registers: AtomicUsize::new(0),
+    reads: AtomicUsize::new(0),
+    writes: AtomicUsize::new(0)
+};
+
+/// Published counters, null if the local counters are used
+static ACTIVE: AtomicPtr<Counters> = AtomicPtr::new(std::ptr::null_mut());
+
+/// Get the counters the VM currently updates.
+#[inline(always)]
+pub fn counters() -> &'static Counters {
+    let active = ACTIVE.load(Ordering::Relaxed);
+    if active.is_null() {
+        &LOCAL
+    } else {
+        unsafe { &*active }
+    }
+}
+
+/// Increment a counter. Counters only have a single writer, so a separate
+/// load and store is sufficient and avoids a locked instruction.
+#[inline(always)]
+fn bump(counter: &AtomicUsize) {
+    counter.store(counter.load(Ordering::Relaxed) + 1, Ordering::Relaxed);
+}
+
+/// Update the counters on a non-tail call.
+///
+/// # Arguments
+///
+/// * `instructions` - Instructions dispatched so far
+/// * `base` - Base register of the callee frame
+#[inline(always)]
+pub(super) fn count_call(instructions: usize, base: usize) {
+    let counters = counters();
+    counters.instructions.store(instructions, Ordering::Relaxed);
+    bump(&counters.calls);
+
+    let depth = base / 256;
+    counters.depth.store(depth, Ordering::Relaxed);
+    if depth > counters.max_depth.load(Ordering::Relaxed) {
+        counters.max_depth.store(depth, Ordering::Relaxed);
+        counters.max_registers.store(base + 256, Ordering::Relaxed);
+    }
+}
+
+/// Update the counters on a return.
+///
+/// # Arguments
+///
+/// * `instructions` - Instructions dispatched so far
+/// * `base` - Base register of the frame returned to
+#[inline(always)]
+pub(super) fn count_return(instructions: usize, base: usize) {
+    let counters = counters();
+    counters.instructions.store(instructions, Ordering::Relaxed);
+    bump(&counters.returns);
+    counters.depth.store(base / 256, Ordering::Relaxed);
+}
+
+/// Update the counters on a tail call.
+#[inline(always)]
+pub(super) fn count_tail_call(instructions: usize) {
+    let counters = counters();
+    counters.instructions.store(instructions, Ordering::Relaxed);
+    bump(&counters.tail_calls);
+}
+
+/// Update the counters on reading input.
+#[inline(always)]
+pub(super) fn count_read(instructions: usize) {
+    let counters = counters();
+    counters.instructions.store(instructions, Ordering::Relaxed);
+    bump(&counters.reads);
+}
+
+/// Update the counters on writing output.
+#[inline(always)]
+pub(super) fn count_write(instructions: usize) {
+    let counters = counters();
+    counters.instructions.store(instructions, Ordering::Relaxed);
+    bump(&counters.writes);
+}
+
+/// Publish the instruction count when a thread halts or is suspended.
+#[inline(always)]
+pub(super) fn count_halt(instructions: usize) {
+    counters().instructions.store(instructions, Ordering::Relaxed);
+}
+
+/// Counters in a memory mapped file, which lets other processes watch a
+/// running VM without interrupting it.
+pub struct CountersFile {
+    counters: *mut Counters,
+    published: bool
+}
+
+impl CountersFile {
+    /// Create a counters file, all counters starting at zero.
+    ///
+    /// # Arguments
+    ///
+    /// * `path` - Path of the file, an existing file is replaced
+    pub fn create<P: AsRef<Path>>(path: P) -> Result<CountersFile> {
+        let file = OpenOptions::new().read(true).write(true).create(true).truncate(true).open(path)?;
+        file.set_len(std::mem::size_of::<Counters>() as u64)?;
+        let file = CountersFile::map(&file, libc::PROT_READ | libc::PROT_WRITE)?;
+        file.counters().magic.store(MAGIC, Ordering::Release);
+        Ok(file)
+    }
+
+    /// Open the counters file of another process for reading.
+    ///
+    /// # Arguments
+    ///
+    /// * `path` - Path of the file
+    pub fn open<P: AsRef<Path>>(path: P) -> Result<CountersFile> {
+        let file = OpenOptions::new().read(true).open(path)?;
+        if file.metadata()?.len() < std::mem::size_of::<Counters>() as u64 {
+            return Err(Error::new(ErrorKind::InvalidData, "Not a counters file"));
+        }
+        let file = CountersFile::map(&file, libc::PROT_READ)?;
+        if file.counters().magic.load(Ordering::Acquire) != MAGIC {
+            return Err(Error::new(ErrorKind::InvalidData, "Not a counters file"));
+        }
+        Ok(file)
+    }
+
+    fn map(file: &std::fs::File, protection: libc::c_int) -> Result<CountersFile> {
+        let counters = unsafe {
+            libc::mmap(std::ptr::null_mut(),
+                       std::mem::size_of::<Counters>(),
+                       protection,
+                       libc::MAP_SHARED,
+                       file.as_raw_fd(),
+                       0)
+        };
+        if counters == libc::MAP_FAILED {
+            return Err(Error::last_os_error());
+        }
+        Ok(CountersFile {
+            counters: counters as *mut Counters,
+            published: false
+        })
+    }
+
+    /// Get the counters stored in the file.
+    pub fn counters(&self) -> &Counters {
+        unsafe { &*self.counters }
+    }
+
+    /// Let the VM update the counters in this file instead of process local
+    /// counters. The file has to be writable.
+    ///
+    /// # Remarks
+    ///
+    /// The counters are process wide, so they should only be published for a
+    /// single running thread. The file must not be dropped while a thread is
+    /// running.
+    pub fn publish(&mut self) {
+        ACTIVE.store(self.counters, Ordering::SeqCst);
+        self.published = true;
+    }
+}
+
+impl Drop for CountersFile {
+    fn drop(&mut self) {
+        if self.published {
+            ACTIVE.store(std::ptr::null_mut(), Ordering::SeqCst);
+        }
+        unsafe {
+            libc::munmap(self.counters as *mut libc::c_void, std::mem::size_of::<Counters>());
+        }
+    }
+}
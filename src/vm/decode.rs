@@ -0,0 +1,121 @@
+use std;
+use common::*;
+
+/// A pre-decoded instruction, as executed by the dispatch loop.
+///
+/// The handler address comes first, so dispatching is a single indirect jump
+/// through the instruction pointer. Register operands are pre-scaled to byte
+/// offsets relative to the frame pointer, immediates and constants are widened
+/// to 64 bit, and jump and call targets are absolute instruction pointers.
+#[repr(C)]
+#[derive(Clone, Copy)]
+pub(super) struct Decoded {
+    pub handler: usize,
+    pub opcode: u32,
+    pub target: i32,
+    pub left: i32,
+    pub right: i32,
+    pub immediate: i64
+}
+
+/// Convert a register number to a byte offset relative to the frame pointer.
+#[inline(always)]
+fn offset(r: usize) -> i32 {
+    (r * std::mem::size_of::<i64>()) as i32
+}
+
+/// Translate the code of a thread into a pre-decoded instruction stream.
+///
+/// # Arguments
+///
+/// * `thread` - Thread providing the code, the function table and constants
+/// * `handlers` - Handler address for each opcode
+///
+/// # Remarks
+///
+/// The stream is allocated up front, so absolute addresses of instructions
+/// are known while translating. The stream must not be resized afterwards.
+/// Superinstructions are decoded according to the instruction they start
+/// with, the following instructions are decoded on their own.
+pub(super) fn decode(thread: &Thread, handlers: &[usize; 256]) -> Vec<Decoded> {
+    let code = thread.code;
+    let mut decoded: Vec<Decoded> = Vec::with_capacity(code.len());
+    let start = decoded.as_ptr() as usize;
+
+    let address = |pc: usize| -> i64 {
+        if pc >= code.len() {
+            panic!("Invalid jump target 0x{:x}", pc);
+        }
+        (start + pc * std::mem::size_of::<Decoded>()) as i64
+    };
+
+    for (pc, instruction) in code.iter().enumerate() {
+        let target = instruction.target as usize;
+        let left = instruction.left as usize;
+        let right = instruction.right as usize;
+
+        let mut entry = Decoded {
+            handler: handlers[instruction.opcode as usize],
+            opcode: instruction.opcode as u32,
+            target: offset(target),
+            left: offset(left),
+            right: offset(right),
+            immediate: 0
+        };
+
+        match superops::base(instruction.opcode) {
+            ops::LD => {
+                entry.immediate = (left | right << 8) as u16 as i16 as i64;
+            }
+            ops::LDB | ops::LDS => {
+                entry.immediate = thread.constants[left | right << 8];
+            }
+            ops::LDR => {
+                entry.left = offset(reg::VAL as usize + 256);
+            }
+            ops::REC | ops::FLD | ops::WTH | ops::WRR | ops::CLO => {
+                entry.immediate = right as i64;
+            }
+            ops::CLI | ops::TLI => {
+                // The left operand is the number of arguments
+                entry.immediate = left as i64;
+            }
+            ops::CALLN => {
+                // The arguments follow the target, the right operand is
+                // their number
+                let function = match native_function(left as u8) {
+                    Some((function, arity)) if arity as usize == right => function,
+                    Some(_) => panic!("Native function {} takes other arguments", left),
+                    None => panic!("Native function {} is not registered", left)
+                };
+                entry.left = offset(target + 1);
+                entry.right = right as i32;
+                entry.immediate = function as usize as i64;
+            }
+            ops::MVO => {
+                entry.target = offset(target + right);
+            }
+            ops::CAL | ops::TLC => {
+                let function_index = target | left << 8 | right << 16;
+                entry.immediate = address(thread.functions[function_index] as usize);
+            }
+            ops::GEN => {
+                entry.immediate = address(thread.functions[left | right << 8] as usize);
+            }
+            ops::JMF => {
+                entry.immediate = address(pc + (target | left << 8 | right << 16));
+            }
+            ops::JMB => {
+                entry.immediate = address(pc - (target | left << 8 | right << 16));
+            }
+            ops::JTF | ops::JFF => {
+                entry.immediate = address(pc + (left | right << 8));
+            }
+            _ => {}
+        }
+
+        decoded.push(entry);
+    }
+
+    decoded
+}
@@ -1,9 +1,267 @@
 use std;
+use std::cmp;
+use std::io::{BufRead, Read};
 use common::*;
+use std::sync::atomic::Ordering;
+use super::bignum::Big;
+use super::decode::*;
+use super::files;
+use super::counters::*;
+use super::generator::{FRAME, Generator, Phase};
+use super::heap::{Heap, VECTOR_WORDS, bignum_words, string_words};
+use super::instrument::Attachment;
+use super::ints::Ints;
+use super::io::{Framing, Io, Output, Status, Suspension, framing};
+use super::sample;
+use super::trace::{Recorder, Trace};
+
+include!(concat!(env!("OUT_DIR"), "/superhandlers.rs"));
+
+/// Interpreter state which is live across all instruction handlers.
+///
+/// The dispatch loop keeps the instruction pointer and the frame pointer in
+/// fixed host registers (see the dispatch macros), so a register operand is a
+/// single load at a pre-scaled offset from the frame pointer.
+pub(super) struct State {
+    pub frame: *mut i64,
+    pub registers: *mut i64,
+    pub limit: *const i64,
+    /// Registers of frames which have been left may hold values up to here,
+    /// the registers above it and above the frame after the current one are
+    /// zero
+    pub dirty: *mut i64,
+    pub heap: *mut Heap,
+    /// Data section of the module, holding the string literals
+    pub data: *const [u8],
+    /// Function table of the module and the start of the decoded code, for
+    /// calling function values
+    pub functions: *const [u64],
+    pub code: *const Decoded,
+    /// Number of instructions dispatched, continuing the published count
+    pub instructions: usize,
+    /// Input and output of the host, the standard streams are used without
+    pub io: Option<*mut Io>,
+    /// Instruction halting the dispatch loop, where a suspended thread exits
+    pub exit: *const Decoded,
+    /// Reason of a suspension, with the instruction to continue at
+    pub suspension: Option<(Suspension, *const Decoded)>,
+    /// Framing of the integers read and written (see `set_framing`)
+    pub framing: (Framing, Framing),
+    /// Buffered output to stdout, if there is no host
+    pub stdout: Output
+}
 
-#[inline(never)]
+impl State {
+    /// Capture the register stack of a thread. The registers must not be
+    /// accessed through the thread while the state is being used.
+    pub(super) fn new(thread: &mut Thread) -> State {
+        let registers = thread.registers.as_mut_ptr();
+        unsafe {
+            State {
+                frame: registers.offset(thread.base as isize),
+                registers,
+                limit: registers.offset(thread.registers.len() as isize),
+                dirty: registers.offset(thread.registers.len() as isize),
+                heap: &mut thread.heap,
+                data: thread.data,
+                functions: thread.functions,
+                code: std::ptr::null(),
+                instructions: counters().instructions.load(Ordering::Relaxed),
+                io: None,
+                exit: std::ptr::null(),
+                suspension: None,
+                framing: framing(),
+                stdout: Output::default()
+            }
+        }
+    }
+
+    /// Base register of the current frame, relative to the register stack
+    pub(super) fn base(&self) -> usize {
+        (self.frame as usize - self.registers as usize) / std::mem::size_of::<i64>()
+    }
+
+    /// Registers of all frames up to the current one, which are the roots of
+    /// the heap
+    unsafe fn roots(&mut self) -> &mut [i64] {
+        let end = self.frame.offset(FRAME as isize);
+        self.roots_to(end)
+    }
+
+    /// Registers up to the given end, or up to the frames of the resident
+    /// generator if they end above
+    ///
+    /// # Remarks
+    ///
+    /// The registers above belong to frames which have been left. They are
+    /// cleared, as a collection does not update them, but they are roots
+    /// again once a call reuses their frame.
+    unsafe fn roots_to(&mut self, end: *mut i64) -> &mut [i64] {
+        let resident = self.registers.offset((*self.heap).resident_end() as isize);
+        let end = (end.max(resident) as *const i64).min(self.limit) as *mut i64;
+        let dirty = (self.dirty.max(self.frame.offset(2 * FRAME as isize)) as *const i64).min(self.limit);
+        if dirty > end {
+            let len = (dirty as usize - end as usize) / std::mem::size_of::<i64>();
+            std::ptr::write_bytes(end, 0, len);
+        }
+        self.dirty = end;
+        let len = (end as usize - self.registers as usize) / std::mem::size_of::<i64>();
+        std::slice::from_raw_parts_mut(self.registers, len)
+    }
+
+    /// Keep track of the registers the current frame and its callees may
+    /// have written, before leaving it
+    #[inline(always)]
+    unsafe fn leave_frame(&mut self) {
+        let end = self.frame.offset(2 * FRAME as isize);
+        if end > self.dirty {
+            self.dirty = end;
+        }
+    }
+
+    /// The whole register stack
+    unsafe fn stack(&self) -> &mut [i64] {
+        let len = (self.limit as usize - self.registers as usize) / std::mem::size_of::<i64>();
+        std::slice::from_raw_parts_mut(self.registers, len)
+    }
+
+    /// Move all return addresses and the instruction pointers of generators
+    /// by `offset` bytes. Suspending a thread makes them relative to the
+    /// start of the decoded code, which is decoded anew when it is resumed.
+    ///
+    /// # Remarks
+    ///
+    /// The return address register of a frame which is not in use holds no
+    /// address, but it is written before it is read again, so moving it is
+    /// harmless.
+    unsafe fn relocate(&mut self, offset: i64) {
+        let end = self.roots().len();
+        let stack = self.stack();
+        let mut frame = 0;
+        while frame < end {
+            stack[frame + reg::RET as usize] += offset;
+            frame += FRAME;
+        }
+        (*self.heap).relocate_generators(offset);
+    }
+
+    /// Leave the dispatch loop, the thread continues at the given
+    /// instruction once it is resumed.
+    unsafe fn suspend(&mut self, suspension: Suspension, pc: *const Decoded) -> *const Decoded {
+        self.suspension = Some((suspension, pc));
+        self.exit
+    }
+
+    #[inline(always)]
+    unsafe fn reg(&self, offset: i32) -> *mut i64 {
+        (self.frame as *mut u8).offset(offset as isize) as *mut i64
+    }
+}
+
+/// Execute a thread, starting at the given PC.
+///
+/// # Remarks
+///
+/// The code is translated into a pre-decoded, direct-threaded instruction
+/// stream first (see `decode`), which the dispatch loop runs on.
 pub fn run(thread: &mut Thread, entry_point: usize) {
-    let mut ops: [usize; 32] = [label_addr!("op_hlt"); 32];
+    execute(thread, entry_point, &mut [], None, None, false);
+}
+
+/// Execute a thread like `run`, reading and writing through the host instead
+/// of the standard streams.
+///
+/// # Arguments
+///
+/// * `thread` - The thread to be executed
+/// * `entry_point` - PC of the first instruction to be executed
+/// * `io` - Input and output of the host
+///
+/// # Remarks
+///
+/// Instead of blocking, the thread is suspended when the host has no input
+/// or can not take more output. The PC and the base register of the thread
+/// are saved in `thread`, so a single OS thread can multiplex many threads by
+/// resuming each once its I/O is ready.
+pub fn run_with_io(thread: &mut Thread, entry_point: usize, io: &mut Io) -> Status {
+    execute(thread, entry_point, &mut [], None, Some(io), false)
+}
+
+/// Continue a suspended thread, retrying the instruction it was suspended at.
+///
+/// # Arguments
+///
+/// * `thread` - The thread returned as suspended by `run_with_io` or `resume`
+/// * `io` - Input and output of the host
+pub fn resume(thread: &mut Thread, io: &mut Io) -> Status {
+    let pc = thread.pc;
+    execute(thread, pc, &mut [], None, Some(io), true)
+}
+
+/// Execute a thread like `run`, with instrumentation which can be switched on
+/// and off while the thread is running (see `set_instrumentation`).
+///
+/// # Arguments
+///
+/// * `thread` - The thread to be executed
+/// * `entry_point` - PC of the first instruction to be executed
+/// * `counts` - Execution count of each PC, incremented while instrumentation
+///              is on. Must have an entry for each instruction.
+///
+/// # Remarks
+///
+/// Only one thread can be instrumented at a time.
+pub fn run_instrumented(thread: &mut Thread, entry_point: usize, counts: &mut [u64]) {
+    assert!(counts.len() >= thread.code.len(), "Missing execution counters");
+    execute(thread, entry_point, counts, None, None, false);
+}
+
+/// Execute a thread like `run`, keeping a trace of the most recently executed
+/// instructions.
+///
+/// # Arguments
+///
+/// * `thread` - The thread to be executed
+/// * `entry_point` - PC of the first instruction to be executed
+/// * `trace` - Ring buffer the instructions are recorded in
+///
+/// # Remarks
+///
+/// Every instruction passes the instrumenting entry point, which records it
+/// with a few plain stores. If the thread panics, the trace is written to
+/// stderr with the disassembly of each instruction. Otherwise it can be
+/// inspected once the thread halts.
+pub fn run_traced(thread: &mut Thread, entry_point: usize, trace: &mut Trace) {
+    execute(thread, entry_point, &mut [], Some(trace), None, false);
+}
+
+/// The dispatch loop. All handlers are labels within this function, so it
+/// must never be inlined.
+///
+/// # Remarks
+///
+/// Instrumentation uses a second entry point for all instructions, which
+/// does the counting and then jumps to the regular handler. Switching it on
+/// points the handler of every instruction to that entry point, switching it
+/// off restores the regular handlers. Without counters, the stream is never
+/// instrumented. The entry point continues at the first component of a
+/// superinstruction, so while instrumented, every instruction is executed
+/// on its own and counted at its own PC.
+///
+/// A traced stream is instrumented from the start and cannot be switched.
+///
+/// A suspending handler continues at a halting instruction outside of the
+/// stream, so suspending costs nothing on the paths which do not suspend.
+/// `resumed` is set when continuing a suspended thread, whose return
+/// addresses are relative to the start of the code.
+#[inline(never)]
+fn execute(thread: &mut Thread,
+           entry_point: usize,
+           counts: &mut [u64],
+           trace: Option<&mut Trace>,
+           io: Option<&mut Io>,
+           resumed: bool) -> Status {
+    let mut ops: [usize; 256] = [label_addr!("op_hlt"); 256];
 
     ops[ops::HLT as usize] = label_addr!("op_hlt");
     ops[ops::LD  as usize] = label_addr!("op_ld");
@@ -32,520 +290,1905 @@ pub fn run(thread: &mut Thread, entry_point: usize) {
     ops[ops::JTF as usize] = label_addr!("op_jtf");
     ops[ops::WRI as usize] = label_addr!("op_wri");
     ops[ops::RDI as usize] = label_addr!("op_rdi");
+    ops[ops::JFF as usize] = label_addr!("op_jff");
+    ops[ops::CONS as usize] = label_addr!("op_cons");
+    ops[ops::CAR as usize] = label_addr!("op_car");
+    ops[ops::CDR as usize] = label_addr!("op_cdr");
+    ops[ops::NIL as usize] = label_addr!("op_nil");
+    ops[ops::MAP as usize] = label_addr!("op_map");
+    ops[ops::GET as usize] = label_addr!("op_get");
+    ops[ops::PUT as usize] = label_addr!("op_put");
+    ops[ops::HAS as usize] = label_addr!("op_has");
+    ops[ops::SIZE as usize] = label_addr!("op_size");
+    ops[ops::LDS as usize] = label_addr!("op_lds");
+    ops[ops::BUF as usize] = label_addr!("op_buf");
+    ops[ops::APP as usize] = label_addr!("op_app");
+    ops[ops::STR as usize] = label_addr!("op_str");
+    ops[ops::SLC as usize] = label_addr!("op_slc");
+    ops[ops::BYT as usize] = label_addr!("op_byt");
+    ops[ops::CMP as usize] = label_addr!("op_cmp");
+    ops[ops::HSH as usize] = label_addr!("op_hsh");
+    ops[ops::WRB as usize] = label_addr!("op_wrb");
+    ops[ops::RDL as usize] = label_addr!("op_rdl");
+    ops[ops::REC as usize] = label_addr!("op_rec");
+    ops[ops::FLD as usize] = label_addr!("op_fld");
+    ops[ops::WTH as usize] = label_addr!("op_wth");
+    ops[ops::VEC as usize] = label_addr!("op_vec");
+    ops[ops::VGT as usize] = label_addr!("op_vgt");
+    ops[ops::VPS as usize] = label_addr!("op_vps");
+    ops[ops::VAS as usize] = label_addr!("op_vas");
+    ops[ops::VLN as usize] = label_addr!("op_vln");
+    ops[ops::RDN as usize] = label_addr!("op_rdn");
+    ops[ops::GEN as usize] = label_addr!("op_gen");
+    ops[ops::RSM as usize] = label_addr!("op_rsm");
+    ops[ops::FIN as usize] = label_addr!("op_fin");
+    ops[ops::YLD as usize] = label_addr!("op_yld");
+    ops[ops::OPN as usize] = label_addr!("op_opn");
+    ops[ops::FRD as usize] = label_addr!("op_frd");
+    ops[ops::FWR as usize] = label_addr!("op_fwr");
+    ops[ops::CLS as usize] = label_addr!("op_cls");
+    ops[ops::IMP as usize] = label_addr!("op_imp");
+    ops[ops::IPR as usize] = label_addr!("op_ipr");
+    ops[ops::IGT as usize] = label_addr!("op_igt");
+    ops[ops::IAD as usize] = label_addr!("op_iad");
+    ops[ops::IGU as usize] = label_addr!("op_igu");
+    ops[ops::RDR as usize] = label_addr!("op_rdr");
+    ops[ops::WRR as usize] = label_addr!("op_wrr");
+    ops[ops::CALLN as usize] = label_addr!("op_calln");
+    ops[ops::MOD as usize] = label_addr!("op_mod");
+    ops[ops::POW as usize] = label_addr!("op_pow");
+    ops[ops::GCD as usize] = label_addr!("op_gcd");
+    ops[ops::MIN as usize] = label_addr!("op_min");
+    ops[ops::MAX as usize] = label_addr!("op_max");
+    ops[ops::ABS as usize] = label_addr!("op_abs");
+    ops[ops::SQRT as usize] = label_addr!("op_sqrt");
+    ops[ops::PCNT as usize] = label_addr!("op_pcnt");
+    ops[ops::CLZ as usize] = label_addr!("op_clz");
+    ops[ops::CTZ as usize] = label_addr!("op_ctz");
+    ops[ops::CLO as usize] = label_addr!("op_clo");
+    ops[ops::CLI as usize] = label_addr!("op_cli");
+    ops[ops::TLI as usize] = label_addr!("op_tli");
+    superinstruction_addresses!(ops);
+
+    let mut unfused = ops;
+    for opcode in superops::FIRST as usize..256 {
+        unfused[opcode] = ops[superops::base(opcode as Opcode) as usize];
+    }
+
+    let hook = label_addr!("op_instrument");
+    let hooks = [hook; 256];
+    let mut code = decode(thread, if trace.is_some() { &hooks } else { &ops });
+    let start = code.as_ptr() as usize;
+    sample::START.store(start, Ordering::Relaxed);
+    let _attachment = if counts.is_empty() || trace.is_some() {
+        None
+    } else {
+        Some(Attachment::new(&mut code, &ops, hook))
+    };
+    let counting = !counts.is_empty();
+    let exit = Decoded {
+        handler: label_addr!("op_hlt"),
+        opcode: ops::HLT as u32,
+        target: 0,
+        left: 0,
+        right: 0,
+        immediate: 0
+    };
+    let mut state = State::new(thread);
+    state.exit = &exit;
+    state.code = code.as_ptr();
+    // The host outlives the loop, its lifetime is only erased to keep the
+    // state free of lifetimes
+    state.io = io.map(|io| unsafe { std::mem::transmute::<&mut Io, *mut Io>(io) });
+    if resumed {
+        unsafe { state.relocate(start as i64) };
+    }
+    let mut recorder = trace.map(|trace| Recorder::new(trace, thread, code.as_ptr(), state.registers));
+    let mut pc: *const Decoded = unsafe { code.as_ptr().offset(entry_point as isize) };
+
+    dispatch!(state, pc);
+
+    do_and_dispatch!(state, "op_ld", pc, {
+        pc = op_ld(&mut state, pc);
+    });
+
+    do_and_dispatch!(state, "op_ldb", pc, {
+        pc = op_ldb(&mut state, pc);
+    });
+
+    do_and_dispatch!(state, "op_ldr", pc, {
+        pc = op_ldr(&mut state, pc);
+    });
+
+    do_and_dispatch!(state, "op_add", pc, {
+        pc = op_add(&mut state, pc);
+    });
+
+    do_and_dispatch!(state, "op_sub", pc, {
+        pc = op_sub(&mut state, pc);
+    });
+
+    do_and_dispatch!(state, "op_mul", pc, {
+        pc = op_mul(&mut state, pc);
+    });
+
+    do_and_dispatch!(state, "op_div", pc, {
+        pc = op_div(&mut state, pc);
+    });
+
+    do_and_dispatch!(state, "op_and", pc, {
+        pc = op_and(&mut state, pc);
+    });
+
+    do_and_dispatch!(state, "op_or", pc, {
+        pc = op_or(&mut state, pc);
+    });
+
+    do_and_dispatch!(state, "op_not", pc, {
+        pc = op_not(&mut state, pc);
+    });
+
+    do_and_dispatch!(state, "op_eq", pc, {
+        pc = op_eq(&mut state, pc);
+    });
+
+    do_and_dispatch!(state, "op_lt", pc, {
+        pc = op_lt(&mut state, pc);
+    });
+
+    do_and_dispatch!(state, "op_le", pc, {
+        pc = op_le(&mut state, pc);
+    });
+
+    do_and_dispatch!(state, "op_gt", pc, {
+        pc = op_gt(&mut state, pc);
+    });
+
+    do_and_dispatch!(state, "op_ge", pc, {
+        pc = op_ge(&mut state, pc);
+    });
+
+    do_and_dispatch!(state, "op_neq", pc, {
+        pc = op_neq(&mut state, pc);
+    });
+
+    do_and_dispatch!(state, "op_cal", pc, {
+        pc = op_cal(&mut state, pc);
+    });
+
+    do_and_dispatch!(state, "op_tlc", pc, {
+        pc = op_tlc(&mut state, pc);
+    });
+
+    do_and_dispatch!(state, "op_ret", pc, {
+        pc = op_ret(&mut state, pc);
+    });
+
+    do_and_dispatch!(state, "op_mov", pc, {
+        pc = op_mov(&mut state, pc);
+    });
+
+    do_and_dispatch!(state, "op_mvo", pc, {
+        pc = op_mvo(&mut state, pc);
+    });
+
+    do_and_dispatch!(state, "op_jmf", pc, {
+        pc = op_jmf(&mut state, pc);
+    });
+
+    do_and_dispatch!(state, "op_jmb", pc, {
+        pc = op_jmb(&mut state, pc);
+    });
+
+    do_and_dispatch!(state, "op_jtf", pc, {
+        pc = op_jtf(&mut state, pc);
+    });
+
+    do_and_dispatch!(state, "op_jff", pc, {
+        pc = op_jff(&mut state, pc);
+    });
+
+    do_and_dispatch!(state, "op_wri", pc, {
+        pc = op_wri(&mut state, pc);
+    });
+
+    do_and_dispatch!(state, "op_rdi", pc, {
+        pc = op_rdi(&mut state, pc);
+    });
+
+    do_and_dispatch!(state, "op_cons", pc, {
+        pc = op_cons(&mut state, pc);
+    });
+
+    do_and_dispatch!(state, "op_car", pc, {
+        pc = op_car(&mut state, pc);
+    });
+
+    do_and_dispatch!(state, "op_cdr", pc, {
+        pc = op_cdr(&mut state, pc);
+    });
+
+    do_and_dispatch!(state, "op_nil", pc, {
+        pc = op_nil(&mut state, pc);
+    });
+
+    do_and_dispatch!(state, "op_map", pc, {
+        pc = op_map(&mut state, pc);
+    });
+
+    do_and_dispatch!(state, "op_get", pc, {
+        pc = op_get(&mut state, pc);
+    });
+
+    do_and_dispatch!(state, "op_put", pc, {
+        pc = op_put(&mut state, pc);
+    });
+
+    do_and_dispatch!(state, "op_has", pc, {
+        pc = op_has(&mut state, pc);
+    });
+
+    do_and_dispatch!(state, "op_size", pc, {
+        pc = op_size(&mut state, pc);
+    });
+
+    do_and_dispatch!(state, "op_lds", pc, {
+        pc = op_lds(&mut state, pc);
+    });
+
+    do_and_dispatch!(state, "op_buf", pc, {
+        pc = op_buf(&mut state, pc);
+    });
+
+    do_and_dispatch!(state, "op_app", pc, {
+        pc = op_app(&mut state, pc);
+    });
+
+    do_and_dispatch!(state, "op_str", pc, {
+        pc = op_str(&mut state, pc);
+    });
+
+    do_and_dispatch!(state, "op_slc", pc, {
+        pc = op_slc(&mut state, pc);
+    });
+
+    do_and_dispatch!(state, "op_byt", pc, {
+        pc = op_byt(&mut state, pc);
+    });
+
+    do_and_dispatch!(state, "op_cmp", pc, {
+        pc = op_cmp(&mut state, pc);
+    });
+
+    do_and_dispatch!(state, "op_hsh", pc, {
+        pc = op_hsh(&mut state, pc);
+    });
+
+    do_and_dispatch!(state, "op_wrb", pc, {
+        pc = op_wrb(&mut state, pc);
+    });
+
+    do_and_dispatch!(state, "op_rdl", pc, {
+        pc = op_rdl(&mut state, pc);
+    });
+
+    do_and_dispatch!(state, "op_rec", pc, {
+        pc = op_rec(&mut state, pc);
+    });
+
+    do_and_dispatch!(state, "op_fld", pc, {
+        pc = op_fld(&mut state, pc);
+    });
+
+    do_and_dispatch!(state, "op_wth", pc, {
+        pc = op_wth(&mut state, pc);
+    });
+
+    do_and_dispatch!(state, "op_vec", pc, {
+        pc = op_vec(&mut state, pc);
+    });
+
+    do_and_dispatch!(state, "op_vgt", pc, {
+        pc = op_vgt(&mut state, pc);
+    });
+
+    do_and_dispatch!(state, "op_vps", pc, {
+        pc = op_vps(&mut state, pc);
+    });
+
+    do_and_dispatch!(state, "op_vas", pc, {
+        pc = op_vas(&mut state, pc);
+    });
+
+    do_and_dispatch!(state, "op_vln", pc, {
+        pc = op_vln(&mut state, pc);
+    });
+
+    do_and_dispatch!(state, "op_rdn", pc, {
+        pc = op_rdn(&mut state, pc);
+    });
+
+    do_and_dispatch!(state, "op_gen", pc, {
+        pc = op_gen(&mut state, pc);
+    });
 
-    let mut pc: usize = entry_point;
+    do_and_dispatch!(state, "op_rsm", pc, {
+        pc = op_rsm(&mut state, pc);
+    });
 
-    dispatch!(&thread, pc, ops);
+    do_and_dispatch!(state, "op_fin", pc, {
+        pc = op_fin(&mut state, pc);
+    });
 
-    do_and_dispatch!(&thread, ops, "op_ld", pc, {
-        pc = op_ld(thread, pc);
+    do_and_dispatch!(state, "op_yld", pc, {
+        pc = op_yld(&mut state, pc);
     });
 
-    do_and_dispatch!(&thread, ops, "op_ldb", pc, {
-        pc = op_ldb(thread, pc);
+    do_and_dispatch!(state, "op_opn", pc, {
+        pc = op_opn(&mut state, pc);
     });
 
-    do_and_dispatch!(&thread, ops, "op_ldr", pc, {
-        pc = op_ldr(thread, pc);
+    do_and_dispatch!(state, "op_frd", pc, {
+        pc = op_frd(&mut state, pc);
     });
 
-    do_and_dispatch!(&thread, ops, "op_add", pc, {
-        pc = op_add(thread, pc);
+    do_and_dispatch!(state, "op_fwr", pc, {
+        pc = op_fwr(&mut state, pc);
     });
 
-    do_and_dispatch!(&thread, ops, "op_sub", pc, {
-        pc = op_sub(thread, pc);
+    do_and_dispatch!(state, "op_cls", pc, {
+        pc = op_cls(&mut state, pc);
     });
 
-    do_and_dispatch!(&thread, ops, "op_mul", pc, {
-        pc = op_mul(thread, pc);
+    do_and_dispatch!(state, "op_imp", pc, {
+        pc = op_imp(&mut state, pc);
     });
 
-    do_and_dispatch!(&thread, ops, "op_div", pc, {
-        pc = op_div(thread, pc);
+    do_and_dispatch!(state, "op_ipr", pc, {
+        pc = op_ipr(&mut state, pc);
     });
 
-    do_and_dispatch!(&thread, ops, "op_and", pc, {
-        pc = op_and(thread, pc);
+    do_and_dispatch!(state, "op_igt", pc, {
+        pc = op_igt(&mut state, pc);
     });
 
-    do_and_dispatch!(&thread, ops, "op_or", pc, {
-        pc = op_or(thread, pc);
+    do_and_dispatch!(state, "op_iad", pc, {
+        pc = op_iad(&mut state, pc);
     });
 
-    do_and_dispatch!(&thread, ops, "op_not", pc, {
-        pc = op_not(thread, pc);
+    do_and_dispatch!(state, "op_igu", pc, {
+        pc = op_igu(&mut state, pc);
     });
 
-    do_and_dispatch!(&thread, ops, "op_eq", pc, {
-        pc = op_eq(thread, pc);
+    do_and_dispatch!(state, "op_rdr", pc, {
+        pc = op_rdr(&mut state, pc);
     });
 
-    do_and_dispatch!(&thread, ops, "op_lt", pc, {
-        pc = op_lt(thread, pc);
+    do_and_dispatch!(state, "op_wrr", pc, {
+        pc = op_wrr(&mut state, pc);
     });
 
-    do_and_dispatch!(&thread, ops, "op_le", pc, {
-        pc = op_le(thread, pc);
+    do_and_dispatch!(state, "op_calln", pc, {
+        pc = op_calln(&mut state, pc);
     });
 
-    do_and_dispatch!(&thread, ops, "op_gt", pc, {
-        pc = op_gt(thread, pc);
+    do_and_dispatch!(state, "op_mod", pc, {
+        pc = op_mod(&mut state, pc);
     });
 
-    do_and_dispatch!(&thread, ops, "op_ge", pc, {
-        pc = op_ge(thread, pc);
+    do_and_dispatch!(state, "op_pow", pc, {
+        pc = op_pow(&mut state, pc);
     });
 
-    do_and_dispatch!(&thread, ops, "op_neq", pc, {
-        pc = op_neq(thread, pc);
+    do_and_dispatch!(state, "op_gcd", pc, {
+        pc = op_gcd(&mut state, pc);
     });
 
-    do_and_dispatch!(&thread, ops, "op_cal", pc, {
-        pc = op_cal(thread, pc);
+    do_and_dispatch!(state, "op_min", pc, {
+        pc = op_min(&mut state, pc);
     });
 
-    do_and_dispatch!(&thread, ops, "op_tlc", pc, {
-        pc = op_tlc(thread, pc);
+    do_and_dispatch!(state, "op_max", pc, {
+        pc = op_max(&mut state, pc);
     });
 
-    do_and_dispatch!(&thread, ops, "op_ret", pc, {
-        pc = op_ret(thread)
+    do_and_dispatch!(state, "op_abs", pc, {
+        pc = op_abs(&mut state, pc);
     });
 
-    do_and_dispatch!(&thread, ops, "op_mov", pc, {
-        pc = op_mov(thread, pc);
+    do_and_dispatch!(state, "op_sqrt", pc, {
+        pc = op_sqrt(&mut state, pc);
     });
 
-    do_and_dispatch!(&thread, ops, "op_mvo", pc, {
-        pc = op_mvo(thread, pc);
+    do_and_dispatch!(state, "op_pcnt", pc, {
+        pc = op_pcnt(&mut state, pc);
     });
 
-    do_and_dispatch!(&thread, ops, "op_jmf", pc, {
-        pc = op_jmf(thread, pc);
+    do_and_dispatch!(state, "op_clz", pc, {
+        pc = op_clz(&mut state, pc);
     });
 
-    do_and_dispatch!(&thread, ops, "op_jmb", pc, {
-        pc = op_jmb(thread, pc);
+    do_and_dispatch!(state, "op_ctz", pc, {
+        pc = op_ctz(&mut state, pc);
     });
 
-    do_and_dispatch!(&thread, ops, "op_jtf", pc, {
-        pc = op_jtf(thread, pc);
+    do_and_dispatch!(state, "op_clo", pc, {
+        pc = op_clo(&mut state, pc);
     });
 
-    do_and_dispatch!(&thread, ops, "op_wri", pc, {
-        pc = op_wri(thread, pc);
+    do_and_dispatch!(state, "op_cli", pc, {
+        pc = op_cli(&mut state, pc);
     });
 
-    do_and_dispatch!(&thread, ops, "op_rdi", pc, {
-        pc = op_rdi(thread, pc);
+    do_and_dispatch!(state, "op_tli", pc, {
+        pc = op_tli(&mut state, pc);
     });
 
-    label!("op_hlt");
+    superinstruction_handlers!(state, pc);
+
+    do_and_dispatch_via!(state, "op_instrument", pc, unfused, {
+        if counting {
+            let index = (pc as usize - start) / std::mem::size_of::<Decoded>();
+            *counts.get_unchecked_mut(index) += 1;
+        }
+        if let Some(ref mut recorder) = recorder {
+            recorder.record(pc, state.frame);
+        }
+    });
+
+    exit_label!(state, "op_hlt", pc);
+    count_halt(state.instructions);
+    thread.base = state.base();
+    match state.suspension {
+        Some((suspension, pc)) => {
+            unsafe { state.relocate(-(start as i64)) };
+            thread.pc = (pc as usize - start) / std::mem::size_of::<Decoded>();
+            Status::Suspended(suspension)
+        }
+        None => Status::Halted
+    }
+}
+
+#[inline(always)]
+pub(super) unsafe fn op_ld(state: &mut State, pc: *const Decoded) -> *const Decoded {
+    let instruction = &*pc;
+    *state.reg(instruction.target) = instruction.immediate;
+    pc.offset(1)
 }
 
+/// Constants are resolved when decoding, so this is the same as `op_ld`
 #[inline(always)]
-fn op_ld(thread: &mut Thread, pc: usize) -> usize {
-    let code = &thread.code;
-    let registers = &mut thread.registers;
-    unsafe {
-        let instruction = code.get_unchecked(pc);
-        let number = instruction.left as u16 | (instruction.right as u16) << 8;
+pub(super) unsafe fn op_ldb(state: &mut State, pc: *const Decoded) -> *const Decoded {
+    op_ld(state, pc)
+}
 
-        let r = instruction.target as usize + thread.base;
-        *registers.get_unchecked_mut(r) = number as i64;
-    }
-    pc + 1
+#[inline(always)]
+pub(super) unsafe fn op_ldr(state: &mut State, pc: *const Decoded) -> *const Decoded {
+    let instruction = &*pc;
+    *state.reg(instruction.target) = *state.reg(instruction.left);
+    pc.offset(1)
 }
 
+/// Check whether an operand or the result of an arithmetic instruction is
+/// a reference rather than an integer in a register, which is the case for
+/// bignums and for results overlapping the reference tag.
 #[inline(always)]
-fn op_ldb(thread: &mut Thread, pc: usize) -> usize {
-    let constants = &thread.constants;
-    let code = &thread.code;
-    let registers = &mut thread.registers;
-    unsafe {
-        let instruction = code.get_unchecked(pc);
-        let index = instruction.left as u16 | (instruction.right as u16) << 8;
-        let c = *constants.get_unchecked(index as usize);
+fn is_big(left: i64, right: i64, result: i64) -> bool {
+    values::is_ref(left) | values::is_ref(right) | values::is_ref(result)
+}
+
+/// Slow path of the arithmetic instructions, for operands or results which
+/// do not fit into a register. The result is stored as a bignum unless it
+/// fits after all. ABS and SQRT ignore the right operand.
+#[cold]
+#[inline(never)]
+unsafe fn big_arithmetic(state: &mut State, opcode: Opcode, left: i64, right: i64) -> i64 {
+    let heap = &mut *state.heap;
+    let result = {
+        let left = heap.integer(left);
+        let right = heap.integer(right);
+        match opcode {
+            ops::ADD => left.add(&right),
+            ops::SUB => left.sub(&right),
+            ops::MUL => left.mul(&right),
+            ops::DIV => left.div_rem(&right).0,
+            ops::MOD => {
+                let remainder = left.div_rem(&right).1;
+                if remainder.negative && !right.negative { remainder.add(&right) } else { remainder }
+            }
+            ops::POW => {
+                if right.negative {
+                    panic!("Negative exponent {}", right);
+                }
+                match right.to_i64() {
+                    Some(exponent) => left.pow(exponent as u64),
+                    None => panic!("Exponent too large: {}", right)
+                }
+            }
+            ops::GCD => {
+                let (mut a, mut b) = (left.abs(), right.abs());
+                while !b.magnitude.is_empty() {
+                    let remainder = a.div_rem(&b).1;
+                    a = b;
+                    b = remainder;
+                }
+                a
+            }
+            ops::SQRT => {
+                if left.negative {
+                    panic!("Square root of negative number {}", left);
+                }
+                left.isqrt()
+            }
+            _ => left.abs()
+        }
+    };
+    store_big(state, &result)
+}
+
+/// Slow path of the bit counts, for bignum operands. Bignums which fit into
+/// 64 bits are counted like integers in a register. Larger ones have no
+/// fixed width, so only their trailing zeros and the set bits of positive
+/// ones are counted.
+#[cold]
+#[inline(never)]
+unsafe fn big_bits(state: &mut State, opcode: Opcode, value: i64) -> i64 {
+    let big = (*state.heap).integer(value);
+    let count = match (big.to_i64(), opcode) {
+        (Some(value), ops::PCNT) => value.count_ones() as u64,
+        (Some(value), ops::CLZ) => value.leading_zeros() as u64,
+        (Some(value), _) => value.trailing_zeros() as u64,
+        (None, ops::PCNT) if !big.negative => big.count_ones(),
+        (None, ops::CTZ) => big.trailing_zeros(),
+        (None, ops::PCNT) => panic!("popcount is not supported for negative bignums: {}", big),
+        (None, _) => panic!("clz is not supported for bignums: {}", big)
+    };
+    count as i64
+}
 
-        let r = instruction.target as usize + thread.base;
-        *registers.get_unchecked_mut(r) = c;
+/// Store an integer, as a bignum if it does not fit into a register.
+unsafe fn store_big(state: &mut State, big: &Big) -> i64 {
+    let heap = &mut *state.heap;
+    if !heap.has_room(bignum_words(big.magnitude.len())) {
+        heap.make_room(state.roots());
     }
-    pc + 1
+    heap.make_integer(big)
 }
 
+/// Check an integer which was not computed by the arithmetic instructions,
+/// like one read from the input. Integers overlapping the reference tag are
+/// promoted to bignums, so they are never taken for references.
 #[inline(always)]
-fn op_ldr(thread: &mut Thread, pc: usize) -> usize {
-    let code = &thread.code;
-    let registers = &mut thread.registers;
-    unsafe {
-        let r = code.get_unchecked(pc).target as usize + thread.base;
-        let rval = *registers.get_unchecked(reg::VAL as usize + thread.base + 256);
-        *registers.get_unchecked_mut(r) = rval;
+unsafe fn checked_integer(state: &mut State, value: i64) -> i64 {
+    if values::is_ref(value) { promote(state, value) } else { value }
+}
+
+#[cold]
+#[inline(never)]
+unsafe fn promote(state: &mut State, value: i64) -> i64 {
+    store_big(state, &Big::from_i64(value))
+}
+
+/// Slow path of the ordering comparisons, for bignum operands. Other
+/// references are not integers and panic.
+#[cold]
+#[inline(never)]
+unsafe fn big_compare(state: &mut State, left: i64, right: i64) -> cmp::Ordering {
+    let heap = &*state.heap;
+    heap.integer(left).cmp(&heap.integer(right))
+}
+
+/// Slow path of `==` and `!=` for two different references, bignums are
+/// equal by value and other references only to themselves. Bignums never
+/// equal an integer in a register.
+#[cold]
+#[inline(never)]
+unsafe fn big_equal(state: &mut State, left: i64, right: i64) -> bool {
+    (*state.heap).equal(left, right)
+}
+
+#[inline(always)]
+pub(super) unsafe fn op_add(state: &mut State, pc: *const Decoded) -> *const Decoded {
+    let instruction = &*pc;
+    let left = *state.reg(instruction.left);
+    let right = *state.reg(instruction.right);
+    let (sum, overflow) = left.overflowing_add(right);
+    *state.reg(instruction.target) = if overflow | is_big(left, right, sum) {
+        big_arithmetic(state, ops::ADD, left, right)
+    } else {
+        sum
+    };
+    pc.offset(1)
+}
+
+#[inline(always)]
+pub(super) unsafe fn op_sub(state: &mut State, pc: *const Decoded) -> *const Decoded {
+    let instruction = &*pc;
+    let left = *state.reg(instruction.left);
+    let right = *state.reg(instruction.right);
+    let (difference, overflow) = left.overflowing_sub(right);
+    *state.reg(instruction.target) = if overflow | is_big(left, right, difference) {
+        big_arithmetic(state, ops::SUB, left, right)
+    } else {
+        difference
+    };
+    pc.offset(1)
+}
+
+#[inline(always)]
+pub(super) unsafe fn op_mul(state: &mut State, pc: *const Decoded) -> *const Decoded {
+    let instruction = &*pc;
+    let left = *state.reg(instruction.left);
+    let right = *state.reg(instruction.right);
+    let (product, overflow) = left.overflowing_mul(right);
+    *state.reg(instruction.target) = if overflow | is_big(left, right, product) {
+        big_arithmetic(state, ops::MUL, left, right)
+    } else {
+        product
+    };
+    pc.offset(1)
+}
+
+#[inline(always)]
+pub(super) unsafe fn op_div(state: &mut State, pc: *const Decoded) -> *const Decoded {
+    let instruction = &*pc;
+    let left = *state.reg(instruction.left);
+    let right = *state.reg(instruction.right);
+    let (quotient, overflow) = left.overflowing_div(right);
+    *state.reg(instruction.target) = if overflow | is_big(left, right, quotient) {
+        big_arithmetic(state, ops::DIV, left, right)
+    } else {
+        quotient
+    };
+    pc.offset(1)
+}
+
+/// The result is never negative, unless the divisor is
+#[inline(always)]
+pub(super) unsafe fn op_mod(state: &mut State, pc: *const Decoded) -> *const Decoded {
+    let instruction = &*pc;
+    let left = *state.reg(instruction.left);
+    let right = *state.reg(instruction.right);
+    let (remainder, overflow) = left.overflowing_rem(right);
+    *state.reg(instruction.target) = if overflow | is_big(left, right, remainder) {
+        big_arithmetic(state, ops::MOD, left, right)
+    } else if remainder < 0 && right > 0 {
+        remainder + right
+    } else {
+        remainder
+    };
+    pc.offset(1)
+}
+
+/// Exponentiation by squaring, promoted to a bignum on overflow
+#[inline(always)]
+pub(super) unsafe fn op_pow(state: &mut State, pc: *const Decoded) -> *const Decoded {
+    let instruction = &*pc;
+    let left = *state.reg(instruction.left);
+    let right = *state.reg(instruction.right);
+    if right < 0 {
+        panic!("Negative exponent {}", right);
+    }
+    let (mut base, mut exponent) = (left, right);
+    let mut result: i64 = 1;
+    let mut overflow = false;
+    while exponent > 0 {
+        if exponent & 1 != 0 {
+            let (product, carry) = result.overflowing_mul(base);
+            result = product;
+            overflow |= carry;
+        }
+        exponent >>= 1;
+        if exponent > 0 {
+            let (square, carry) = base.overflowing_mul(base);
+            base = square;
+            overflow |= carry;
+        }
     }
-    pc + 1
+    *state.reg(instruction.target) = if overflow | is_big(left, right, result) {
+        big_arithmetic(state, ops::POW, left, right)
+    } else {
+        result
+    };
+    pc.offset(1)
 }
 
+/// Binary GCD, which strips common factors of two with `tzcnt` instead of
+/// dividing
 #[inline(always)]
-fn op_add(thread: &mut Thread, pc: usize) -> usize {
-    let code = &thread.code;
-    let registers = &mut thread.registers;
-    unsafe {
-        let instruction = code.get_unchecked(pc);
-        let rl = instruction.left as usize + thread.base;
-        let rr = instruction.right as usize + thread.base;
-        let r = instruction.target as usize + thread.base;
-        let left = *registers.get_unchecked(rl);
-        let right = *registers.get_unchecked(rr);
-        *registers.get_unchecked_mut(r) = left + right;
+pub(super) unsafe fn op_gcd(state: &mut State, pc: *const Decoded) -> *const Decoded {
+    let instruction = &*pc;
+    let left = *state.reg(instruction.left);
+    let right = *state.reg(instruction.right);
+    let mut a = magnitude(left);
+    let mut b = magnitude(right);
+    let result = if a == 0 || b == 0 {
+        a | b
+    } else {
+        let shift = (a | b).trailing_zeros();
+        a >>= a.trailing_zeros();
+        while b != 0 {
+            b >>= b.trailing_zeros();
+            if a > b {
+                std::mem::swap(&mut a, &mut b);
+            }
+            b -= a;
+        }
+        a << shift
+    } as i64;
+    // The result is 2^63 for the magnitude of the smallest integer
+    *state.reg(instruction.target) = if is_big(left, right, result) | (result < 0) {
+        big_arithmetic(state, ops::GCD, left, right)
+    } else {
+        result
+    };
+    pc.offset(1)
+}
+
+/// Get the absolute value of an integer, which does not overflow.
+#[inline(always)]
+fn magnitude(value: i64) -> u64 {
+    if value < 0 { (value as u64).wrapping_neg() } else { value as u64 }
+}
+
+/// Get the square root of an integer rounded down, correcting the floating
+/// point estimate.
+#[inline(always)]
+fn isqrt(value: i64) -> i64 {
+    if value < 0 {
+        panic!("Square root of negative number {}", value);
+    }
+    let value = value as u64;
+    let mut root = (value as f64).sqrt() as u64;
+    while root * root > value {
+        root -= 1;
     }
-    pc + 1
+    while (root + 1) * (root + 1) <= value {
+        root += 1;
+    }
+    root as i64
+}
+
+#[inline(always)]
+pub(super) unsafe fn op_min(state: &mut State, pc: *const Decoded) -> *const Decoded {
+    let instruction = &*pc;
+    let left = *state.reg(instruction.left);
+    let right = *state.reg(instruction.right);
+    *state.reg(instruction.target) = if values::is_ref(left) | values::is_ref(right) {
+        if big_compare(state, left, right) == cmp::Ordering::Greater { right } else { left }
+    } else {
+        cmp::min(left, right)
+    };
+    pc.offset(1)
+}
+
+#[inline(always)]
+pub(super) unsafe fn op_max(state: &mut State, pc: *const Decoded) -> *const Decoded {
+    let instruction = &*pc;
+    let left = *state.reg(instruction.left);
+    let right = *state.reg(instruction.right);
+    *state.reg(instruction.target) = if values::is_ref(left) | values::is_ref(right) {
+        if big_compare(state, left, right) == cmp::Ordering::Greater { left } else { right }
+    } else {
+        cmp::max(left, right)
+    };
+    pc.offset(1)
 }
 
 #[inline(always)]
-fn op_sub(thread: &mut Thread, pc: usize) -> usize {
-    let code = &thread.code;
-    let registers = &mut thread.registers;
-    unsafe {
-        let instruction = code.get_unchecked(pc);
-        let rl = instruction.left as usize + thread.base;
-        let rr = instruction.right as usize + thread.base;
-        let r = instruction.target as usize + thread.base;
-        let left = *registers.get_unchecked(rl);
-        let right = *registers.get_unchecked(rr);
-        *registers.get_unchecked_mut(r) = left - right;
+pub(super) unsafe fn op_abs(state: &mut State, pc: *const Decoded) -> *const Decoded {
+    let instruction = &*pc;
+    let left = *state.reg(instruction.left);
+    let (result, overflow) = left.overflowing_abs();
+    *state.reg(instruction.target) = if overflow | is_big(left, left, result) {
+        big_arithmetic(state, ops::ABS, left, left)
+    } else {
+        result
+    };
+    pc.offset(1)
+}
+
+/// The floating point square root is exact to one, the result is corrected
+/// from there
+#[inline(always)]
+pub(super) unsafe fn op_sqrt(state: &mut State, pc: *const Decoded) -> *const Decoded {
+    let instruction = &*pc;
+    let left = *state.reg(instruction.left);
+    *state.reg(instruction.target) = if values::is_ref(left) {
+        big_arithmetic(state, ops::SQRT, left, left)
+    } else {
+        isqrt(left)
+    };
+    pc.offset(1)
+}
+
+/// Compiled to `popcnt` if the target supports it
+#[inline(always)]
+pub(super) unsafe fn op_pcnt(state: &mut State, pc: *const Decoded) -> *const Decoded {
+    let instruction = &*pc;
+    let left = *state.reg(instruction.left);
+    *state.reg(instruction.target) = if values::is_ref(left) {
+        big_bits(state, ops::PCNT, left)
+    } else {
+        left.count_ones() as i64
+    };
+    pc.offset(1)
+}
+
+/// Compiled to `lzcnt` if the target supports it, 64 for 0
+#[inline(always)]
+pub(super) unsafe fn op_clz(state: &mut State, pc: *const Decoded) -> *const Decoded {
+    let instruction = &*pc;
+    let left = *state.reg(instruction.left);
+    *state.reg(instruction.target) = if values::is_ref(left) {
+        big_bits(state, ops::CLZ, left)
+    } else {
+        left.leading_zeros() as i64
+    };
+    pc.offset(1)
+}
+
+/// Compiled to `tzcnt` if the target supports it, 64 for 0
+#[inline(always)]
+pub(super) unsafe fn op_ctz(state: &mut State, pc: *const Decoded) -> *const Decoded {
+    let instruction = &*pc;
+    let left = *state.reg(instruction.left);
+    *state.reg(instruction.target) = if values::is_ref(left) {
+        big_bits(state, ops::CTZ, left)
+    } else {
+        left.trailing_zeros() as i64
+    };
+    pc.offset(1)
+}
+
+#[inline(always)]
+pub(super) unsafe fn op_and(state: &mut State, pc: *const Decoded) -> *const Decoded {
+    let instruction = &*pc;
+    let left = *state.reg(instruction.left);
+    let right = *state.reg(instruction.right);
+    *state.reg(instruction.target) = (left != 0 && right != 0) as i64;
+    pc.offset(1)
+}
+
+#[inline(always)]
+pub(super) unsafe fn op_or(state: &mut State, pc: *const Decoded) -> *const Decoded {
+    let instruction = &*pc;
+    let left = *state.reg(instruction.left);
+    let right = *state.reg(instruction.right);
+    *state.reg(instruction.target) = (left != 0 || right != 0) as i64;
+    pc.offset(1)
+}
+
+#[inline(always)]
+pub(super) unsafe fn op_not(state: &mut State, pc: *const Decoded) -> *const Decoded {
+    let instruction = &*pc;
+    let left = *state.reg(instruction.left);
+    *state.reg(instruction.target) = (left == 0) as i64;
+    pc.offset(1)
+}
+
+#[inline(always)]
+pub(super) unsafe fn op_eq(state: &mut State, pc: *const Decoded) -> *const Decoded {
+    let instruction = &*pc;
+    let left = *state.reg(instruction.left);
+    let right = *state.reg(instruction.right);
+    *state.reg(instruction.target) = if values::is_ref(left) & values::is_ref(right) && left != right {
+        (big_equal(state, left, right)) as i64
+    } else {
+        (left == right) as i64
+    };
+    pc.offset(1)
+}
+
+#[inline(always)]
+pub(super) unsafe fn op_lt(state: &mut State, pc: *const Decoded) -> *const Decoded {
+    let instruction = &*pc;
+    let left = *state.reg(instruction.left);
+    let right = *state.reg(instruction.right);
+    *state.reg(instruction.target) = if values::is_ref(left) | values::is_ref(right) {
+        (big_compare(state, left, right) == cmp::Ordering::Less) as i64
+    } else {
+        (left < right) as i64
+    };
+    pc.offset(1)
+}
+
+#[inline(always)]
+pub(super) unsafe fn op_le(state: &mut State, pc: *const Decoded) -> *const Decoded {
+    let instruction = &*pc;
+    let left = *state.reg(instruction.left);
+    let right = *state.reg(instruction.right);
+    *state.reg(instruction.target) = if values::is_ref(left) | values::is_ref(right) {
+        (big_compare(state, left, right) != cmp::Ordering::Greater) as i64
+    } else {
+        (left <= right) as i64
+    };
+    pc.offset(1)
+}
+
+#[inline(always)]
+pub(super) unsafe fn op_gt(state: &mut State, pc: *const Decoded) -> *const Decoded {
+    let instruction = &*pc;
+    let left = *state.reg(instruction.left);
+    let right = *state.reg(instruction.right);
+    *state.reg(instruction.target) = if values::is_ref(left) | values::is_ref(right) {
+        (big_compare(state, left, right) == cmp::Ordering::Greater) as i64
+    } else {
+        (left > right) as i64
+    };
+    pc.offset(1)
+}
+
+#[inline(always)]
+pub(super) unsafe fn op_ge(state: &mut State, pc: *const Decoded) -> *const Decoded {
+    let instruction = &*pc;
+    let left = *state.reg(instruction.left);
+    let right = *state.reg(instruction.right);
+    *state.reg(instruction.target) = if values::is_ref(left) | values::is_ref(right) {
+        (big_compare(state, left, right) != cmp::Ordering::Less) as i64
+    } else {
+        (left >= right) as i64
+    };
+    pc.offset(1)
+}
+
+#[inline(always)]
+pub(super) unsafe fn op_neq(state: &mut State, pc: *const Decoded) -> *const Decoded {
+    let instruction = &*pc;
+    let left = *state.reg(instruction.left);
+    let right = *state.reg(instruction.right);
+    *state.reg(instruction.target) = if values::is_ref(left) & values::is_ref(right) && left != right {
+        (!big_equal(state, left, right)) as i64
+    } else {
+        (left != right) as i64
+    };
+    pc.offset(1)
+}
+
+#[inline(always)]
+pub(super) unsafe fn op_cal(state: &mut State, pc: *const Decoded) -> *const Decoded {
+    state.frame = state.frame.offset(256);
+
+    // Check for stack overflow
+    if state.frame as *const i64 >= state.limit {
+        panic!("stackoverflow");
+    }
+
+    // The frames of a suspended generator are overwritten from here on
+    if (*state.heap).resident().is_some() {
+        (*state.heap).evict(state.stack());
     }
-    pc + 1
+
+    *state.frame.offset(reg::RET as isize) = pc.offset(1) as i64;
+    count_call(state.instructions, state.base());
+    (*pc).immediate as *const Decoded
+}
+
+#[inline(always)]
+pub(super) unsafe fn op_tlc(state: &mut State, pc: *const Decoded) -> *const Decoded {
+    count_tail_call(state.instructions);
+    (*pc).immediate as *const Decoded
 }
 
+/// Get the entry point and the captured values of a function value, which is
+/// called with the given number of arguments.
 #[inline(always)]
-fn op_mul(thread: &mut Thread, pc: usize) -> usize {
-    let code = &thread.code;
-    let registers = &mut thread.registers;
-    unsafe {
-        let instruction = code.get_unchecked(pc);
-        let rl = instruction.left as usize + thread.base;
-        let rr = instruction.right as usize + thread.base;
-        let r = instruction.target as usize + thread.base;
-        let left = *registers.get_unchecked(rl);
-        let right = *registers.get_unchecked(rr);
-        *registers.get_unchecked_mut(r) = left * right;
+unsafe fn callee<'a>(state: &State, function: i64, arguments: usize) -> (*const Decoded, &'a [i64]) {
+    let heap = &*state.heap;
+    let fields = match heap.function_fields(function) {
+        Some(fields) => fields,
+        None => panic!("Not a function: {}", heap.format(function))
+    };
+    if fields[1] as usize != arguments {
+        panic!("Function of {} arguments called with {}", fields[1], arguments);
     }
-    pc + 1
+    let entry = state.code.offset((*state.functions)[fields[0] as usize] as isize);
+    (entry, &fields[2..])
 }
 
+/// Call a function value. The arguments have been passed like to a call, the
+/// captured values are copied to the parameter registers following them.
 #[inline(always)]
-fn op_div(thread: &mut Thread, pc: usize) -> usize {
-    let code = &thread.code;
-    let registers = &mut thread.registers;
-    unsafe {
-        let instruction = code.get_unchecked(pc);
-        let rl = instruction.left as usize + thread.base;
-        let rr = instruction.right as usize + thread.base;
-        let r = instruction.target as usize + thread.base;
-        let left = *registers.get_unchecked(rl);
-        let right = *registers.get_unchecked(rr);
-        *registers.get_unchecked_mut(r) = left / right;
+pub(super) unsafe fn op_cli(state: &mut State, pc: *const Decoded) -> *const Decoded {
+    let instruction = &*pc;
+    let function = *state.reg(instruction.target);
+    let arguments = instruction.immediate as usize;
+    state.frame = state.frame.offset(256);
+
+    // Check for stack overflow
+    if state.frame as *const i64 >= state.limit {
+        panic!("stackoverflow");
+    }
+
+    // The frames of a suspended generator are overwritten from here on
+    if (*state.heap).resident().is_some() {
+        (*state.heap).evict(state.stack());
     }
-    pc + 1
+
+    let (entry, captured) = callee(state, function, arguments);
+    let parameters = state.frame.offset(reg::VAL as isize + arguments as isize);
+    std::ptr::copy_nonoverlapping(captured.as_ptr(), parameters, captured.len());
+    *state.frame.offset(reg::RET as isize) = pc.offset(1) as i64;
+    count_call(state.instructions, state.base());
+    entry
+}
+
+/// Tail call of a function value, the arguments have been moved to the
+/// parameter registers of the current frame
+#[inline(always)]
+pub(super) unsafe fn op_tli(state: &mut State, pc: *const Decoded) -> *const Decoded {
+    let instruction = &*pc;
+    let function = *state.reg(instruction.target);
+    let arguments = instruction.immediate as usize;
+    let (entry, captured) = callee(state, function, arguments);
+    let parameters = state.frame.offset(reg::VAL as isize + arguments as isize);
+    std::ptr::copy_nonoverlapping(captured.as_ptr(), parameters, captured.len());
+    count_tail_call(state.instructions);
+    entry
+}
+
+#[inline(always)]
+pub(super) unsafe fn op_ret(state: &mut State, _pc: *const Decoded) -> *const Decoded {
+    let pc = *state.frame.offset(reg::RET as isize) as *const Decoded;
+    state.leave_frame();
+    state.frame = state.frame.offset(-256);
+    count_return(state.instructions, state.base());
+    pc
+}
+
+#[inline(always)]
+pub(super) unsafe fn op_mov(state: &mut State, pc: *const Decoded) -> *const Decoded {
+    let instruction = &*pc;
+    *state.reg(instruction.target) = *state.reg(instruction.left);
+    pc.offset(1)
+}
+
+/// The register offset is added to the target when decoding
+#[inline(always)]
+pub(super) unsafe fn op_mvo(state: &mut State, pc: *const Decoded) -> *const Decoded {
+    op_mov(state, pc)
+}
+
+#[inline(always)]
+pub(super) unsafe fn op_jmf(_state: &mut State, pc: *const Decoded) -> *const Decoded {
+    (*pc).immediate as *const Decoded
+}
+
+#[inline(always)]
+pub(super) unsafe fn op_jmb(state: &mut State, pc: *const Decoded) -> *const Decoded {
+    count_tail_call(state.instructions);
+    (*pc).immediate as *const Decoded
 }
 
 #[inline(always)]
-fn op_and(thread: &mut Thread, pc: usize) -> usize {
-    let code = &thread.code;
-    let registers = &mut thread.registers;
-    unsafe {
-        let instruction = code.get_unchecked(pc);
-        let rl = instruction.left as usize + thread.base;
-        let rr = instruction.right as usize + thread.base;
-        let r = instruction.target as usize + thread.base;
-        let left = *registers.get_unchecked(rl);
-        let right = *registers.get_unchecked(rr);
-        *registers.get_unchecked_mut(r) = (left != 0 && right != 0) as i64;
+pub(super) unsafe fn op_jtf(state: &mut State, pc: *const Decoded) -> *const Decoded {
+    let instruction = &*pc;
+    if *state.reg(instruction.target) == 0 {
+        pc.offset(1)
+    } else {
+        instruction.immediate as *const Decoded
     }
-    pc + 1
 }
 
 #[inline(always)]
-fn op_or(thread: &mut Thread, pc: usize) -> usize {
-    let code = &thread.code;
-    let registers = &mut thread.registers;
-    unsafe {
-        let instruction = code.get_unchecked(pc);
-        let rl = instruction.left as usize + thread.base;
-        let rr = instruction.right as usize + thread.base;
-        let r = instruction.target as usize + thread.base;
-        let left = *registers.get_unchecked(rl);
-        let right = *registers.get_unchecked(rr);
-        *registers.get_unchecked_mut(r) = (left != 0 || right != 0) as i64;
+pub(super) unsafe fn op_jff(state: &mut State, pc: *const Decoded) -> *const Decoded {
+    let instruction = &*pc;
+    if *state.reg(instruction.target) != 0 {
+        pc.offset(1)
+    } else {
+        instruction.immediate as *const Decoded
     }
-    pc + 1
 }
 
+/// Integers are written as raw bytes with binary framing
 #[inline(always)]
-fn op_not(thread: &mut Thread, pc: usize) -> usize {
-    let code = &thread.code;
-    let registers = &mut thread.registers;
-    unsafe {
-        let instruction = code.get_unchecked(pc);
-        let rl = instruction.left as usize + thread.base;
-        let r = instruction.target as usize + thread.base;
-        let left = *registers.get_unchecked(rl);
-        *registers.get_unchecked_mut(r) = (left == 0) as i64;
+pub(super) unsafe fn op_wri(state: &mut State, pc: *const Decoded) -> *const Decoded {
+    let instruction = &*pc;
+    let left = *state.reg(instruction.left);
+    *state.reg(instruction.target) = left;
+
+    let written = if values::is_ref(left) {
+        write_output(state, format!("{}\n", (*state.heap).format(left)).as_bytes())
+    } else if state.framing.1 == Framing::Binary {
+        write_output(state, &raw_bytes(left))
+    } else {
+        write_output(state, format!("{}\n", left).as_bytes())
+    };
+    if !written {
+        return state.suspend(Suspension::OutputFull, pc);
     }
-    pc + 1
+    count_write(state.instructions);
+    pc.offset(1)
 }
 
+/// Append the next line of input to `line`, from the host if there is one.
+///
+/// # Remarks
+///
+/// The line break is not appended. Returns the number of bytes read
+/// including the line break, which is 0 at the end of the input. `None` if
+/// the host has no input available yet.
+unsafe fn read_input(state: &mut State, line: &mut Vec<u8>) -> Option<usize> {
+    match state.io {
+        Some(io) => {
+            let start = line.len();
+            let read = (*io).read_line(line)?;
+            Some(if read { line.len() - start + 1 } else { 0 })
+        }
+        None => {
+            state.stdout.flush();
+            let stdin = std::io::stdin();
+            let read = stdin.lock().read_until(b'\n', line).expect("Could not read from stdio");
+            if read > 0 && line.last() == Some(&b'\n') {
+                line.pop();
+            }
+            Some(read)
+        }
+    }
+}
+
+/// Keep only the line appended to the `len` bytes of a buffer if one was
+/// read, and only the old bytes otherwise, reusing the storage either way.
 #[inline(always)]
-fn op_eq(thread: &mut Thread, pc: usize) -> usize {
-    let code = &thread.code;
-    let registers = &mut thread.registers;
-    unsafe {
-        let instruction = code.get_unchecked(pc);
-        let rl = instruction.left as usize + thread.base;
-        let rr = instruction.right as usize + thread.base;
-        let r = instruction.target as usize + thread.base;
-        let left = *registers.get_unchecked(rl);
-        let right = *registers.get_unchecked(rr);
-        *registers.get_unchecked_mut(r) = (left == right) as i64;
+fn replace_line(mut bytes: Vec<u8>, len: usize, read: bool) -> Vec<u8> {
+    if read {
+        bytes.drain(..len);
+    } else {
+        bytes.truncate(len);
     }
-    pc + 1
+    bytes
 }
 
+/// Read a little-endian 64 bit integer, from the host if there is one.
+/// Returns `Some(None)` at the end of the input and `None` if the host has
+/// no input available yet.
+unsafe fn read_raw(state: &mut State) -> Option<Option<i64>> {
+    let mut bytes = [0u8; 8];
+    let read = match state.io {
+        Some(io) => (*io).read_bytes(&mut bytes)?,
+        None => {
+            state.stdout.flush();
+            let stdin = std::io::stdin();
+            let result = stdin.lock().read_exact(&mut bytes);
+            match result {
+                Ok(()) => true,
+                Err(ref error) if error.kind() == std::io::ErrorKind::UnexpectedEof => false,
+                Err(error) => panic!("Could not read from stdio: {}", error)
+            }
+        }
+    };
+    Some(if read { Some(i64::from_le(std::mem::transmute(bytes))) } else { None })
+}
+
+/// Read an integer in the framing of the input, like `read_raw`.
+unsafe fn read_integer(state: &mut State) -> Option<Option<i64>> {
+    if state.framing.0 == Framing::Binary {
+        return read_raw(state);
+    }
+    let mut line = Vec::new();
+    let read = read_input(state, &mut line)?;
+    Some(parse_integer(&line, read))
+}
+
+/// Write to the output, to the host if there is one. Returns `false` if the
+/// host can not take the bytes yet.
+unsafe fn write_output(state: &mut State, bytes: &[u8]) -> bool {
+    match state.io {
+        Some(io) => (*io).write(bytes),
+        None => {
+            state.stdout.write(bytes);
+            true
+        }
+    }
+}
+
+/// Get the little-endian bytes of an integer.
 #[inline(always)]
-fn op_lt(thread: &mut Thread, pc: usize) -> usize {
-    let code = &thread.code;
-    let registers = &mut thread.registers;
-    unsafe {
-        let instruction = code.get_unchecked(pc);
-        let rl = instruction.left as usize + thread.base;
-        let rr = instruction.right as usize + thread.base;
-        let r = instruction.target as usize + thread.base;
-        let left = *registers.get_unchecked(rl);
-        let right = *registers.get_unchecked(rr);
-        *registers.get_unchecked_mut(r) = (left < right) as i64;
+fn raw_bytes(value: i64) -> [u8; 8] {
+    unsafe { std::mem::transmute(value.to_le()) }
+}
+
+/// Parse a line of input as an integer, `None` at the end of the input.
+fn parse_integer(line: &[u8], read: usize) -> Option<i64> {
+    if read == 0 {
+        return None;
+    }
+    match std::str::from_utf8(line).ok().and_then(|text| text.trim().parse::<i64>().ok()) {
+        Some(i) => Some(i),
+        None => panic!("Could not read integer")
     }
-    pc + 1
 }
 
 #[inline(always)]
-fn op_le(thread: &mut Thread, pc: usize) -> usize {
-    let code = &thread.code;
-    let registers = &mut thread.registers;
-    unsafe {
-        let instruction = code.get_unchecked(pc);
-        let rl = instruction.left as usize + thread.base;
-        let rr = instruction.right as usize + thread.base;
-        let r = instruction.target as usize + thread.base;
-        let left = *registers.get_unchecked(rl);
-        let right = *registers.get_unchecked(rr);
-        *registers.get_unchecked_mut(r) = (left <= right) as i64;
+pub(super) unsafe fn op_rdi(state: &mut State, pc: *const Decoded) -> *const Decoded {
+    let instruction = &*pc;
+    let integer = match read_integer(state) {
+        Some(integer) => integer,
+        None => return state.suspend(Suspension::NeedInput, pc)
+    };
+    *state.reg(instruction.target) = match integer {
+        Some(i) => checked_integer(state, i),
+        None => panic!("Could not read integer")
+    };
+    count_read(state.instructions);
+    pc.offset(1)
+}
+
+/// Like `op_rdi`, but the end of the input is `nil` instead of an error
+#[inline(always)]
+pub(super) unsafe fn op_rdn(state: &mut State, pc: *const Decoded) -> *const Decoded {
+    let instruction = &*pc;
+    let integer = match read_integer(state) {
+        Some(integer) => integer,
+        None => return state.suspend(Suspension::NeedInput, pc)
+    };
+    *state.reg(instruction.target) = match integer {
+        Some(i) => checked_integer(state, i),
+        None => values::NIL
+    };
+    count_read(state.instructions);
+    pc.offset(1)
+}
+
+/// The end of the input is `nil`
+#[inline(always)]
+pub(super) unsafe fn op_rdr(state: &mut State, pc: *const Decoded) -> *const Decoded {
+    let instruction = &*pc;
+    let integer = match read_raw(state) {
+        Some(integer) => integer,
+        None => return state.suspend(Suspension::NeedInput, pc)
+    };
+    *state.reg(instruction.target) = match integer {
+        Some(i) => checked_integer(state, i),
+        None => values::NIL
+    };
+    count_read(state.instructions);
+    pc.offset(1)
+}
+
+/// The integers are read from consecutive registers, their number is
+/// resolved when decoding. They are written with a single write, the result
+/// is the last one.
+#[inline(always)]
+pub(super) unsafe fn op_wrr(state: &mut State, pc: *const Decoded) -> *const Decoded {
+    let instruction = &*pc;
+    let count = instruction.immediate as usize;
+    let values = std::slice::from_raw_parts(state.reg(instruction.left), count);
+    let mut bytes = [0u8; 8 * 255];
+    for (i, &value) in values.iter().enumerate() {
+        if values::is_ref(value) {
+            panic!("Only integers can be written raw: {}", (*state.heap).format(value));
+        }
+        bytes[8 * i..8 * i + 8].copy_from_slice(&raw_bytes(value));
     }
-    pc + 1
+    if !write_output(state, &bytes[..8 * count]) {
+        return state.suspend(Suspension::OutputFull, pc);
+    }
+    *state.reg(instruction.target) = values[count - 1];
+    count_write(state.instructions);
+    pc.offset(1)
 }
 
+/// The native function was resolved when decoding, it gets the arguments
+/// straight from the register window
 #[inline(always)]
-fn op_gt(thread: &mut Thread, pc: usize) -> usize {
-    let code = &thread.code;
-    let registers = &mut thread.registers;
-    unsafe {
-        let instruction = code.get_unchecked(pc);
-        let rl = instruction.left as usize + thread.base;
-        let rr = instruction.right as usize + thread.base;
-        let r = instruction.target as usize + thread.base;
-        let left = *registers.get_unchecked(rl);
-        let right = *registers.get_unchecked(rr);
-        *registers.get_unchecked_mut(r) = (left > right) as i64;
+pub(super) unsafe fn op_calln(state: &mut State, pc: *const Decoded) -> *const Decoded {
+    let instruction = &*pc;
+    let function: Native = std::mem::transmute(instruction.immediate as usize);
+    let arguments = std::slice::from_raw_parts(state.reg(instruction.left), instruction.right as usize);
+    let result = function(arguments);
+    if values::is_ref(result) && result != values::NIL && !arguments.contains(&result) {
+        panic!("Native function returned {:#x}, which overlaps the tag of references", result);
     }
-    pc + 1
+    *state.reg(instruction.target) = result;
+    pc.offset(1)
 }
 
+/// Allocation is a pointer bump, unless the nursery is full
 #[inline(always)]
-fn op_ge(thread: &mut Thread, pc: usize) -> usize {
-    let code = &thread.code;
-    let registers = &mut thread.registers;
-    unsafe {
-        let instruction = code.get_unchecked(pc);
-        let rl = instruction.left as usize + thread.base;
-        let rr = instruction.right as usize + thread.base;
-        let r = instruction.target as usize + thread.base;
-        let left = *registers.get_unchecked(rl);
-        let right = *registers.get_unchecked(rr);
-        *registers.get_unchecked_mut(r) = (left >= right) as i64;
+pub(super) unsafe fn op_cons(state: &mut State, pc: *const Decoded) -> *const Decoded {
+    let instruction = &*pc;
+    let heap = &mut *state.heap;
+    if !heap.has_room(3) {
+        heap.make_room(state.roots());
     }
-    pc + 1
+    let car = *state.reg(instruction.left);
+    let cdr = *state.reg(instruction.right);
+    *state.reg(instruction.target) = heap.cons(car, cdr);
+    pc.offset(1)
+}
+
+#[inline(always)]
+pub(super) unsafe fn op_car(state: &mut State, pc: *const Decoded) -> *const Decoded {
+    let instruction = &*pc;
+    let list = *state.reg(instruction.left);
+    *state.reg(instruction.target) = match (*state.heap).car(list) {
+        Some(car) => car,
+        None => panic!("car of {}", (*state.heap).format(list))
+    };
+    pc.offset(1)
 }
 
 #[inline(always)]
-fn op_neq(thread: &mut Thread, pc: usize) -> usize {
-    let code = &thread.code;
-    let registers = &mut thread.registers;
-    unsafe {
-        let instruction = code.get_unchecked(pc);
-        let rl = instruction.left as usize + thread.base;
-        let rr = instruction.right as usize + thread.base;
-        let r = instruction.target as usize + thread.base;
-        let left = *registers.get_unchecked(rl);
-        let right = *registers.get_unchecked(rr);
-        *registers.get_unchecked_mut(r) = (left != right) as i64;
+pub(super) unsafe fn op_cdr(state: &mut State, pc: *const Decoded) -> *const Decoded {
+    let instruction = &*pc;
+    let list = *state.reg(instruction.left);
+    *state.reg(instruction.target) = match (*state.heap).cdr(list) {
+        Some(cdr) => cdr,
+        None => panic!("cdr of {}", (*state.heap).format(list))
+    };
+    pc.offset(1)
+}
+
+#[inline(always)]
+pub(super) unsafe fn op_nil(state: &mut State, pc: *const Decoded) -> *const Decoded {
+    let instruction = &*pc;
+    let left = *state.reg(instruction.left);
+    *state.reg(instruction.target) = (left == values::NIL) as i64;
+    pc.offset(1)
+}
+
+#[inline(always)]
+pub(super) unsafe fn op_map(state: &mut State, pc: *const Decoded) -> *const Decoded {
+    let instruction = &*pc;
+    let heap = &mut *state.heap;
+    if !heap.has_room(2) {
+        heap.make_room(state.roots());
     }
-    pc + 1
+    *state.reg(instruction.target) = heap.make_map();
+    pc.offset(1)
 }
 
+/// Missing keys are `nil`
 #[inline(always)]
-fn op_cal(thread: &mut Thread, pc: usize) -> usize {
-    let code = &thread.code;
-    let functions = &thread.functions;
-    let registers = &mut thread.registers;
-    thread.base += 256;
+pub(super) unsafe fn op_get(state: &mut State, pc: *const Decoded) -> *const Decoded {
+    let instruction = &*pc;
+    let map = *state.reg(instruction.left);
+    let key = *state.reg(instruction.right);
+    (*state.heap).check_key(key);
+    *state.reg(instruction.target) = (*state.heap).map(map).get(key).unwrap_or(values::NIL);
+    pc.offset(1)
+}
 
-    // Check for stack overflow
-    if thread.base >= registers.len() {
-        panic!("stackoverflow");
+/// The target holds the map, which is also the result
+#[inline(always)]
+pub(super) unsafe fn op_put(state: &mut State, pc: *const Decoded) -> *const Decoded {
+    let instruction = &*pc;
+    let map = *state.reg(instruction.target);
+    let key = *state.reg(instruction.left);
+    let value = *state.reg(instruction.right);
+    (*state.heap).put(map, key, value);
+    pc.offset(1)
+}
+
+#[inline(always)]
+pub(super) unsafe fn op_has(state: &mut State, pc: *const Decoded) -> *const Decoded {
+    let instruction = &*pc;
+    let map = *state.reg(instruction.left);
+    let key = *state.reg(instruction.right);
+    (*state.heap).check_key(key);
+    *state.reg(instruction.target) = (*state.heap).map(map).get(key).is_some() as i64;
+    pc.offset(1)
+}
+
+#[inline(always)]
+pub(super) unsafe fn op_size(state: &mut State, pc: *const Decoded) -> *const Decoded {
+    let instruction = &*pc;
+    let value = *state.reg(instruction.left);
+    *state.reg(instruction.target) = (*state.heap).len(value) as i64;
+    pc.offset(1)
+}
+
+/// The offset and length of the literal are resolved when decoding
+#[inline(always)]
+pub(super) unsafe fn op_lds(state: &mut State, pc: *const Decoded) -> *const Decoded {
+    let instruction = &*pc;
+    let heap = &mut *state.heap;
+    if !heap.has_room(4) {
+        heap.make_room(state.roots());
     }
+    *state.reg(instruction.target) = heap.literal(&*state.data, instruction.immediate);
+    pc.offset(1)
+}
 
-    unsafe {
-        let return_reg = reg::RET as usize + thread.base;
-        *registers.get_unchecked_mut(return_reg) = (pc + 1) as i64;
+#[inline(always)]
+pub(super) unsafe fn op_buf(state: &mut State, pc: *const Decoded) -> *const Decoded {
+    let instruction = &*pc;
+    let heap = &mut *state.heap;
+    if !heap.has_room(2) {
+        heap.make_room(state.roots());
+    }
+    *state.reg(instruction.target) = heap.make_buffer();
+    pc.offset(1)
+}
 
-        let instruction = code.get_unchecked(pc);
-        let b0 = instruction.target as usize;
-        let b1 = instruction.left as usize;
-        let b2 = instruction.right as usize;
+/// The buffer is also the result, so appends can be chained
+#[inline(always)]
+pub(super) unsafe fn op_app(state: &mut State, pc: *const Decoded) -> *const Decoded {
+    let instruction = &*pc;
+    let buffer = *state.reg(instruction.left);
+    let value = *state.reg(instruction.right);
+    (*state.heap).append(buffer, value);
+    *state.reg(instruction.target) = buffer;
+    pc.offset(1)
+}
+
+/// The buffer has to be read again after making room, as it may have moved
+#[inline(always)]
+pub(super) unsafe fn op_str(state: &mut State, pc: *const Decoded) -> *const Decoded {
+    let instruction = &*pc;
+    let heap = &mut *state.heap;
+    let words = string_words(heap.len(*state.reg(instruction.left)));
+    if !heap.has_room(words) {
+        heap.make_room(state.roots());
+    }
+    *state.reg(instruction.target) = heap.freeze(*state.reg(instruction.left));
+    pc.offset(1)
+}
 
-        let function_index = b0 | b1 << 8 | b2 << 16;
-        *functions.get_unchecked(function_index) as usize
+/// The target holds the string and receives the slice
+#[inline(always)]
+pub(super) unsafe fn op_slc(state: &mut State, pc: *const Decoded) -> *const Decoded {
+    let instruction = &*pc;
+    let heap = &mut *state.heap;
+    let start = *state.reg(instruction.left);
+    let end = *state.reg(instruction.right);
+    if !heap.has_room(heap.slice_words(*state.reg(instruction.target), start, end)) {
+        heap.make_room(state.roots());
     }
+    let string = *state.reg(instruction.target);
+    *state.reg(instruction.target) = heap.slice(string, start, end);
+    pc.offset(1)
 }
 
 #[inline(always)]
-fn op_tlc(thread: &mut Thread, pc: usize) -> usize {
-    let code = &thread.code;
-    let functions = &thread.functions;
-    unsafe {
-        let instruction = code.get_unchecked(pc);
-        let b0 = instruction.target as usize;
-        let b1 = instruction.left as usize;
-        let b2 = instruction.right as usize;
+pub(super) unsafe fn op_byt(state: &mut State, pc: *const Decoded) -> *const Decoded {
+    let instruction = &*pc;
+    let string = *state.reg(instruction.left);
+    let index = *state.reg(instruction.right);
+    *state.reg(instruction.target) = match (*state.heap).string(string).get(index as usize) {
+        Some(&byte) if index >= 0 => byte as i64,
+        _ => panic!("Byte {} of {}", index, (*state.heap).format(string))
+    };
+    pc.offset(1)
+}
+
+#[inline(always)]
+pub(super) unsafe fn op_cmp(state: &mut State, pc: *const Decoded) -> *const Decoded {
+    let instruction = &*pc;
+    let left = *state.reg(instruction.left);
+    let right = *state.reg(instruction.right);
+    *state.reg(instruction.target) = match (*state.heap).compare(left, right) {
+        cmp::Ordering::Less => -1,
+        cmp::Ordering::Equal => 0,
+        cmp::Ordering::Greater => 1
+    };
+    pc.offset(1)
+}
+
+#[inline(always)]
+pub(super) unsafe fn op_hsh(state: &mut State, pc: *const Decoded) -> *const Decoded {
+    let instruction = &*pc;
+    let string = *state.reg(instruction.left);
+    *state.reg(instruction.target) = (*state.heap).hash(string);
+    pc.offset(1)
+}
 
-        let function_index = b0 | b1 << 8 | b2 << 16;
-        *functions.get_unchecked(function_index) as usize
+/// The bytes are written as they are, without a line break
+#[inline(always)]
+pub(super) unsafe fn op_wrb(state: &mut State, pc: *const Decoded) -> *const Decoded {
+    let instruction = &*pc;
+    let string = *state.reg(instruction.left);
+    *state.reg(instruction.target) = string;
+
+    // The bytes stay in place, writing only changes the output
+    let bytes: *const [u8] = (*state.heap).string(string);
+    if !write_output(state, &*bytes) {
+        return state.suspend(Suspension::OutputFull, pc);
     }
+    count_write(state.instructions);
+    pc.offset(1)
 }
 
+/// The line is read into the storage of the buffer, which is only
+/// replaced once a complete line is available
 #[inline(always)]
-fn op_ret(thread: &mut Thread) -> usize {
-    let registers = &mut thread.registers;
-    let pc = unsafe {
-        *registers.get_unchecked(reg::RET as usize + thread.base) as usize
+pub(super) unsafe fn op_rdl(state: &mut State, pc: *const Decoded) -> *const Decoded {
+    let instruction = &*pc;
+    let buffer = *state.reg(instruction.left);
+    let mut bytes = (*state.heap).take_bytes(buffer);
+    let len = bytes.len();
+    let read = read_input(state, &mut bytes);
+    (*state.heap).set_bytes(buffer, replace_line(bytes, len, read.is_some()));
+    let read = match read {
+        Some(read) => read,
+        None => return state.suspend(Suspension::NeedInput, pc)
     };
-    thread.base -= 256;
-    pc
+    *state.reg(instruction.target) = read as i64;
+    count_read(state.instructions);
+    pc.offset(1)
+}
+
+/// The fields are read from consecutive registers, their number is resolved
+/// when decoding
+#[inline(always)]
+pub(super) unsafe fn op_rec(state: &mut State, pc: *const Decoded) -> *const Decoded {
+    let instruction = &*pc;
+    let count = instruction.immediate as usize;
+    let heap = &mut *state.heap;
+    if !heap.has_room(count + 1) {
+        heap.make_room(state.roots());
+    }
+    let fields = std::slice::from_raw_parts(state.reg(instruction.left), count);
+    *state.reg(instruction.target) = heap.record(fields);
+    pc.offset(1)
+}
+
+/// Like a record, the function and the captured values are read from
+/// consecutive registers
+#[inline(always)]
+pub(super) unsafe fn op_clo(state: &mut State, pc: *const Decoded) -> *const Decoded {
+    let instruction = &*pc;
+    let count = instruction.immediate as usize;
+    let heap = &mut *state.heap;
+    if !heap.has_room(count + 1) {
+        heap.make_room(state.roots());
+    }
+    let fields = std::slice::from_raw_parts(state.reg(instruction.left), count);
+    *state.reg(instruction.target) = heap.function(fields);
+    pc.offset(1)
+}
+
+#[inline(always)]
+pub(super) unsafe fn op_fld(state: &mut State, pc: *const Decoded) -> *const Decoded {
+    let instruction = &*pc;
+    let record = *state.reg(instruction.left);
+    *state.reg(instruction.target) = (*state.heap).record_field(record, instruction.immediate as usize);
+    pc.offset(1)
+}
+
+/// The target holds the record and receives the copy
+#[inline(always)]
+pub(super) unsafe fn op_wth(state: &mut State, pc: *const Decoded) -> *const Decoded {
+    let instruction = &*pc;
+    let heap = &mut *state.heap;
+    let words = heap.len(*state.reg(instruction.target)) + 2;
+    if !heap.has_room(words) {
+        heap.make_room(state.roots());
+    }
+    let record = *state.reg(instruction.target);
+    let value = *state.reg(instruction.left);
+    *state.reg(instruction.target) = heap.with(record, instruction.immediate as usize, value);
+    pc.offset(1)
 }
 
 #[inline(always)]
-fn op_mov(thread: &mut Thread, pc: usize) -> usize {
-    let code = &thread.code;
-    let registers = &mut thread.registers;
-    unsafe {
-        let instruction = code.get_unchecked(pc);
-        let rl = instruction.left as usize + thread.base;
-        let r = instruction.target as usize + thread.base;
-        *registers.get_unchecked_mut(r) = *registers.get_unchecked(rl);
+pub(super) unsafe fn op_vec(state: &mut State, pc: *const Decoded) -> *const Decoded {
+    let instruction = &*pc;
+    let heap = &mut *state.heap;
+    if !heap.has_room(VECTOR_WORDS) {
+        heap.make_room(state.roots());
     }
-    pc + 1
+    *state.reg(instruction.target) = heap.make_vector();
+    pc.offset(1)
+}
+
+#[inline(always)]
+pub(super) unsafe fn op_vgt(state: &mut State, pc: *const Decoded) -> *const Decoded {
+    let instruction = &*pc;
+    let vector = *state.reg(instruction.left);
+    let index = *state.reg(instruction.right);
+    *state.reg(instruction.target) = (*state.heap).vector_get(vector, index);
+    pc.offset(1)
 }
 
 #[inline(always)]
-fn op_mvo(thread: &mut Thread, pc: usize) -> usize {
-    let code = &thread.code;
-    let registers = &mut thread.registers;
-    unsafe {
-        let instruction = code.get_unchecked(pc);
-        let rl = instruction.left as usize + thread.base;
-        let offset = instruction.right as usize;
-        let r = instruction.target as usize + thread.base + offset;
-        *registers.get_unchecked_mut(r) = *registers.get_unchecked(rl);
+pub(super) unsafe fn op_vps(state: &mut State, pc: *const Decoded) -> *const Decoded {
+    let instruction = &*pc;
+    let heap = &mut *state.heap;
+    if !heap.has_room(VECTOR_WORDS) {
+        heap.make_room(state.roots());
     }
-    pc + 1
+    let vector = *state.reg(instruction.left);
+    let value = *state.reg(instruction.right);
+    *state.reg(instruction.target) = heap.vector_push(vector, value);
+    pc.offset(1)
 }
 
+/// The target holds the vector and receives the new version
 #[inline(always)]
-fn op_jmf(thread: &mut Thread, pc: usize) -> usize {
-    let code = &thread.code;
-    unsafe {
-        let instruction = code.get_unchecked(pc);
-        let b0 = instruction.target as usize;
-        let b1 = instruction.left as usize;
-        let b2 = instruction.right as usize;
-        let offset = b0 | b1 << 8 | b2 << 16;
-        pc + offset
+pub(super) unsafe fn op_vas(state: &mut State, pc: *const Decoded) -> *const Decoded {
+    let instruction = &*pc;
+    let heap = &mut *state.heap;
+    if !heap.has_room(VECTOR_WORDS) {
+        heap.make_room(state.roots());
     }
+    let vector = *state.reg(instruction.target);
+    let index = *state.reg(instruction.left);
+    let value = *state.reg(instruction.right);
+    *state.reg(instruction.target) = heap.vector_assoc(vector, index, value);
+    pc.offset(1)
 }
 
 #[inline(always)]
-fn op_jmb(thread: &mut Thread, pc: usize) -> usize {
-    let code = &thread.code;
-    unsafe {
-        let instruction = code.get_unchecked(pc);
-        let b0 = instruction.target as usize;
-        let b1 = instruction.left as usize;
-        let b2 = instruction.right as usize;
-        let offset = b0 | b1 << 8 | b2 << 16;
-        pc - offset
+pub(super) unsafe fn op_vln(state: &mut State, pc: *const Decoded) -> *const Decoded {
+    let instruction = &*pc;
+    let vector = *state.reg(instruction.left);
+    *state.reg(instruction.target) = (*state.heap).vector_len(vector) as i64;
+    pc.offset(1)
+}
+
+/// Create a generator calling a function. The arguments are passed in the
+/// next frame, like to a call.
+#[inline(always)]
+pub(super) unsafe fn op_gen(state: &mut State, pc: *const Decoded) -> *const Decoded {
+    let instruction = &*pc;
+    let heap = &mut *state.heap;
+    let frame = state.frame.offset(FRAME as isize);
+    if frame.offset(FRAME as isize) as *const i64 > state.limit {
+        panic!("stackoverflow");
     }
+    if !heap.has_room(2) {
+        heap.make_room(state.roots_to(frame.offset(FRAME as isize)));
+    }
+    let arguments = std::slice::from_raw_parts(frame, FRAME);
+    let generator = Generator::new(instruction.immediate as usize, arguments);
+    *state.reg(instruction.target) = heap.make_generator(generator);
+    pc.offset(1)
 }
 
+/// Continue a generator until it yields, the right operand is the result of
+/// the yield it stopped at.
+///
+/// # Remarks
+///
+/// The frames of the generator are placed two frames above the current one,
+/// with the return address of the bottom frame pointing to the following
+/// `FIN`. A yield continues after the `FIN`. The frames are only copied if
+/// they are not in place already.
 #[inline(always)]
-fn op_jtf(thread: &mut Thread, pc: usize) -> usize {
-    let code = &thread.code;
-    let registers = &mut thread.registers;
-    unsafe {
-        let instruction = code.get_unchecked(pc);
-        let rl = instruction.left as usize;
-        let rr = instruction.right as usize;
-        let r = instruction.target as usize + thread.base;
-        let offset = rl | rr << 8;
-        if *registers.get_unchecked(r) == 0 {
-            pc + 1
-        } else {
-            pc + offset
+pub(super) unsafe fn op_rsm(state: &mut State, pc: *const Decoded) -> *const Decoded {
+    let instruction = &*pc;
+    let heap = &mut *state.heap;
+    let index = heap.generator_index(*state.reg(instruction.left));
+    let value = *state.reg(instruction.right);
+    let base = state.base();
+    let bottom = base + 2 * FRAME;
+
+    match heap.generator(index).phase {
+        Phase::Suspended => {}
+        Phase::Running => panic!("Generator is already running"),
+        Phase::Done => {
+            *state.reg(instruction.target) = values::NIL;
+            return pc.offset(2);
         }
     }
+
+    if heap.resident() == Some(index) && heap.generator(index).base == bottom {
+        heap.take_resident();
+    } else {
+        heap.evict(state.stack());
+        let stack = state.stack();
+        let generator = heap.generator(index);
+        if bottom + generator.len() > stack.len() {
+            panic!("stackoverflow");
+        }
+        stack[bottom..bottom + generator.len()].copy_from_slice(&generator.frames);
+        generator.frames.clear();
+        generator.base = bottom;
+    }
+
+    let outer = heap.running();
+    let registers = state.registers.offset(bottom as isize);
+    let (top, entry) = {
+        let generator = heap.generator(index);
+        if let Some(receiver) = generator.receiver {
+            *registers.offset(receiver as isize) = value;
+        }
+        *registers.offset(reg::RET as isize) = pc.offset(1) as i64;
+        generator.phase = Phase::Running;
+        generator.resumer = base;
+        generator.resume_pc = pc as usize;
+        generator.outer = outer;
+        (generator.len() - FRAME, generator.pc)
+    };
+    heap.set_running(Some(index));
+    state.frame = registers.offset(top as isize);
+    entry as *const Decoded
+}
+
+/// Reached when the function of a generator returns, from the frame above
+/// the one which resumed it.
+#[inline(always)]
+pub(super) unsafe fn op_fin(state: &mut State, pc: *const Decoded) -> *const Decoded {
+    let instruction = &*pc;
+    state.leave_frame();
+    state.frame = state.frame.offset(-(FRAME as isize));
+    let heap = &mut *state.heap;
+    let index = heap.running().expect("No generator has returned");
+    let outer = {
+        let generator = heap.generator(index);
+        generator.phase = Phase::Done;
+        generator.frames = Vec::new();
+        generator.outer
+    };
+    heap.set_running(outer);
+    *state.reg(instruction.target) = values::NIL;
+    pc.offset(1)
 }
 
+/// Suspend the running generator, leaving its frames in place, and pass a
+/// value to the resume which continued it.
 #[inline(always)]
-fn op_wri(thread: &mut Thread, pc: usize) -> usize {
-    let code = &thread.code;
-    let registers = &mut thread.registers;
-    unsafe {
-        let instruction = code.get_unchecked(pc);
-        let rl = instruction.left as usize + thread.base;
-        let r = instruction.target as usize + thread.base;
-        let left = *registers.get_unchecked(rl);
-        *registers.get_unchecked_mut(r) = left;
+pub(super) unsafe fn op_yld(state: &mut State, pc: *const Decoded) -> *const Decoded {
+    let instruction = &*pc;
+    let heap = &mut *state.heap;
+    let index = match heap.running() {
+        Some(index) => index,
+        None => panic!("Yield outside of a generator")
+    };
+    let value = *state.reg(instruction.left);
+    let base = state.base();
+
+    let (resumer, resume_pc, outer) = {
+        let generator = heap.generator(index);
+        let receiver = instruction.target as usize / std::mem::size_of::<i64>();
+        generator.depth = (base - generator.base) / FRAME + 1;
+        generator.receiver = Some(base - generator.base + receiver);
+        generator.pc = pc.offset(1) as usize;
+        generator.phase = Phase::Suspended;
+        (generator.resumer, generator.resume_pc as *const Decoded, generator.outer)
+    };
+    heap.set_resident(index, state.stack());
 
-        println!("{}", left);
+    heap.set_running(outer);
+    state.leave_frame();
+    state.frame = state.registers.offset(resumer as isize);
+    *state.reg((*resume_pc).target) = value;
+    resume_pc.offset(2)
+}
+
+/// Wait until a file descriptor is ready and execute the instruction again.
+/// A thread run by a host is suspended, so that the host can run other
+/// threads meanwhile, otherwise the OS thread blocks.
+unsafe fn wait_for(state: &mut State, suspension: Suspension, pc: *const Decoded) -> *const Decoded {
+    if state.io.is_some() {
+        return state.suspend(suspension, pc);
     }
-    pc + 1
+    match suspension {
+        Suspension::Readable(fd) => files::wait(fd, false),
+        Suspension::Writable(fd) => files::wait(fd, true),
+        _ => {}
+    }
+    pc
 }
 
+/// The result is `nil` if the file can not be opened
 #[inline(always)]
-fn op_rdi(thread: &mut Thread, pc: usize) -> usize {
-    let code = &thread.code;
-    let registers = &mut thread.registers;
-    unsafe {
-        let instruction = code.get_unchecked(pc);
-        let r = instruction.target as usize + thread.base;
+pub(super) unsafe fn op_opn(state: &mut State, pc: *const Decoded) -> *const Decoded {
+    let instruction = &*pc;
+    let heap = &mut *state.heap;
+    let path = heap.string(*state.reg(instruction.left)).to_vec();
+    let write = *state.reg(instruction.right) != 0;
+    *state.reg(instruction.target) = match heap.files().open(&path, write) {
+        Some(fd) => fd as i64,
+        None => values::NIL
+    };
+    pc.offset(1)
+}
 
-        let mut input_text = String::new();
-        std::io::stdin()
-            .read_line(&mut input_text)
-            .expect("Could not read from stdio");
-        *registers.get_unchecked_mut(r) = match input_text.trim().parse::<i64>() {
-            Ok(i) => i,
-            _ => panic!("Could not read integer")
-        };
+/// Like `op_rdl`, reading from a file descriptor
+#[inline(always)]
+pub(super) unsafe fn op_frd(state: &mut State, pc: *const Decoded) -> *const Decoded {
+    let instruction = &*pc;
+    let fd = *state.reg(instruction.left) as i32;
+    let buffer = *state.reg(instruction.right);
+    let heap = &mut *state.heap;
+    let mut bytes = heap.take_bytes(buffer);
+    let len = bytes.len();
+    let read = heap.files().read_line(fd, &mut bytes);
+    heap.set_bytes(buffer, replace_line(bytes, len, read.is_some()));
+    let read = match read {
+        Some(read) => read,
+        None => return wait_for(state, Suspension::Readable(fd), pc)
+    };
+    *state.reg(instruction.target) = read as i64;
+    count_read(state.instructions);
+    pc.offset(1)
+}
+
+/// Like `op_wrb`, writing to a file descriptor
+#[inline(always)]
+pub(super) unsafe fn op_fwr(state: &mut State, pc: *const Decoded) -> *const Decoded {
+    let instruction = &*pc;
+    let fd = *state.reg(instruction.left) as i32;
+    let string = *state.reg(instruction.right);
+    let heap = &mut *state.heap;
+    // The bytes stay in place, writing only changes the file descriptors
+    let bytes: *const [u8] = heap.string(string);
+    if !heap.files().write(fd, &*bytes) {
+        return wait_for(state, Suspension::Writable(fd), pc);
+    }
+    *state.reg(instruction.target) = string;
+    count_write(state.instructions);
+    pc.offset(1)
+}
+
+/// Waits until the queued output is written
+#[inline(always)]
+pub(super) unsafe fn op_cls(state: &mut State, pc: *const Decoded) -> *const Decoded {
+    let instruction = &*pc;
+    let fd = *state.reg(instruction.left) as i32;
+    if !(*state.heap).files().close(fd) {
+        return wait_for(state, Suspension::Writable(fd), pc);
     }
-    pc + 1
+    *state.reg(instruction.target) = values::NIL;
+    pc.offset(1)
+}
+
+/// Allocate an integer array, `nil` if the file can not be opened.
+unsafe fn load_integers(state: &mut State, pc: *const Decoded, parse: bool) -> *const Decoded {
+    let instruction = &*pc;
+    let heap = &mut *state.heap;
+    let path = String::from_utf8_lossy(heap.string(*state.reg(instruction.left))).into_owned();
+    let integers = if parse { Ints::parse(&path) } else { Ints::map(&path) };
+    *state.reg(instruction.target) = match integers {
+        Ok(integers) => {
+            if !heap.has_room(2) {
+                heap.make_room(state.roots());
+            }
+            heap.make_integers(integers)
+        }
+        Err(ref error) if error.kind() == std::io::ErrorKind::InvalidData => {
+            panic!("Could not load integers from {}: {}", path, error)
+        }
+        Err(_) => values::NIL
+    };
+    pc.offset(1)
+}
+
+/// The file is mapped, not read
+#[inline(always)]
+pub(super) unsafe fn op_imp(state: &mut State, pc: *const Decoded) -> *const Decoded {
+    load_integers(state, pc, false)
+}
+
+#[inline(always)]
+pub(super) unsafe fn op_ipr(state: &mut State, pc: *const Decoded) -> *const Decoded {
+    load_integers(state, pc, true)
+}
+
+#[inline(always)]
+pub(super) unsafe fn op_igt(state: &mut State, pc: *const Decoded) -> *const Decoded {
+    let instruction = &*pc;
+    let integers = (*state.heap).ints(*state.reg(instruction.left));
+    let index = *state.reg(instruction.right);
+    let integer = match integers.get(index as usize) {
+        Some(&integer) if index >= 0 => integer,
+        _ => panic!("Index {} out of range for {} integers", index, integers.len())
+    };
+    *state.reg(instruction.target) = checked_integer(state, integer);
+    pc.offset(1)
+}
+
+/// The address of the integers is a plain integer, which the collector
+/// ignores. It stays valid while the array is referenced.
+#[inline(always)]
+pub(super) unsafe fn op_iad(state: &mut State, pc: *const Decoded) -> *const Decoded {
+    let instruction = &*pc;
+    let integers = (*state.heap).ints(*state.reg(instruction.left));
+    *state.reg(instruction.target) = integers.as_ptr() as i64;
+    pc.offset(1)
+}
+
+/// Load an integer by address and index, without checking the index. Only
+/// generated by folds over integer arrays, which compare the index with the
+/// length first.
+#[inline(always)]
+pub(super) unsafe fn op_igu(state: &mut State, pc: *const Decoded) -> *const Decoded {
+    let instruction = &*pc;
+    let address = *state.reg(instruction.left) as *const i64;
+    let integer = *address.offset(*state.reg(instruction.right) as isize);
+    *state.reg(instruction.target) = checked_integer(state, integer);
+    pc.offset(1)
 }
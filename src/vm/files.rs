@@ -0,0 +1,197 @@
+use std;
+use std::collections::HashMap;
+use std::ffi::CString;
+use std::io::{Error, ErrorKind};
+use std::os::unix::io::RawFd;
+use libc;
+
+/// Number of bytes read from a file descriptor at once
+const CHUNK: usize = 64 * 1024;
+
+/// Bytes read from a file descriptor but not consumed yet, and bytes not
+/// written yet
+#[derive(Default)]
+struct Channel {
+    input: Vec<u8>,
+    output: Vec<u8>,
+    end: bool
+}
+
+/// File descriptors used by a thread, all in nonblocking mode.
+///
+/// # Remarks
+///
+/// A file descriptor is switched to nonblocking mode when a thread uses it
+/// first, so descriptors of the host, like pipes and sockets, can be used as
+/// well. Input is read in large chunks and split into lines, so a file
+/// descriptor should only be read by a single thread. Output which the file
+/// descriptor does not take right away is queued, and the next write waits
+/// for it to be written.
+#[derive(Default)]
+pub(super) struct Files {
+    channels: HashMap<RawFd, Channel>,
+    /// File descriptors opened by the thread, closed when it is dropped
+    owned: Vec<RawFd>
+}
+
+impl Files {
+    /// Open a file in nonblocking mode, `None` if it can not be opened.
+    ///
+    /// # Arguments
+    ///
+    /// * `path` - Path of the file
+    /// * `write` - Whether the file is created or truncated for writing,
+    ///             instead of opened for reading
+    pub(super) fn open(&mut self, path: &[u8], write: bool) -> Option<RawFd> {
+        let path = CString::new(path).ok()?;
+        let flags = if write {
+            libc::O_WRONLY | libc::O_CREAT | libc::O_TRUNC
+        } else {
+            libc::O_RDONLY
+        };
+        let fd = unsafe { libc::open(path.as_ptr(), flags | libc::O_NONBLOCK | libc::O_CLOEXEC, 0o644) };
+        if fd < 0 {
+            return None;
+        }
+        self.owned.push(fd);
+        self.channels.insert(fd, Channel::default());
+        Some(fd)
+    }
+
+    fn channel(&mut self, fd: RawFd) -> &mut Channel {
+        let channels = &mut self.channels;
+        channels.entry(fd).or_insert_with(|| {
+            set_nonblocking(fd);
+            Channel::default()
+        })
+    }
+
+    /// Append the next line to `line`, without the line break.
+    ///
+    /// Returns the number of bytes read including the line break, which is
+    /// 0 at the end of the input, or `None` if no complete line is available
+    /// yet.
+    pub(super) fn read_line(&mut self, fd: RawFd, line: &mut Vec<u8>) -> Option<usize> {
+        let channel = self.channel(fd);
+        let mut searched = 0;
+        loop {
+            if let Some(position) = channel.input[searched..].iter().position(|&byte| byte == b'\n') {
+                let end = searched + position;
+                line.extend_from_slice(&channel.input[..end]);
+                channel.input.drain(..end + 1);
+                return Some(end + 1);
+            }
+            searched = channel.input.len();
+            if channel.end {
+                line.extend_from_slice(&channel.input);
+                channel.input.clear();
+                return Some(searched);
+            }
+
+            let start = channel.input.len();
+            channel.input.resize(start + CHUNK, 0);
+            let read = unsafe {
+                libc::read(fd, channel.input[start..].as_mut_ptr() as *mut libc::c_void, CHUNK)
+            };
+            channel.input.truncate(start + std::cmp::max(read, 0) as usize);
+            if read == 0 {
+                channel.end = true;
+            } else if read < 0 {
+                let error = Error::last_os_error();
+                match error.kind() {
+                    ErrorKind::WouldBlock => return None,
+                    ErrorKind::Interrupted => {}
+                    _ => panic!("Could not read from file descriptor {}: {}", fd, error)
+                }
+            }
+        }
+    }
+
+    /// Write bytes, queueing those the file descriptor does not take right
+    /// away. Returns `false` without writing anything if earlier output is
+    /// still queued.
+    pub(super) fn write(&mut self, fd: RawFd, bytes: &[u8]) -> bool {
+        if !self.flush(fd) {
+            return false;
+        }
+        let written = write_some(fd, bytes);
+        self.channel(fd).output.extend_from_slice(&bytes[written..]);
+        true
+    }
+
+    /// Write the queued output, returns `false` if some of it is left.
+    pub(super) fn flush(&mut self, fd: RawFd) -> bool {
+        let channel = self.channel(fd);
+        if !channel.output.is_empty() {
+            let written = write_some(fd, &channel.output);
+            channel.output.drain(..written);
+        }
+        channel.output.is_empty()
+    }
+
+    /// Close a file descriptor once its queued output is written. Returns
+    /// `false` if some of it is left.
+    pub(super) fn close(&mut self, fd: RawFd) -> bool {
+        if !self.flush(fd) {
+            return false;
+        }
+        self.channels.remove(&fd);
+        self.owned.retain(|&owned| owned != fd);
+        unsafe { libc::close(fd) };
+        true
+    }
+}
+
+impl Drop for Files {
+    fn drop(&mut self) {
+        for &fd in self.owned.iter() {
+            unsafe { libc::close(fd) };
+        }
+    }
+}
+
+/// Write as many bytes as the file descriptor takes without blocking.
+fn write_some(fd: RawFd, bytes: &[u8]) -> usize {
+    let mut written = 0;
+    while written < bytes.len() {
+        let result = unsafe {
+            libc::write(fd, bytes[written..].as_ptr() as *const libc::c_void, bytes.len() - written)
+        };
+        if result >= 0 {
+            written += result as usize;
+            continue;
+        }
+        let error = Error::last_os_error();
+        match error.kind() {
+            ErrorKind::WouldBlock => break,
+            ErrorKind::Interrupted => {}
+            _ => panic!("Could not write to file descriptor {}: {}", fd, error)
+        }
+    }
+    written
+}
+
+fn set_nonblocking(fd: RawFd) {
+    unsafe {
+        let flags = libc::fcntl(fd, libc::F_GETFL);
+        if flags < 0 || libc::fcntl(fd, libc::F_SETFL, flags | libc::O_NONBLOCK) < 0 {
+            panic!("Invalid file descriptor {}: {}", fd, Error::last_os_error());
+        }
+    }
+}
+
+/// Block until a file descriptor is ready, for threads which are not run by
+/// a reactor.
+///
+/// # Arguments
+///
+/// * `fd` - The file descriptor
+/// * `write` - Whether to wait until it can be written instead of read
+pub(super) fn wait(fd: RawFd, write: bool) {
+    let mut poll = libc::pollfd {
+        fd,
+        events: if write { libc::POLLOUT } else { libc::POLLIN },
+        revents: 0
+    };
+    unsafe { libc::poll(&mut poll, 1, -1) };
+}
@@ -0,0 +1,88 @@
+/// Number of registers of a frame
+pub(super) const FRAME: usize = 256;
+
+/// Life cycle of a generator
+#[derive(Clone, Copy, PartialEq, Debug)]
+pub(super) enum Phase {
+    /// Created or stopped at a yield, waiting to be resumed
+    Suspended,
+    /// Executing, its frames are on top of the frame which resumed it
+    Running,
+    /// The generator function has returned
+    Done
+}
+
+/// Saved execution state of a generator, the storage of a generator object.
+///
+/// A generator owns a segment of consecutive frames, starting with the frame
+/// of the generator function. While it is running, the segment is placed in
+/// the register stack two frames above the frame which resumed it, leaving
+/// the frame in between to the calls of the resumer. When it yields, the
+/// segment stays in place and the generator becomes resident. Its registers
+/// are only copied to `frames` once they are about to be overwritten, so a
+/// consumer resuming a generator in a loop never copies them.
+pub(super) struct Generator {
+    /// Registers of the saved frames, empty while the segment is in the
+    /// register stack
+    pub frames: Vec<i64>,
+    /// Number of frames of the segment
+    pub depth: usize,
+    /// Register index of the bottom frame, while the segment is in place
+    pub base: usize,
+    /// Instruction to continue at
+    pub pc: usize,
+    /// Register receiving the value sent by the next resume, relative to the
+    /// bottom frame. `None` until the generator has yielded.
+    pub receiver: Option<usize>,
+    pub phase: Phase,
+    /// Register index of the frame which resumed the generator, the resume
+    /// instruction and the generator it ran in, while running
+    pub resumer: usize,
+    pub resume_pc: usize,
+    pub outer: Option<usize>
+}
+
+impl Generator {
+    /// Create a generator which calls a function when it is resumed first.
+    ///
+    /// # Arguments
+    ///
+    /// * `entry` - Instruction the function starts at
+    /// * `frame` - Registers of the frame of the function, with the arguments
+    pub(super) fn new(entry: usize, frame: &[i64]) -> Generator {
+        Generator {
+            frames: frame.to_vec(),
+            depth: 1,
+            base: 0,
+            pc: entry,
+            receiver: None,
+            phase: Phase::Suspended,
+            resumer: 0,
+            resume_pc: 0,
+            outer: None
+        }
+    }
+
+    /// Number of registers of the segment
+    pub(super) fn len(&self) -> usize {
+        self.depth * FRAME
+    }
+
+    /// Move the instruction pointers of the generator by `offset` bytes,
+    /// when the code it runs in is moved.
+    pub(super) fn relocate(&mut self, offset: i64) {
+        self.pc = (self.pc as i64 + offset) as usize;
+        self.resume_pc = (self.resume_pc as i64 + offset) as usize;
+        for frame in self.frames.chunks_mut(FRAME) {
+            frame[0] += offset;
+        }
+    }
+
+    /// Apply a function to all saved registers, which is used to update
+    /// references when collecting garbage.
+    pub(super) fn update_values<F: FnMut(i64) -> i64>(&mut self, mut f: F) {
+        for value in self.frames.iter_mut() {
+            *value = f(*value);
+        }
+    }
+}
@@ -0,0 +1,1371 @@
+use std;
+use std::cmp::Ordering;
+use std::io::Write;
+use std::time::{Duration, Instant};
+use common::values::*;
+use super::bignum::Big;
+use super::files::Files;
+use super::generator::Generator;
+use super::ints::Ints;
+use super::map::{Table, hash_bytes};
+
+/// Size of the nursery in words, small enough to stay in the cache
+const NURSERY_WORDS: usize = 32 * 1024;
+
+/// Objects of more words are allocated in the old generation directly
+const LARGE_WORDS: usize = NURSERY_WORDS / 8;
+
+/// Size of the old generation in words before the first major collection
+const MIN_THRESHOLD: usize = 1024 * 1024;
+
+/// Kinds of heap objects, stored in the object header
+const CONS: i64 = 1;
+/// A map, its only field is the index of its hash table
+const MAP: i64 = 2;
+/// A string, its first field is the length in bytes, followed by the bytes.
+/// The remaining fields are not values, so they are skipped when scanning.
+const STR: i64 = 3;
+/// Part of a string, its fields are the string, the offset and the length
+const SLICE: i64 = 4;
+/// A byte buffer, its only field is the index of its bytes
+const BUF: i64 = 5;
+/// A record, its first field is the type number followed by the fields
+const REC: i64 = 6;
+/// A persistent vector, its fields are the length, the shift of the root
+/// level, the root node and the tail node
+const VEC: i64 = 7;
+/// A node of the trie of a vector, its first field is the number of used
+/// slots followed by `BRANCH` slots
+const NODE: i64 = 8;
+/// A generator, its only field is the index of its saved frames
+const GEN: i64 = 9;
+/// A read-only integer array, its only field is the index of its integers
+const INTS: i64 = 10;
+/// An integer out of the range of registers, its first field is the number
+/// of 32 bit limbs, negative for a negative integer, followed by the limbs.
+/// The remaining fields are not values, so they are skipped when scanning.
+const BIG: i64 = 11;
+/// A function value, its fields are the index of the function, its number
+/// of parameters and the values it captured
+const FUN: i64 = 12;
+
+/// Number of slots of a vector node
+const BRANCH: usize = 32;
+const BITS: usize = 5;
+const NODE_WORDS: usize = BRANCH + 2;
+
+/// Words allocated by a vector operation at most, for a path through a trie
+/// of 7 levels, a new root, the tail and the vector itself
+pub(super) const VECTOR_WORDS: usize = 9 * NODE_WORDS + 5;
+
+/// Index of the first element stored in the tail of a vector.
+#[inline(always)]
+fn tail_offset(len: usize) -> usize {
+    if len < BRANCH { 0 } else { (len - 1) >> BITS << BITS }
+}
+
+/// Set in the header of an object which was copied during a collection, the
+/// remaining bits are the reference to the copy
+const FORWARDED: i64 = std::i64::MIN;
+
+/// Build the header of an object.
+#[inline(always)]
+fn header(kind: i64, size: usize) -> i64 {
+    kind << 48 | size as i64
+}
+
+#[inline(always)]
+fn kind(header: i64) -> i64 {
+    header >> 48
+}
+
+/// Number of fields following the header
+#[inline(always)]
+fn size(header: i64) -> usize {
+    (header & 0xffff_ffff_ffff) as usize
+}
+
+/// Number of words of a string of the given length, including the header.
+#[inline(always)]
+pub(super) fn string_words(len: usize) -> usize {
+    2 + (len + 7) / 8
+}
+
+/// Number of words of a bignum with the given number of limbs, including
+/// the header.
+#[inline(always)]
+pub(super) fn bignum_words(limbs: usize) -> usize {
+    2 + (limbs + 1) / 2
+}
+
+/// Get the bytes of a string object.
+///
+/// # Arguments
+///
+/// * `space` - The space holding the string
+/// * `index` - Offset of the header of the string
+#[inline(always)]
+fn string_bytes(space: &[i64], index: usize) -> &[u8] {
+    let len = space[index + 1] as usize;
+    assert!(string_words(len) <= space.len() - index);
+    unsafe { std::slice::from_raw_parts(space.as_ptr().offset(index as isize + 2) as *const u8, len) }
+}
+
+/// Get the bytes of a string object for initializing them.
+#[inline(always)]
+fn string_bytes_mut(space: &mut [i64], index: usize) -> &mut [u8] {
+    let len = space[index + 1] as usize;
+    assert!(string_words(len) <= space.len() - index);
+    unsafe { std::slice::from_raw_parts_mut(space.as_mut_ptr().offset(index as isize + 2) as *mut u8, len) }
+}
+
+/// Contents of a mutable object, which are kept outside of the collected
+/// spaces
+enum Storage {
+    Table(Table),
+    Bytes(Vec<u8>),
+    Frames(Generator),
+    Ints(Ints)
+}
+
+/// Storage of a map, a buffer or a generator, with the state needed to
+/// collect it
+struct External {
+    storage: Storage,
+    /// Number of the last collection which found the object alive
+    epoch: u64,
+    /// Whether the object is in the remembered set of the heap
+    remembered: bool
+}
+
+/// Check whether a value refers to an object in the given space.
+#[inline(always)]
+fn in_space(value: i64, space: i64) -> bool {
+    is_ref(value) && value != NIL && value & OLD == space
+}
+
+/// Statistics of the garbage collector
+#[derive(Clone, Copy, Default, Debug)]
+pub struct GcStats {
+    pub minor_collections: u64,
+    pub major_collections: u64,
+    /// Words allocated in the nursery
+    pub allocated: u64,
+    /// Words copied from the nursery to the old generation
+    pub promoted: u64,
+    /// Words in the old generation after the last collection
+    pub live: u64,
+    pub total_pause: Duration,
+    pub max_pause: Duration
+}
+
+/// Heap of a thread, holding all objects which do not fit into a register.
+///
+/// Objects are allocated by bumping a pointer in a small nursery. When the
+/// nursery is full, the surviving objects are copied to the old generation,
+/// which is compacted by copying as well once it has grown enough.
+///
+/// Maps, byte buffers and generators are the only mutable objects. Their
+/// contents are kept outside of the collected spaces and freed once the
+/// object is found dead. Storing a nursery reference into an old map puts its
+/// table in a remembered set, whose values are roots of the next minor
+/// collection. Saved generator frames are always remembered.
+///
+/// Vectors are tries of 32 slots per node with a separate tail, like the
+/// persistent vectors of Clojure. Updates copy the path to the changed slot
+/// and share all other nodes. Pushing appends to the tail in place as long
+/// as no other version of the vector has appended to it, which a node tracks
+/// by its number of used slots. Old tails changed this way are remembered
+/// like maps.
+///
+/// Strings are immutable and store their bytes inline. Slicing a string does
+/// not copy it, the slice refers to the string instead. String literals are
+/// slices of a copy of the data section of the module, which is made once.
+/// Objects which are too large for the nursery, which can only be strings,
+/// are allocated in the old generation right away.
+///
+/// The collector copies the spine of a list right behind its first cell, so
+/// traversing a list that survived a collection reads memory sequentially.
+///
+/// # Remarks
+///
+/// Roots are the registers of all frames up to the current one and of the
+/// resident generator (see `Generator`). Registers are
+/// not typed, so every value with the reference tag (see `common::values`) is
+/// treated as a reference.
+pub struct Heap {
+    /// Allocated on first use, word 0 is never used so that it can be `NIL`
+    nursery: Vec<i64>,
+    top: usize,
+    old: Vec<i64>,
+    /// Size of the old generation triggering the next major collection
+    threshold: usize,
+    /// Contents of the maps and buffers, with the indices of unused entries
+    externals: Vec<Option<External>>,
+    free_externals: Vec<usize>,
+    /// Contents of the maps and buffers allocated since the last collection
+    young_externals: Vec<usize>,
+    /// Tables of old maps which may refer to the nursery
+    remembered: Vec<usize>,
+    /// Old objects changed in place which may refer to the nursery
+    remembered_objects: Vec<usize>,
+    /// Generator whose suspended frames are still in the register stack,
+    /// its storage is kept even if the generator is dead
+    resident: Option<usize>,
+    /// Storage index of the running generator, kept across suspensions of
+    /// the thread
+    running: Option<usize>,
+    /// File descriptors used by the thread
+    files: Files,
+    /// Number of the current collection
+    epoch: u64,
+    /// Old string holding the string literals, with the address and length
+    /// of the data section it was copied from
+    literals: i64,
+    literals_key: (usize, usize),
+    stats: GcStats
+}
+
+impl Heap {
+    /// Create an empty heap, memory is only allocated once the thread
+    /// allocates its first object.
+    pub fn new() -> Heap {
+        Heap {
+            nursery: Vec::new(),
+            top: 1,
+            old: Vec::new(),
+            threshold: MIN_THRESHOLD,
+            externals: Vec::new(),
+            free_externals: Vec::new(),
+            young_externals: Vec::new(),
+            remembered: Vec::new(),
+            remembered_objects: Vec::new(),
+            resident: None,
+            running: None,
+            files: Files::default(),
+            epoch: 0,
+            literals: NIL,
+            literals_key: (0, 0),
+            stats: GcStats::default()
+        }
+    }
+
+    /// Get the statistics of the collector.
+    pub fn stats(&self) -> GcStats {
+        let mut stats = self.stats;
+        stats.allocated += self.top as u64 - 1;
+        stats
+    }
+
+    /// Get the first element of a list, `None` if the value is not a list
+    /// or empty.
+    pub fn car(&self, list: i64) -> Option<i64> {
+        self.cons_field(list, 1)
+    }
+
+    /// Get the rest of a list, `None` if the value is not a list or empty.
+    pub fn cdr(&self, list: i64) -> Option<i64> {
+        self.cons_field(list, 2)
+    }
+
+    /// Get the value of a key in a map, `None` if the value is not a map or
+    /// the key is missing.
+    pub fn get(&self, map: i64, key: i64) -> Option<i64> {
+        self.table(map).and_then(|table| table.get(key))
+    }
+
+    /// Get the bytes of a string, a slice or a buffer, `None` if the value is
+    /// none of them.
+    pub fn bytes(&self, value: i64) -> Option<&[u8]> {
+        if !is_ref(value) || value == NIL {
+            return None;
+        }
+        let space = if value & OLD != 0 { &self.old } else { &self.nursery };
+        let index = offset(value);
+        match kind(*space.get(index)?) {
+            STR => Some(string_bytes(space, index)),
+            SLICE => {
+                let start = space[index + 2] as usize;
+                let len = space[index + 3] as usize;
+                self.bytes(space[index + 1]).map(|bytes| &bytes[start..start + len])
+            }
+            BUF => match self.external(value, BUF)?.storage {
+                Storage::Bytes(ref bytes) => Some(bytes),
+                _ => None
+            },
+            _ => None
+        }
+    }
+
+    /// Collect the elements of a list which only contains integers. Returns
+    /// `None` if the value is not a list.
+    pub fn to_vec(&self, list: i64) -> Option<Vec<i64>> {
+        let mut elements = Vec::new();
+        let mut list = list;
+        while list != NIL {
+            elements.push(self.car(list)?);
+            list = self.cdr(list)?;
+        }
+        Some(elements)
+    }
+
+    /// Format a value like it is written by the program, lists are written
+    /// as their elements in parentheses and maps as their entries in braces.
+    pub fn format(&self, value: i64) -> String {
+        if !is_ref(value) {
+            return value.to_string();
+        }
+        if value == NIL {
+            return "nil".to_string();
+        }
+        if let Some(bytes) = self.bytes(value) {
+            return String::from_utf8_lossy(bytes).into_owned();
+        }
+        if let Some(big) = self.bignum(value) {
+            return big.to_string();
+        }
+        if let Some(fields) = self.record_fields(value) {
+            let fields: Vec<String> = fields.iter().map(|&field| self.format(field)).collect();
+            return format!("#({})", fields.join(" "));
+        }
+        if self.function_fields(value).is_some() {
+            return "#<function>".to_string();
+        }
+        if let Some((len, _, _, _)) = self.vector_fields(value) {
+            let elements: Vec<String> = (0..len)
+                .map(|index| self.format(self.vector_get(value, index as i64)))
+                .collect();
+            return format!("[{}]", elements.join(" "));
+        }
+        if self.external(value, GEN).is_some() {
+            return "#<generator>".to_string();
+        }
+        if let Some(integers) = self.integers(value) {
+            return format!("#<{} integers>", integers.len());
+        }
+        if let Some(table) = self.table(value) {
+            let mut entries = table.entries();
+            entries.sort();
+            let entries: Vec<String> = entries.into_iter()
+                .map(|(key, value)| format!("{} {}", key, self.format(value)))
+                .collect();
+            return format!("{{{}}}", entries.join(", "));
+        }
+
+        let mut out = String::from("(");
+        let mut list = value;
+        let mut stack: Vec<i64> = Vec::new();
+        loop {
+            match (self.car(list), self.cdr(list)) {
+                (Some(car), Some(cdr)) => {
+                    if out.len() > 1 && !out.ends_with('(') {
+                        out.push(' ');
+                    }
+                    if self.car(car).is_some() {
+                        // Nested lists are formatted without recursion
+                        stack.push(cdr);
+                        out.push('(');
+                        list = car;
+                        continue;
+                    }
+                    out.push_str(&self.format(car));
+                    list = cdr;
+                }
+                _ => {
+                    if list != NIL {
+                        out.push_str(" . ");
+                        out.push_str(&self.format(list));
+                    }
+                    out.push(')');
+                    match stack.pop() {
+                        Some(rest) => list = rest,
+                        None => return out
+                    }
+                }
+            }
+        }
+    }
+
+    /// Get a field of an object of the given kind.
+    fn field(&self, value: i64, expected: i64, field: usize) -> Option<i64> {
+        if !is_ref(value) || value == NIL {
+            return None;
+        }
+        let space = if value & OLD != 0 { &self.old } else { &self.nursery };
+        let index = offset(value);
+        match space.get(index) {
+            Some(&header) if kind(header) == expected => space.get(index + field).cloned(),
+            _ => None
+        }
+    }
+
+    fn cons_field(&self, list: i64, field: usize) -> Option<i64> {
+        self.field(list, CONS, field)
+    }
+
+    /// Get the value of a bignum, `None` if the value is not one.
+    fn bignum(&self, value: i64) -> Option<Big> {
+        let limbs = self.field(value, BIG, 1)?;
+        let space = if value & OLD != 0 { &self.old } else { &self.nursery };
+        let start = unsafe { space.as_ptr().offset(offset(value) as isize + 2) as *const u32 };
+        let magnitude = unsafe { std::slice::from_raw_parts(start, limbs.abs() as usize) };
+        Some(Big::new(limbs < 0, magnitude.to_vec()))
+    }
+
+    /// Get the value of an integer, which is either in the register or a
+    /// bignum, `None` for other values.
+    fn number(&self, value: i64) -> Option<Big> {
+        if is_ref(value) { self.bignum(value) } else { Some(Big::from_i64(value)) }
+    }
+
+    /// Get the value of an integer, panicking for other values.
+    pub(super) fn integer(&self, value: i64) -> Big {
+        match self.number(value) {
+            Some(big) => big,
+            None => panic!("Not an integer: {}", self.format(value))
+        }
+    }
+
+    /// Store an integer, in the register if it fits and as a bignum
+    /// otherwise. The caller has to make room for `bignum_words` first.
+    pub(super) fn make_integer(&mut self, big: &Big) -> i64 {
+        if let Some(value) = big.to_i64() {
+            if !is_ref(value) {
+                return value;
+            }
+        }
+        let limbs = big.magnitude.len();
+        let object = self.alloc(BIG, bignum_words(limbs) - 1);
+        let space = if object & OLD != 0 { &mut self.old } else { &mut self.nursery };
+        let index = offset(object);
+        space[index + 1] = if big.negative { -(limbs as i64) } else { limbs as i64 };
+        let start = unsafe { space.as_mut_ptr().offset(index as isize + 2) as *mut u32 };
+        unsafe { std::ptr::copy_nonoverlapping(big.magnitude.as_ptr(), start, limbs) };
+        object
+    }
+
+    /// Get the storage of a map or a buffer.
+    #[inline(always)]
+    fn external(&self, value: i64, expected: i64) -> Option<&External> {
+        let index = self.field(value, expected, 1)? as usize;
+        Some(self.externals[index].as_ref().expect("Object refers to freed storage"))
+    }
+
+    #[inline(always)]
+    fn table(&self, map: i64) -> Option<&Table> {
+        match self.external(map, MAP)?.storage {
+            Storage::Table(ref table) => Some(table),
+            _ => None
+        }
+    }
+
+    /// Get the hash table of a map, panicking if the value is not a map.
+    #[inline(always)]
+    pub(super) fn map(&self, map: i64) -> &Table {
+        match self.table(map) {
+            Some(table) => table,
+            None => panic!("Not a map: {}", self.format(map))
+        }
+    }
+
+    /// Check a key of a map, which has to be an integer in a register.
+    /// References, including bignums, are not keys, as the keys of a map are
+    /// not updated when objects move.
+    #[inline(always)]
+    pub(super) fn check_key(&self, key: i64) {
+        if is_ref(key) {
+            panic!("Not an integer key: {}", self.format(key));
+        }
+    }
+
+    /// Get the fields of a record, without its type number.
+    fn record_fields(&self, record: i64) -> Option<&[i64]> {
+        self.field(record, REC, 0)?;
+        let space = if record & OLD != 0 { &self.old } else { &self.nursery };
+        let index = offset(record);
+        Some(&space[index + 2..index + 1 + size(space[index])])
+    }
+
+    /// Get a field of a record, panicking if the value is not a record or
+    /// has no such field.
+    #[inline(always)]
+    pub(super) fn record_field(&self, record: i64, index: usize) -> i64 {
+        match self.record_fields(record).and_then(|fields| fields.get(index)) {
+            Some(&field) => field,
+            None => panic!("No field {} in {}", index, self.format(record))
+        }
+    }
+
+    /// Get the number of entries of a map, the number of bytes of a string
+    /// or the number of fields of a record, panicking for other values.
+    pub(super) fn len(&self, value: i64) -> usize {
+        if let Some(table) = self.table(value) {
+            return table.len();
+        }
+        if let Some(fields) = self.record_fields(value) {
+            return fields.len();
+        }
+        if let Some((len, _, _, _)) = self.vector_fields(value) {
+            return len;
+        }
+        if let Some(integers) = self.integers(value) {
+            return integers.len();
+        }
+        match self.bytes(value) {
+            Some(bytes) => bytes.len(),
+            None => panic!("No size: {}", self.format(value))
+        }
+    }
+
+    /// Get the bytes of a string, panicking if the value has none.
+    #[inline(always)]
+    pub(super) fn string(&self, value: i64) -> &[u8] {
+        match self.bytes(value) {
+            Some(bytes) => bytes,
+            None => panic!("Not a string: {}", self.format(value))
+        }
+    }
+
+    /// Allocate an object, either in the nursery or in the old generation if
+    /// it is large. The caller has to make room first and to set the fields.
+    #[inline(always)]
+    fn alloc(&mut self, kind: i64, fields: usize) -> i64 {
+        let words = fields + 1;
+        if words > LARGE_WORDS {
+            let index = self.old.len();
+            self.old.resize(index + words, 0);
+            self.old[index] = header(kind, fields);
+            return REF | OLD | index as i64;
+        }
+
+        let top = self.top;
+        self.nursery[top] = header(kind, fields);
+        self.top = top + words;
+        REF | top as i64
+    }
+
+    /// Allocate a string of the given length, its bytes are set through
+    /// `string_bytes_mut`.
+    fn alloc_string(&mut self, len: usize) -> i64 {
+        let string = self.alloc(STR, string_words(len) - 1);
+        let space = if string & OLD != 0 { &mut self.old } else { &mut self.nursery };
+        space[offset(string) + 1] = len as i64;
+        string
+    }
+
+    /// Allocate a map or a buffer with the given contents.
+    fn alloc_external(&mut self, kind: i64, storage: Storage) -> i64 {
+        let external = External {
+            storage,
+            epoch: self.epoch,
+            remembered: false
+        };
+        let index = match self.free_externals.pop() {
+            Some(index) => {
+                self.externals[index] = Some(external);
+                index
+            }
+            None => {
+                self.externals.push(Some(external));
+                self.externals.len() - 1
+            }
+        };
+        self.young_externals.push(index);
+
+        let object = self.alloc(kind, 1);
+        self.nursery[offset(object) + 1] = index as i64;
+        object
+    }
+
+    /// Get the index of the contents of a buffer, panicking if the value is
+    /// not a buffer.
+    fn buffer_index(&self, buffer: i64) -> usize {
+        match self.field(buffer, BUF, 1) {
+            Some(index) => index as usize,
+            None => panic!("Not a buffer: {}", self.format(buffer))
+        }
+    }
+
+    fn buffer_mut(&mut self, index: usize) -> &mut Vec<u8> {
+        match self.externals[index] {
+            Some(External { storage: Storage::Bytes(ref mut bytes), .. }) => bytes,
+            _ => panic!("Buffer refers to freed storage")
+        }
+    }
+
+    /// Allocate an empty map. The caller has to make room first.
+    pub(super) fn make_map(&mut self) -> i64 {
+        self.alloc_external(MAP, Storage::Table(Table::new()))
+    }
+
+    /// Allocate an empty byte buffer. The caller has to make room first.
+    pub(super) fn make_buffer(&mut self) -> i64 {
+        self.alloc_external(BUF, Storage::Bytes(Vec::new()))
+    }
+
+    /// Set the value of a key in a map, panicking if the value is not a map
+    /// or the key is not an integer.
+    pub(super) fn put(&mut self, map: i64, key: i64, value: i64) {
+        self.check_key(key);
+        let index = match self.field(map, MAP, 1) {
+            Some(index) => index as usize,
+            None => panic!("Not a map: {}", self.format(map))
+        };
+        let external = self.externals[index].as_mut().expect("Map refers to freed storage");
+
+        // Write barrier, an old map must not refer to the nursery unnoticed
+        if map & OLD != 0 && in_space(value, 0) && !external.remembered {
+            external.remembered = true;
+            self.remembered.push(index);
+        }
+        if let Storage::Table(ref mut table) = external.storage {
+            table.insert(key, value);
+        }
+    }
+
+    /// Allocate a cons cell. The caller has to make room first.
+    #[inline(always)]
+    pub(super) fn cons(&mut self, car: i64, cdr: i64) -> i64 {
+        let top = self.top;
+        unsafe {
+            *self.nursery.get_unchecked_mut(top) = header(CONS, 2);
+            *self.nursery.get_unchecked_mut(top + 1) = car;
+            *self.nursery.get_unchecked_mut(top + 2) = cdr;
+        }
+        self.top = top + 3;
+        REF | top as i64
+    }
+
+    /// Allocate a record. The caller has to make room first.
+    ///
+    /// # Arguments
+    ///
+    /// * `fields` - The type number of the record, followed by the fields
+    pub(super) fn record(&mut self, fields: &[i64]) -> i64 {
+        let record = self.alloc(REC, fields.len());
+        let index = offset(record);
+        self.nursery[index + 1..index + 1 + fields.len()].copy_from_slice(fields);
+        record
+    }
+
+    /// Allocate a function value. The caller has to make room first.
+    ///
+    /// # Arguments
+    ///
+    /// * `fields` - The index of the function and its number of parameters,
+    ///              followed by the captured values
+    pub(super) fn function(&mut self, fields: &[i64]) -> i64 {
+        let function = self.alloc(FUN, fields.len());
+        let index = offset(function);
+        self.nursery[index + 1..index + 1 + fields.len()].copy_from_slice(fields);
+        function
+    }
+
+    /// Get the fields of a function value, `None` if the value is not one.
+    #[inline(always)]
+    pub(super) fn function_fields(&self, function: i64) -> Option<&[i64]> {
+        self.field(function, FUN, 0)?;
+        let space = if function & OLD != 0 { &self.old } else { &self.nursery };
+        let index = offset(function);
+        Some(&space[index + 1..index + 1 + size(space[index])])
+    }
+
+    /// Copy a record, replacing one of its fields. The caller has to make
+    /// room for a record of the same size first.
+    pub(super) fn with(&mut self, record: i64, index: usize, value: i64) -> i64 {
+        self.record_field(record, index);
+        let words = self.len(record) + 2;
+        let copy = self.alloc(REC, words - 1);
+        let (from, to) = (offset(record), offset(copy));
+        if record & OLD != 0 {
+            self.nursery[to + 1..to + words].copy_from_slice(&self.old[from + 1..from + words]);
+        } else {
+            for word in 1..words {
+                self.nursery[to + word] = self.nursery[from + word];
+            }
+        }
+        self.nursery[to + 2 + index] = value;
+        copy
+    }
+
+    /// Read a word of an object in either space.
+    #[inline(always)]
+    fn word(&self, object: i64, field: usize) -> i64 {
+        let space = if object & OLD != 0 { &self.old } else { &self.nursery };
+        space[offset(object) + field]
+    }
+
+    #[inline(always)]
+    fn set_word(&mut self, object: i64, field: usize, value: i64) {
+        let space = if object & OLD != 0 { &mut self.old } else { &mut self.nursery };
+        space[offset(object) + field] = value;
+    }
+
+    /// Get the length, shift, root and tail of a vector.
+    #[inline(always)]
+    fn vector_fields(&self, vector: i64) -> Option<(usize, usize, i64, i64)> {
+        let len = self.field(vector, VEC, 1)? as usize;
+        Some((len, self.word(vector, 2) as usize, self.word(vector, 3), self.word(vector, 4)))
+    }
+
+    fn vector_parts(&self, vector: i64) -> (usize, usize, i64, i64) {
+        match self.vector_fields(vector) {
+            Some(parts) => parts,
+            None => panic!("Not a vector: {}", self.format(vector))
+        }
+    }
+
+    #[inline(always)]
+    fn slot(&self, node: i64, index: usize) -> i64 {
+        self.word(node, 2 + index)
+    }
+
+    /// Allocate a vector node holding the first `used` slots of another node,
+    /// or no slots if the other node is `NIL`. Unused slots are cleared, as
+    /// they are scanned by the collector.
+    fn new_node(&mut self, from: i64, used: usize) -> i64 {
+        let node = self.alloc(NODE, BRANCH + 1);
+        let index = offset(node);
+        self.nursery[index + 1] = used as i64;
+        for slot in 0..BRANCH {
+            let value = if slot < used { self.slot(from, slot) } else { 0 };
+            self.nursery[index + 2 + slot] = value;
+        }
+        node
+    }
+
+    fn new_vector(&mut self, len: usize, shift: usize, root: i64, tail: i64) -> i64 {
+        let vector = self.alloc(VEC, 4);
+        let index = offset(vector);
+        self.nursery[index + 1] = len as i64;
+        self.nursery[index + 2] = shift as i64;
+        self.nursery[index + 3] = root;
+        self.nursery[index + 4] = tail;
+        vector
+    }
+
+    /// Allocate an empty vector. The caller has to make room first.
+    pub(super) fn make_vector(&mut self) -> i64 {
+        let tail = self.new_node(NIL, 0);
+        self.new_vector(0, BITS, NIL, tail)
+    }
+
+    /// Get the length of a vector, panicking if the value is not a vector.
+    #[inline(always)]
+    pub(super) fn vector_len(&self, vector: i64) -> usize {
+        self.vector_parts(vector).0
+    }
+
+    /// Get an element of a vector, panicking if the index is out of bounds.
+    pub(super) fn vector_get(&self, vector: i64, index: i64) -> i64 {
+        let (len, shift, root, tail) = self.vector_parts(vector);
+        if index < 0 || index as usize >= len {
+            panic!("Index {} out of bounds of a vector of length {}", index, len);
+        }
+
+        let index = index as usize;
+        if index >= tail_offset(len) {
+            return self.slot(tail, index & (BRANCH - 1));
+        }
+        let mut node = root;
+        let mut level = shift;
+        while level > 0 {
+            node = self.slot(node, (index >> level) & (BRANCH - 1));
+            level -= BITS;
+        }
+        self.slot(node, index & (BRANCH - 1))
+    }
+
+    /// Append an element to a vector. The caller has to make room for
+    /// `VECTOR_WORDS` first.
+    pub(super) fn vector_push(&mut self, vector: i64, value: i64) -> i64 {
+        let (len, shift, root, tail) = self.vector_parts(vector);
+        let used = len - tail_offset(len);
+
+        if used < BRANCH {
+            // The tail is shared until another version appends to it
+            let tail = if self.word(tail, 1) as usize == used {
+                if tail & OLD != 0 && in_space(value, 0) {
+                    self.remembered_objects.push(offset(tail));
+                }
+                tail
+            } else {
+                self.new_node(tail, used)
+            };
+            self.set_word(tail, 2 + used, value);
+            self.set_word(tail, 1, used as i64 + 1);
+            return self.new_vector(len + 1, shift, root, tail);
+        }
+
+        // The tail is full, so it becomes a leaf of the trie
+        let (root, shift) = if (len >> BITS) > (1 << shift) {
+            let path = self.new_path(shift, tail);
+            let node = self.new_node(NIL, 2);
+            self.set_word(node, 2, root);
+            self.set_word(node, 3, path);
+            (node, shift + BITS)
+        } else {
+            (self.push_tail(len, shift, root, tail), shift)
+        };
+        let tail = self.new_node(NIL, 1);
+        self.set_word(tail, 2, value);
+        self.new_vector(len + 1, shift, root, tail)
+    }
+
+    /// Copy the path to the rightmost leaf of a trie, adding a full tail.
+    fn push_tail(&mut self, len: usize, level: usize, parent: i64, tail: i64) -> i64 {
+        let index = ((len - 1) >> level) & (BRANCH - 1);
+        let used = if parent == NIL { 0 } else { self.word(parent, 1) as usize };
+        let child = if level == BITS {
+            tail
+        } else if index < used {
+            let child = self.slot(parent, index);
+            self.push_tail(len, level - BITS, child, tail)
+        } else {
+            self.new_path(level - BITS, tail)
+        };
+
+        let node = self.new_node(parent, used);
+        self.set_word(node, 2 + index, child);
+        self.set_word(node, 1, used.max(index + 1) as i64);
+        node
+    }
+
+    /// Build a path of nodes with a single slot down to a leaf.
+    fn new_path(&mut self, level: usize, leaf: i64) -> i64 {
+        let mut node = leaf;
+        let mut level = level;
+        while level > 0 {
+            let parent = self.new_node(NIL, 1);
+            self.set_word(parent, 2, node);
+            node = parent;
+            level -= BITS;
+        }
+        node
+    }
+
+    /// Replace an element of a vector, or append it if the index is the
+    /// length. The caller has to make room for `VECTOR_WORDS` first.
+    pub(super) fn vector_assoc(&mut self, vector: i64, index: i64, value: i64) -> i64 {
+        let (len, shift, root, tail) = self.vector_parts(vector);
+        if index < 0 || index as usize > len {
+            panic!("Index {} out of bounds of a vector of length {}", index, len);
+        }
+
+        let index = index as usize;
+        if index == len {
+            return self.vector_push(vector, value);
+        }
+        if index >= tail_offset(len) {
+            let tail = self.new_node(tail, len - tail_offset(len));
+            self.set_word(tail, 2 + (index & (BRANCH - 1)), value);
+            return self.new_vector(len, shift, root, tail);
+        }
+
+        // Copy the nodes on the path from the root to the leaf
+        let used = self.word(root, 1) as usize;
+        let root = self.new_node(root, used);
+        let mut node = root;
+        let mut level = shift;
+        while level > 0 {
+            let slot = (index >> level) & (BRANCH - 1);
+            let child = self.slot(node, slot);
+            let used = self.word(child, 1) as usize;
+            let child = self.new_node(child, used);
+            self.set_word(node, 2 + slot, child);
+            node = child;
+            level -= BITS;
+        }
+        self.set_word(node, 2 + (index & (BRANCH - 1)), value);
+        self.new_vector(len, shift, root, tail)
+    }
+
+    /// Get a string literal. The caller has to make room for a slice first.
+    ///
+    /// # Arguments
+    ///
+    /// * `data` - Data section of the module
+    /// * `literal` - Offset and length of the literal (see `values::literal`)
+    ///
+    /// # Remarks
+    ///
+    /// The data section is copied to the old generation the first time a
+    /// literal of the module is used, all literals are slices of this copy.
+    pub(super) fn literal(&mut self, data: &[u8], literal: i64) -> i64 {
+        let key = (data.as_ptr() as usize, data.len());
+        if self.literals == NIL || self.literals_key != key {
+            let index = self.old.len();
+            self.old.resize(index + string_words(data.len()), 0);
+            self.old[index] = header(STR, string_words(data.len()) - 1);
+            self.old[index + 1] = data.len() as i64;
+            string_bytes_mut(&mut self.old, index).copy_from_slice(data);
+            self.literals = REF | OLD | index as i64;
+            self.literals_key = key;
+        }
+
+        let literals = self.literals;
+        self.make_slice(literals, (literal >> 32) as usize, (literal & 0xffff_ffff) as usize)
+    }
+
+    fn make_slice(&mut self, string: i64, start: usize, len: usize) -> i64 {
+        let slice = self.alloc(SLICE, 3);
+        let index = offset(slice);
+        self.nursery[index + 1] = string;
+        self.nursery[index + 2] = start as i64;
+        self.nursery[index + 3] = len as i64;
+        slice
+    }
+
+    /// Words allocated by `slice`.
+    pub(super) fn slice_words(&self, string: i64, start: i64, end: i64) -> usize {
+        if self.field(string, BUF, 1).is_some() {
+            string_words((end - start).max(0) as usize)
+        } else {
+            4
+        }
+    }
+
+    /// Get the bytes from `start` up to `end` of a string without copying
+    /// them. The bytes of a buffer are copied into a new string, as the
+    /// buffer may change later. The caller has to make room for
+    /// `slice_words` first.
+    pub(super) fn slice(&mut self, string: i64, start: i64, end: i64) -> i64 {
+        let len = self.string(string).len() as i64;
+        if start < 0 || start > end || end > len {
+            panic!("Invalid slice {}..{} of {}", start, end, self.format(string));
+        }
+
+        if self.field(string, BUF, 1).is_some() {
+            let copy = self.alloc_string((end - start) as usize);
+            let index = self.buffer_index(string);
+            let space = if copy & OLD != 0 { &mut self.old } else { &mut self.nursery };
+            if let Some(External { storage: Storage::Bytes(ref bytes), .. }) = self.externals[index] {
+                string_bytes_mut(space, offset(copy)).copy_from_slice(&bytes[start as usize..end as usize]);
+            }
+            return copy;
+        }
+
+        // Slices always refer to a string, so reading one is a single step
+        match self.field(string, SLICE, 1) {
+            Some(base) => {
+                let first = self.field(string, SLICE, 2).unwrap_or(0);
+                self.make_slice(base, (first + start) as usize, (end - start) as usize)
+            }
+            None => self.make_slice(string, start as usize, (end - start) as usize)
+        }
+    }
+
+    /// Copy the contents of a buffer into a new string. The caller has to
+    /// make room for a string of the length of the buffer first.
+    pub(super) fn freeze(&mut self, buffer: i64) -> i64 {
+        let index = self.buffer_index(buffer);
+        let len = self.buffer_mut(index).len();
+        let string = self.alloc_string(len);
+        let space = if string & OLD != 0 { &mut self.old } else { &mut self.nursery };
+        if let Some(External { storage: Storage::Bytes(ref bytes), .. }) = self.externals[index] {
+            string_bytes_mut(space, offset(string)).copy_from_slice(bytes);
+        }
+        string
+    }
+
+    /// Append a value to a buffer, strings are appended as their bytes and
+    /// all other values as they are written.
+    pub(super) fn append(&mut self, buffer: i64, value: i64) {
+        let index = self.buffer_index(buffer);
+        let mut bytes = std::mem::replace(self.buffer_mut(index), Vec::new());
+        if !is_ref(value) {
+            write!(bytes, "{}", value).unwrap();
+        } else if self.field(value, BUF, 1) == Some(index as i64) {
+            let copy = bytes.clone();
+            bytes.extend_from_slice(&copy);
+        } else {
+            match self.bytes(value) {
+                Some(value) => bytes.extend_from_slice(value),
+                None => bytes.extend_from_slice(self.format(value).as_bytes())
+            }
+        }
+        *self.buffer_mut(index) = bytes;
+    }
+
+    /// Compare two integers by value, or the bytes of two strings.
+    pub(super) fn compare(&self, left: i64, right: i64) -> Ordering {
+        if let (Some(left), Some(right)) = (self.number(left), self.number(right)) {
+            return left.cmp(&right);
+        }
+        self.string(left).cmp(self.string(right))
+    }
+
+    /// Compare two integers by value, other values are only equal to
+    /// themselves.
+    pub(super) fn equal(&self, left: i64, right: i64) -> bool {
+        match (self.number(left), self.number(right)) {
+            (Some(left), Some(right)) => left == right,
+            _ => left == right
+        }
+    }
+
+    /// Hash the bytes of a string, the hash is an integer of 47 bits.
+    pub(super) fn hash(&self, string: i64) -> i64 {
+        (hash_bytes(self.string(string)) & (OLD as u64 - 1)) as i64
+    }
+
+    /// Take the contents of a buffer, leaving it empty until they are put
+    /// back with `set_bytes`. Panics if the value is not a buffer.
+    pub(super) fn take_bytes(&mut self, buffer: i64) -> Vec<u8> {
+        let index = self.buffer_index(buffer);
+        std::mem::replace(self.buffer_mut(index), Vec::new())
+    }
+
+    /// Replace the contents of a buffer, panicking if the value is not a
+    /// buffer.
+    pub(super) fn set_bytes(&mut self, buffer: i64, bytes: Vec<u8>) {
+        let index = self.buffer_index(buffer);
+        *self.buffer_mut(index) = bytes;
+    }
+
+    /// Allocate a generator. The caller has to make room first.
+    pub(super) fn make_generator(&mut self, generator: Generator) -> i64 {
+        self.alloc_external(GEN, Storage::Frames(generator))
+    }
+
+    /// Allocate an integer array. The caller has to make room first.
+    pub(super) fn make_integers(&mut self, integers: Ints) -> i64 {
+        self.alloc_external(INTS, Storage::Ints(integers))
+    }
+
+    #[inline(always)]
+    fn integers(&self, array: i64) -> Option<&[i64]> {
+        match self.external(array, INTS)?.storage {
+            Storage::Ints(ref integers) => Some(integers.as_slice()),
+            _ => None
+        }
+    }
+
+    /// Get the integers of an integer array, panicking if the value is not
+    /// an integer array. They stay in place until the array is collected.
+    #[inline(always)]
+    pub(super) fn ints(&self, array: i64) -> &[i64] {
+        match self.integers(array) {
+            Some(integers) => integers,
+            None => panic!("Not an integer array: {}", self.format(array))
+        }
+    }
+
+    /// Get the index of the storage of a generator, panicking if the value is
+    /// not a generator. The index stays the same when the object is moved.
+    pub(super) fn generator_index(&self, value: i64) -> usize {
+        match self.field(value, GEN, 1) {
+            Some(index) => index as usize,
+            None => panic!("Not a generator: {}", self.format(value))
+        }
+    }
+
+    /// Get the saved state of a generator by the index of its storage.
+    #[inline(always)]
+    pub(super) fn generator(&mut self, index: usize) -> &mut Generator {
+        match self.externals[index] {
+            Some(External { storage: Storage::Frames(ref mut generator), .. }) => generator,
+            _ => panic!("Generator refers to freed storage")
+        }
+    }
+
+    /// Index of the storage of the running generator
+    #[inline(always)]
+    pub(super) fn running(&self) -> Option<usize> {
+        self.running
+    }
+
+    pub(super) fn set_running(&mut self, index: Option<usize>) {
+        self.running = index;
+    }
+
+    /// Get the file descriptors used by the thread.
+    #[inline(always)]
+    pub(super) fn files(&mut self) -> &mut Files {
+        &mut self.files
+    }
+
+    /// Index of the storage of the resident generator
+    #[inline(always)]
+    pub(super) fn resident(&self) -> Option<usize> {
+        self.resident
+    }
+
+    /// Leave the frames of a suspended generator in the register stack. A
+    /// generator resident before is evicted.
+    pub(super) fn set_resident(&mut self, index: usize, registers: &[i64]) {
+        if self.resident != Some(index) {
+            self.evict(registers);
+        }
+        self.resident = Some(index);
+    }
+
+    /// Take over the frames of the resident generator, which is resumed in
+    /// place.
+    pub(super) fn take_resident(&mut self) {
+        self.resident = None;
+    }
+
+    /// Register index after the frames of the resident generator, 0 if
+    /// there is none
+    pub(super) fn resident_end(&self) -> usize {
+        match self.resident.and_then(|index| self.externals[index].as_ref()) {
+            Some(&External { storage: Storage::Frames(ref generator), .. }) => {
+                generator.base + generator.len()
+            }
+            _ => 0
+        }
+    }
+
+    /// Move the instruction pointers of all generators by `offset` bytes (see
+    /// `Generator::relocate`).
+    pub(super) fn relocate_generators(&mut self, offset: i64) {
+        for external in self.externals.iter_mut() {
+            if let Some(External { storage: Storage::Frames(ref mut generator), .. }) = *external {
+                generator.relocate(offset);
+            }
+        }
+    }
+
+    /// Copy the frames of the resident generator out of the register stack,
+    /// before they are overwritten.
+    ///
+    /// # Arguments
+    ///
+    /// * `registers` - The whole register stack
+    #[inline(never)]
+    pub(super) fn evict(&mut self, registers: &[i64]) {
+        let index = match self.resident.take() {
+            Some(index) => index,
+            None => return
+        };
+        {
+            let generator = self.generator(index);
+            let start = generator.base;
+            let end = start + generator.len();
+            generator.frames.extend_from_slice(&registers[start..end]);
+        }
+
+        // The frames may refer to the nursery, regardless of the generation
+        // of the generator
+        let external = self.externals[index].as_mut().expect("Generator refers to freed storage");
+        if !external.remembered {
+            external.remembered = true;
+            self.remembered.push(index);
+        }
+    }
+
+    /// Check whether an object of the given number of words fits into the
+    /// nursery without a collection.
+    #[inline(always)]
+    pub(super) fn has_room(&self, words: usize) -> bool {
+        words > LARGE_WORDS || self.top + words <= self.nursery.len()
+    }
+
+    /// Make room in the nursery, by collecting garbage if it is in use.
+    ///
+    /// # Arguments
+    ///
+    /// * `roots` - Registers which may hold references, updated in place
+    #[inline(never)]
+    pub(super) fn make_room(&mut self, roots: &mut [i64]) {
+        if self.nursery.is_empty() {
+            self.nursery = vec![0; NURSERY_WORDS];
+            return;
+        }
+
+        let start = Instant::now();
+        self.minor(roots);
+        if self.old.len() > self.threshold {
+            self.major(roots);
+        }
+
+        let pause = start.elapsed();
+        self.stats.total_pause += pause;
+        self.stats.max_pause = self.stats.max_pause.max(pause);
+        self.stats.live = self.old.len() as u64;
+    }
+
+    /// Copy all live objects of the nursery to the old generation.
+    fn minor(&mut self, roots: &mut [i64]) {
+        self.epoch += 1;
+        let promoted = self.old.len();
+        for root in roots.iter_mut() {
+            *root = evacuate(&mut self.nursery, 0, &mut self.old, *root);
+        }
+        for index in self.remembered_objects.drain(..) {
+            for field in index + 1..index + 1 + size(self.old[index]) {
+                let value = self.old[field];
+                self.old[field] = evacuate(&mut self.nursery, 0, &mut self.old, value);
+            }
+        }
+        for index in self.remembered.drain(..) {
+            if let Some(ref mut external) = self.externals[index] {
+                let nursery = &mut self.nursery;
+                let old = &mut self.old;
+                match external.storage {
+                    Storage::Table(ref mut table) => {
+                        table.update_values(|value| evacuate(nursery, 0, old, value));
+                    }
+                    Storage::Frames(ref mut generator) => {
+                        generator.update_values(|value| evacuate(nursery, 0, old, value));
+                    }
+                    Storage::Bytes(_) | Storage::Ints(_) => {}
+                }
+                external.remembered = false;
+            }
+        }
+        scan(&mut self.nursery, 0, &mut self.old, promoted, &mut self.externals, self.epoch);
+
+        // Free the contents of maps, buffers and generators which died young
+        let epoch = self.epoch;
+        let resident = self.resident;
+        for index in self.young_externals.drain(..) {
+            if Some(index) != resident &&
+               self.externals[index].as_ref().map_or(false, |external| external.epoch != epoch) {
+                self.externals[index] = None;
+                self.free_externals.push(index);
+            }
+        }
+
+        self.stats.minor_collections += 1;
+        self.stats.allocated += self.top as u64 - 1;
+        self.stats.promoted += (self.old.len() - promoted) as u64;
+        self.top = 1;
+    }
+
+    /// Compact the old generation, the nursery has to be empty.
+    fn major(&mut self, roots: &mut [i64]) {
+        self.epoch += 1;
+        let mut to: Vec<i64> = Vec::with_capacity(self.old.len());
+        for root in roots.iter_mut() {
+            *root = evacuate(&mut self.old, OLD, &mut to, *root);
+        }
+        self.literals = evacuate(&mut self.old, OLD, &mut to, self.literals);
+        scan(&mut self.old, OLD, &mut to, 0, &mut self.externals, self.epoch);
+
+        let epoch = self.epoch;
+        for index in 0..self.externals.len() {
+            if Some(index) != self.resident &&
+               self.externals[index].as_ref().map_or(false, |external| external.epoch != epoch) {
+                self.externals[index] = None;
+                self.free_externals.push(index);
+            }
+        }
+
+        self.old = to;
+        self.threshold = (2 * self.old.len()).max(MIN_THRESHOLD);
+        self.stats.major_collections += 1;
+    }
+}
+
+impl Default for Heap {
+    fn default() -> Heap {
+        Heap::new()
+    }
+}
+
+/// Copy a single object and set its forwarding reference.
+fn copy(from: &mut [i64], to: &mut Vec<i64>, value: i64) -> i64 {
+    let index = offset(value);
+    let words = size(from[index]) + 1;
+    let moved = REF | OLD | to.len() as i64;
+    to.extend_from_slice(&from[index..index + words]);
+    from[index] = FORWARDED | moved;
+    moved
+}
+
+/// Copy an object to the old generation, unless it was copied before, and
+/// get its new reference. Values not referring to the collected space are
+/// returned unchanged.
+///
+/// # Arguments
+///
+/// * `from` - The collected space
+/// * `space` - Reference bits of the collected space
+/// * `to` - The space objects are copied to
+/// * `value` - A value which may refer to an object
+///
+/// # Remarks
+///
+/// The cells of a list spine are copied one after another, the fields of the
+/// copies still refer to the collected space until they are scanned.
+fn evacuate(from: &mut [i64], space: i64, to: &mut Vec<i64>, value: i64) -> i64 {
+    if !in_space(value, space) {
+        return value;
+    }
+    let header = from[offset(value)];
+    if header & FORWARDED != 0 {
+        return header & !FORWARDED;
+    }
+
+    let moved = copy(from, to, value);
+    if kind(header) == CONS {
+        let mut cell = value;
+        loop {
+            let cdr = from[offset(cell) + 2];
+            if !in_space(cdr, space) {
+                break;
+            }
+            let header = from[offset(cdr)];
+            if header & FORWARDED != 0 || kind(header) != CONS {
+                break;
+            }
+            copy(from, to, cdr);
+            cell = cdr;
+        }
+    }
+    moved
+}
+
+/// Evacuate the objects referenced by all objects copied so far, until no
+/// new objects are copied.
+///
+/// # Arguments
+///
+/// * `from` - The collected space
+/// * `space` - Reference bits of the collected space
+/// * `to` - The space objects are copied to
+/// * `start` - Index of the first copied object in `to`
+/// * `externals` - Contents of the maps, buffers, generators and integer
+///                 arrays, the contents of copied objects are marked, the
+///                 tables of maps and the frames of generators are scanned
+/// * `epoch` - Number of the collection
+fn scan(from: &mut [i64],
+        space: i64,
+        to: &mut Vec<i64>,
+        start: usize,
+        externals: &mut [Option<External>],
+        epoch: u64) {
+    let mut index = start;
+    while index < to.len() {
+        let words = size(to[index]);
+        match kind(to[index]) {
+            MAP | BUF | GEN | INTS => {
+                if let Some(ref mut external) = externals[to[index + 1] as usize] {
+                    external.epoch = epoch;
+                    match external.storage {
+                        Storage::Table(ref mut table) => {
+                            table.update_values(|value| evacuate(from, space, to, value));
+                        }
+                        Storage::Frames(ref mut generator) => {
+                            generator.update_values(|value| evacuate(from, space, to, value));
+                        }
+                        Storage::Bytes(_) | Storage::Ints(_) => {}
+                    }
+                }
+            }
+            STR | BIG => {
+                index += words + 1;
+                continue;
+            }
+            _ => {}
+        }
+        for field in index + 1..index + 1 + words {
+            let value = to[field];
+            let moved = evacuate(from, space, to, value);
+            to[field] = moved;
+        }
+        index += words + 1;
+    }
+}
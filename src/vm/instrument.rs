@@ -0,0 +1,137 @@
+use std;
+use std::sync::atomic::{AtomicBool, AtomicPtr, AtomicUsize, Ordering};
+use super::decode::Decoded;
+
+/// Whether instrumentation is requested
+static ENABLED: AtomicBool = AtomicBool::new(false);
+
+/// Held while the instruction stream is being re-threaded
+static BUSY: AtomicBool = AtomicBool::new(false);
+
+/// Instruction stream of the running instrumented thread, null if none
+static STREAM: AtomicPtr<Decoded> = AtomicPtr::new(std::ptr::null_mut());
+static LEN: AtomicUsize = AtomicUsize::new(0);
+
+/// Handler addresses of the regular handlers, indexed by opcode
+static HANDLERS: AtomicPtr<usize> = AtomicPtr::new(std::ptr::null_mut());
+
+/// Address of the instrumenting entry point
+static HOOK: AtomicUsize = AtomicUsize::new(0);
+
+/// Point the handler of every instruction of the registered stream either to
+/// the instrumenting entry point or back to its regular handler. Must only be
+/// called while holding `BUSY`.
+///
+/// The handler addresses are replaced one word at a time, so the stream stays
+/// valid for a thread executing it concurrently.
+unsafe fn rethread(enabled: bool) {
+    let stream = STREAM.load(Ordering::Acquire);
+    if stream.is_null() {
+        return;
+    }
+
+    let handlers = HANDLERS.load(Ordering::Relaxed);
+    let hook = HOOK.load(Ordering::Relaxed);
+    for pc in 0..LEN.load(Ordering::Relaxed) {
+        let instruction = stream.offset(pc as isize);
+        let handler = if enabled {
+            hook
+        } else {
+            *handlers.offset((*instruction).opcode as isize)
+        };
+        let slot = &mut (*instruction).handler as *mut usize as *const AtomicUsize;
+        (*slot).store(handler, Ordering::Relaxed);
+    }
+}
+
+/// Re-thread the registered stream until it matches the requested state.
+///
+/// # Remarks
+///
+/// This never blocks, so it can be called from a signal handler. If another
+/// caller is currently re-threading, it picks up the new request once done.
+fn apply() {
+    loop {
+        if BUSY.compare_exchange(false, true, Ordering::Acquire, Ordering::Relaxed).is_err() {
+            return;
+        }
+        let enabled = ENABLED.load(Ordering::SeqCst);
+        unsafe {
+            rethread(enabled);
+        }
+        BUSY.store(false, Ordering::Release);
+
+        if ENABLED.load(Ordering::SeqCst) == enabled {
+            return;
+        }
+    }
+}
+
+/// Wait until the stream registration can be changed.
+fn lock() {
+    while BUSY.compare_exchange(false, true, Ordering::Acquire, Ordering::Relaxed).is_err() {
+        std::thread::yield_now();
+    }
+}
+
+/// Switch the instrumentation of the running instrumented thread on or off.
+///
+/// # Arguments
+///
+/// * `enabled` - Whether instructions should pass the instrumenting entry point
+///
+/// # Remarks
+///
+/// The request also applies to instrumented threads started later. This may
+/// be called from any thread or from a signal handler, as it only rewrites
+/// the handler addresses of the instruction stream. While instrumentation is
+/// off, instructions dispatch directly to their regular handlers, so there is
+/// no overhead at all.
+pub fn set_instrumentation(enabled: bool) {
+    ENABLED.store(enabled, Ordering::SeqCst);
+    apply();
+}
+
+/// Check whether instrumentation is currently requested.
+pub fn instrumentation() -> bool {
+    ENABLED.load(Ordering::SeqCst)
+}
+
+/// Registration of an instruction stream for switching its instrumentation,
+/// the stream is unregistered when this is dropped.
+pub(super) struct Attachment;
+
+impl Attachment {
+    /// Register the instruction stream of a thread and thread it according
+    /// to the requested instrumentation.
+    ///
+    /// # Arguments
+    ///
+    /// * `stream` - The pre-decoded instruction stream, which must outlive the
+    ///              attachment
+    /// * `handlers` - Regular handler address for each opcode, which must
+    ///                outlive the attachment
+    /// * `hook` - Address of the instrumenting entry point
+    pub(super) fn new(stream: &mut [Decoded], handlers: &[usize; 256], hook: usize) -> Attachment {
+        lock();
+        LEN.store(stream.len(), Ordering::Relaxed);
+        HANDLERS.store(handlers.as_ptr() as *mut usize, Ordering::Relaxed);
+        HOOK.store(hook, Ordering::Relaxed);
+        STREAM.store(stream.as_mut_ptr(), Ordering::Release);
+        unsafe {
+            rethread(ENABLED.load(Ordering::SeqCst));
+        }
+        BUSY.store(false, Ordering::Release);
+
+        apply();
+        Attachment
+    }
+}
+
+impl Drop for Attachment {
+    fn drop(&mut self) {
+        lock();
+        STREAM.store(std::ptr::null_mut(), Ordering::Release);
+        BUSY.store(false, Ordering::Release);
+    }
+}
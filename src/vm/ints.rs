@@ -0,0 +1,167 @@
+use std;
+use std::fs::File;
+use std::io::{Error, ErrorKind, Result};
+use std::os::unix::io::AsRawFd;
+use std::path::Path;
+use libc;
+
+/// Memory of an integer array, either a mapped file or parsed integers
+enum Backing {
+    Mapped(*mut libc::c_void, usize),
+    Parsed(Vec<i64>)
+}
+
+/// Read-only array of integers, the storage of an integer array object.
+/// The integers never move, so a loop over them can keep their address in a
+/// register.
+pub(super) struct Ints {
+    backing: Backing
+}
+
+impl Ints {
+    /// Map a binary file of little-endian 64 bit integers. Pages are only
+    /// read when the integers are accessed.
+    ///
+    /// # Arguments
+    ///
+    /// * `path` - Path of the file, its size has to be a multiple of 8
+    pub(super) fn map<P: AsRef<Path>>(path: P) -> Result<Ints> {
+        let backing = match map_file(path)? {
+            Some((address, len)) if len % 8 != 0 => {
+                unsafe { libc::munmap(address, len) };
+                return Err(Error::new(ErrorKind::InvalidData, "Not a file of 64 bit integers"));
+            }
+            Some((address, len)) => Backing::Mapped(address, len),
+            None => Backing::Parsed(Vec::new())
+        };
+        Ok(Ints { backing })
+    }
+
+    /// Parse a text file of decimal integers separated by whitespace. The
+    /// file is mapped and parsed in one pass, without splitting it into
+    /// lines or strings.
+    ///
+    /// # Arguments
+    ///
+    /// * `path` - Path of the file
+    pub(super) fn parse<P: AsRef<Path>>(path: P) -> Result<Ints> {
+        let text = map_file(path)?;
+        let integers = {
+            let bytes = match text {
+                Some((address, len)) => unsafe { std::slice::from_raw_parts(address as *const u8, len) },
+                None => &[]
+            };
+            parse_integers(bytes)
+        };
+        if let Some((address, len)) = text {
+            unsafe { libc::munmap(address, len) };
+        }
+        Ok(Ints { backing: Backing::Parsed(integers?) })
+    }
+
+    /// Get the integers.
+    #[inline(always)]
+    pub(super) fn as_slice(&self) -> &[i64] {
+        match self.backing {
+            Backing::Mapped(address, len) => unsafe {
+                std::slice::from_raw_parts(address as *const i64, len / 8)
+            },
+            Backing::Parsed(ref integers) => integers
+        }
+    }
+}
+
+impl Drop for Ints {
+    fn drop(&mut self) {
+        if let Backing::Mapped(address, len) = self.backing {
+            unsafe { libc::munmap(address, len) };
+        }
+    }
+}
+
+/// Map a whole file for reading it sequentially, `None` if it is empty.
+fn map_file<P: AsRef<Path>>(path: P) -> Result<Option<(*mut libc::c_void, usize)>> {
+    let file = File::open(path)?;
+    let len = file.metadata()?.len() as usize;
+    if len == 0 {
+        return Ok(None);
+    }
+    let address = unsafe {
+        libc::mmap(std::ptr::null_mut(), len, libc::PROT_READ, libc::MAP_PRIVATE, file.as_raw_fd(), 0)
+    };
+    if address == libc::MAP_FAILED {
+        return Err(Error::last_os_error());
+    }
+    unsafe { libc::madvise(address, len, libc::MADV_SEQUENTIAL) };
+    Ok(Some((address, len)))
+}
+
+/// Parse decimal integers separated by whitespace.
+///
+/// # Remarks
+///
+/// Runs of eight digits are converted at once, by loading them into a word
+/// and combining the digits pairwise with three multiplications.
+fn parse_integers(bytes: &[u8]) -> Result<Vec<i64>> {
+    let invalid = || Error::new(ErrorKind::InvalidData, "Could not parse integer");
+    // Integers have at least two bytes each, except for the last one
+    let mut integers = Vec::with_capacity(bytes.len() / 2 + 1);
+    let mut i = 0;
+    while i < bytes.len() {
+        let byte = bytes[i];
+        if byte.is_ascii_whitespace() {
+            i += 1;
+            continue;
+        }
+
+        let negative = byte == b'-';
+        if negative {
+            i += 1;
+        }
+        let start = i;
+        let mut value: i64 = 0;
+        while i + 8 <= bytes.len() {
+            let word = load_word(&bytes[i..i + 8]);
+            if !eight_digits(word) {
+                break;
+            }
+            value = value.checked_mul(100_000_000)
+                .and_then(|value| value.checked_add(parse_eight(word) as i64))
+                .ok_or_else(&invalid)?;
+            i += 8;
+        }
+        while i < bytes.len() && bytes[i].is_ascii_digit() {
+            value = value.checked_mul(10)
+                .and_then(|value| value.checked_add((bytes[i] - b'0') as i64))
+                .ok_or_else(&invalid)?;
+            i += 1;
+        }
+        if i == start || (i < bytes.len() && !bytes[i].is_ascii_whitespace()) {
+            return Err(invalid());
+        }
+        integers.push(if negative { -value } else { value });
+    }
+    Ok(integers)
+}
+
+#[inline(always)]
+fn load_word(bytes: &[u8]) -> u64 {
+    u64::from_le(unsafe { std::ptr::read_unaligned(bytes.as_ptr() as *const u64) })
+}
+
+/// Check whether all bytes of a word are ASCII digits.
+#[inline(always)]
+fn eight_digits(word: u64) -> bool {
+    let high = word & 0xf0f0_f0f0_f0f0_f0f0;
+    let low = (word.wrapping_add(0x0606_0606_0606_0606) & 0xf0f0_f0f0_f0f0_f0f0) >> 4;
+    high | low == 0x3333_3333_3333_3333
+}
+
+/// Convert eight ASCII digits, the first one in the lowest byte.
+#[inline(always)]
+fn parse_eight(word: u64) -> u64 {
+    let digits = word & 0x0f0f_0f0f_0f0f_0f0f;
+    let pairs = digits.wrapping_mul(10 << 8 | 1) >> 8;
+    let quads = (pairs & 0x00ff_00ff_00ff_00ff).wrapping_mul(100 << 16 | 1) >> 16;
+    (quads & 0x0000_ffff_0000_ffff).wrapping_mul(10_000 << 32 | 1) >> 32
+}
@@ -0,0 +1,119 @@
+use std;
+use std::cell::Cell;
+use std::io::Write;
+use std::os::unix::io::RawFd;
+
+/// Output is written to stdout once this many bytes are buffered
+const OUTPUT_BUFFER: usize = 64 * 1024;
+
+/// Outcome of running a thread with the input and output of a host
+#[derive(Clone, Copy, PartialEq, Eq, Debug)]
+pub enum Status {
+    /// The thread executed `HLT`
+    Halted,
+    /// The thread is waiting for the host, `resume` continues it
+    Suspended(Suspension)
+}
+
+/// Reason a thread was suspended
+#[derive(Clone, Copy, PartialEq, Eq, Debug)]
+pub enum Suspension {
+    /// A read found no complete line of input
+    NeedInput,
+    /// A write was refused by the output
+    OutputFull,
+    /// A file descriptor has no complete line to read (see `Reactor`)
+    Readable(RawFd),
+    /// A file descriptor does not take more output yet
+    Writable(RawFd)
+}
+
+/// Input and output of a thread run by an event driven host, used instead of
+/// the standard streams.
+///
+/// # Remarks
+///
+/// Neither method may block. If the host can not serve a request right away,
+/// the thread is suspended before the reading or writing instruction, which
+/// is executed again when the thread is resumed.
+pub trait Io {
+    /// Append the next line of input to `line`, without the line break.
+    ///
+    /// Returns `Some(true)` if a line was read, `Some(false)` at the end of
+    /// the input and `None` if no complete line is available yet.
+    fn read_line(&mut self, line: &mut Vec<u8>) -> Option<bool>;
+
+    /// Write bytes to the output, either all of them or none. Returns `false`
+    /// if the output can not take them right now.
+    fn write(&mut self, bytes: &[u8]) -> bool;
+
+    /// Fill `bytes` with the next bytes of binary input, for raw reads.
+    ///
+    /// Returns `Some(true)` if they were read, `Some(false)` at the end of
+    /// the input and `None` if not enough input is available yet. The default
+    /// implementation supports no binary input.
+    fn read_bytes(&mut self, _bytes: &mut [u8]) -> Option<bool> {
+        panic!("The host does not support binary input");
+    }
+}
+
+/// Encoding of the integers read by `read` and `(input)` and written by
+/// `write`
+#[derive(Clone, Copy, PartialEq, Eq, Debug)]
+pub enum Framing {
+    /// Decimal integers on lines of their own
+    Text,
+    /// Little-endian 64 bit integers without separators, like `read-raw`
+    /// and `write-raw`
+    Binary
+}
+
+thread_local! {
+    static FRAMING: Cell<(Framing, Framing)> = Cell::new((Framing::Text, Framing::Text));
+}
+
+/// Select the framing of the input and output of the threads run on the
+/// calling OS thread from now on.
+pub fn set_framing(input: Framing, output: Framing) {
+    FRAMING.with(|framing| framing.set((input, output)));
+}
+
+/// Get the framing of the input and output selected by `set_framing`.
+pub fn framing() -> (Framing, Framing) {
+    FRAMING.with(|framing| framing.get())
+}
+
+/// Buffer of the output to stdout, written in large blocks. It is flushed
+/// before reading from stdin and when it is dropped, even while unwinding.
+#[derive(Default)]
+pub(super) struct Output {
+    bytes: Vec<u8>
+}
+
+impl Output {
+    #[inline(always)]
+    pub(super) fn write(&mut self, bytes: &[u8]) {
+        self.bytes.extend_from_slice(bytes);
+        if self.bytes.len() >= OUTPUT_BUFFER {
+            self.flush();
+        }
+    }
+
+    pub(super) fn flush(&mut self) {
+        if self.bytes.is_empty() {
+            return;
+        }
+        let stdout = std::io::stdout();
+        let mut stdout = stdout.lock();
+        stdout.write_all(&self.bytes).and_then(|_| stdout.flush()).expect("Could not write to stdio");
+        self.bytes.clear();
+    }
+}
+
+impl Drop for Output {
+    fn drop(&mut self) {
+        let stdout = std::io::stdout();
+        let mut stdout = stdout.lock();
+        let _ = stdout.write_all(&self.bytes).and_then(|_| stdout.flush());
+    }
+}
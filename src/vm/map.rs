@@ -0,0 +1,222 @@
+use std;
+
+/// Number of control bytes probed at once
+const GROUP: usize = 8;
+
+/// Control byte of an empty slot, full slots hold the top 7 bits of the hash
+const EMPTY: u8 = 0x80;
+
+const LSB: u64 = 0x0101_0101_0101_0101;
+const MSB: u64 = 0x8080_8080_8080_8080;
+
+/// Hash an integer key, the top 7 bits are stored in the control byte and
+/// the remaining bits select the first slot to probe.
+#[inline(always)]
+fn hash(key: i64) -> u64 {
+    let key = key as u64;
+    let h = (key ^ key >> 32).wrapping_mul(0x9e37_79b9_7f4a_7c15);
+    h ^ h >> 32
+}
+
+/// Hash a string of bytes. Whole words are loaded at once, so the loop runs
+/// once per 8 bytes instead of once per byte.
+pub(super) fn hash_bytes(bytes: &[u8]) -> u64 {
+    let mut h = bytes.len() as u64;
+    for chunk in bytes.chunks(GROUP) {
+        let word = if chunk.len() == GROUP {
+            unsafe { u64::from_le(std::ptr::read_unaligned(chunk.as_ptr() as *const u64)) }
+        } else {
+            chunk.iter().rev().fold(0, |word, &byte| word << 8 | byte as u64)
+        };
+        h = (h ^ word).wrapping_mul(0x9e37_79b9_7f4a_7c15);
+        h ^= h >> 29;
+    }
+    h
+}
+
+#[inline(always)]
+fn h2(hash: u64) -> u8 {
+    (hash >> 57) as u8
+}
+
+/// Bit mask with the top bit of every byte set that may be equal to `byte`.
+/// A byte directly following a match can be reported as a false positive,
+/// so the keys of matches still have to be compared.
+#[inline(always)]
+fn match_byte(group: u64, byte: u8) -> u64 {
+    let x = group ^ (LSB * byte as u64);
+    x.wrapping_sub(LSB) & !x & MSB
+}
+
+/// Bit mask with the top bit of every empty byte set
+#[inline(always)]
+fn match_empty(group: u64) -> u64 {
+    group & MSB
+}
+
+/// Iterate the byte positions of a bit mask returned by `match_byte`.
+struct Lanes(u64);
+
+impl Iterator for Lanes {
+    type Item = usize;
+
+    #[inline(always)]
+    fn next(&mut self) -> Option<usize> {
+        if self.0 == 0 {
+            return None;
+        }
+        let lane = self.0.trailing_zeros() as usize / 8;
+        self.0 &= self.0 - 1;
+        Some(lane)
+    }
+}
+
+/// Hash table from integer keys to values, the storage of a map object.
+///
+/// The table uses open addressing with one control byte per slot, like
+/// SwissTable. A probe loads a group of 8 control bytes as one word and
+/// compares all of them to the hash tag at once, so keys are only compared
+/// for slots which are likely to match. Tables grow at a load factor of 7/8.
+/// Entries can not be removed.
+pub(super) struct Table {
+    /// One byte per slot, followed by a copy of the first group so that a
+    /// group can be loaded at any slot
+    ctrl: Vec<u8>,
+    keys: Vec<i64>,
+    values: Vec<i64>,
+    len: usize,
+    growth_left: usize
+}
+
+impl Table {
+    /// Create an empty table.
+    pub(super) fn new() -> Table {
+        Table::with_capacity(GROUP)
+    }
+
+    fn with_capacity(capacity: usize) -> Table {
+        Table {
+            ctrl: vec![EMPTY; capacity + GROUP],
+            keys: vec![0; capacity],
+            values: vec![0; capacity],
+            len: 0,
+            growth_left: capacity - capacity / 8
+        }
+    }
+
+    /// Number of entries
+    pub(super) fn len(&self) -> usize {
+        self.len
+    }
+
+    #[inline(always)]
+    fn mask(&self) -> usize {
+        self.keys.len() - 1
+    }
+
+    #[inline(always)]
+    fn group(&self, position: usize) -> u64 {
+        assert!(position + GROUP <= self.ctrl.len());
+        unsafe {
+            let group = self.ctrl.as_ptr().offset(position as isize) as *const u64;
+            u64::from_le(std::ptr::read_unaligned(group))
+        }
+    }
+
+    /// Set the control byte of a slot and of its copy after the end.
+    #[inline(always)]
+    fn set_ctrl(&mut self, slot: usize, byte: u8) {
+        let mask = self.mask();
+        self.ctrl[slot] = byte;
+        self.ctrl[(slot.wrapping_sub(GROUP) & mask) + GROUP] = byte;
+    }
+
+    /// Find the slot of a key, or the first empty slot of its probe sequence.
+    #[inline(always)]
+    fn find(&self, key: i64, hash: u64) -> Result<usize, usize> {
+        let mask = self.mask();
+        let tag = h2(hash);
+        let mut position = hash as usize & mask;
+        let mut stride = 0;
+        loop {
+            let group = self.group(position);
+            for lane in Lanes(match_byte(group, tag)) {
+                let slot = (position + lane) & mask;
+                if self.ctrl[slot] == tag && self.keys[slot] == key {
+                    return Ok(slot);
+                }
+            }
+            if let Some(lane) = Lanes(match_empty(group)).next() {
+                return Err((position + lane) & mask);
+            }
+
+            // Triangular probing visits every group of a power of two table
+            stride += GROUP;
+            position = (position + stride) & mask;
+        }
+    }
+
+    /// Get the value of a key.
+    #[inline(always)]
+    pub(super) fn get(&self, key: i64) -> Option<i64> {
+        match self.find(key, hash(key)) {
+            Ok(slot) => Some(self.values[slot]),
+            Err(_) => None
+        }
+    }
+
+    /// Set the value of a key.
+    pub(super) fn insert(&mut self, key: i64, value: i64) {
+        let hash = hash(key);
+        let slot = match self.find(key, hash) {
+            Ok(slot) => {
+                self.values[slot] = value;
+                return;
+            }
+            Err(_) if self.growth_left == 0 => {
+                self.grow();
+                self.find(key, hash).unwrap_err()
+            }
+            Err(slot) => slot
+        };
+
+        self.set_ctrl(slot, h2(hash));
+        self.keys[slot] = key;
+        self.values[slot] = value;
+        self.len += 1;
+        self.growth_left -= 1;
+    }
+
+    /// Double the capacity, rehashing all entries.
+    fn grow(&mut self) {
+        let mut table = Table::with_capacity(self.keys.len() * 2);
+        for (key, value) in self.entries() {
+            let hash = hash(key);
+            let slot = table.find(key, hash).unwrap_err();
+            table.set_ctrl(slot, h2(hash));
+            table.keys[slot] = key;
+            table.values[slot] = value;
+        }
+        table.len = self.len;
+        table.growth_left -= self.len;
+        *self = table;
+    }
+
+    /// Get all entries, in no particular order.
+    pub(super) fn entries(&self) -> Vec<(i64, i64)> {
+        (0..self.keys.len())
+            .filter(|&slot| self.ctrl[slot] & EMPTY == 0)
+            .map(|slot| (self.keys[slot], self.values[slot]))
+            .collect()
+    }
+
+    /// Apply a function to all values, which is used to update references
+    /// when collecting garbage.
+    pub(super) fn update_values<F: FnMut(i64) -> i64>(&mut self, mut f: F) {
+        for slot in 0..self.keys.len() {
+            if self.ctrl[slot] & EMPTY == 0 {
+                self.values[slot] = f(self.values[slot]);
+            }
+        }
+    }
+}
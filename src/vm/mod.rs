@@ -1,5 +1,27 @@
 #[macro_use]
 mod threading;
+mod bignum;
+mod counters;
+mod decode;
 mod dispatch;
+mod files;
+mod generator;
+mod heap;
+mod instrument;
+mod ints;
+mod io;
+mod map;
+mod profile;
+mod reactor;
+mod sample;
+mod trace;
 
-pub use self::dispatch::run;
\ No newline at end of file
+pub use self::counters::{Counters, CountersFile, Snapshot, counters};
+pub use self::dispatch::{resume, run, run_instrumented, run_traced, run_with_io};
+pub use self::heap::{GcStats, Heap};
+pub use self::instrument::{instrumentation, set_instrumentation};
+pub use self::io::{Framing, Io, Status, Suspension, framing, set_framing};
+pub use self::profile::run_profiled;
+pub use self::reactor::Reactor;
+pub use self::sample::run_sampled;
+pub use self::trace::{Trace, TraceEntry};
@@ -0,0 +1,201 @@
+use std;
+use std::collections::HashMap;
+use common::*;
+use super::decode::*;
+use super::dispatch::*;
+
+/// Longest instruction sequence being counted
+const MAX_SEQUENCE: usize = 4;
+
+/// Execute a thread like `run`, while counting branch outcomes, call sites,
+/// function entries and executed instruction sequences.
+///
+/// # Arguments
+///
+/// * `thread` - The thread to be executed
+/// * `entry_point` - PC of the first instruction to be executed
+/// * `profile` - Counts are added to this profile
+///
+/// # Remarks
+///
+/// This interpreter uses a plain loop with a match instead of the threaded
+/// dispatch, so it is considerably slower than `run`. Counters are kept in
+/// dense per-PC tables while running and only merged into the profile once
+/// the thread halts.
+///
+/// Superinstructions are executed one instruction at a time, so sequences are
+/// always counted in terms of base instructions.
+///
+/// The profile records the hash of the code, so it is only applied to the
+/// same code. Panics if the profile already holds counts of different code.
+pub fn run_profiled(thread: &mut Thread, entry_point: usize, profile: &mut Profile) {
+    let hash = code_hash(thread.functions, thread.constants, thread.code);
+    if profile.code != 0 && profile.code != hash {
+        panic!("Profile was recorded on different code");
+    }
+    profile.code = hash;
+
+    let len = thread.code.len();
+    let mut taken: Vec<u64> = vec![0; len];
+    let mut not_taken: Vec<u64> = vec![0; len];
+    let mut calls: Vec<u64> = vec![0; len];
+    let mut entries: Vec<u64> = vec![0; len];
+    let mut sequences: HashMap<u64, u64> = HashMap::new();
+    let mut window: u64 = 0;
+    let mut window_len: usize = 0;
+
+    let code = decode(thread, &[0; 256]);
+    let start = code.as_ptr();
+    let mut state = State::new(thread);
+    state.code = start;
+    let mut pc: usize = entry_point;
+    loop {
+        let opcode = superops::base(thread.code[pc].opcode);
+        state.instructions += 1;
+        let next = unsafe {
+            let ip = start.offset(pc as isize);
+            let next = match opcode {
+                ops::LD  => op_ld(&mut state, ip),
+                ops::LDB => op_ldb(&mut state, ip),
+                ops::LDR => op_ldr(&mut state, ip),
+                ops::ADD => op_add(&mut state, ip),
+                ops::SUB => op_sub(&mut state, ip),
+                ops::MUL => op_mul(&mut state, ip),
+                ops::DIV => op_div(&mut state, ip),
+                ops::AND => op_and(&mut state, ip),
+                ops::OR  => op_or(&mut state, ip),
+                ops::NOT => op_not(&mut state, ip),
+                ops::EQ  => op_eq(&mut state, ip),
+                ops::LT  => op_lt(&mut state, ip),
+                ops::LE  => op_le(&mut state, ip),
+                ops::GT  => op_gt(&mut state, ip),
+                ops::GE  => op_ge(&mut state, ip),
+                ops::NEQ => op_neq(&mut state, ip),
+                ops::CAL => op_cal(&mut state, ip),
+                ops::TLC => op_tlc(&mut state, ip),
+                ops::RET => op_ret(&mut state, ip),
+                ops::MOV => op_mov(&mut state, ip),
+                ops::MVO => op_mvo(&mut state, ip),
+                ops::JMF => op_jmf(&mut state, ip),
+                ops::JMB => op_jmb(&mut state, ip),
+                ops::JTF => op_jtf(&mut state, ip),
+                ops::JFF => op_jff(&mut state, ip),
+                ops::WRI => op_wri(&mut state, ip),
+                ops::RDI => op_rdi(&mut state, ip),
+                ops::CONS => op_cons(&mut state, ip),
+                ops::CAR => op_car(&mut state, ip),
+                ops::CDR => op_cdr(&mut state, ip),
+                ops::NIL => op_nil(&mut state, ip),
+                ops::MAP => op_map(&mut state, ip),
+                ops::GET => op_get(&mut state, ip),
+                ops::PUT => op_put(&mut state, ip),
+                ops::HAS => op_has(&mut state, ip),
+                ops::SIZE => op_size(&mut state, ip),
+                ops::LDS => op_lds(&mut state, ip),
+                ops::BUF => op_buf(&mut state, ip),
+                ops::APP => op_app(&mut state, ip),
+                ops::STR => op_str(&mut state, ip),
+                ops::SLC => op_slc(&mut state, ip),
+                ops::BYT => op_byt(&mut state, ip),
+                ops::CMP => op_cmp(&mut state, ip),
+                ops::HSH => op_hsh(&mut state, ip),
+                ops::WRB => op_wrb(&mut state, ip),
+                ops::RDL => op_rdl(&mut state, ip),
+                ops::REC => op_rec(&mut state, ip),
+                ops::FLD => op_fld(&mut state, ip),
+                ops::WTH => op_wth(&mut state, ip),
+                ops::VEC => op_vec(&mut state, ip),
+                ops::VGT => op_vgt(&mut state, ip),
+                ops::VPS => op_vps(&mut state, ip),
+                ops::VAS => op_vas(&mut state, ip),
+                ops::VLN => op_vln(&mut state, ip),
+                ops::RDN => op_rdn(&mut state, ip),
+                ops::GEN => op_gen(&mut state, ip),
+                ops::RSM => op_rsm(&mut state, ip),
+                ops::FIN => op_fin(&mut state, ip),
+                ops::YLD => op_yld(&mut state, ip),
+                ops::OPN => op_opn(&mut state, ip),
+                ops::FRD => op_frd(&mut state, ip),
+                ops::FWR => op_fwr(&mut state, ip),
+                ops::CLS => op_cls(&mut state, ip),
+                ops::IMP => op_imp(&mut state, ip),
+                ops::IPR => op_ipr(&mut state, ip),
+                ops::IGT => op_igt(&mut state, ip),
+                ops::IAD => op_iad(&mut state, ip),
+                ops::IGU => op_igu(&mut state, ip),
+                ops::RDR => op_rdr(&mut state, ip),
+                ops::WRR => op_wrr(&mut state, ip),
+                ops::CALLN => op_calln(&mut state, ip),
+                ops::MOD => op_mod(&mut state, ip),
+                ops::POW => op_pow(&mut state, ip),
+                ops::GCD => op_gcd(&mut state, ip),
+                ops::MIN => op_min(&mut state, ip),
+                ops::MAX => op_max(&mut state, ip),
+                ops::ABS => op_abs(&mut state, ip),
+                ops::SQRT => op_sqrt(&mut state, ip),
+                ops::PCNT => op_pcnt(&mut state, ip),
+                ops::CLZ => op_clz(&mut state, ip),
+                ops::CTZ => op_ctz(&mut state, ip),
+                ops::CLO => op_clo(&mut state, ip),
+                ops::CLI => op_cli(&mut state, ip),
+                ops::TLI => op_tli(&mut state, ip),
+                _ => break
+            };
+            (next as usize - start as usize) / std::mem::size_of::<Decoded>()
+        };
+
+        match opcode {
+            ops::JTF | ops::JFF => {
+                if next == pc + 1 {
+                    not_taken[pc] += 1;
+                } else {
+                    taken[pc] += 1;
+                }
+            }
+            ops::CAL | ops::TLC | ops::CLI | ops::TLI | ops::JMB => {
+                calls[pc] += 1;
+                entries[next] += 1;
+            }
+            _ => {}
+        }
+
+        // Count all sequences ending in this instruction, sequences are packed
+        // into an integer with the length in the topmost byte
+        for n in 1..window_len + 1 {
+            let mask = (1u64 << (8 * n)) - 1;
+            let key = ((n as u64 + 1) << 56) | (window & mask) << 8 | opcode as u64;
+            *sequences.entry(key).or_insert(0) += 1;
+        }
+        if ops::ends_sequence(opcode) {
+            window_len = 0;
+        } else {
+            window = window << 8 | opcode as u64;
+            window_len = (window_len + 1).min(MAX_SEQUENCE - 1);
+        }
+
+        pc = next;
+    }
+    thread.base = state.base();
+
+    for pc in 0..len {
+        if taken[pc] != 0 || not_taken[pc] != 0 {
+            let counts = profile.branches.entry(pc as u64).or_insert((0, 0));
+            counts.0 += taken[pc];
+            counts.1 += not_taken[pc];
+        }
+        if calls[pc] != 0 {
+            *profile.calls.entry(pc as u64).or_insert(0) += calls[pc];
+        }
+        if entries[pc] != 0 {
+            *profile.entries.entry(pc as u64).or_insert(0) += entries[pc];
+        }
+    }
+
+    for (key, count) in sequences {
+        let n = (key >> 56) as usize;
+        let sequence: Vec<Opcode> = (0..n).rev()
+            .map(|i| (key >> (8 * i)) as Opcode)
+            .collect();
+        *profile.sequences.entry(sequence).or_insert(0) += count;
+    }
+}
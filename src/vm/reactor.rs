@@ -0,0 +1,178 @@
+use std;
+use std::collections::{HashMap, VecDeque};
+use std::io::{BufRead, Error, ErrorKind, Read, Result, Write};
+use std::os::unix::io::RawFd;
+use libc;
+use common::Thread;
+use super::dispatch::{resume, run_with_io};
+use super::io::{Io, Status, Suspension};
+
+/// Number of events taken from the kernel at once
+const EVENTS: usize = 64;
+
+/// A thread run by a reactor, with the PC it starts at until it has run
+struct Task<'a, 'b: 'a> {
+    thread: &'a mut Thread<'b>,
+    entry_point: Option<usize>
+}
+
+/// Tasks waiting for a file descriptor, with the events they wait for
+struct Waiters {
+    tasks: Vec<usize>,
+    events: u32
+}
+
+/// Runs many threads on a single OS thread. A thread which would block on a
+/// file descriptor (see `Files`) is suspended and parked until an epoll
+/// instance reports the file descriptor as ready, meanwhile the other
+/// threads run.
+///
+/// # Remarks
+///
+/// The standard streams are not multiplexed, reading and writing them
+/// blocks all threads.
+pub struct Reactor<'a, 'b: 'a> {
+    epoll: RawFd,
+    tasks: Vec<Task<'a, 'b>>,
+    /// Tasks to run next, in order
+    ready: VecDeque<usize>,
+    /// Parked tasks by file descriptor, which are registered with the epoll
+    /// instance
+    waiting: HashMap<RawFd, Waiters>
+}
+
+impl<'a, 'b> Reactor<'a, 'b> {
+    /// Create a reactor without threads.
+    pub fn new() -> Result<Reactor<'a, 'b>> {
+        let epoll = unsafe { libc::epoll_create1(libc::EPOLL_CLOEXEC) };
+        if epoll < 0 {
+            return Err(Error::last_os_error());
+        }
+        Ok(Reactor {
+            epoll,
+            tasks: Vec::new(),
+            ready: VecDeque::new(),
+            waiting: HashMap::new()
+        })
+    }
+
+    /// Add a thread, which starts running with the next call of `run`.
+    ///
+    /// # Arguments
+    ///
+    /// * `thread` - The thread, which can be inspected once it has halted
+    /// * `entry_point` - PC of the first instruction to be executed
+    pub fn spawn(&mut self, thread: &'a mut Thread<'b>, entry_point: usize) {
+        self.ready.push_back(self.tasks.len());
+        self.tasks.push(Task {
+            thread,
+            entry_point: Some(entry_point)
+        });
+    }
+
+    /// Run all threads until they have halted.
+    pub fn run(&mut self) -> Result<()> {
+        let mut stdio = Stdio;
+        let mut events = vec![libc::epoll_event { events: 0, u64: 0 }; EVENTS];
+        loop {
+            while let Some(id) = self.ready.pop_front() {
+                let status = {
+                    let task = &mut self.tasks[id];
+                    match task.entry_point.take() {
+                        Some(entry_point) => run_with_io(task.thread, entry_point, &mut stdio),
+                        None => resume(task.thread, &mut stdio)
+                    }
+                };
+                match status {
+                    Status::Halted => {}
+                    Status::Suspended(Suspension::Readable(fd)) => self.park(id, fd, libc::EPOLLIN as u32)?,
+                    Status::Suspended(Suspension::Writable(fd)) => self.park(id, fd, libc::EPOLLOUT as u32)?,
+                    Status::Suspended(_) => self.ready.push_back(id)
+                }
+            }
+            if self.waiting.is_empty() {
+                return Ok(());
+            }
+
+            let count = unsafe { libc::epoll_wait(self.epoll, events.as_mut_ptr(), EVENTS as i32, -1) };
+            if count < 0 {
+                let error = Error::last_os_error();
+                if error.kind() == ErrorKind::Interrupted {
+                    continue;
+                }
+                return Err(error);
+            }
+            for event in events[..count as usize].iter() {
+                let fd = event.u64 as RawFd;
+                if let Some(waiters) = self.waiting.remove(&fd) {
+                    self.control(libc::EPOLL_CTL_DEL, fd, 0)?;
+                    self.ready.extend(waiters.tasks);
+                }
+            }
+        }
+    }
+
+    /// Wait for a file descriptor, together with the tasks already waiting
+    /// for it.
+    fn park(&mut self, id: usize, fd: RawFd, events: u32) -> Result<()> {
+        let (operation, events) = match self.waiting.get(&fd) {
+            Some(waiters) => (libc::EPOLL_CTL_MOD, waiters.events | events),
+            None => (libc::EPOLL_CTL_ADD, events)
+        };
+        if let Err(error) = self.control(operation, fd, events) {
+            // Regular files can not be polled, they are always ready
+            if error.raw_os_error() == Some(libc::EPERM) {
+                self.ready.push_back(id);
+                return Ok(());
+            }
+            return Err(error);
+        }
+        let waiters = self.waiting.entry(fd).or_insert(Waiters { tasks: Vec::new(), events: 0 });
+        waiters.tasks.push(id);
+        waiters.events = events;
+        Ok(())
+    }
+
+    fn control(&self, operation: libc::c_int, fd: RawFd, events: u32) -> Result<()> {
+        let mut event = libc::epoll_event { events, u64: fd as u64 };
+        if unsafe { libc::epoll_ctl(self.epoll, operation, fd, &mut event) } < 0 {
+            return Err(Error::last_os_error());
+        }
+        Ok(())
+    }
+}
+
+impl<'a, 'b> Drop for Reactor<'a, 'b> {
+    fn drop(&mut self) {
+        unsafe { libc::close(self.epoll) };
+    }
+}
+
+/// The standard streams of the threads of a reactor
+struct Stdio;
+
+impl Io for Stdio {
+    fn read_line(&mut self, line: &mut Vec<u8>) -> Option<bool> {
+        let stdin = std::io::stdin();
+        let read = stdin.lock().read_until(b'\n', line).expect("Could not read from stdio");
+        if line.last() == Some(&b'\n') {
+            line.pop();
+        }
+        Some(read > 0)
+    }
+
+    fn read_bytes(&mut self, bytes: &mut [u8]) -> Option<bool> {
+        let stdin = std::io::stdin();
+        match stdin.lock().read_exact(bytes) {
+            Ok(()) => Some(true),
+            Err(ref error) if error.kind() == ErrorKind::UnexpectedEof => Some(false),
+            Err(error) => panic!("Could not read from stdio: {}", error)
+        }
+    }
+
+    fn write(&mut self, bytes: &[u8]) -> bool {
+        let stdout = std::io::stdout();
+        stdout.lock().write_all(bytes).expect("Could not write to stdio");
+        true
+    }
+}
@@ -0,0 +1,99 @@
+use std;
+use std::sync::atomic::{AtomicPtr, AtomicUsize, Ordering};
+use std::time::Duration;
+use libc;
+use common::*;
+use super::decode::Decoded;
+use super::dispatch::run;
+
+/// Address of the instruction being executed, updated by the dispatch loop
+/// before every dispatch
+pub(super) static CURRENT: AtomicUsize = AtomicUsize::new(0);
+
+/// Address of the first instruction of the running instruction stream
+pub(super) static START: AtomicUsize = AtomicUsize::new(0);
+
+/// Sample counters of the running thread, one per PC, null if not sampling
+static COUNTS: AtomicPtr<AtomicUsize> = AtomicPtr::new(std::ptr::null_mut());
+static LEN: AtomicUsize = AtomicUsize::new(0);
+
+/// Signal handler attributing a sample to the current instruction. Only
+/// atomics are accessed, so the handler is async signal safe.
+extern "C" fn on_sample(_signal: libc::c_int) {
+    let counts = COUNTS.load(Ordering::Relaxed);
+    if counts.is_null() {
+        return;
+    }
+
+    let offset = CURRENT.load(Ordering::Relaxed).wrapping_sub(START.load(Ordering::Relaxed));
+    let pc = offset / std::mem::size_of::<Decoded>();
+    if pc < LEN.load(Ordering::Relaxed) {
+        unsafe {
+            (*counts.offset(pc as isize)).fetch_add(1, Ordering::Relaxed);
+        }
+    }
+}
+
+extern "C" {
+    fn setitimer(which: libc::c_int,
+                 new_value: *const libc::itimerval,
+                 old_value: *mut libc::itimerval) -> libc::c_int;
+}
+
+/// Arm or disarm the profiling timer.
+fn set_timer(interval: Duration) {
+    let interval = libc::timeval {
+        tv_sec: interval.as_secs() as libc::time_t,
+        tv_usec: interval.subsec_nanos() as libc::suseconds_t / 1000
+    };
+    let timer = libc::itimerval {
+        it_interval: interval,
+        it_value: interval
+    };
+    unsafe {
+        setitimer(libc::ITIMER_PROF, &timer, std::ptr::null_mut());
+    }
+}
+
+/// Execute a thread like `run`, while sampling the executing PC.
+///
+/// # Arguments
+///
+/// * `thread` - The thread to be executed
+/// * `entry_point` - PC of the first instruction to be executed
+/// * `interval` - CPU time between two samples
+///
+/// # Remarks
+///
+/// A `SIGPROF` timer interrupts the thread periodically, the signal handler
+/// reads the instruction the dispatch loop is currently executing. Unlike
+/// `run_profiled`, the thread runs on the threaded interpreter at full speed.
+/// A superinstruction is attributed to the PC it starts at.
+///
+/// Returns the number of samples taken at each PC. Only one thread can be
+/// sampled at a time, as the timer and the PC slot are process wide.
+pub fn run_sampled(thread: &mut Thread, entry_point: usize, interval: Duration) -> Vec<u64> {
+    let counts: Vec<AtomicUsize> = (0..thread.code.len()).map(|_| AtomicUsize::new(0)).collect();
+    LEN.store(counts.len(), Ordering::Relaxed);
+    COUNTS.store(counts.as_ptr() as *mut AtomicUsize, Ordering::SeqCst);
+
+    let mut previous: libc::sigaction = unsafe { std::mem::zeroed() };
+    unsafe {
+        let mut action: libc::sigaction = std::mem::zeroed();
+        action.sa_sigaction = on_sample as usize;
+        action.sa_flags = libc::SA_RESTART;
+        libc::sigemptyset(&mut action.sa_mask);
+        libc::sigaction(libc::SIGPROF, &action, &mut previous);
+    }
+    set_timer(interval);
+
+    run(thread, entry_point);
+
+    set_timer(Duration::from_secs(0));
+    COUNTS.store(std::ptr::null_mut(), Ordering::SeqCst);
+    unsafe {
+        libc::sigaction(libc::SIGPROF, &previous, std::ptr::null_mut());
+    }
+
+    counts.into_iter().map(|count| count.into_inner() as u64).collect()
+}
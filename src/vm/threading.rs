@@ -10,6 +10,21 @@ macro_rules! label {
     }
 }
 
+/// Declare the label a thread halts at. The pinned registers hold the state
+/// of the halting thread here, like at the handler labels.
+#[cfg(target_arch = "x86_64")]
+macro_rules! exit_label {
+    ($state:expr, $name:expr, $pc:expr) => {
+        unsafe {
+            asm!(concat!($name, ":")
+                 : "={rdx}"($pc), "={r12}"($state.frame), "={r13}"($state.instructions)
+                 :
+                 :
+                 : "volatile");
+        }
+    }
+}
+
 #[cfg(target_arch = "x86_64")]
 macro_rules! label_addr {
     ($name:expr) => {
@@ -27,15 +42,56 @@ macro_rules! label_addr {
     }
 }
 
+/// Jump to the handler of the pre-decoded instruction at `$pc`.
+///
+/// The handler address is the first field of every instruction, so this is a
+/// single indirect jump. The instruction pointer and the frame pointer are
+/// pinned to fixed registers, matching the outputs declared at each handler
+/// label, so they stay in registers across handlers.
+///
+/// The instruction pointer is also published to the sampling slot, a single
+/// store which lets the sampling profiler find the executing instruction. The
+/// number of dispatched instructions is kept in a third pinned register.
 #[cfg(target_arch = "x86_64")]
 macro_rules! dispatch {
-    ($vm:expr, $pc:expr, $jumptable:expr) => {
+    ($state:expr, $pc:expr) => {
+        ::vm::sample::CURRENT.store($pc as usize, ::std::sync::atomic::Ordering::Relaxed);
+        $state.instructions += 1;
+
+        unsafe {
+            asm!("jmpq *(%rdx)"
+                 :
+                 : "{rdx}"($pc), "{r12}"($state.frame), "{r13}"($state.instructions)
+                 :
+                 : "volatile");
+        }
+    }
+}
+
+/// Like `do_and_dispatch`, but continue with the handler the table holds for
+/// the opcode of the instruction at `$pc`, ignoring the handler address stored
+/// in the instruction. This allows an entry point to run in front of the
+/// regular handlers.
+#[cfg(target_arch = "x86_64")]
+macro_rules! do_and_dispatch_via {
+    ($state:expr, $name:expr, $pc:expr, $handlers:expr, $action:expr) => {
+        unsafe {
+            asm!(concat!($name, ":")
+                 : "={rdx}"($pc), "={r12}"($state.frame), "={r13}"($state.instructions)
+                 :
+                 :
+                 : "volatile");
+        }
+
+        unsafe {
+            $action
+        }
+
         unsafe {
-            let opcode = $vm.code.get_unchecked($pc).opcode as usize;
-            let addr = *$jumptable.get_unchecked(opcode);
             asm!("jmpq *$0"
                  :
-                 : "r"(addr), "{rdx}"($pc)
+                 : "r"(*$handlers.get_unchecked((*$pc).opcode as usize)),
+                   "{rdx}"($pc), "{r12}"($state.frame), "{r13}"($state.instructions)
                  :
                  : "volatile");
         }
@@ -44,19 +100,19 @@ macro_rules! dispatch {
 
 #[cfg(target_arch = "x86_64")]
 macro_rules! do_and_dispatch {
-    ($vm:expr, $jmptable:expr, $name:expr, $pc:expr, $action:expr) => {
+    ($state:expr, $name:expr, $pc:expr, $action:expr) => {
         unsafe {
             asm!(concat!($name, ":")
-                 : "={rdx}"($pc)
+                 : "={rdx}"($pc), "={r12}"($state.frame), "={r13}"($state.instructions)
                  :
                  :
                  : "volatile");
         }
 
-        {
+        unsafe {
             $action
         }
 
-        dispatch!($vm, $pc, $jmptable);
+        dispatch!($state, $pc);
     }
 }
@@ -0,0 +1,151 @@
+use std;
+use std::io::{Result, Write};
+use common::*;
+use disassembler::disassemble_instruction;
+use super::decode::Decoded;
+
+/// A single executed instruction of a trace
+#[derive(Clone, Copy, Default, PartialEq, Debug)]
+pub struct TraceEntry {
+    pub pc: usize,
+    /// Opcode of the instruction, the first component of a superinstruction
+    /// as these are traced one instruction at a time
+    pub opcode: Opcode,
+    /// Base register of the frame the instruction was executed in
+    pub base: usize
+}
+
+/// Fixed-size ring buffer of the most recently executed instructions of a
+/// thread, see `run_traced`.
+pub struct Trace {
+    entries: Vec<TraceEntry>,
+    recorded: usize
+}
+
+impl Trace {
+    /// Create an empty trace.
+    ///
+    /// # Arguments
+    ///
+    /// * `capacity` - Number of instructions kept, rounded up to a power of two
+    pub fn new(capacity: usize) -> Trace {
+        Trace {
+            entries: vec![TraceEntry::default(); capacity.max(1).next_power_of_two()],
+            recorded: 0
+        }
+    }
+
+    /// Get the recorded instructions, oldest first.
+    pub fn entries(&self) -> Vec<TraceEntry> {
+        if self.recorded <= self.entries.len() {
+            return self.entries[..self.recorded].to_vec();
+        }
+        let split = self.recorded & (self.entries.len() - 1);
+        let mut entries = self.entries[split..].to_vec();
+        entries.extend_from_slice(&self.entries[..split]);
+        entries
+    }
+
+    /// Total number of instructions executed while tracing, including the
+    /// ones no longer kept
+    pub fn recorded(&self) -> usize {
+        self.recorded
+    }
+
+    /// Write the recorded instructions with their disassembly, oldest first.
+    ///
+    /// # Arguments
+    ///
+    /// * `out` - Output stream
+    /// * `constants` - Constant table of the traced code
+    /// * `functions` - Function table of the traced code
+    /// * `instructions` - The traced code
+    pub fn write<W: Write>(&self,
+                           out: &mut W,
+                           constants: &[i64],
+                           functions: &[u64],
+                           instructions: &[Instruction]) -> Result<()> {
+        let entries = self.entries();
+        writeln!(out, "Last {} of {} executed instructions:", entries.len(), self.recorded)?;
+        for entry in entries {
+            write!(out, "  base {:>6}  ", entry.base)?;
+            match instructions.get(entry.pc) {
+                Some(instruction) => {
+                    disassemble_instruction(out, constants, functions, entry.pc, instruction)?;
+                }
+                None => writeln!(out, "0x{:05x}: Invalid address", entry.pc)?
+            }
+        }
+        Ok(())
+    }
+}
+
+/// Records into a trace while a thread is running.
+///
+/// To keep recording cheap, raw instruction and frame pointers are stored.
+/// They are converted to PCs and base registers when recording ends, and the
+/// opcodes of superinstructions to their first component. If it ends because
+/// of a panic, the trace is written to stderr.
+pub(super) struct Recorder<'a> {
+    trace: &'a mut Trace,
+    mask: usize,
+    start: usize,
+    registers: usize,
+    code: &'a [Instruction],
+    constants: &'a [i64],
+    functions: &'a [u64]
+}
+
+impl<'a> Recorder<'a> {
+    /// Start recording a new trace.
+    ///
+    /// # Arguments
+    ///
+    /// * `trace` - The trace, previous contents are discarded
+    /// * `thread` - The thread being traced
+    /// * `start` - Address of the first instruction of the decoded stream
+    /// * `registers` - Address of the register stack
+    pub(super) fn new<'t: 'a>(trace: &'a mut Trace,
+                              thread: &Thread<'t>,
+                      start: *const Decoded,
+                      registers: *const i64) -> Recorder<'a> {
+        trace.recorded = 0;
+        let mask = trace.entries.len() - 1;
+        Recorder {
+            trace,
+            mask,
+            start: start as usize,
+            registers: registers as usize,
+            code: thread.code,
+            constants: thread.constants,
+            functions: thread.functions
+        }
+    }
+
+    /// Record an instruction about to be executed, using plain stores only.
+    #[inline(always)]
+    pub(super) unsafe fn record(&mut self, pc: *const Decoded, frame: *const i64) {
+        let index = self.trace.recorded & self.mask;
+        let entry = self.trace.entries.get_unchecked_mut(index);
+        entry.pc = pc as usize;
+        entry.opcode = (*pc).opcode as Opcode;
+        entry.base = frame as usize;
+        self.trace.recorded += 1;
+    }
+}
+
+impl<'a> Drop for Recorder<'a> {
+    fn drop(&mut self) {
+        let recorded = self.trace.recorded.min(self.trace.entries.len());
+        for entry in &mut self.trace.entries[..recorded] {
+            entry.pc = (entry.pc - self.start) / std::mem::size_of::<Decoded>();
+            entry.base = (entry.base - self.registers) / std::mem::size_of::<i64>();
+            entry.opcode = superops::base(entry.opcode);
+        }
+
+        if std::thread::panicking() {
+            let stderr = std::io::stderr();
+            let _ = self.trace.write(&mut stderr.lock(), self.constants, self.functions, self.code);
+        }
+    }
+}
@@ -0,0 +1,130 @@
+extern crate lilium;
+use lilium::*;
+
+/// Run a program and format its result.
+fn run_formatted(program: &str) -> String {
+    let module = compile(program);
+    let mut registers = vec![0; 1024];
+    let mut thread = Thread {
+        functions: &module.functions,
+        constants: &module.constants,
+        data: &module.data,
+        code: &module.code,
+        registers: &mut registers,
+        base: 0,
+        pc: 0,
+        heap: Heap::new()
+    };
+    run(&mut thread, module.entry_point as usize);
+    thread.heap.format(thread.registers[reg::VAL as usize])
+}
+
+const FIB: &str = "(def fib (a b c) (if (> c 1) ((fib b (+ a b) (- c 1))) (b)))";
+const POW: &str = "(def power (acc x n) (if (> n 0) ((power (* acc x) x (- n 1))) (acc)))";
+
+#[test]
+fn bignums_promotion() {
+    assert_eq!(run_formatted(&format!("{} (fib 0 1 93)", FIB)), "12200160415121876738");
+    assert_eq!(run_formatted(&format!("{} (fib 0 1 100)", FIB)), "354224848179261915075");
+    assert_eq!(run_formatted(&format!("{} (- 0 (power 1 30 20))", POW)),
+               "-348678440100000000000000000000");
+
+    // Results fitting into a register are integers again
+    assert_eq!(run_formatted(&format!("{} (- (+ (fib 0 1 100) 7) (fib 0 1 100))", FIB)), "7");
+    assert_eq!(run_formatted(&format!("{} (compare (fib 0 1 100) (fib 0 1 99))", FIB)), "1");
+}
+
+#[test]
+fn bignums_reference_tag() {
+    // Integers overlapping the tag of references are stored as bignums
+    assert_eq!(run_formatted("(* 32753 281474976710656)"), "9219149912204115968");
+    assert_eq!(run_formatted("(nil? (- (* 32753 281474976710656) 281474976710656))"), "0");
+}
+
+#[test]
+fn bignums_karatsuba() {
+    // Squaring 3^2000, about 100 limbs, is split recursively
+    let program = format!(concat!(
+        "{} (let ((x (power 1 3 2000)))",
+        "  (compare (* x x) (power 1 3 4000)))"
+    ), POW);
+    assert_eq!(run_formatted(&program), "0");
+    let program = format!("{} (- (* (power 1 7 900) (power 1 7 1100)) (power 1 7 2000))", POW);
+    assert_eq!(run_formatted(&program), "0");
+}
+
+#[test]
+fn bignums_collected() {
+    // Bignums survive collections in lists
+    let program = concat!(
+        "(def fibs (a b n acc) (if (> n 0) ((fibs b (+ a b) (- n 1) (cons b acc))) (acc)))",
+        "(car (fibs 0 1 3000 nil))"
+    );
+    let result = run_formatted(program);
+    assert_eq!(result.len(), 627);
+    assert!(result.starts_with("41061588630797126033356837"));
+}
+
+#[test]
+fn bignums_comparisons() {
+    // Bignums are compared by value, with each other and with integers
+    assert_eq!(run_formatted(&format!("{} (> (fib 0 1 100) 5)", FIB)), "1");
+    assert_eq!(run_formatted(&format!("{} (< (fib 0 1 100) (fib 0 1 99))", FIB)), "0");
+    assert_eq!(run_formatted(&format!("{} (<= (fib 0 1 100) (fib 0 1 100))", FIB)), "1");
+    assert_eq!(run_formatted(&format!("{} (>= 5 (fib 0 1 100))", FIB)), "0");
+    assert_eq!(run_formatted(&format!("{} (< (- 0 (fib 0 1 100)) (- 0 5))", FIB)), "1");
+    assert_eq!(run_formatted(&format!("{} (== (fib 0 1 100) (fib 0 1 100))", FIB)), "1");
+    assert_eq!(run_formatted(&format!("{} (!= (fib 0 1 100) (fib 0 1 100))", FIB)), "0");
+    assert_eq!(run_formatted(&format!("{} (== (fib 0 1 100) (fib 0 1 99))", FIB)), "0");
+    assert_eq!(run_formatted(&format!("{} (min 5 (fib 0 1 100))", FIB)), "5");
+    assert_eq!(run_formatted(&format!("{} (max 5 (fib 0 1 100))", FIB)), "354224848179261915075");
+
+    // Integers overlapping the reference tag are bignums, too
+    assert_eq!(run_formatted("(< 5 (* 32753 281474976710656))"), "1");
+}
+
+#[test]
+fn bignums_division() {
+    assert_eq!(run_formatted(&format!("{} (/ (fib 0 1 100) (fib 0 1 99))", FIB)), "1");
+    assert_eq!(run_formatted(&format!("{} (/ (fib 0 1 100) 1000)", FIB)), "354224848179261915");
+    assert_eq!(run_formatted(&format!("{} (% (fib 0 1 100) 1000)", FIB)), "75");
+    assert_eq!(run_formatted(&format!("{} (% (- 0 (fib 0 1 100)) 1000)", FIB)), "925");
+    assert_eq!(run_formatted(&format!("{} (/ (* (fib 0 1 100) (fib 0 1 90)) (fib 0 1 90))", FIB)),
+               "354224848179261915075");
+    assert_eq!(run_formatted(&format!("{} (% (fib 0 1 100) (fib 0 1 99))", FIB)), "135301852344706746049");
+    assert_eq!(run_formatted(&format!("{} (abs (- 0 (fib 0 1 100)))", FIB)), "354224848179261915075");
+
+    // Overflowing powers are promoted
+    assert_eq!(run_formatted("(pow 30 20)"), "348678440100000000000000000000");
+    assert_eq!(run_formatted(&format!("{} (pow (fib 0 1 100) 1)", FIB)), "354224848179261915075");
+}
+
+#[test]
+fn bignums_reference_literals() {
+    // Literals overlapping the tag of references are bignums, not references
+    assert_eq!(run_formatted("9219149912204115968"), "9219149912204115968");
+    assert_eq!(run_formatted("(nil? 9219149912204115968)"), "0");
+    assert_eq!(run_formatted("(== 9219149912204115968 (* 32753 281474976710656))"), "1");
+    assert_eq!(run_formatted("(- 9219149912204115968 1)"), "9219149912204115967");
+}
+
+#[test]
+fn bignums_roots_and_bits() {
+    assert_eq!(run_formatted("(isqrt (pow 10 40))"), "100000000000000000000");
+    assert_eq!(run_formatted("(isqrt (- (pow 10 40) 1))"), "99999999999999999999");
+    assert_eq!(run_formatted("(popcount (- (pow 2 100) 1))"), "100");
+    assert_eq!(run_formatted("(ctz (pow 2 100))"), "100");
+    assert_eq!(run_formatted("(ctz (- 0 (* 3 (pow 2 100))))"), "100");
+
+    // Bignums overlapping the tag of references are counted in 64 bits
+    assert_eq!(run_formatted("(isqrt 9219149912204115968)"), "3036305306");
+    assert_eq!(run_formatted("(popcount 9219149912204115968)"), "12");
+    assert_eq!(run_formatted("(clz 9219149912204115968)"), "1");
+    assert_eq!(run_formatted("(ctz 9219149912204115968)"), "48");
+}
+
+#[test]
+#[should_panic(expected = "clz is not supported for bignums")]
+fn bignums_leading_zeros() {
+    run_formatted("(clz (pow 2 100))");
+}
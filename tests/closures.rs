@@ -0,0 +1,86 @@
+#[macro_use]
+mod common;
+
+extern crate lilium;
+use lilium::*;
+
+const TWICE: &str = "(def twice (f x) (f (f x)))";
+
+#[test]
+fn closures_values() {
+    let program = format!("{} (twice (lambda (y) (* y 3)) 2)", TWICE);
+    assert_eq!(run_program!(&program, 1024), 18);
+
+    // Captured values are copied when the lambda is evaluated
+    let program = format!("{} (let ((k 5)) (twice (lambda (y) (+ y k)) 1))", TWICE);
+    assert_eq!(run_program!(&program, 1024), 11);
+
+    // Functions returning functions
+    let adder = "(def adder (n) (lambda (x) (+ x n)))";
+    assert_eq!(run_program!(&format!("{} (let ((add (adder 10))) (add 5))", adder), 1024), 15);
+    assert_eq!(run_program!(&format!("{} (call (adder 1) 41)", adder), 1024), 42);
+    let nested = "(def curry (a) (lambda (b) (lambda (c) (+ (* a 100) (+ (* b 10) c)))))";
+    assert_eq!(run_program!(&format!("{} (call (call (curry 1) 2) 3)", nested), 1024), 123);
+
+    // Defined functions are values too
+    let program = format!("{} (def square (x) (* x x)) (twice square 3)", TWICE);
+    assert_eq!(run_program!(&program, 1024), 81);
+    let program = "(call (car (cons (lambda (x) (+ x 1)) nil)) 1)";
+    assert_eq!(run_program!(program, 1024), 2);
+}
+
+#[test]
+fn closures_known_calls() {
+    // A lambda which is only called is neither allocated nor called indirectly
+    let program = "(let ((a 3) (f (lambda (x) (* x a)))) (+ (f 2) (f 5)))";
+    assert_eq!(run_program!(program, 1024), 21);
+    let module = compile(program);
+    assert!(module.code.iter().all(|i| i.opcode != ops::CLO && i.opcode != ops::CLI));
+    assert_eq!(module.code.iter().filter(|i| i.opcode == ops::CAL).count(), 2);
+
+    // Passing the lambda on makes it a value
+    let program = format!("{} (let ((a 3) (f (lambda (x) (* x a)))) (+ (f 2) (twice f 5)))", TWICE);
+    assert_eq!(run_program!(&program, 1024), 51);
+    let module = compile(&program);
+    assert_eq!(module.code.iter().filter(|i| i.opcode == ops::CLO).count(), 1);
+}
+
+#[test]
+fn closures_tail_calls() {
+    // Tail calls of function values do not grow the stack
+    let program = "(def spin (n) (if (== n 0) (7) ((call (lambda (m) (spin m)) (- n 1))))) (spin 100000)";
+    assert_eq!(run_program!(program, 1024), 7);
+    assert!(compile(program).code.iter().any(|i| i.opcode == ops::TLI));
+}
+
+#[test]
+fn closures_collected() {
+    // Closures survive collections along with the values they captured
+    let program = concat!(
+        "(def total (fs acc) (if (nil? fs) (acc) ((total (cdr fs) (+ acc (call (car fs) 2))))))",
+        "(total (fold (acc x) (cons (lambda (y) (* y (car (cons x nil)))) acc) nil (range 0 100000)) 0)"
+    );
+    assert_eq!(run_program!(program, 1024), 2 * (0..100000i64).sum::<i64>());
+}
+
+#[test]
+#[should_panic(expected = "Not a function: 5")]
+fn closures_not_a_function() {
+    run_program!("(call 5 1)", 1024);
+}
+
+#[test]
+#[should_panic(expected = "Function of 1 arguments called with 2")]
+fn closures_arity() {
+    run_program!("(call (lambda (x) x) 1 2)", 1024);
+}
+
+#[test]
+fn closures_shadowing() {
+    // Lambdas bound by let shadow functions, other variables do not
+    let function = "(def f (x) (* x 10))";
+    assert_eq!(run_program!(&format!("{} (let ((f 1)) (f 2))", function), 1024), 20);
+    assert_eq!(run_program!(&format!("{} (let ((f (lambda (x) (+ x 1)))) (f 2))", function), 1024), 3);
+    let program = format!("{} (def g (f) (+ (f 2) (call f 2))) (g (lambda (x) x))", function);
+    assert_eq!(run_program!(&program, 1024), 22);
+}
@@ -4,17 +4,22 @@ macro_rules! run_program {
             let Module {
                 functions: f,
                 constants: c,
+                data: d,
                 entry_point: e,
-                code: i
+                code: i,
+                ..
             } = compile($program);
 
             let mut registers: [i64; $registers] = [0; $registers];
             let mut thread = Thread {
                 functions: &f,
                 constants: &c,
+                data: &d,
                 code: &i,
                 registers: &mut registers,
-                base: 0
+                base: 0,
+                pc: 0,
+                heap: Heap::new()
             };
             run(&mut thread, e as usize);
 
@@ -0,0 +1,42 @@
+extern crate lilium;
+use lilium::*;
+
+#[test]
+fn counters_file() {
+    let module = compile(concat!(
+        "(def sum (a)",
+        "  (if (> a 0) ((+ a (sum (- a 1)))) (0)))",
+        "(sum 10)"
+    ));
+
+    let path = std::env::temp_dir().join(format!("lilium-{}.stats", std::process::id()));
+    {
+        let mut stats = CountersFile::create(&path).unwrap();
+        stats.publish();
+
+        let mut registers = vec![0; 8192];
+        let mut thread = Thread {
+            functions: &module.functions,
+            constants: &module.constants,
+            data: &module.data,
+            code: &module.code,
+            registers: &mut registers,
+            base: 0,
+            pc: 0,
+            heap: Heap::new()
+        };
+        run(&mut thread, module.entry_point as usize);
+    }
+
+    let stats = CountersFile::open(&path).unwrap();
+    let snapshot = stats.counters().snapshot();
+    std::fs::remove_file(&path).unwrap();
+
+    // One call from the main code and ten recursive ones
+    assert_eq!(snapshot.calls, 11);
+    assert_eq!(snapshot.returns, 11);
+    assert_eq!(snapshot.depth, 0);
+    assert_eq!(snapshot.max_depth, 11);
+    assert_eq!(snapshot.max_registers, 12 * 256);
+    assert!(snapshot.instructions > 11 * 3);
+}
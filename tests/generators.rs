@@ -0,0 +1,85 @@
+#[macro_use]
+mod common;
+
+extern crate lilium;
+use lilium::*;
+
+#[test]
+fn generators_basic() {
+    // The consumer resumes the generator in a loop without calling anything,
+    // so the frames of the generator stay in place
+    let result = run_program!(concat!(
+        "(def count (i n) (if (< i n) ((yield i) (count (+ i 1) n)) (0)))",
+        "(def sum (g acc v) (if (nil? v) (acc) ((sum g (+ acc v) (resume g 0)))))",
+        "(let ((g (generator (count 0 100)))) (sum g 0 (resume g 0)))"
+    ), 2048);
+    assert_eq!(result, 4950);
+
+    // A finished generator keeps returning nil
+    let result = run_program!(concat!(
+        "(def once (x) (yield x) 0)",
+        "(def drain (g) (resume g 0) (resume g 0) (nil? (resume g 0)))",
+        "(drain (generator (once 1)))"
+    ), 2048);
+    assert_eq!(result, 1);
+}
+
+#[test]
+fn generators_stackful() {
+    // Yields from nested calls suspend all frames of the generator
+    let result = run_program!(concat!(
+        "(def emit (n) (if (> n 0) ((emit (- n 1)) (yield n) (emit (- n 1))) (0)))",
+        "(def digits (g acc v) (if (nil? v) (acc) ((digits g (+ (* acc 10) v) (resume g 0)))))",
+        "(let ((g (generator (emit 3)))) (digits g 0 (resume g 0)))"
+    ), 4096);
+    assert_eq!(result, 1213121);
+}
+
+#[test]
+fn generators_send() {
+    // The value passed to resume is the result of the yield
+    let result = run_program!(concat!(
+        "(def total (t) (total (+ t (yield t))))",
+        "(def feed (g i n) (if (< i n) ((resume g i) (feed g (+ i 1) n)) ((resume g 0))))",
+        "(feed (generator (total 0)) 0 5)"
+    ), 2048);
+    assert_eq!(result, 10);
+}
+
+#[test]
+fn generators_interleaved() {
+    // Two generators share the frames above the consumer, and calls of the
+    // consumer overwrite them, so their frames are saved and restored
+    let result = run_program!(concat!(
+        "(def count (i n) (if (< i n) ((yield i) (count (+ i 1) n)) (0)))",
+        "(def mul (x y) (* x y))",
+        "(def zip (a b acc x y) (if (nil? x) (acc) ((zip a b (+ acc (mul x y)) (resume a 0) (resume b 0)))))",
+        "(let ((a (generator (count 0 10))) (b (generator (count 10 20)))) (zip a b 0 (resume a 0) (resume b 0)))"
+    ), 2048);
+    assert_eq!(result, 735);
+}
+
+#[test]
+fn generators_collect() {
+    // Collections find the values of resident and of saved frames
+    let result = run_program!(concat!(
+        "(def lists (i) (yield (cons i nil)) (lists (+ i 1)))",
+        "(def drain (g n acc) (if (> n 0) ((drain g (- n 1) (+ acc (car (resume g 0))))) (acc)))",
+        "(drain (generator (lists 0)) 100000 0)"
+    ), 2048);
+    assert_eq!(result, 4999950000);
+
+    let result = run_program!(concat!(
+        "(def lists (i) (yield (cons i nil)) (lists (+ i 1)))",
+        "(def first (l) (car l))",
+        "(def drain (g n acc) (if (> n 0) ((drain g (- n 1) (+ acc (first (resume g 0))))) (acc)))",
+        "(drain (generator (lists 0)) 100000 0)"
+    ), 2048);
+    assert_eq!(result, 4999950000);
+}
+
+#[test]
+#[should_panic(expected = "Yield outside of a generator")]
+fn generators_yield_outside() {
+    run_program!("(yield 1)", 512);
+}
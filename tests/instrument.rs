@@ -0,0 +1,43 @@
+extern crate lilium;
+use lilium::*;
+
+#[test]
+fn instrument_switch() {
+    let module = compile(concat!(
+        "(def fun (a)",
+        "  (if (> a 0) ((fun (- a 1))) (0)))",
+        "(fun 10)"
+    ));
+    let entry = module.functions[0] as usize;
+
+    let mut registers = vec![0; 1024];
+    let mut counts = vec![0; module.code.len()];
+    for &enabled in &[true, false] {
+        set_instrumentation(enabled);
+        let mut thread = Thread {
+            functions: &module.functions,
+            constants: &module.constants,
+            data: &module.data,
+            code: &module.code,
+            registers: &mut registers,
+            base: 0,
+            pc: 0,
+            heap: Heap::new()
+        };
+        run_instrumented(&mut thread, module.entry_point as usize, &mut counts);
+    }
+
+    // Counting is off during the second run
+    assert_eq!(counts[entry], 11);
+    assert_eq!(counts[module.entry_point as usize], 1);
+
+    // Superinstructions are executed as their components, each counted at
+    // its own PC
+    let fused: Vec<usize> = (0..module.code.len()).filter(|&pc| module.code[pc].opcode >= 128).collect();
+    assert!(!fused.is_empty());
+    for pc in fused {
+        if counts[pc] > 0 {
+            assert!(counts[pc + 1] >= counts[pc], "PC {} counted {} times after {}", pc + 1, counts[pc + 1], counts[pc]);
+        }
+    }
+}
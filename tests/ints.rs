@@ -0,0 +1,61 @@
+#[macro_use]
+mod common;
+
+extern crate lilium;
+use lilium::*;
+use std::io::Write;
+
+fn write_file(name: &str, bytes: &[u8]) -> String {
+    let path = std::env::temp_dir().join(format!("lilium-{}-{}", name, std::process::id()));
+    std::fs::File::create(&path).unwrap().write_all(bytes).unwrap();
+    path.to_str().unwrap().to_string()
+}
+
+#[test]
+fn ints_mapped() {
+    let mut bytes = Vec::new();
+    for i in 0..100000i64 {
+        for shift in 0..8 {
+            bytes.push((i * 3 - 1000 >> (8 * shift)) as u8);
+        }
+    }
+    let path = write_file("mapped", &bytes);
+
+    let result = run_program!(&format!(concat!(
+        "(let ((a (load-ints \"{}\")))",
+        "  (+ (* (size a) 1000) (ints-get a 5)))"
+    ), path), 512);
+    assert_eq!(result, 100000 * 1000 + 15 - 1000);
+
+    // Allocating in the loop collects garbage while the array is in use
+    let result = run_program!(&format!(
+        "(fold (acc x) (+ acc (car (cons x nil))) 0 (ints-each (load-ints \"{}\")))", path
+    ), 512);
+    std::fs::remove_file(&path).unwrap();
+    assert_eq!(result, (0..100000i64).map(|i| i * 3 - 1000).sum::<i64>());
+}
+
+#[test]
+fn ints_parsed() {
+    let path = write_file("parsed", b"12 -7\n1234567890123  99999999\n\n-100000000 0\n3");
+    let program = format!("(fold (acc x) (+ acc x) 0 (ints-each (parse-ints \"{}\")))", path);
+    assert_eq!(run_program!(&program, 512), 12 - 7 + 1234567890123 + 99999999 - 100000000 + 3);
+    let result = run_program!(&format!("(ints-get (parse-ints \"{}\") 2)", path), 512);
+    assert_eq!(result, 1234567890123);
+    std::fs::remove_file(&path).unwrap();
+
+    // Loads in the loop are not checked
+    let module = compile(&program);
+    assert!(module.code.iter().any(|i| i.opcode == ops::IGU));
+    assert!(module.code.iter().all(|i| i.opcode != ops::IGT));
+
+    let result = run_program!("(nil? (parse-ints \"/nonexistent/file\"))", 512);
+    assert_eq!(result, 1);
+}
+
+#[test]
+#[should_panic(expected = "out of range")]
+fn ints_range() {
+    let path = write_file("range", b"1 2 3");
+    run_program!(&format!("(ints-get (parse-ints \"{}\") 3)", path), 512);
+}
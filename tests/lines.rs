@@ -0,0 +1,37 @@
+extern crate lilium;
+use lilium::*;
+
+#[test]
+fn lines_locations() {
+    let module = compile(concat!(
+        "(def inc (a)\n",
+        "  (+ a 1))\n",
+        "(write\n",
+        "   (inc 41))\n"
+    ));
+    let runs = module.lines.as_ref().unwrap().runs();
+
+    let location = |opcode: Opcode| {
+        let pc = module.code.iter().position(|i| i.opcode == opcode).unwrap();
+        locate(&runs, pc as u64).unwrap()
+    };
+    assert_eq!(location(ops::ADD), Location { line: 2, column: 3 });
+    assert_eq!(location(ops::RET), Location { line: 1, column: 1 });
+    assert_eq!(location(ops::CAL), Location { line: 4, column: 4 });
+    assert_eq!(location(ops::WRI), Location { line: 3, column: 1 });
+}
+
+#[test]
+fn lines_encoding() {
+    let runs = vec![
+        (0, Location { line: 10, column: 1 }),
+        (3, Location { line: 2, column: 200 }),
+        (1000, Location { line: 70000, column: 5 })
+    ];
+    let table = LineTable::new(&runs);
+
+    assert_eq!(table.runs(), runs);
+    assert_eq!(table.size(), 13);
+    assert_eq!(locate(&runs, 999), Some(runs[1].1));
+    assert_eq!(locate(&runs, 5000), Some(runs[2].1));
+}
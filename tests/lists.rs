@@ -0,0 +1,103 @@
+#[macro_use]
+mod common;
+
+extern crate lilium;
+use lilium::*;
+
+#[test]
+fn lists_basic() {
+    let result = run_program!(concat!(
+        "(let ((l (cons 1 (cons 2 (cons 3 nil)))))",
+        "  (+ (car l) (car (cdr (cdr l)))))"
+    ), 512);
+    assert_eq!(result, 4);
+
+    let result = run_program!("(+ (nil? nil) (nil? (cons 1 nil)))", 512);
+    assert_eq!(result, 1);
+}
+
+#[test]
+fn lists_collect() {
+    // Building the list and summing it up needs several collections, only
+    // the accumulated list survives them
+    let module = compile(concat!(
+        "(def upto (n acc) (if (> n 0) ((upto (- n 1) (cons n acc))) (acc)))",
+        "(def sum (l acc) (if (nil? l) (acc) ((sum (cdr l) (+ acc (car l))))))",
+        "(def garbage (n) (if (> n 0) ((cons n nil) (garbage (- n 1))) (0)))",
+        "(def churn (l) (garbage 100000) (sum l 0))",
+        "(churn (upto 100000 nil))"
+    ));
+
+    let mut registers = vec![0; 4096];
+    let mut thread = Thread {
+        functions: &module.functions,
+        constants: &module.constants,
+        data: &module.data,
+        code: &module.code,
+        registers: &mut registers,
+        base: 0,
+        pc: 0,
+        heap: Heap::new()
+    };
+    run(&mut thread, module.entry_point as usize);
+
+    assert_eq!(thread.registers[reg::VAL as usize], 5000050000);
+    let stats = thread.heap.stats();
+    assert!(stats.minor_collections > 10);
+    assert_eq!(stats.allocated, 3 * 200000);
+    assert!(stats.promoted >= 3 * 100000);
+}
+
+#[test]
+fn lists_result() {
+    let module = compile("(cons (cons 1 (cons 2 nil)) (cons 3 4))");
+    let mut registers = vec![0; 512];
+    let mut thread = Thread {
+        functions: &module.functions,
+        constants: &module.constants,
+        data: &module.data,
+        code: &module.code,
+        registers: &mut registers,
+        base: 0,
+        pc: 0,
+        heap: Heap::new()
+    };
+    run(&mut thread, module.entry_point as usize);
+
+    let list = thread.registers[reg::VAL as usize];
+    assert_eq!(thread.heap.format(list), "((1 2) 3 . 4)");
+    let first = thread.heap.car(list).unwrap();
+    assert_eq!(thread.heap.to_vec(first), Some(vec![1, 2]));
+    assert_eq!(thread.heap.to_vec(list), None);
+}
+
+#[test]
+fn lists_dead_frames() {
+    // The reference `deep` leaves in a high register of its frame dies when
+    // it returns. The caller collects garbage, then `churn` runs in the same
+    // frame and collects garbage again, which must not find the reference.
+    let nesting = 40;
+    let deep = format!("(def deep (n) (+ (. (pair 1 2) x) {}(car (cons n nil)){}))",
+                       "(+ 0 ".repeat(nesting), ")".repeat(nesting));
+    let module = compile(&format!(concat!(
+        "(defrecord pair x y)",
+        "{}",
+        "(def garbage (n acc) (if (> n 0) ((garbage (- n 1) (+ acc (car (cons n nil))))) (acc)))",
+        "(def churn (n) (garbage n 0))",
+        "(+ (deep 1) (+ (fold (acc x) (+ acc (car (cons x nil))) 0 (range 0 100000)) (churn 100000)))"
+    ), deep));
+
+    let mut registers = vec![0; 1024];
+    let mut thread = Thread {
+        functions: &module.functions,
+        constants: &module.constants,
+        data: &module.data,
+        code: &module.code,
+        registers: &mut registers,
+        base: 0,
+        pc: 0,
+        heap: Heap::new()
+    };
+    run(&mut thread, module.entry_point as usize);
+    assert_eq!(thread.registers[reg::VAL as usize], 2 + 4999950000 + 5000050000);
+}
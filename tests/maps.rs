@@ -0,0 +1,73 @@
+#[macro_use]
+mod common;
+
+extern crate lilium;
+use lilium::*;
+
+#[test]
+fn maps_basic() {
+    let result = run_program!(concat!(
+        "(let ((m (put (put (make-map) 1 10) 2 20)))",
+        "  (+ (get m 1) (+ (get m 2) (+ (has? m 3) (size m)))))"
+    ), 512);
+    assert_eq!(result, 32);
+
+    let result = run_program!(concat!(
+        "(let ((m (put (put (make-map) 7 1) 7 2)))",
+        "  (+ (nil? (get m 8)) (+ (get m 7) (size m))))"
+    ), 512);
+    assert_eq!(result, 4);
+}
+
+#[test]
+fn maps_grow() {
+    let result = run_program!(concat!(
+        "(def fill (m n) (if (> n 0) ((fill (put m (* n 7919) n) (- n 1))) (m)))",
+        "(def check (m n acc) (if (> n 0) ((check m (- n 1) (+ acc (get m (* n 7919))))) (acc)))",
+        "(def both (m) (+ (size m) (check m 5000 0)))",
+        "(both (fill (make-map) 5000))"
+    ), 1024);
+    assert_eq!(result, 5000 + 5000 * 5001 / 2);
+}
+
+#[test]
+fn maps_collect() {
+    // The map is promoted before it is filled with new lists, which have to
+    // survive the following collections through the remembered set
+    let module = compile(concat!(
+        "(def fill (m n) (if (> n 0) ((fill (put m n (cons n nil)) (- n 1))) (m)))",
+        "(def garbage (n) (if (> n 0) ((cons n nil) (garbage (- n 1))) (0)))",
+        "(def total (m n acc) (if (> n 0) ((total m (- n 1) (+ acc (car (get m n))))) (acc)))",
+        "(def churn (m) (garbage 50000) (fill m 1000) (garbage 50000) (total m 1000 0))",
+        "(churn (make-map))"
+    ));
+
+    let mut registers = vec![0; 4096];
+    let mut thread = Thread {
+        functions: &module.functions,
+        constants: &module.constants,
+        data: &module.data,
+        code: &module.code,
+        registers: &mut registers,
+        base: 0,
+        pc: 0,
+        heap: Heap::new()
+    };
+    run(&mut thread, module.entry_point as usize);
+
+    assert_eq!(thread.registers[reg::VAL as usize], 500500);
+    assert!(thread.heap.stats().minor_collections >= 8);
+}
+
+#[test]
+#[should_panic(expected = "Not an integer key: (1)")]
+fn maps_reference_key() {
+    // Keys are not updated by the collector, so references are rejected
+    run_program!("(put (make-map) (cons 1 nil) 2)", 512);
+}
+
+#[test]
+#[should_panic(expected = "Not an integer key: a")]
+fn maps_reference_lookup() {
+    run_program!("(has? (make-map) \"a\")", 512);
+}
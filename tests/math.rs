@@ -0,0 +1,50 @@
+#[macro_use]
+mod common;
+
+extern crate lilium;
+use lilium::*;
+
+#[test]
+fn math_arithmetic() {
+    assert_eq!(run_program!("(% 17 5)", 512), 2);
+    assert_eq!(run_program!("(% (- 0 17) 5)", 512), 3);
+    assert_eq!(run_program!("(pow 3 13)", 512), 1594323);
+    assert_eq!(run_program!("(pow (- 0 2) 63)", 512), i64::min_value());
+    assert_eq!(run_program!("(pow 7 0)", 512), 1);
+    assert_eq!(run_program!("(min 3 (- 0 4))", 512), -4);
+    assert_eq!(run_program!("(max 3 (- 0 4))", 512), 3);
+    assert_eq!(run_program!("(abs (- 0 42))", 512), 42);
+}
+
+#[test]
+fn math_number_theory() {
+    assert_eq!(run_program!("(gcd 1071 462)", 512), 21);
+    assert_eq!(run_program!("(gcd (- 0 48) 180)", 512), 12);
+    assert_eq!(run_program!("(gcd 0 9)", 512), 9);
+    assert_eq!(run_program!("(isqrt 99)", 512), 9);
+    assert_eq!(run_program!("(isqrt 100)", 512), 10);
+    assert_eq!(run_program!("(isqrt 9223372036854775807)", 512), 3037000499);
+
+    // Trial division with a single instruction per step
+    let program = concat!(
+        "(def prime (n d) (if (> d (isqrt n)) (1) ((if (== (% n d) 0) (0) ((prime n (+ d 1)))))))",
+        "(fold (acc n) (+ acc (prime n 2)) 0 (range 2 1000))"
+    );
+    assert_eq!(run_program!(program, 1024), 168);
+    assert!(compile(program).code.iter().all(|i| i.opcode != ops::DIV));
+}
+
+#[test]
+fn math_bits() {
+    assert_eq!(run_program!("(popcount 255)", 512), 8);
+    assert_eq!(run_program!("(popcount (- 0 1))", 512), 64);
+    assert_eq!(run_program!("(clz 1)", 512), 63);
+    assert_eq!(run_program!("(ctz 40)", 512), 3);
+    assert_eq!(run_program!("(ctz 0)", 512), 64);
+}
+
+#[test]
+#[should_panic(expected = "Square root of negative number")]
+fn math_negative_root() {
+    run_program!("(isqrt (- 0 1))", 512);
+}
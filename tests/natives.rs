@@ -0,0 +1,54 @@
+#[macro_use]
+mod common;
+
+extern crate lilium;
+use lilium::*;
+
+fn hypot(arguments: &[i64]) -> i64 {
+    ((arguments[0] * arguments[0] + arguments[1] * arguments[1]) as f64).sqrt() as i64
+}
+
+fn checksum(arguments: &[i64]) -> i64 {
+    arguments.iter().fold(0, |acc, &x| acc * 31 + x)
+}
+
+#[test]
+fn natives_call() {
+    register_native("hypot", 2, hypot);
+    register_native("checksum", 4, checksum);
+    let result = run_program!("(+ (hypot 3 4) (checksum 1 (hypot 6 8) 3 (- 5 1)))", 512);
+    assert_eq!(result, 5 + ((1 * 31 + 10) * 31 + 3) * 31 + 4);
+
+    // In a loop and in tail position
+    let program = concat!(
+        "(def norm (i n acc) (if (< i n) ((norm (+ i 1) n (+ acc (hypot i i)))) ((hypot acc 0))))",
+        "(norm 0 100 0)"
+    );
+    assert_eq!(run_program!(program, 1024), (0..100).map(|i| hypot(&[i, i])).sum::<i64>());
+    let module = compile(program);
+    assert_eq!(module.code.iter().filter(|i| i.opcode == ops::CALLN).count(), 2);
+}
+
+#[test]
+fn natives_shadowed() {
+    // Functions of the program take precedence
+    register_native("twice", 1, |arguments| arguments[0] * 2);
+    assert_eq!(run_program!("(def twice (x) (* x 3)) (twice 5)", 512), 15);
+    assert_eq!(run_program!("(twice 5)", 512), 10);
+}
+
+#[test]
+#[should_panic(expected = "takes 1 arguments")]
+fn natives_arity() {
+    register_native("negate", 1, |arguments| -arguments[0]);
+    run_program!("(negate 1 2)", 512);
+}
+
+#[test]
+#[should_panic(expected = "overlaps the tag of references")]
+fn natives_reference_tag() {
+    // Natives can not allocate, so an integer in the range of references can
+    // not be returned
+    register_native("forge", 1, |arguments| arguments[0] + values::REF);
+    run_program!("(forge 1)", 512);
+}
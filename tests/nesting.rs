@@ -0,0 +1,32 @@
+#[macro_use]
+mod common;
+
+extern crate lilium;
+use lilium::*;
+
+#[test]
+fn nested_conditionals() {
+    let mut program = String::from("(def lookup (x)");
+    for i in 0..10000 {
+        program.push_str(&format!(" (if (== x {}) ({}) (", i, i * 2));
+    }
+    program.push_str("0");
+    for _ in 0..10000 {
+        program.push_str("))");
+    }
+    program.push_str(")(lookup 9999)");
+
+    let result = run_program!(&program, 1536);
+    assert_eq!(result, 19998);
+}
+
+#[test]
+fn function_body_sequence() {
+    let result = run_program!(concat!(
+        "(def fun (a)",
+        "  (write a)",
+        "  (+ a 1))",
+        "(fun 41)"
+    ), 1536);
+    assert_eq!(result, 42);
+}
@@ -0,0 +1,100 @@
+extern crate lilium;
+use lilium::*;
+
+const PROGRAM: &str = concat!(
+    "(def count (a b)",
+    "  (if",
+    "    (> a 0)",
+    "    ((count (- a 1) (+ b 2)))",
+    "    (b)))",
+    "(count 100 0)"
+);
+
+fn execute(module: &Module, profile: &mut Profile) -> i64 {
+    let mut registers: [i64; 1536] = [0; 1536];
+    let mut thread = Thread {
+        functions: &module.functions,
+        constants: &module.constants,
+        data: &module.data,
+        code: &module.code,
+        registers: &mut registers,
+        base: 0,
+        pc: 0,
+        heap: Heap::new()
+    };
+    run_profiled(&mut thread, module.entry_point as usize, profile);
+    thread.registers[reg::VAL as usize]
+}
+
+#[test]
+fn profile_counts() {
+    let module = compile(PROGRAM);
+    let mut profile = Profile::default();
+    assert_eq!(execute(&module, &mut profile), 200);
+
+    assert_eq!(profile.branches.len(), 1);
+    assert_eq!(profile.branches.values().next(), Some(&(100, 1)));
+    assert_eq!(profile.entries.get(&module.functions[0]), Some(&101));
+}
+
+#[test]
+fn profile_layout() {
+    let module = compile(PROGRAM);
+    let mut profile = Profile::default();
+    execute(&module, &mut profile);
+
+    // The likely arm now falls through, so the jump is rarely taken
+    let optimized = compile_with_profile(PROGRAM, &profile);
+    let mut optimized_profile = Profile::default();
+    assert_eq!(execute(&optimized, &mut optimized_profile), 200);
+    assert_eq!(optimized_profile.branches.values().next(), Some(&(1, 100)));
+}
+
+#[test]
+fn profile_sequences() {
+    let module = compile(PROGRAM);
+    let mut profile = Profile::default();
+    execute(&module, &mut profile);
+
+    // Sequences are counted up to the first control flow instruction
+    let sequence = vec![ops::LD, ops::GT, ops::JTF];
+    assert_eq!(profile.sequences.get(&sequence), Some(&101));
+    let sequence = vec![ops::JTF, ops::MOV];
+    assert_eq!(profile.sequences.get(&sequence), None);
+}
+
+#[test]
+fn profile_sequences_io() {
+    // Instructions which may suspend the thread also end a sequence
+    let module = compile("(def show (x) (write x) (+ x 1)) (show (show 1))");
+    let mut profile = Profile::default();
+    execute(&module, &mut profile);
+
+    assert!(profile.sequences.keys().any(|sequence| sequence.last() == Some(&ops::WRI)));
+    for sequence in profile.sequences.keys() {
+        assert!(!sequence[..sequence.len() - 1].contains(&ops::WRI));
+    }
+}
+
+#[test]
+#[should_panic(expected = "Profile was recorded on different code")]
+fn profile_other_program() {
+    let module = compile(PROGRAM);
+    let mut profile = Profile::default();
+    execute(&module, &mut profile);
+    compile_with_profile(&PROGRAM.replace("(+ b 2)", "(+ b (* 2 1))"), &profile);
+}
+
+#[test]
+#[should_panic(expected = "Profile was recorded on different code")]
+fn profile_other_layout() {
+    let module = compile(PROGRAM);
+    let mut profile = Profile::default();
+    execute(&module, &mut profile);
+
+    // A profile of the optimized layout does not fit the default layout
+    let optimized = compile_with_profile(PROGRAM, &profile);
+    let mut optimized_profile = Profile::default();
+    execute(&optimized, &mut optimized_profile);
+    compile_with_profile(PROGRAM, &optimized_profile);
+}
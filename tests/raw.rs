@@ -0,0 +1,139 @@
+extern crate lilium;
+use lilium::*;
+
+/// Host which gets its binary input in pieces and records every write.
+#[derive(Default)]
+struct Host {
+    input: Vec<u8>,
+    position: usize,
+    closed: bool,
+    writes: Vec<Vec<u8>>
+}
+
+impl Io for Host {
+    fn read_line(&mut self, _line: &mut Vec<u8>) -> Option<bool> {
+        panic!("Text input read");
+    }
+
+    fn write(&mut self, bytes: &[u8]) -> bool {
+        self.writes.push(bytes.to_vec());
+        true
+    }
+
+    fn read_bytes(&mut self, bytes: &mut [u8]) -> Option<bool> {
+        if self.input.len() - self.position < bytes.len() {
+            return if self.closed { Some(false) } else { None };
+        }
+        bytes.copy_from_slice(&self.input[self.position..self.position + bytes.len()]);
+        self.position += bytes.len();
+        Some(true)
+    }
+}
+
+fn raw(values: &[i64]) -> Vec<u8> {
+    let mut bytes = Vec::new();
+    for &value in values {
+        for shift in 0..8 {
+            bytes.push((value >> (8 * shift)) as u8);
+        }
+    }
+    bytes
+}
+
+/// Run a program with the host until it halts, returning its result.
+fn run_program(program: &str, host: &mut Host) -> i64 {
+    let module = compile(program);
+    let mut registers = vec![0; 512];
+    let mut thread = Thread {
+        functions: &module.functions,
+        constants: &module.constants,
+        data: &module.data,
+        code: &module.code,
+        registers: &mut registers,
+        base: 0,
+        pc: 0,
+        heap: Heap::new()
+    };
+    assert_eq!(run_with_io(&mut thread, module.entry_point as usize, host), Status::Halted);
+    thread.registers[reg::VAL as usize]
+}
+
+#[test]
+fn raw_read() {
+    let mut host = Host { input: raw(&[40, -2, 4]), closed: true, ..Host::default() };
+    let program = "(- (+ (read-raw) (read-raw)) (* (read-raw) (if (nil? (read-raw)) (10) (0))))";
+    let result = run_program(program, &mut host);
+    assert_eq!(result, 40 - 2 - 4 * 10);
+
+    // Suspended until all eight bytes of an integer are there
+    let module = compile("(+ (read-raw) 1)");
+    let mut registers = vec![0; 512];
+    let mut thread = Thread {
+        functions: &module.functions,
+        constants: &module.constants,
+        data: &module.data,
+        code: &module.code,
+        registers: &mut registers,
+        base: 0,
+        pc: 0,
+        heap: Heap::new()
+    };
+    let mut host = Host { input: raw(&[41])[..5].to_vec(), ..Host::default() };
+    let status = run_with_io(&mut thread, module.entry_point as usize, &mut host);
+    assert_eq!(status, Status::Suspended(Suspension::NeedInput));
+    host.input = raw(&[41]);
+    assert_eq!(resume(&mut thread, &mut host), Status::Halted);
+    assert_eq!(thread.registers[reg::VAL as usize], 42);
+}
+
+#[test]
+fn raw_write() {
+    // A batch is written at once, its result is the last integer
+    let mut host = Host::default();
+    let result = run_program("(let ((x 3)) (write-raw 1 (- 0 2) (+ x 4)))", &mut host);
+    assert_eq!(result, 7);
+    assert_eq!(host.writes, vec![raw(&[1, -2, 7])]);
+
+    let module = compile("(write-raw 1 2 3 4)");
+    let writes: Vec<&Instruction> = module.code.iter().filter(|i| i.opcode == ops::WRR).collect();
+    assert_eq!(writes.len(), 1);
+    assert_eq!(writes[0].right, 4);
+}
+
+#[test]
+fn raw_framing() {
+    // Binary framing applies to read, write and the input stream
+    set_framing(Framing::Binary, Framing::Binary);
+    let values: Vec<i64> = (0..1000).map(|i| i * 1_000_000_007 - 500).collect();
+    let mut host = Host { input: raw(&values), closed: true, ..Host::default() };
+    let result = run_program("(write (fold (acc x) (+ acc x) (read) (input)))", &mut host);
+    set_framing(Framing::Text, Framing::Text);
+    let sum = values.iter().sum::<i64>();
+    assert_eq!(result, sum);
+    assert_eq!(host.writes, vec![raw(&[sum])]);
+
+    // Strings are still written as text
+    let mut host = Host::default();
+    set_framing(Framing::Text, Framing::Binary);
+    run_program("(write \"abc\")", &mut host);
+    set_framing(Framing::Text, Framing::Text);
+    assert_eq!(host.writes, vec![b"abc\n".to_vec()]);
+}
+
+#[test]
+#[should_panic(expected = "Only integers can be written raw")]
+fn raw_write_string() {
+    run_program("(write-raw 1 \"abc\")", &mut Host::default());
+}
+
+#[test]
+fn raw_reference_tag() {
+    // Integers overlapping the tag of references are read as bignums, so only
+    // the end of the input is nil
+    let mut host = Host { input: raw(&[values::NIL, 5]), closed: true, ..Host::default() };
+    let program = concat!(
+        "(def diff (a b) (if (nil? a) (0) ((if (nil? (read-raw)) ((- a b)) (1)))))",
+        "(diff (read-raw) (read-raw))"
+    );
+    assert_eq!(run_program(program, &mut host), values::NIL - 5);
+}
@@ -0,0 +1,96 @@
+#[macro_use]
+mod common;
+
+extern crate libc;
+extern crate lilium;
+use lilium::*;
+
+fn thread<'a>(module: &'a Module, registers: &'a mut [i64]) -> Thread<'a> {
+    Thread {
+        functions: &module.functions,
+        constants: &module.constants,
+        data: &module.data,
+        code: &module.code,
+        registers: registers,
+        base: 0,
+        pc: 0,
+        heap: Heap::new()
+    }
+}
+
+#[test]
+fn reactor_pipes() {
+    // Pairs of threads streaming more lines through a pipe than it can
+    // hold, so that both sides are parked repeatedly
+    let mut modules = Vec::new();
+    for _ in 0..10 {
+        let mut fds = [0; 2];
+        assert_eq!(unsafe { libc::pipe(fds.as_mut_ptr()) }, 0);
+        modules.push(compile(&format!(concat!(
+            "(def consume (fd b lines) (if (> (fd-read fd b) 0) ((consume fd b (+ lines 1))) (lines)))",
+            "(consume {} (buffer) 0)"
+        ), fds[0])));
+        modules.push(compile(&format!(concat!(
+            "(def produce (fd i n) (if (< i n) ((fd-write fd \"line\\n\") (produce fd (+ i 1) n)) ((fd-close fd) n)))",
+            "(produce {} 0 20000)"
+        ), fds[1])));
+    }
+    let mut registers = vec![vec![0; 1024]; modules.len()];
+    let mut threads: Vec<Thread> = modules.iter().zip(registers.iter_mut()).map(|(module, registers)| {
+        thread(module, registers)
+    }).collect();
+
+    {
+        let mut reactor = Reactor::new().unwrap();
+        for (thread, module) in threads.iter_mut().zip(modules.iter()) {
+            reactor.spawn(thread, module.entry_point as usize);
+        }
+        reactor.run().unwrap();
+    }
+    for thread in threads.iter() {
+        assert_eq!(thread.registers[reg::VAL as usize], 20000);
+    }
+}
+
+#[test]
+fn reactor_sockets() {
+    // A client sending lines over a Unix socket and an echo server
+    let mut fds = [0; 2];
+    assert_eq!(unsafe { libc::socketpair(libc::AF_UNIX, libc::SOCK_STREAM, 0, fds.as_mut_ptr()) }, 0);
+    let server = compile(&format!(concat!(
+        "(def serve (fd b) (if (> (fd-read fd b) 0) ((fd-write fd (append b \"\\n\")) (serve fd b)) ((fd-close fd))))",
+        "(serve {} (buffer))"
+    ), fds[0]));
+    let client = compile(&format!(concat!(
+        "(def ask (fd b i n total) (if (< i n) ((fd-write fd \"ping\\n\") (ask fd b (+ i 1) n (+ total (fd-read fd b)))) ((fd-close fd) total)))",
+        "(ask {} (buffer) 0 100 0)"
+    ), fds[1]));
+
+    let mut server_registers = vec![0; 1024];
+    let mut client_registers = vec![0; 1024];
+    let mut server_thread = thread(&server, &mut server_registers);
+    let mut client_thread = thread(&client, &mut client_registers);
+    {
+        let mut reactor = Reactor::new().unwrap();
+        reactor.spawn(&mut server_thread, server.entry_point as usize);
+        reactor.spawn(&mut client_thread, client.entry_point as usize);
+        reactor.run().unwrap();
+    }
+    assert_eq!(client_thread.registers[reg::VAL as usize], 100 * 5);
+}
+
+#[test]
+fn reactor_files() {
+    // Without a reactor, file descriptors block
+    let path = std::env::temp_dir().join(format!("lilium-files-{}", std::process::id()));
+    let result = run_program!(&format!(concat!(
+        "(def fill (fd i) (if (> i 0) ((fd-write fd \"abc\\n\") (fill fd (- i 1))) ((fd-close fd))))",
+        "(def count (fd b n) (if (> (fd-read fd b) 0) ((count fd b (+ n (size b)))) ((fd-close fd) n)))",
+        "(let ((x (fill (fd-open \"{0}\" 1) 1000))) (count (fd-open \"{0}\" 0) (buffer) 0))"
+    ), path.display()), 1024);
+    std::fs::remove_file(&path).unwrap();
+    assert_eq!(result, 3000);
+
+    let result = run_program!("(nil? (fd-open \"/nonexistent/file\" 0))", 512);
+    assert_eq!(result, 1);
+}
@@ -0,0 +1,56 @@
+#[macro_use]
+mod common;
+
+extern crate lilium;
+use lilium::*;
+
+#[test]
+fn records_heap() {
+    let result = run_program!(concat!(
+        "(defrecord point x y)",
+        "(def make (a) (point a (* a 2)))",
+        "(def norm (p) (+ (. p x) (. p y)))",
+        "(norm (make 7))"
+    ), 1024);
+    assert_eq!(result, 21);
+
+    let result = run_program!(concat!(
+        "(defrecord point x y)",
+        "(def moved (p) (with p y 100))",
+        "(def both (p q) (+ (* (. p y) 1000) (. q y)))",
+        "(def test (p) (both p (moved p)))",
+        "(test (point 1 2))"
+    ), 1024);
+    assert_eq!(result, 2100);
+}
+
+#[test]
+fn records_scalar() {
+    let program = concat!(
+        "(defrecord span start end)",
+        "(let ((s (span 3 10))) (- (. s end) (. s start)))"
+    );
+    assert_eq!(run_program!(program, 512), 7);
+
+    // The record does not escape, so it is never allocated
+    let module = compile(program);
+    assert!(module.code.iter().all(|i| i.opcode != ops::REC));
+
+    // Passed to a function, the record has to be allocated
+    let module = compile(concat!(
+        "(defrecord span start end)",
+        "(def length (s) (- (. s end) (. s start)))",
+        "(let ((s (span 3 10))) (length s))"
+    ));
+    assert!(module.code.iter().any(|i| i.opcode == ops::REC));
+}
+
+#[test]
+fn records_collect() {
+    let result = run_program!(concat!(
+        "(defrecord pair a b)",
+        "(def step (p n) (if (> n 0) ((step (pair (+ (. p a) 1) (+ (. p b) 2)) (- n 1))) ((+ (. p a) (. p b)))))",
+        "(step (pair 0 1) 100000)"
+    ), 1024);
+    assert_eq!(result, 300001);
+}
@@ -0,0 +1,37 @@
+extern crate lilium;
+use lilium::*;
+
+#[test]
+fn statistics_frames() {
+    let module = compile(concat!(
+        "(def inc (a) (+ a 1))",
+        "(inc (inc 2))"
+    ));
+    let statistics = Statistics::new(&module);
+
+    assert_eq!(statistics.instructions, module.code.len());
+    assert_eq!(statistics.functions.len(), 2);
+    assert_eq!(statistics.functions[0].callers.len(), 1);
+    assert_eq!(statistics.functions[1].call_sites, 2);
+    assert_eq!(statistics.functions[1].register_requirement,
+               Some(256 + statistics.functions[0].register_requirement.unwrap()));
+}
+
+#[test]
+fn statistics_recursion() {
+    let module = compile(concat!(
+        "(def sum (a) (if (> a 0) ((+ a (sum (- a 1)))) (0)))",
+        "(def tail (a b) (if (> a 0) ((tail (- a 1) (+ a b))) (b)))",
+        "(+ (sum 100000) (tail 100000 0))"
+    ));
+    let statistics = Statistics::new(&module);
+
+    assert_eq!(statistics.duplicate_constants, vec![(100000, 2)]);
+    assert_eq!(statistics.functions[0].register_requirement, None);
+    assert!(statistics.functions[1].register_requirement.is_some());
+    assert_eq!(statistics.functions[1].tail_call_sites, 1);
+
+    let mut json: Vec<u8> = Vec::new();
+    statistics.write_json(&mut json).unwrap();
+    assert!(String::from_utf8(json).unwrap().contains("\"registers\": null"));
+}
@@ -0,0 +1,46 @@
+#[macro_use]
+mod common;
+
+extern crate lilium;
+use lilium::*;
+
+#[test]
+fn streams_fold() {
+    assert_eq!(run_program!("(fold (acc x) (+ acc x) 0 (range 0 101))", 512), 5050);
+    assert_eq!(run_program!("(fold (acc x) (+ acc x) 7 (range 5 5))", 512), 7);
+    assert_eq!(run_program!(concat!(
+        "(fold (acc x) (+ acc x) 0",
+        "  (map (y) (* y y) (filter (y) (> y 5) (range 0 10))))"
+    ), 512), 36 + 49 + 64 + 81);
+}
+
+#[test]
+fn streams_take() {
+    // Taking stops the pipeline early, the rest of the range is not pulled
+    assert_eq!(run_program!("(fold (acc x) (+ (* acc 10) x) 0 (take 3 (range 1 1000000000)))", 512), 123);
+    assert_eq!(run_program!("(fold (acc x) (+ acc x) 0 (take 0 (range 1 10)))", 512), 0);
+    assert_eq!(run_program!(concat!(
+        "(fold (acc x) (+ acc x) 0",
+        "  (take 2 (filter (y) (> y 4) (map (y) (+ y 1) (range 0 10)))))"
+    ), 512), 5 + 6);
+}
+
+#[test]
+fn streams_scope() {
+    // Bodies see the variables of the enclosing function
+    assert_eq!(run_program!(concat!(
+        "(def scaled (k n) (fold (acc x) (+ acc x) 0 (map (y) (* y k) (range 0 n))))",
+        "(scaled 3 4)"
+    ), 512), 18);
+}
+
+#[test]
+fn streams_fused() {
+    // The pipeline is a single loop, elements cost no calls or allocations
+    let module = compile(concat!(
+        "(fold (acc x) (+ acc x) 0",
+        "  (take 5 (map (y) (* y 2) (filter (y) (> y 1) (input)))))"
+    ));
+    assert!(module.code.iter().all(|i| i.opcode != ops::CAL && i.opcode != ops::CONS));
+    assert!(module.code.iter().any(|i| i.opcode == ops::RDN));
+}
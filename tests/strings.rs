@@ -0,0 +1,71 @@
+#[macro_use]
+mod common;
+
+extern crate lilium;
+use lilium::*;
+
+/// Run a program and get the bytes of its result.
+fn run_string(program: &str) -> Vec<u8> {
+    let module = compile(program);
+    let mut registers = vec![0; 4096];
+    let mut thread = Thread {
+        functions: &module.functions,
+        constants: &module.constants,
+        data: &module.data,
+        code: &module.code,
+        registers: &mut registers,
+        base: 0,
+        pc: 0,
+        heap: Heap::new()
+    };
+    run(&mut thread, module.entry_point as usize);
+
+    let result = thread.registers[reg::VAL as usize];
+    thread.heap.bytes(result).expect("Result is not a string").to_vec()
+}
+
+#[test]
+fn strings_literal() {
+    assert_eq!(run_string("\"hello\""), b"hello");
+    assert_eq!(run_string("\"a \\\"quoted\\\" \\\\ line\\n\""), b"a \"quoted\" \\ line\n");
+    assert_eq!(run_program!("(size \"\")", 512), 0);
+    assert_eq!(run_program!("(+ (byte \"abc\" 1) (size \"abc\"))", 512), 98 + 3);
+}
+
+#[test]
+fn strings_slice() {
+    assert_eq!(run_string("(slice \"hello world\" 6 11)"), b"world");
+    assert_eq!(run_string("(slice (slice \"hello world\" 2 9) 1 5)"), b"lo w");
+    assert_eq!(run_program!("(size (slice \"hello\" 5 5))", 512), 0);
+}
+
+#[test]
+fn strings_compare() {
+    assert_eq!(run_program!("(compare \"abc\" \"abd\")", 512), -1);
+    assert_eq!(run_program!("(compare \"abc\" (slice \"xabcx\" 1 4))", 512), 0);
+    assert_eq!(run_program!("(compare \"abcd\" \"abc\")", 512), 1);
+    assert_eq!(run_program!("(== (hash \"some long string\") (hash (slice \"-some long string-\" 1 17)))", 512), 1);
+    assert_eq!(run_program!("(== (hash \"some long string\") (hash \"some long strinG\"))", 512), 0);
+}
+
+#[test]
+fn strings_buffer() {
+    assert_eq!(run_string("(string (append (append (append (buffer) \"x = \") 42) \"!\"))"), b"x = 42!");
+    assert_eq!(run_string(concat!(
+        "(def twice (b) (append b b))",
+        "(string (twice (append (buffer) \"ab\")))"
+    )), b"abab");
+}
+
+#[test]
+fn strings_collect() {
+    // Strings built before the garbage have to be copied intact, the large
+    // string is allocated in the old generation
+    let result = run_string(concat!(
+        "(def garbage (n) (if (> n 0) ((cons n nil) (garbage (- n 1))) (0)))",
+        "(def fill (b n) (if (> n 0) ((fill (append b n) (- n 1))) (b)))",
+        "(def small (s) (garbage 50000) (append (append (buffer) s) (size (string (fill (buffer) 100000)))))",
+        "(string (small (slice \"a literal\" 2 9)))"
+    ));
+    assert_eq!(result, b"literal488895");
+}
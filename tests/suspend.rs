@@ -0,0 +1,192 @@
+extern crate lilium;
+use lilium::*;
+use std::collections::VecDeque;
+
+/// Host which gets its input in pieces and takes a limited number of writes
+/// before its output has to be drained.
+#[derive(Default)]
+struct Host {
+    input: VecDeque<String>,
+    closed: bool,
+    output: Vec<String>,
+    capacity: usize
+}
+
+impl Io for Host {
+    fn read_line(&mut self, line: &mut Vec<u8>) -> Option<bool> {
+        match self.input.pop_front() {
+            Some(text) => {
+                line.extend_from_slice(text.as_bytes());
+                Some(true)
+            }
+            None if self.closed => Some(false),
+            None => None
+        }
+    }
+
+    fn write(&mut self, bytes: &[u8]) -> bool {
+        if self.output.len() >= self.capacity {
+            return false;
+        }
+        self.output.push(String::from_utf8_lossy(bytes).into_owned());
+        true
+    }
+}
+
+#[test]
+fn suspend_input() {
+    // Suspended in a call, which returns to the resumed code
+    let module = compile("(def fetch (x) (+ x (read))) (write (+ (fetch 1) (fetch 0)))");
+    let mut registers = vec![0; 512];
+    let mut thread = Thread {
+        functions: &module.functions,
+        constants: &module.constants,
+        data: &module.data,
+        code: &module.code,
+        registers: &mut registers,
+        base: 0,
+        pc: 0,
+        heap: Heap::new()
+    };
+    let mut host = Host { capacity: 16, ..Host::default() };
+
+    let status = run_with_io(&mut thread, module.entry_point as usize, &mut host);
+    assert_eq!(status, Status::Suspended(Suspension::NeedInput));
+    host.input.push_back("20".to_string());
+    assert_eq!(resume(&mut thread, &mut host), Status::Suspended(Suspension::NeedInput));
+    host.input.push_back("21".to_string());
+    assert_eq!(resume(&mut thread, &mut host), Status::Halted);
+    assert_eq!(host.output, vec!["42\n".to_string()]);
+}
+
+#[test]
+fn suspend_output() {
+    let module = compile(concat!(
+        "(def count (i n) (if (< i n) ((write i) (count (+ i 1) n)) (0)))",
+        "(count 0 5)"
+    ));
+    let mut registers = vec![0; 512];
+    let mut thread = Thread {
+        functions: &module.functions,
+        constants: &module.constants,
+        data: &module.data,
+        code: &module.code,
+        registers: &mut registers,
+        base: 0,
+        pc: 0,
+        heap: Heap::new()
+    };
+    let mut host = Host { capacity: 2, ..Host::default() };
+
+    // Each time the output is full, it is drained before resuming
+    let mut lines = Vec::new();
+    let mut status = run_with_io(&mut thread, module.entry_point as usize, &mut host);
+    while status == Status::Suspended(Suspension::OutputFull) {
+        assert_eq!(host.output.len(), 2);
+        lines.extend(host.output.drain(..));
+        status = resume(&mut thread, &mut host);
+    }
+    assert_eq!(status, Status::Halted);
+    lines.extend(host.output.drain(..));
+    assert_eq!(lines, vec!["0\n", "1\n", "2\n", "3\n", "4\n"]);
+}
+
+#[test]
+fn suspend_multiplexed() {
+    // Threads summing their input until its end, all fed one line at a time
+    // in turns. One of them reads in a generator, which stays suspended
+    // across suspensions of its thread.
+    let programs = [
+        "(fold (acc x) (+ acc x) 0 (input))",
+        concat!(
+            "(def echo (i) (yield (fold (acc x) x nil (take 1 (input)))) (echo i))",
+            "(def sum (g acc x) (if (nil? x) (acc) ((sum g (+ acc x) (resume g 0)))))",
+            "(let ((g (generator (echo 0)))) (sum g 0 (resume g 0)))"
+        )
+    ];
+    let modules: Vec<Module> = (0..100).map(|i| compile(programs[i % 2])).collect();
+    let mut registers = vec![vec![0; 2048]; modules.len()];
+    let mut threads: Vec<Thread> = modules.iter().zip(registers.iter_mut()).map(|(module, registers)| {
+        Thread {
+            functions: &module.functions,
+            constants: &module.constants,
+            data: &module.data,
+            code: &module.code,
+            registers: registers,
+            base: 0,
+            pc: module.entry_point as usize,
+            heap: Heap::new()
+        }
+    }).collect();
+    let mut hosts: Vec<Host> = (0..threads.len()).map(|_| Host::default()).collect();
+
+    for round in 0..11 {
+        for (i, (thread, host)) in threads.iter_mut().zip(hosts.iter_mut()).enumerate() {
+            if round < 10 {
+                host.input.push_back(format!("{}", i + round));
+            } else {
+                host.closed = true;
+            }
+            let status = resume(thread, host);
+            let expected = if round < 10 { Status::Suspended(Suspension::NeedInput) } else { Status::Halted };
+            assert_eq!(status, expected);
+        }
+    }
+    for (i, thread) in threads.iter().enumerate() {
+        assert_eq!(thread.registers[reg::VAL as usize], (10 * i + 45) as i64);
+    }
+}
+
+#[test]
+fn suspend_buffer_slice() {
+    // A slice of a buffer keeps its bytes when a shorter line is read into it
+    let module = compile(concat!(
+        "(def later (b s) (read-line b) (write-bytes (string (append (append (buffer) s) b))))",
+        "(def sliced (b) (read-line b) (later b (slice b 0 5)))",
+        "(sliced (buffer))"
+    ));
+    let mut registers = vec![0; 512];
+    let mut thread = Thread {
+        functions: &module.functions,
+        constants: &module.constants,
+        data: &module.data,
+        code: &module.code,
+        registers: &mut registers,
+        base: 0,
+        pc: 0,
+        heap: Heap::new()
+    };
+    let mut host = Host { capacity: 16, closed: true, ..Host::default() };
+    host.input.push_back("hello world".to_string());
+    host.input.push_back("hi".to_string());
+    assert_eq!(run_with_io(&mut thread, module.entry_point as usize, &mut host), Status::Halted);
+    assert_eq!(host.output, vec!["hellohi".to_string()]);
+}
+
+#[test]
+fn suspend_buffer_read() {
+    // A line read after a suspension replaces the previous one in the buffer
+    let module = compile(concat!(
+        "(def again (b) (read-line b) (write-bytes (string b)))",
+        "(def once (b) (read-line b) (again b))",
+        "(once (buffer))"
+    ));
+    let mut registers = vec![0; 512];
+    let mut thread = Thread {
+        functions: &module.functions,
+        constants: &module.constants,
+        data: &module.data,
+        code: &module.code,
+        registers: &mut registers,
+        base: 0,
+        pc: 0,
+        heap: Heap::new()
+    };
+    let mut host = Host { capacity: 16, ..Host::default() };
+    host.input.push_back("hello world".to_string());
+    let status = run_with_io(&mut thread, module.entry_point as usize, &mut host);
+    assert_eq!(status, Status::Suspended(Suspension::NeedInput));
+    host.input.push_back("hi".to_string());
+    assert_eq!(resume(&mut thread, &mut host), Status::Halted);
+    assert_eq!(host.output, vec!["hi".to_string()]);
+}
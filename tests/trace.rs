@@ -0,0 +1,97 @@
+extern crate lilium;
+use lilium::*;
+use std::panic::{AssertUnwindSafe, catch_unwind};
+
+#[test]
+fn trace_last_instructions() {
+    let module = compile(concat!(
+        "(def fun (a)",
+        "  (if (> a 0) ((fun (- a 1))) (0)))",
+        "(fun 10)"
+    ));
+
+    let mut registers = vec![0; 1024];
+    let mut thread = Thread {
+        functions: &module.functions,
+        constants: &module.constants,
+        data: &module.data,
+        code: &module.code,
+        registers: &mut registers,
+        base: 0,
+        pc: 0,
+        heap: Heap::new()
+    };
+    let mut trace = Trace::new(3);
+    run_traced(&mut thread, module.entry_point as usize, &mut trace);
+
+    let entries = trace.entries();
+    assert_eq!(entries.len(), 4);
+    assert!(trace.recorded() > 4);
+    assert_eq!(entries[3].opcode, ops::HLT);
+    assert_eq!(entries[3].pc, module.code.len() - 1);
+    assert_eq!(entries[2].opcode, ops::LDR);
+    assert_eq!(entries[1].base, 256);
+}
+
+#[test]
+fn trace_panic() {
+    let module = compile("(write (/ 1 (- 2 2)))");
+
+    let mut registers = vec![0; 256];
+    let mut trace = Trace::new(16);
+    let result = catch_unwind(AssertUnwindSafe(|| {
+        let mut thread = Thread {
+            functions: &module.functions,
+            constants: &module.constants,
+            data: &module.data,
+            code: &module.code,
+            registers: &mut registers,
+            base: 0,
+            pc: 0,
+            heap: Heap::new()
+        };
+        run_traced(&mut thread, module.entry_point as usize, &mut trace);
+    }));
+    assert!(result.is_err());
+
+    let entries = trace.entries();
+    assert_eq!(entries.last().unwrap().opcode, ops::DIV);
+
+    let mut dump: Vec<u8> = Vec::new();
+    trace.write(&mut dump, &module.constants, &module.functions, &module.code).unwrap();
+    assert!(String::from_utf8(dump).unwrap().lines().last().unwrap().ends_with("div 2 3 4"));
+}
+
+#[test]
+fn trace_superinstructions() {
+    let module = compile(concat!(
+        "(def fun (a)",
+        "  (if (> a 0) ((fun (- a 1))) (0)))",
+        "(fun 10)"
+    ));
+
+    let mut registers = vec![0; 1024];
+    let mut thread = Thread {
+        functions: &module.functions,
+        constants: &module.constants,
+        data: &module.data,
+        code: &module.code,
+        registers: &mut registers,
+        base: 0,
+        pc: 0,
+        heap: Heap::new()
+    };
+    let mut trace = Trace::new(1024);
+    run_traced(&mut thread, module.entry_point as usize, &mut trace);
+
+    // Superinstructions are recorded as their components, one entry per PC
+    let entries = trace.entries();
+    assert_eq!(entries.len(), trace.recorded());
+    assert!(entries.iter().any(|entry| module.code[entry.pc].opcode >= 128));
+    for (i, entry) in entries.iter().enumerate() {
+        assert!(entry.opcode < 128);
+        if module.code[entry.pc].opcode >= 128 {
+            assert_eq!(entries[i + 1].pc, entry.pc + 1);
+        }
+    }
+}
@@ -0,0 +1,77 @@
+#[macro_use]
+mod common;
+
+extern crate lilium;
+use lilium::*;
+
+#[test]
+fn vectors_basic() {
+    let result = run_program!(concat!(
+        "(let ((v (vec-push (vec-push (vec-push (vector) 10) 20) 30)))",
+        "  (+ (vec-len v) (+ (vec-get v 0) (vec-get v 2))))"
+    ), 512);
+    assert_eq!(result, 43);
+
+    // Appending at the length is the same as pushing
+    let result = run_program!("(vec-get (vec-assoc (vector) 0 5) 0)", 512);
+    assert_eq!(result, 5);
+}
+
+#[test]
+fn vectors_persistent() {
+    // Updates and appends leave older versions unchanged, including two
+    // versions appending to the same tail
+    let result = run_program!(concat!(
+        "(def fill (v n) (if (> n 0) ((fill (vec-push v n) (- n 1))) (v)))",
+        "(def check (v w x) (+ (* (vec-get v 500) 1000000) (+ (* (vec-get w 500) 1000) (+ (vec-get w 1000) (vec-get x 1000)))))",
+        "(def versions (v) (check v (vec-push (vec-assoc v 500 7) 1) (vec-push v 2)))",
+        "(versions (fill (vector) 1000))"
+    ), 1024);
+    assert_eq!(result, 500 * 1000000 + 7 * 1000 + 1 + 2);
+}
+
+#[test]
+fn vectors_collect() {
+    let module = compile(concat!(
+        "(def fill (v n) (if (> n 0) ((fill (vec-push v n) (- n 1))) (v)))",
+        "(def bump (v i) (if (< i (vec-len v)) ((bump (vec-assoc v i (+ (vec-get v i) 1)) (+ i 1))) (v)))",
+        "(def sum (v i acc) (if (< i (vec-len v)) ((sum v (+ i 1) (+ acc (vec-get v i)))) (acc)))",
+        "(sum (bump (fill (vector) 100000) 0) 0 0)"
+    ));
+
+    let mut registers = vec![0; 4096];
+    let mut thread = Thread {
+        functions: &module.functions,
+        constants: &module.constants,
+        data: &module.data,
+        code: &module.code,
+        registers: &mut registers,
+        base: 0,
+        pc: 0,
+        heap: Heap::new()
+    };
+    run(&mut thread, module.entry_point as usize);
+
+    assert_eq!(thread.registers[reg::VAL as usize], 100000 * 100001 / 2 + 100000);
+    assert!(thread.heap.stats().minor_collections > 10);
+}
+
+#[test]
+fn vectors_format() {
+    let module = compile("(vec-push (vec-push (vector) (cons 1 nil)) 2)");
+    let mut registers = vec![0; 512];
+    let mut thread = Thread {
+        functions: &module.functions,
+        constants: &module.constants,
+        data: &module.data,
+        code: &module.code,
+        registers: &mut registers,
+        base: 0,
+        pc: 0,
+        heap: Heap::new()
+    };
+    run(&mut thread, module.entry_point as usize);
+
+    let result = thread.registers[reg::VAL as usize];
+    assert_eq!(thread.heap.format(result), "[(1) 2]");
+}